@@ -0,0 +1,489 @@
+/*
+ * Copyright 2014 MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <mongoc.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "bulk_pipeline.h"
+
+struct _bulk_pipeline_t {
+   mongoc_collection_t *collection;
+   mongoc_client_pool_t *pool;
+   const char *database_name;
+   const char *collection_name;
+   int n_writers;
+   int n_batches;
+   bulk_batch_t *batches;
+   bulk_batch_t *current;
+   bulk_batch_t **free_batches;
+   int n_free;
+   bulk_batch_t **ready;
+   int ready_head;
+   int n_ready;
+   bool closing;
+   bool failed;
+   int64_t count;
+   FILE *progress_file;
+   int64_t progress_size;
+   const char *progress_format;
+   bulk_batch_size_t batch_size;
+   size_t target_bytes;
+   bulk_ack_func_t ack;
+   void *ack_ctx;
+   bool replay;
+   int64_t *seqs;
+   bool *done;
+   int64_t next_seq;
+   int64_t next_ack;
+   bson_error_t error;
+   pthread_t *writers;
+   pthread_mutex_t mutex;
+   pthread_cond_t cond_ready;
+   pthread_cond_t cond_free;
+};
+
+/*
+ * max_message_size is the server's maxMessageSizeBytes, a batch leaves
+ * headroom below it for the insert command around the documents
+ */
+void
+bulk_batch_size_init (bulk_batch_size_t *batch_size,
+                      size_t             target_bytes,
+                      size_t             max_message_size,
+                      bool               auto_tune)
+{
+   memset (batch_size, 0, sizeof *batch_size);
+   batch_size->max_bytes = max_message_size > 2 * BULK_BATCH_HEADROOM ?
+      max_message_size - BULK_BATCH_HEADROOM : BULK_BATCH_TARGET_BYTES;
+   batch_size->min_bytes = BSON_MIN (BULK_BATCH_MIN_BYTES, batch_size->max_bytes);
+   if (target_bytes == 0)
+      target_bytes = BULK_BATCH_TARGET_BYTES;
+   batch_size->target_bytes = BSON_MIN (BSON_MAX (target_bytes, batch_size->min_bytes), batch_size->max_bytes);
+   batch_size->auto_tune = auto_tune;
+   batch_size->step = BULK_TUNE_STEP;
+}
+
+/*
+ * the server's maxMessageSizeBytes from isMaster; the client only learns
+ * it once connected, so asking first also makes the connection, 0 when
+ * the server cannot be reached
+ */
+size_t
+bulk_max_message_size (mongoc_client_t *client)
+{
+   bson_t *command, reply;
+   bson_iter_t iter;
+   bson_error_t error;
+   size_t max_message_size = 0;
+
+   command = BCON_NEW ("isMaster", BCON_INT32 (1));
+   if (mongoc_client_command_simple (client, "admin", command, NULL, &reply, &error)) {
+      if (bson_iter_init_find (&iter, &reply, "maxMessageSizeBytes"))
+         max_message_size = (size_t)bson_iter_as_int64 (&iter);
+      else
+         max_message_size = mongoc_client_get_max_message_size (client);
+   }
+   else
+      fprintf (stderr, "WARNING: isMaster failed: %s\n", error.message);
+   bson_destroy (&reply);
+   bson_destroy (command);
+   return max_message_size;
+}
+
+/*
+ * hill climb on throughput - every BULK_TUNE_WINDOW batches compare the
+ * window's bytes/sec with the previous window, keep stepping the target
+ * in the same direction while it improves and reverse when it does not
+ */
+void
+bulk_batch_size_observe (bulk_batch_size_t *batch_size,
+                         size_t             bytes,
+                         double             seconds)
+{
+   double rate, target;
+
+   if (!batch_size->auto_tune)
+      return;
+   batch_size->window_bytes += bytes;
+   batch_size->window_seconds += seconds;
+   if (++batch_size->n_samples < BULK_TUNE_WINDOW)
+      return;
+   rate = batch_size->window_bytes / (batch_size->window_seconds + 0.000001);
+   if (batch_size->last_rate > 0.0 && rate < batch_size->last_rate)
+      batch_size->step = 1.0 / batch_size->step;
+   batch_size->last_rate = rate;
+   target = batch_size->target_bytes * batch_size->step;
+   if (target >= batch_size->max_bytes) {
+      target = batch_size->max_bytes;
+      batch_size->step = 1.0 / BULK_TUNE_STEP;
+   }
+   else if (target <= batch_size->min_bytes) {
+      target = batch_size->min_bytes;
+      batch_size->step = BULK_TUNE_STEP;
+   }
+   batch_size->target_bytes = (size_t)target;
+   batch_size->n_samples = 0;
+   batch_size->window_bytes = 0.0;
+   batch_size->window_seconds = 0.0;
+}
+
+/* true when next_len more bytes would carry the batch past its target */
+bool
+bulk_batch_size_full (const bulk_batch_size_t *batch_size,
+                      size_t                   len,
+                      size_t                   n_docs,
+                      size_t                   next_len)
+{
+   return n_docs > 0 && (len + next_len > batch_size->target_bytes || n_docs >= BULK_BATCH_MAX_DOCS);
+}
+
+void
+bulk_batch_append (bulk_batch_t *batch,
+                   const bson_t *doc)
+{
+   if (batch->len + doc->len > batch->size) {
+      batch->size = BSON_MAX (batch->len + doc->len, 2 * batch->size);
+      batch->data = bson_realloc (batch->data, batch->size);
+   }
+   memcpy (batch->data + batch->len, bson_get_data (doc), doc->len);
+   batch->len += doc->len;
+   batch->n_docs++;
+}
+
+/* true when the only write errors in the reply are duplicate keys */
+static bool
+bulk_reply_only_duplicates (const bson_t *reply)
+{
+   bson_iter_t iter, errors, error_doc;
+   bool any = false;
+
+   if (bson_iter_init_find (&iter, reply, "writeConcernErrors") &&
+       bson_iter_recurse (&iter, &errors) && bson_iter_next (&errors))
+      return false;
+   if (!bson_iter_init_find (&iter, reply, "writeErrors") || !bson_iter_recurse (&iter, &errors))
+      return false;
+   while (bson_iter_next (&errors)) {
+      if (!bson_iter_recurse (&errors, &error_doc) || !bson_iter_find (&error_doc, "code") ||
+          bson_iter_as_int64 (&error_doc) != 11000)
+         return false;
+      any = true;
+   }
+   return any;
+}
+
+bool
+bulk_batch_execute (bulk_batch_t        *batch,
+                    mongoc_collection_t *collection,
+                    bool                 replay,
+                    bson_error_t        *error)
+{
+   mongoc_bulk_operation_t *bulk;
+   bson_t doc, reply;
+   size_t offset;
+   uint32_t len;
+   bool ret;
+
+   if (batch->n_docs == 0)
+      return true;
+   bulk = mongoc_collection_create_bulk_operation (collection, !replay, NULL);
+   for (offset = 0; offset < batch->len; offset += len) {
+      memcpy (&len, batch->data + offset, sizeof len);
+      len = BSON_UINT32_FROM_LE (len);
+      bson_init_static (&doc, batch->data + offset, len);
+      mongoc_bulk_operation_insert (bulk, &doc);
+   }
+   ret = mongoc_bulk_operation_execute (bulk, &reply, error);
+   if (!ret && replay)
+      ret = bulk_reply_only_duplicates (&reply);
+   bson_destroy (&reply);
+   mongoc_bulk_operation_destroy (bulk);
+   return ret;
+}
+
+/* called with the pipeline mutex held */
+static void
+bulk_pipeline_account (bulk_pipeline_t *pipeline,
+                       bulk_batch_t    *batch,
+                       bool             ret,
+                       bson_error_t    *error,
+                       int64_t          usec)
+{
+   int64_t count;
+
+   if (ret) {
+      bulk_batch_size_observe (&pipeline->batch_size, batch->len, usec / 1000000.0);
+      count = pipeline->count;
+      pipeline->count += batch->n_docs;
+      if (pipeline->progress_size > 0 &&
+          pipeline->count / pipeline->progress_size > count / pipeline->progress_size) {
+         fprintf (pipeline->progress_file, pipeline->progress_format, batch->n_docs, pipeline->count);
+         fflush (pipeline->progress_file);
+      }
+   }
+   else if (!pipeline->failed) {
+      fprintf (stderr, "bulk_pipeline execute failure: %s\n", error->message);
+      pipeline->failed = true;
+      pipeline->error = *error;
+   }
+}
+
+static void
+bulk_batch_reset (bulk_batch_t *batch)
+{
+   batch->len = 0;
+   batch->n_docs = 0;
+   batch->tag = 0;
+}
+
+/*
+ * called with the pipeline mutex held once a writer is done with a
+ * batch; with an ack callback, batches go back to the free list in
+ * submit order so every acked tag covers all the batches before it
+ */
+static void
+bulk_pipeline_release (bulk_pipeline_t *pipeline,
+                       bulk_batch_t    *batch)
+{
+   int i;
+
+   if (!pipeline->ack) {
+      bulk_batch_reset (batch);
+      pipeline->free_batches[pipeline->n_free++] = batch;
+      pthread_cond_signal (&pipeline->cond_free);
+      return;
+   }
+   pipeline->done[batch - pipeline->batches] = true;
+   for (i = 0; i < pipeline->n_batches; i++) {
+      if (!pipeline->done[i] || pipeline->seqs[i] != pipeline->next_ack)
+         continue;
+      if (!pipeline->failed)
+         pipeline->ack (pipeline->ack_ctx, &pipeline->batches[i]);
+      pipeline->done[i] = false;
+      pipeline->next_ack++;
+      bulk_batch_reset (&pipeline->batches[i]);
+      pipeline->free_batches[pipeline->n_free++] = &pipeline->batches[i];
+      pthread_cond_signal (&pipeline->cond_free);
+      i = -1;
+   }
+}
+
+static void *
+bulk_pipeline_writer (void *arg)
+{
+   bulk_pipeline_t *pipeline = arg;
+   mongoc_client_t *client;
+   mongoc_collection_t *collection;
+   bulk_batch_t *batch;
+   bson_error_t error;
+   bool skip, ret;
+   int64_t start;
+
+   client = mongoc_client_pool_pop (pipeline->pool);
+   collection = mongoc_client_get_collection (client, pipeline->database_name, pipeline->collection_name);
+   for (;;) {
+      pthread_mutex_lock (&pipeline->mutex);
+      while (pipeline->n_ready == 0 && !pipeline->closing)
+         pthread_cond_wait (&pipeline->cond_ready, &pipeline->mutex);
+      if (pipeline->n_ready == 0) {
+         pthread_mutex_unlock (&pipeline->mutex);
+         break;
+      }
+      batch = pipeline->ready[pipeline->ready_head];
+      pipeline->ready_head = (pipeline->ready_head + 1) % pipeline->n_batches;
+      pipeline->n_ready--;
+      skip = pipeline->failed;
+      pthread_mutex_unlock (&pipeline->mutex);
+      start = bson_get_monotonic_time ();
+      ret = skip || bulk_batch_execute (batch, collection, pipeline->replay, &error);
+      pthread_mutex_lock (&pipeline->mutex);
+      if (!skip)
+         bulk_pipeline_account (pipeline, batch, ret, &error, bson_get_monotonic_time () - start);
+      bulk_pipeline_release (pipeline, batch);
+      pthread_mutex_unlock (&pipeline->mutex);
+   }
+   mongoc_collection_destroy (collection);
+   mongoc_client_pool_push (pipeline->pool, client);
+   return NULL;
+}
+
+bulk_pipeline_t *
+bulk_pipeline_new (mongoc_collection_t  *collection,
+                   mongoc_client_pool_t *pool,
+                   const char           *database_name,
+                   int                   n_writers,
+                   int                   max_in_flight)
+{
+   bulk_pipeline_t *pipeline;
+   int i;
+
+   pipeline = bson_malloc0 (sizeof *pipeline);
+   pipeline->collection = collection;
+   pipeline->pool = pool;
+   pipeline->database_name = database_name;
+   pipeline->collection_name = mongoc_collection_get_name (collection);
+   pipeline->n_writers = pool ? n_writers : 0;
+   pipeline->n_batches = BSON_MAX (max_in_flight, pipeline->n_writers) + 1;
+   pipeline->batches = bson_malloc0 (pipeline->n_batches * sizeof (bulk_batch_t));
+   pipeline->free_batches = bson_malloc0 (pipeline->n_batches * sizeof (bulk_batch_t*));
+   pipeline->ready = bson_malloc0 (pipeline->n_batches * sizeof (bulk_batch_t*));
+   pipeline->seqs = bson_malloc0 (pipeline->n_batches * sizeof (int64_t));
+   pipeline->done = bson_malloc0 (pipeline->n_batches * sizeof (bool));
+   for (i = 1; i < pipeline->n_batches; i++)
+      pipeline->free_batches[pipeline->n_free++] = &pipeline->batches[i];
+   pipeline->current = &pipeline->batches[0];
+   bulk_batch_size_init (&pipeline->batch_size, BULK_BATCH_TARGET_BYTES, 0, false);
+   pipeline->target_bytes = pipeline->batch_size.target_bytes;
+   pthread_mutex_init (&pipeline->mutex, NULL);
+   pthread_cond_init (&pipeline->cond_ready, NULL);
+   pthread_cond_init (&pipeline->cond_free, NULL);
+   pipeline->writers = bson_malloc0 ((pipeline->n_writers + 1) * sizeof (pthread_t));
+   for (i = 0; i < pipeline->n_writers; i++) {
+      if (pthread_create (&pipeline->writers[i], NULL, bulk_pipeline_writer, pipeline) != 0) {
+         /* run with the writers started, none means inserting inline */
+         fprintf (stderr, "WARNING: bulk_pipeline writer %d not started\n", i);
+         pipeline->n_writers = i;
+      }
+   }
+   return pipeline;
+}
+
+void
+bulk_pipeline_set_progress (bulk_pipeline_t *pipeline,
+                            FILE            *progress_file,
+                            int64_t          progress_size,
+                            const char      *progress_format)
+{
+   pipeline->progress_file = progress_file;
+   pipeline->progress_size = progress_size;
+   pipeline->progress_format = progress_format;
+}
+
+/* set before the first submit */
+void
+bulk_pipeline_set_ack (bulk_pipeline_t *pipeline,
+                       bulk_ack_func_t  ack,
+                       void            *ack_ctx,
+                       bool             replay)
+{
+   pipeline->ack = ack;
+   pipeline->ack_ctx = ack_ctx;
+   pipeline->replay = replay;
+}
+
+/* set before the first submit */
+void
+bulk_pipeline_set_batch_size (bulk_pipeline_t         *pipeline,
+                              const bulk_batch_size_t *batch_size)
+{
+   pipeline->batch_size = *batch_size;
+   pipeline->target_bytes = batch_size->target_bytes;
+}
+
+bulk_batch_t *
+bulk_pipeline_batch (bulk_pipeline_t *pipeline)
+{
+   return pipeline->current;
+}
+
+/* true when the current batch should be submitted before appending next */
+bool
+bulk_pipeline_batch_full (bulk_pipeline_t *pipeline,
+                          const bson_t    *next)
+{
+   bulk_batch_t *batch = pipeline->current;
+
+   return batch->n_docs > 0 && (batch->len + next->len > pipeline->target_bytes || batch->n_docs >= BULK_BATCH_MAX_DOCS);
+}
+
+/*
+ * hand the current batch to the writers and switch to a free one,
+ * returns false once any batch has failed
+ */
+bool
+bulk_pipeline_submit (bulk_pipeline_t *pipeline)
+{
+   bulk_batch_t *batch = pipeline->current;
+   bson_error_t error;
+   int64_t start;
+   bool ret;
+
+   if (batch->n_docs == 0)
+      return !pipeline->failed;
+   if (pipeline->n_writers == 0) {
+      start = bson_get_monotonic_time ();
+      ret = !pipeline->failed && bulk_batch_execute (batch, pipeline->collection, pipeline->replay, &error);
+      if (!pipeline->failed)
+         bulk_pipeline_account (pipeline, batch, ret, &error, bson_get_monotonic_time () - start);
+      if (ret && pipeline->ack)
+         pipeline->ack (pipeline->ack_ctx, batch);
+      bulk_batch_reset (batch);
+      pipeline->target_bytes = pipeline->batch_size.target_bytes;
+      return ret;
+   }
+   pthread_mutex_lock (&pipeline->mutex);
+   pipeline->seqs[batch - pipeline->batches] = pipeline->next_seq++;
+   pipeline->ready[(pipeline->ready_head + pipeline->n_ready) % pipeline->n_batches] = batch;
+   pipeline->n_ready++;
+   pthread_cond_signal (&pipeline->cond_ready);
+   while (pipeline->n_free == 0)
+      pthread_cond_wait (&pipeline->cond_free, &pipeline->mutex);
+   pipeline->current = pipeline->free_batches[--pipeline->n_free];
+   pipeline->target_bytes = pipeline->batch_size.target_bytes;
+   ret = !pipeline->failed;
+   pthread_mutex_unlock (&pipeline->mutex);
+   return ret;
+}
+
+/*
+ * flush the current batch, wait for the writers and return the number
+ * of documents inserted, or -1 after a failure; the tuned batch size is
+ * handed back through batch_size when it is not NULL and tuning is on,
+ * an untuned size is left alone as other threads may be reading it
+ */
+int64_t
+bulk_pipeline_destroy (bulk_pipeline_t   *pipeline,
+                       bson_error_t      *error,
+                       bulk_batch_size_t *batch_size)
+{
+   int64_t ret;
+   int i;
+
+   bulk_pipeline_submit (pipeline);
+   pthread_mutex_lock (&pipeline->mutex);
+   pipeline->closing = true;
+   pthread_cond_broadcast (&pipeline->cond_ready);
+   pthread_mutex_unlock (&pipeline->mutex);
+   for (i = 0; i < pipeline->n_writers; i++)
+      pthread_join (pipeline->writers[i], NULL);
+   ret = pipeline->failed ? -1 : pipeline->count;
+   if (pipeline->failed && error)
+      *error = pipeline->error;
+   if (batch_size && pipeline->batch_size.auto_tune)
+      *batch_size = pipeline->batch_size;
+   for (i = 0; i < pipeline->n_batches; i++)
+      bson_free (pipeline->batches[i].data);
+   pthread_mutex_destroy (&pipeline->mutex);
+   pthread_cond_destroy (&pipeline->cond_ready);
+   pthread_cond_destroy (&pipeline->cond_free);
+   bson_free (pipeline->writers);
+   bson_free (pipeline->ready);
+   bson_free (pipeline->seqs);
+   bson_free (pipeline->done);
+   bson_free (pipeline->free_batches);
+   bson_free (pipeline->batches);
+   bson_free (pipeline);
+   return ret;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2014 MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Pipelined bulk inserts - a producer fills one batch while writer
+ * threads, each on its own pooled client, execute the batches already
+ * submitted.  At most max_in_flight batches are queued or executing;
+ * bulk_pipeline_submit blocks beyond that.  With no writers, batches
+ * execute inline on the producer's collection.
+ *
+ * Batches close on a byte size rather than a document count, so small
+ * rows travel in large batches and large documents in small ones.  With
+ * auto_tune set, the target moves toward the size with the best measured
+ * throughput, always within [min_bytes, max_bytes].
+ *
+ * An ack callback sees each batch once it and every batch submitted
+ * before it have been inserted, with the producer's tag, e.g. the input
+ * offset the batch ends at.  In replay mode batches are unordered and
+ * duplicate key errors count as success, so re-sending documents with
+ * a deterministic _id is harmless.
+ */
+
+#ifndef BULK_PIPELINE_H
+#define BULK_PIPELINE_H
+#include <mongoc.h>
+#include <stdio.h>
+
+typedef struct {
+   uint8_t *data;
+   size_t len;
+   size_t size;
+   size_t n_docs;
+   int64_t tag;
+} bulk_batch_t;
+
+typedef void (*bulk_ack_func_t) (void               *ctx,
+                                 const bulk_batch_t *batch);
+
+#define BULK_BATCH_TARGET_BYTES (4*1024*1024)
+#define BULK_BATCH_MIN_BYTES (256*1024)
+#define BULK_BATCH_MAX_DOCS 100000
+#define BULK_BATCH_HEADROOM (16*1024)
+#define BULK_TUNE_WINDOW 8
+#define BULK_TUNE_STEP 1.25
+
+typedef struct {
+   size_t target_bytes;
+   size_t min_bytes;
+   size_t max_bytes;
+   bool auto_tune;
+   int n_samples;
+   double window_bytes;
+   double window_seconds;
+   double last_rate;
+   double step;
+} bulk_batch_size_t;
+
+typedef struct _bulk_pipeline_t bulk_pipeline_t;
+
+void
+bulk_batch_size_init (bulk_batch_size_t *batch_size,
+                      size_t             target_bytes,
+                      size_t             max_message_size,
+                      bool               auto_tune);
+
+size_t
+bulk_max_message_size (mongoc_client_t *client);
+
+void
+bulk_batch_size_observe (bulk_batch_size_t *batch_size,
+                         size_t             bytes,
+                         double             seconds);
+
+bool
+bulk_batch_size_full (const bulk_batch_size_t *batch_size,
+                      size_t                   len,
+                      size_t                   n_docs,
+                      size_t                   next_len);
+
+void
+bulk_batch_append (bulk_batch_t *batch,
+                   const bson_t *doc);
+
+bool
+bulk_batch_execute (bulk_batch_t        *batch,
+                    mongoc_collection_t *collection,
+                    bool                 replay,
+                    bson_error_t        *error);
+
+bulk_pipeline_t *
+bulk_pipeline_new (mongoc_collection_t  *collection,
+                   mongoc_client_pool_t *pool,
+                   const char           *database_name,
+                   int                   n_writers,
+                   int                   max_in_flight);
+
+void
+bulk_pipeline_set_progress (bulk_pipeline_t *pipeline,
+                            FILE            *progress_file,
+                            int64_t          progress_size,
+                            const char      *progress_format);
+
+void
+bulk_pipeline_set_ack (bulk_pipeline_t *pipeline,
+                       bulk_ack_func_t  ack,
+                       void            *ack_ctx,
+                       bool             replay);
+
+void
+bulk_pipeline_set_batch_size (bulk_pipeline_t         *pipeline,
+                              const bulk_batch_size_t *batch_size);
+
+bulk_batch_t *
+bulk_pipeline_batch (bulk_pipeline_t *pipeline);
+
+bool
+bulk_pipeline_batch_full (bulk_pipeline_t *pipeline,
+                          const bson_t    *next);
+
+bool
+bulk_pipeline_submit (bulk_pipeline_t *pipeline);
+
+int64_t
+bulk_pipeline_destroy (bulk_pipeline_t   *pipeline,
+                       bson_error_t      *error,
+                       bulk_batch_size_t *batch_size);
+
+#endif
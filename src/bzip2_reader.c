@@ -0,0 +1,465 @@
+/*
+ * Copyright 2014 MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <bzlib.h>
+#include "bzip2_reader.h"
+
+#define BZIP2_READ_SIZE (1024*1024)
+#define BZIP2_OUT_SIZE (1024*1024)
+#define BZIP2_MAGIC_MASK UINT64_C (0xffffffffffff)
+#define BZIP2_BLOCK_MAGIC UINT64_C (0x314159265359)
+#define BZIP2_EOS_MAGIC UINT64_C (0x177245385090)
+/* end of stream magic, combined crc, padding and the next "BZh9" */
+#define BZIP2_EOS_GAP_BITS (48 + 32 + 7 + 32)
+#define BZIP2_MAX_MERGE 4
+#define BZIP2_JOBS_PER_THREAD 4
+
+typedef enum {
+   BZIP2_JOB_NEW,
+   BZIP2_JOB_RUNNING,
+   BZIP2_JOB_DONE,
+   BZIP2_JOB_FAILED
+} bzip2_job_state_t;
+
+/*
+ * one block - the compressed bits [start_bit, end_bit) of the input,
+ * copied from the byte holding start_bit so the block begins at bit
+ * start_bit % 8 of in[0]
+ */
+typedef struct _bzip2_job_t {
+   struct _bzip2_job_t *next;
+   uint64_t start_bit;
+   uint64_t end_bit;
+   uint8_t *in;
+   size_t in_len;
+   char *out;
+   size_t out_len;
+   size_t out_pos;
+   int n_merged;
+   bzip2_job_state_t state;
+} bzip2_job_t;
+
+struct _bzip2_reader_t {
+   int fd;
+   uint8_t *prefix;
+   size_t prefix_len;
+   int n_threads;
+   pthread_t scanner;
+   pthread_t *decoders;
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   bzip2_job_t *head;
+   bzip2_job_t *tail;
+   int n_jobs;
+   int max_jobs;
+   bool scan_done;
+   bool failed;
+   bool closing;
+};
+
+/*
+ * rewrap a block as a one-block stream - "BZh9", the block bits
+ * realigned to a byte boundary, the end of stream magic and the block
+ * crc as the combined crc - and decode it
+ */
+static bool
+bzip2_block_decode (const uint8_t *in,
+                    uint64_t       start_bit,
+                    uint64_t       end_bit,
+                    char         **out,
+                    size_t        *out_len)
+{
+   int shift = start_bit % 8;
+   uint64_t n_bits = end_bit - start_bit, bit;
+   size_t n_bytes = n_bits / 8, i, size;
+   uint8_t *stream, *q;
+   uint64_t acc = 0;
+   int acc_bits = 0;
+   uint32_t crc;
+   bz_stream strm;
+   int ret;
+
+   if (n_bits < 48 + 32)
+      return false;
+   stream = malloc (4 + n_bytes + 16);
+   memcpy (stream, "BZh9", 4);
+   q = stream + 4;
+   for (i = 0; i < n_bytes; i++)
+      *q++ = shift ? (uint8_t)((in[i] << shift) | (in[i + 1] >> (8 - shift))) : in[i];
+   for (bit = shift + 8 * n_bytes; bit < shift + n_bits; bit++) {
+      acc = (acc << 1) | ((in[bit / 8] >> (7 - bit % 8)) & 1);
+      acc_bits++;
+   }
+   acc = (acc << 48) | BZIP2_EOS_MAGIC;
+   acc_bits += 48;
+   for (; acc_bits >= 8; acc_bits -= 8)
+      *q++ = (uint8_t)(acc >> (acc_bits - 8));
+   crc = (uint32_t)stream[10] << 24 | (uint32_t)stream[11] << 16 | (uint32_t)stream[12] << 8 | stream[13];
+   acc = (acc << 32) | crc;
+   acc_bits += 32;
+   for (; acc_bits >= 8; acc_bits -= 8)
+      *q++ = (uint8_t)(acc >> (acc_bits - 8));
+   if (acc_bits > 0)
+      *q++ = (uint8_t)(acc << (8 - acc_bits));
+
+   memset (&strm, 0, sizeof strm);
+   if (BZ2_bzDecompressInit (&strm, 0, 0) != BZ_OK) {
+      free (stream);
+      return false;
+   }
+   strm.next_in = (char *)stream;
+   strm.avail_in = q - stream;
+   size = BZIP2_OUT_SIZE;
+   *out = malloc (size);
+   *out_len = 0;
+   do {
+      if (*out_len == size) {
+         size *= 2;
+         *out = realloc (*out, size);
+      }
+      strm.next_out = *out + *out_len;
+      strm.avail_out = size - *out_len;
+      ret = BZ2_bzDecompress (&strm);
+      *out_len = size - strm.avail_out;
+   } while (ret == BZ_OK && (strm.avail_in > 0 || strm.avail_out == 0));
+   BZ2_bzDecompressEnd (&strm);
+   free (stream);
+   if (ret != BZ_STREAM_END) {
+      free (*out);
+      *out = NULL;
+      *out_len = 0;
+      return false;
+   }
+   return true;
+}
+
+/* queue the block [start_bit, end_bit), buf holds the input from buf_bit0 */
+static bool
+bzip2_reader_emit (bzip2_reader_t *reader,
+                   const uint8_t  *buf,
+                   uint64_t        buf_bit0,
+                   uint64_t        start_bit,
+                   uint64_t        end_bit)
+{
+   bzip2_job_t *job;
+
+   job = calloc (1, sizeof *job);
+   job->start_bit = start_bit;
+   job->end_bit = end_bit;
+   job->in_len = (end_bit + 7) / 8 - start_bit / 8;
+   job->in = malloc (job->in_len);
+   memcpy (job->in, buf + (start_bit - buf_bit0) / 8, job->in_len);
+   job->state = BZIP2_JOB_NEW;
+   pthread_mutex_lock (&reader->mutex);
+   while (reader->n_jobs >= reader->max_jobs && !reader->closing)
+      pthread_cond_wait (&reader->cond, &reader->mutex);
+   if (reader->tail)
+      reader->tail->next = job;
+   else
+      reader->head = job;
+   reader->tail = job;
+   reader->n_jobs++;
+   pthread_cond_broadcast (&reader->cond);
+   pthread_mutex_unlock (&reader->mutex);
+   return !reader->closing;
+}
+
+/*
+ * find every block and end of stream magic at any bit offset, a block
+ * runs to the next magic; an end of stream magic only ends a block when
+ * the next block magic follows within BZIP2_EOS_GAP_BITS, otherwise it
+ * was block data that happened to match
+ */
+static void *
+bzip2_reader_scan (void *arg)
+{
+   bzip2_reader_t *reader = arg;
+   uint8_t *buf = NULL;
+   size_t buf_len = 0, buf_size = 0, keep;
+   uint64_t buf_bit0 = 0, pos = 0, window = 0, magic, bit;
+   uint64_t block_start = 0, eos_bit = 0;
+   bool in_block = false, ok = true;
+   ssize_t n;
+   int k;
+
+   for (;;) {
+      if (buf_len + BZIP2_READ_SIZE > buf_size) {
+         buf_size = buf_len + 2 * BZIP2_READ_SIZE;
+         buf = realloc (buf, buf_size);
+      }
+      if (reader->prefix_len > 0) {
+         memcpy (buf + buf_len, reader->prefix, reader->prefix_len);
+         n = reader->prefix_len;
+         reader->prefix_len = 0;
+      }
+      else
+         n = read (reader->fd, buf + buf_len, BZIP2_READ_SIZE);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n < 0) {
+         fprintf (stderr, "ERROR: bzip2_reader read: %s\n", strerror (errno));
+         ok = false;
+         break;
+      }
+      if (n == 0)
+         break;
+      if (buf_bit0 == 0 && buf_len < 3 && buf_len + n >= 3 && memcmp (buf, "BZh", 3) != 0) {
+         fprintf (stderr, "ERROR: bzip2_reader: not a bzip2 stream\n");
+         ok = false;
+         break;
+      }
+      buf_len += n;
+      for (; pos < buf_bit0 / 8 + buf_len && ok; pos++) {
+         window = (window << 8) | buf[pos - buf_bit0 / 8];
+         if (pos < 6)
+            continue;
+         for (k = 7; k >= 0 && ok; k--) {
+            magic = (window >> k) & BZIP2_MAGIC_MASK;
+            if (magic != BZIP2_BLOCK_MAGIC && magic != BZIP2_EOS_MAGIC)
+               continue;
+            bit = pos * 8 + 8 - k - 48;
+            if (magic == BZIP2_EOS_MAGIC) {
+               if (in_block)
+                  eos_bit = bit;
+               continue;
+            }
+            if (in_block)
+               ok = bzip2_reader_emit (reader, buf, buf_bit0, block_start,
+                                       eos_bit && bit - eos_bit <= BZIP2_EOS_GAP_BITS ? eos_bit : bit);
+            in_block = true;
+            block_start = bit;
+            eos_bit = 0;
+         }
+      }
+      if (!ok)
+         break;
+      /* keep the open block, or enough bytes for a magic straddling pos */
+      keep = in_block ? block_start / 8 : (pos >= 7 ? pos - 7 : 0);
+      if (keep > buf_bit0 / 8) {
+         memmove (buf, buf + (keep - buf_bit0 / 8), buf_len - (keep - buf_bit0 / 8));
+         buf_len -= keep - buf_bit0 / 8;
+         buf_bit0 = keep * 8;
+      }
+   }
+   if (ok && in_block) {
+      if (eos_bit)
+         ok = bzip2_reader_emit (reader, buf, buf_bit0, block_start, eos_bit);
+      else {
+         fprintf (stderr, "ERROR: bzip2_reader: truncated stream\n");
+         ok = false;
+      }
+   }
+   free (buf);
+   pthread_mutex_lock (&reader->mutex);
+   reader->scan_done = true;
+   reader->failed = reader->failed || !ok;
+   pthread_cond_broadcast (&reader->cond);
+   pthread_mutex_unlock (&reader->mutex);
+   return NULL;
+}
+
+static void *
+bzip2_reader_decode (void *arg)
+{
+   bzip2_reader_t *reader = arg;
+   bzip2_job_t *job;
+   bool ok;
+
+   pthread_mutex_lock (&reader->mutex);
+   for (;;) {
+      for (job = reader->head; job && job->state != BZIP2_JOB_NEW; job = job->next)
+         ;
+      if (job) {
+         job->state = BZIP2_JOB_RUNNING;
+         pthread_mutex_unlock (&reader->mutex);
+         ok = bzip2_block_decode (job->in, job->start_bit, job->end_bit, &job->out, &job->out_len);
+         pthread_mutex_lock (&reader->mutex);
+         job->state = ok ? BZIP2_JOB_DONE : BZIP2_JOB_FAILED;
+         pthread_cond_broadcast (&reader->cond);
+      }
+      else if (reader->scan_done || reader->closing)
+         break;
+      else
+         pthread_cond_wait (&reader->cond, &reader->mutex);
+   }
+   pthread_mutex_unlock (&reader->mutex);
+   return NULL;
+}
+
+/*
+ * a block that fails to decode was cut short by a false magic inside
+ * its data, join it with the following block and decode again - called
+ * with the mutex held
+ */
+static bool
+bzip2_reader_merge (bzip2_reader_t *reader,
+                    bzip2_job_t    *job)
+{
+   bzip2_job_t *next;
+   size_t len;
+   bool ok;
+
+   while (!job->next && !reader->scan_done)
+      pthread_cond_wait (&reader->cond, &reader->mutex);
+   next = job->next;
+   while (next && next->state == BZIP2_JOB_RUNNING)
+      pthread_cond_wait (&reader->cond, &reader->mutex);
+   if (!next || next->start_bit != job->end_bit || job->n_merged >= BZIP2_MAX_MERGE)
+      return false;
+   len = job->end_bit / 8 - job->start_bit / 8;
+   job->in = realloc (job->in, len + next->in_len);
+   memcpy (job->in + len, next->in, next->in_len);
+   job->in_len = len + next->in_len;
+   job->end_bit = next->end_bit;
+   job->n_merged++;
+   job->next = next->next;
+   if (reader->tail == next)
+      reader->tail = job;
+   reader->n_jobs--;
+   free (next->in);
+   free (next->out);
+   free (next);
+   job->state = BZIP2_JOB_RUNNING;
+   pthread_cond_broadcast (&reader->cond);
+   pthread_mutex_unlock (&reader->mutex);
+   ok = bzip2_block_decode (job->in, job->start_bit, job->end_bit, &job->out, &job->out_len);
+   pthread_mutex_lock (&reader->mutex);
+   job->state = ok ? BZIP2_JOB_DONE : BZIP2_JOB_FAILED;
+   return true;
+}
+
+bzip2_reader_t *
+bzip2_reader_new (int         fd,
+                  const void *prefix,
+                  size_t      prefix_len,
+                  int         n_threads)
+{
+   bzip2_reader_t *reader;
+   int i;
+
+   reader = calloc (1, sizeof *reader);
+   reader->fd = fd;
+   reader->prefix = malloc (prefix_len + 1);
+   memcpy (reader->prefix, prefix, prefix_len);
+   reader->prefix_len = prefix_len;
+   reader->n_threads = n_threads > 0 ? n_threads : 1;
+   reader->max_jobs = BZIP2_JOBS_PER_THREAD * reader->n_threads;
+   pthread_mutex_init (&reader->mutex, NULL);
+   pthread_cond_init (&reader->cond, NULL);
+   if (pthread_create (&reader->scanner, NULL, bzip2_reader_scan, reader) != 0) {
+      fprintf (stderr, "ERROR: bzip2_reader: scanner thread not started\n");
+      pthread_mutex_destroy (&reader->mutex);
+      pthread_cond_destroy (&reader->cond);
+      free (reader->prefix);
+      free (reader);
+      return NULL;
+   }
+   reader->decoders = calloc (reader->n_threads, sizeof (pthread_t));
+   for (i = 0; i < reader->n_threads; i++) {
+      if (pthread_create (&reader->decoders[i], NULL, bzip2_reader_decode, reader) != 0)
+         break;
+   }
+   reader->n_threads = i;
+   if (reader->n_threads == 0) {
+      fprintf (stderr, "ERROR: bzip2_reader: no decoder thread started\n");
+      bzip2_reader_destroy (reader);
+      return NULL;
+   }
+   return reader;
+}
+
+ssize_t
+bzip2_reader_read (bzip2_reader_t *reader,
+                   void           *buf,
+                   size_t          len)
+{
+   bzip2_job_t *job;
+   size_t n;
+
+   pthread_mutex_lock (&reader->mutex);
+   for (;;) {
+      job = reader->head;
+      if (reader->failed) {
+         pthread_mutex_unlock (&reader->mutex);
+         return -1;
+      }
+      if (!job && reader->scan_done) {
+         pthread_mutex_unlock (&reader->mutex);
+         return 0;
+      }
+      if (!job || job->state == BZIP2_JOB_NEW || job->state == BZIP2_JOB_RUNNING) {
+         pthread_cond_wait (&reader->cond, &reader->mutex);
+         continue;
+      }
+      if (job->state == BZIP2_JOB_FAILED) {
+         if (!bzip2_reader_merge (reader, job)) {
+            fprintf (stderr, "ERROR: bzip2_reader: bad block at bit %"PRIu64"\n", job->start_bit);
+            reader->failed = true;
+         }
+         continue;
+      }
+      if (job->out_pos < job->out_len)
+         break;
+      reader->head = job->next;
+      if (!reader->head)
+         reader->tail = NULL;
+      reader->n_jobs--;
+      free (job->in);
+      free (job->out);
+      free (job);
+      pthread_cond_broadcast (&reader->cond);
+   }
+   pthread_mutex_unlock (&reader->mutex);
+   /* the head job is the reader's alone once decoded */
+   n = len < job->out_len - job->out_pos ? len : job->out_len - job->out_pos;
+   memcpy (buf, job->out + job->out_pos, n);
+   job->out_pos += n;
+   return n;
+}
+
+void
+bzip2_reader_destroy (bzip2_reader_t *reader)
+{
+   bzip2_job_t *job, *next;
+   int i;
+
+   pthread_mutex_lock (&reader->mutex);
+   reader->closing = true;
+   pthread_cond_broadcast (&reader->cond);
+   pthread_mutex_unlock (&reader->mutex);
+   pthread_join (reader->scanner, NULL);
+   for (i = 0; i < reader->n_threads; i++)
+      pthread_join (reader->decoders[i], NULL);
+   for (job = reader->head; job; job = next) {
+      next = job->next;
+      free (job->in);
+      free (job->out);
+      free (job);
+   }
+   pthread_mutex_destroy (&reader->mutex);
+   pthread_cond_destroy (&reader->cond);
+   free (reader->decoders);
+   free (reader->prefix);
+   free (reader);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright 2014 MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Parallel bzip2 decompression of a file or pipe - a scanner thread
+ * splits the compressed input at the 48-bit block magic, each block is
+ * rewrapped as a one-block stream and decoded by libbz2 on one of
+ * n_threads decoder threads, and bzip2_reader_read returns the output
+ * in input order.  Works on any bzip2 file, single or multi-stream,
+ * in the same way as bzip2recover finds blocks.
+ */
+
+#ifndef BZIP2_READER_H
+#define BZIP2_READER_H
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct _bzip2_reader_t bzip2_reader_t;
+
+/*
+ * prefix holds bytes already read from fd, e.g. to sniff the "BZh" magic;
+ * NULL when no scanner or decoder thread can be started
+ */
+bzip2_reader_t *
+bzip2_reader_new (int         fd,
+                  const void *prefix,
+                  size_t      prefix_len,
+                  int         n_threads);
+
+/* returns the number of bytes read, 0 at the end, or -1 on a bad stream */
+ssize_t
+bzip2_reader_read (bzip2_reader_t *reader,
+                   void           *buf,
+                   size_t          len);
+
+void
+bzip2_reader_destroy (bzip2_reader_t *reader);
+
+#endif
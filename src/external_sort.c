@@ -0,0 +1,239 @@
+/*
+ * Copyright 2014 MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <mongoc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "external_sort.h"
+
+/* a record is the header followed by len bytes of BSON */
+typedef struct {
+   int64_t key;
+   uint64_t seq;
+   uint32_t len;
+} external_sort_record_t;
+
+/* the sort key of a buffered record and where it is */
+typedef struct {
+   external_sort_record_t record;
+   size_t offset;
+} external_sort_index_t;
+
+typedef struct {
+   FILE *fp;
+   external_sort_record_t record;
+   uint8_t *data;
+   size_t size;
+   bool valid;
+} external_sort_run_t;
+
+struct _external_sort_t {
+   size_t run_bytes;
+   uint8_t *buf;
+   size_t len;
+   size_t size;
+   external_sort_index_t *index;
+   size_t n_records;
+   size_t index_size;
+   size_t next_record;
+   uint64_t seq;
+   external_sort_run_t *runs;
+   int n_runs;
+   int64_t count;
+   bool failed;
+};
+
+external_sort_t *
+external_sort_new (size_t run_bytes)
+{
+   external_sort_t *sort;
+
+   sort = bson_malloc0 (sizeof (external_sort_t));
+   sort->run_bytes = run_bytes;
+   return sort;
+}
+
+static int
+external_sort_compare (const external_sort_record_t *a,
+                       const external_sort_record_t *b)
+{
+   if (a->key != b->key)
+      return a->key < b->key ? -1 : 1;
+   return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+static int
+external_sort_index_compare (const void *a,
+                             const void *b)
+{
+   return external_sort_compare (&((const external_sort_index_t *)a)->record,
+                                 &((const external_sort_index_t *)b)->record);
+}
+
+static bool
+external_sort_spill (external_sort_t *sort)
+{
+   external_sort_run_t *run;
+   const external_sort_index_t *index;
+   size_t i;
+
+   if (sort->n_records == 0)
+      return true;
+   qsort (sort->index, sort->n_records, sizeof (external_sort_index_t), external_sort_index_compare);
+   sort->runs = bson_realloc (sort->runs, (sort->n_runs + 1) * sizeof (external_sort_run_t));
+   run = &sort->runs[sort->n_runs++];
+   memset (run, 0, sizeof (external_sort_run_t));
+   if ((run->fp = tmpfile ()) == NULL) {
+      perror ("external_sort tmpfile");
+      return false;
+   }
+   for (i = 0; i < sort->n_records; i++) {
+      index = &sort->index[i];
+      if (fwrite (sort->buf + index->offset, sizeof (external_sort_record_t) + index->record.len, 1, run->fp) != 1) {
+         perror ("external_sort fwrite");
+         return false;
+      }
+   }
+   sort->len = sort->n_records = 0;
+   return true;
+}
+
+bool
+external_sort_add (external_sort_t *sort,
+                   int64_t          key,
+                   const bson_t    *doc)
+{
+   external_sort_record_t record;
+   size_t len = sizeof record + doc->len;
+
+   if (sort->failed)
+      return false;
+   if (sort->len > 0 && sort->len + len > sort->run_bytes && !external_sort_spill (sort)) {
+      sort->failed = true;
+      return false;
+   }
+   if (sort->len + len > sort->size) {
+      sort->size = BSON_MAX (sort->len + len, 2 * sort->size);
+      sort->buf = bson_realloc (sort->buf, sort->size);
+   }
+   if (sort->n_records == sort->index_size) {
+      sort->index_size = BSON_MAX (1024, 2 * sort->index_size);
+      sort->index = bson_realloc (sort->index, sort->index_size * sizeof (external_sort_index_t));
+   }
+   record.key = key;
+   record.seq = sort->seq++;
+   record.len = doc->len;
+   memcpy (sort->buf + sort->len, &record, sizeof record);
+   memcpy (sort->buf + sort->len + sizeof record, bson_get_data (doc), doc->len);
+   sort->index[sort->n_records].record = record;
+   sort->index[sort->n_records++].offset = sort->len;
+   sort->len += len;
+   sort->count++;
+   return true;
+}
+
+static bool
+external_sort_run_read (external_sort_run_t *run)
+{
+   run->valid = fread (&run->record, sizeof run->record, 1, run->fp) == 1;
+   if (!run->valid)
+      return !ferror (run->fp);
+   if (run->record.len > run->size) {
+      run->size = run->record.len;
+      run->data = bson_realloc (run->data, run->size);
+   }
+   run->valid = fread (run->data, 1, run->record.len, run->fp) == run->record.len;
+   return run->valid;
+}
+
+bool
+external_sort_finish (external_sort_t *sort)
+{
+   int i;
+
+   if (sort->failed)
+      return false;
+   if (sort->n_runs == 0) {
+      qsort (sort->index, sort->n_records, sizeof (external_sort_index_t), external_sort_index_compare);
+      sort->next_record = 0;
+      return true;
+   }
+   if (!external_sort_spill (sort))
+      return false;
+   bson_free (sort->buf);
+   sort->buf = NULL;
+   sort->size = 0;
+   for (i = 0; i < sort->n_runs; i++) {
+      rewind (sort->runs[i].fp);
+      if (!external_sort_run_read (&sort->runs[i]))
+         return false;
+   }
+   return true;
+}
+
+bool
+external_sort_next (external_sort_t *sort,
+                    int64_t         *key,
+                    bson_t          *doc)
+{
+   const external_sort_index_t *index;
+   external_sort_run_t *min = NULL;
+   int i;
+
+   if (sort->n_runs == 0) {
+      if (sort->next_record >= sort->n_records)
+         return false;
+      index = &sort->index[sort->next_record++];
+      *key = index->record.key;
+      return bson_init_static (doc, sort->buf + index->offset + sizeof (external_sort_record_t), index->record.len);
+   }
+   for (i = 0; i < sort->n_runs; i++) {
+      if (sort->runs[i].valid && (!min || external_sort_compare (&sort->runs[i].record, &min->record) < 0))
+         min = &sort->runs[i];
+   }
+   if (!min)
+      return false;
+   *key = min->record.key;
+   /* hand out a copy, the run buffer is refilled below */
+   if (min->record.len > sort->size) {
+      sort->size = min->record.len;
+      sort->buf = bson_realloc (sort->buf, sort->size);
+   }
+   memcpy (sort->buf, min->data, min->record.len);
+   return bson_init_static (doc, sort->buf, min->record.len) && external_sort_run_read (min);
+}
+
+int64_t
+external_sort_count (const external_sort_t *sort)
+{
+   return sort->count;
+}
+
+void
+external_sort_destroy (external_sort_t *sort)
+{
+   int i;
+
+   for (i = 0; i < sort->n_runs; i++) {
+      if (sort->runs[i].fp)
+         fclose (sort->runs[i].fp);
+      bson_free (sort->runs[i].data);
+   }
+   bson_free (sort->runs);
+   bson_free (sort->buf);
+   bson_free (sort->index);
+   bson_free (sort);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2014 MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * External sort of BSON documents by an integer key - documents are
+ * buffered up to run_bytes, sorted and spilled to a temporary file as a
+ * run; after external_sort_finish the runs are merged back in key order.
+ * Documents with equal keys come back in the order they were added.
+ * A sort that fits in one run never touches the disk.
+ */
+
+#ifndef EXTERNAL_SORT_H
+#define EXTERNAL_SORT_H
+#include <mongoc.h>
+
+#define EXTERNAL_SORT_RUN_BYTES (256*1024*1024)
+
+typedef struct _external_sort_t external_sort_t;
+
+external_sort_t *
+external_sort_new (size_t run_bytes);
+
+bool
+external_sort_add (external_sort_t *sort,
+                   int64_t          key,
+                   const bson_t    *doc);
+
+bool
+external_sort_finish (external_sort_t *sort);
+
+/* doc is valid until the next call, false at the end or on a read error */
+bool
+external_sort_next (external_sort_t *sort,
+                    int64_t         *key,
+                    bson_t          *doc);
+
+int64_t
+external_sort_count (const external_sort_t *sort);
+
+void
+external_sort_destroy (external_sort_t *sort);
+
+#endif
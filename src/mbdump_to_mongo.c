@@ -24,11 +24,21 @@
 #include <math.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
 #include <libgen.h>
-
-#define INSERT_BATCH_SIZE 1000
-#define BULK_OPS_SIZE 1000
-#define PROGRESS_SIZE (100*BULK_OPS_SIZE)
+#include <pthread.h>
+#include "bulk_pipeline.h"
+#include "bzip2_reader.h"
+#include <bzlib.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ROW_SCAN_X86 1
+#endif
+
+#define PROGRESS_SIZE 100000
 #define PROGRESS_SIZE_FORMAT "M"
 #define PROGRESS_END_FORMAT ">%zd=%"PRId64
 
@@ -43,14 +53,32 @@
 #define ASSERT(e) \
     assert (e)
 
+#define CHUNK_SIZE (64*1024*1024)
+#define READ_AHEAD_SIZE (32*1024*1024)
+#define HUGE_PAGE_SIZE (2*1024*1024)
+#define BSON_OUT_BUFFER_SIZE (8*1024*1024)
+
 char mbdump_dir[MAXPATHLEN];
 char schema_file[MAXPATHLEN];
-char mbdump_file[MAXPATHLEN];
+char plan_file[MAXPATHLEN];
+int jobs = 1;
+int writers = 0;
+int in_flight = 2;
+int bzip2_threads = 0;
+char out_bson_dir[MAXPATHLEN];
+char checkpoint_dir[MAXPATHLEN];
+char delta_dir[MAXPATHLEN];
+char merge_spec_file[MAXPATHLEN];
+bool resume = false;
+size_t batch_bytes = 0;
+bool auto_tune = false;
+bulk_batch_size_t batch_size;
+pthread_mutex_t batch_size_mutex = PTHREAD_MUTEX_INITIALIZER;
+mongoc_client_pool_t *writer_pool = NULL;
+const char *database_name = NULL;
 
 #define MONGODB_DEFAULT_URI "mongodb://localhost/musicbrainz"
 
-char buf[BUFSIZ];
-
 double
 dtimeofday ()
 {
@@ -146,468 +174,3745 @@ bson_init_from_json_file (bson_t     *bson,
     return ret;
 }
 
-bool
-bson_find_create_table (bson_t      *bson_schema,
-                        const char  *table_name,
-                        bson_iter_t *iter_col)
-{
-    bson_iter_t iter_json, iter_ary, iter_sql, iter_table_prop;
+/*
+ * Column converters take a (value, len) span into the row; value is NULL
+ * for a SQL NULL (\N).  Empty strings are not appended.
+ */
 
-    bson_iter_init_find (&iter_json, bson_schema, "json") || DIE;
-    BSON_ITER_HOLDS_ARRAY (&iter_json) || DIE;
-    bson_iter_recurse (&iter_json, &iter_ary) || DIE;
-    while (bson_iter_next (&iter_ary)) {
-        (BSON_ITER_HOLDS_DOCUMENT (&iter_ary) || DIE);
-        bson_iter_recurse (&iter_ary, &iter_sql) || DIE;
-        if (bson_iter_find (&iter_sql, "create_table") &&
-            (BSON_ITER_HOLDS_DOCUMENT (&iter_sql) || DIE) &&
-            (bson_iter_recurse (&iter_sql, &iter_table_prop) || DIE) &&
-            (bson_iter_find (&iter_table_prop, "table_name") || DIE) &&
-            (BSON_ITER_HOLDS_UTF8 (&iter_table_prop) || DIE) &&
-            (strcmp (bson_iter_utf8 (&iter_table_prop, NULL), table_name) == 0) &&
-            (bson_iter_find (&iter_table_prop, "columns") || DIE) &&
-            (BSON_ITER_HOLDS_ARRAY (&iter_table_prop) || DIE)) {
-            bson_iter_recurse (&iter_table_prop, iter_col) || DIE;
-            return true;
-        }
-    }
-    return (false);
+#define SPAN_S_SIZE 64
+
+const char *
+span_to_s (char       *s,
+           size_t      size,
+           const char *value,
+           size_t      len)
+{
+    len = BSON_MIN (len, size - 1);
+    memcpy (s, value, len);
+    s[len] = '\0';
+    return s;
 }
 
 bool
 bson_append_utf8_from_s (bson_t     *bson,
                          const char *key,
-                         const char *value)
+                         const char *value,
+                         size_t      len)
 {
     bool ret = true;
 
-    if (value && *value)
-        ret = BSON_APPEND_UTF8 (bson, key, value);
+    if (value && len > 0)
+        ret = bson_append_utf8 (bson, key, -1, value, len);
     return ret;
 }
 
 bool
-bson_append_int32_from_s (bson_t     *bson,
+bson_append_bool_from_s (bson_t      *bson,
                           const char *key,
-                          const char *value)
+                          const char *value,
+                          size_t      len)
 {
     bool ret = true;
 
-    if (value && strcmp ("\\N", value) != 0)
-        ret = BSON_APPEND_INT32 (bson, key, atoi (value));
+    if (value) {
+        (len == 1 && (*value == 't' || *value == 'f')) || DIE;
+        ret = BSON_APPEND_BOOL (bson, key, (*value == 't') ? true : false);
+    }
     return ret;
 }
 
+/*
+ * Length-aware parsers for the hot converters - no strdup, no locale,
+ * no NUL terminator needed.  They return false on malformed input but
+ * still produce the value atoi/atof would have for the parsed prefix.
+ */
+
 bool
-bson_append_double_from_s (bson_t    *bson,
+parse_int32 (const char *s,
+             size_t      len,
+             int32_t    *value)
+{
+    const char *p = s, *end = s + len;
+    bool negative = false;
+    uint32_t n = 0;
+    const char *digits;
+
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+    for (digits = p; p < end && *p >= '0' && *p <= '9'; p++)
+        n = n * 10 + (*p - '0');
+    *value = negative ? (int32_t)(0 - n) : (int32_t)n;
+    return p > digits && p == end;
+}
+
+const double pow10_table[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define DOUBLE_EXACT_MANTISSA ((uint64_t)1 << 53)
+
+/*
+ * decimal mantissa and power of ten both exact in a double give a
+ * correctly rounded result from one multiply or divide (Clinger's fast
+ * path); anything else falls back to strtod
+ */
+bool
+parse_double (const char *s,
+              size_t      len,
+              double     *value)
+{
+    const char *p = s, *end = s + len;
+    bool negative = false, exact = true;
+    uint64_t mantissa = 0;
+    int exp10 = 0, n_digits = 0;
+    char buf[SPAN_S_SIZE];
+
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+    for (; p < end && *p >= '0' && *p <= '9'; p++, n_digits++) {
+        if (mantissa < DOUBLE_EXACT_MANTISSA / 10)
+            mantissa = mantissa * 10 + (*p - '0');
+        else {
+            exp10++;
+            exact = exact && *p == '0';
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, n_digits++) {
+            if (mantissa < DOUBLE_EXACT_MANTISSA / 10) {
+                mantissa = mantissa * 10 + (*p - '0');
+                exp10--;
+            }
+            else
+                exact = exact && *p == '0';
+        }
+    }
+    if (n_digits > 0 && p < end && (*p == 'e' || *p == 'E')) {
+        int32_t e;
+
+        exact = exact && parse_int32 (p + 1, end - (p + 1), &e) && e > -400 && e < 400;
+        exp10 += exact ? e : 0;
+        p = end;
+    }
+    if (n_digits > 0 && p == end && exact && exp10 >= -22 && exp10 <= 22) {
+        *value = (exp10 < 0) ? mantissa / pow10_table[-exp10] : mantissa * pow10_table[exp10];
+        *value = negative ? -*value : *value;
+        return true;
+    }
+    *value = strtod (span_to_s (buf, sizeof buf, s, len), NULL);
+    return n_digits > 0 && len < sizeof buf;
+}
+
+bool
+parse_digits (const char **p,
+              const char  *end,
+              int          n,
+              int         *value)
+{
+    for (*value = 0; n > 0; n--, (*p)++) {
+        if (*p >= end || **p < '0' || **p > '9')
+            return false;
+        *value = *value * 10 + (**p - '0');
+    }
+    return true;
+}
+
+int64_t
+days_from_civil (int64_t y,
+                 int     m,
+                 int     d)
+{
+    int64_t era;
+    int yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = (int)(y - era * 400);
+    doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/*
+ * PostgreSQL timestamp output, "YYYY-MM-DD HH:MM:SS[.ffffff][+-HH[:MM]]",
+ * to milliseconds since the epoch in UTC
+ */
+bool
+pg_timestamp_parse (const char *s,
+                    size_t      len,
+                    int64_t    *msec)
+{
+    const char *p = s, *end = s + len;
+    int year, month, day, hour, minute, second, usec = 0, scale = 100000;
+    int tz_hour = 0, tz_minute = 0, tz_sign = 0, digit;
+
+    if (!(parse_digits (&p, end, 4, &year) && p < end && *p++ == '-' &&
+          parse_digits (&p, end, 2, &month) && p < end && *p++ == '-' &&
+          parse_digits (&p, end, 2, &day) && p < end && (*p == ' ' || *p == 'T') && p++ &&
+          parse_digits (&p, end, 2, &hour) && p < end && *p++ == ':' &&
+          parse_digits (&p, end, 2, &minute) && p < end && *p++ == ':' &&
+          parse_digits (&p, end, 2, &second)))
+        return false;
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, scale /= 10) {
+            digit = *p - '0';
+            usec += digit * scale;
+        }
+    }
+    if (p < end && (*p == '+' || *p == '-')) {
+        tz_sign = (*p++ == '-') ? -1 : 1;
+        if (!parse_digits (&p, end, 2, &tz_hour))
+            return false;
+        if (p < end && *p == ':')
+            p++;
+        if (p < end && !parse_digits (&p, end, 2, &tz_minute))
+            return false;
+    }
+    *msec = ((days_from_civil (year, month, day) * 24 + hour) * 60 + minute) * 60 + second;
+    *msec -= tz_sign * (tz_hour * 3600 + tz_minute * 60);
+    *msec = *msec * 1000 + usec / 1000;
+    return p == end;
+}
+
+bool
+bson_append_int32_from_s (bson_t     *bson,
                           const char *key,
-                          const char *value)
+                          const char *value,
+                          size_t      len)
 {
+    int32_t i;
     bool ret = true;
 
-    if (value && strcmp ("\\N", value) != 0)
-        ret = BSON_APPEND_DOUBLE (bson, key, atof (value));
+    if (value) {
+        ret = parse_int32 (value, len, &i);
+        ret = BSON_APPEND_INT32 (bson, key, i) && ret;
+    }
     return ret;
 }
 
 bool
-bson_append_bool_from_s (bson_t      *bson,
+bson_append_double_from_s (bson_t    *bson,
                           const char *key,
-                          const char *value)
+                          const char *value,
+                          size_t      len)
 {
+    double d;
     bool ret = true;
 
-    if (value && strcmp ("\\N", value) != 0) {
-        strcmp ("t", value) == 0 || strcmp ("f", value) == 0 || DIE;
-        ret = BSON_APPEND_BOOL (bson, key, (strcmp ("t", value) == 0) ? true : false);
+    if (value) {
+        ret = parse_double (value, len, &d);
+        ret = BSON_APPEND_DOUBLE (bson, key, d) && ret;
     }
     return ret;
 }
 
-#define FORMAT_PG_TIMESTAMP_WITH_TIME_ZONE "%F %T.%6d%z"
-#define FORMAT_PG_TIMESTAMP_F_T "%F %T"
-#define FORMAT_PG_TIMESTAMP_USEC ".%6d"
-#define FORMAT_PG_TIMESTAMP_Z "%z"
-
 bool
-pg_timestamp_with_time_zone_from_s (const char     *s,
-                                    struct timeval *timeval)
+bson_append_date_time_from_s (bson_t     *bson,
+                              const char *key,
+                              const char *value,
+                              size_t      len)
 {
-    struct tm tm;
-    char *p;
+    int64_t msec;
+    bool ret = true;
 
-    p = strptime (s, FORMAT_PG_TIMESTAMP_F_T, &tm);
-    sscanf (p, FORMAT_PG_TIMESTAMP_USEC, &timeval->tv_usec);
-    p = strptime (p + 7, FORMAT_PG_TIMESTAMP_Z, &tm);
-    if (p)
-       fprintf (stderr, "WARNING: strptime parsing incomplete\n");
-    timeval->tv_sec = timegm (&tm);
-    return p == NULL;
+    if (value) {
+        ret = pg_timestamp_parse (value, len, &msec);
+        ret = ret && BSON_APPEND_DATE_TIME (bson, key, msec);
+    }
+    return ret;
 }
 
+/* INTEGER[] - "{1,2,3}" */
 bool
-bson_append_timeval_from_s (bson_t     *bson,
-                            const char *key,
-                            const char *value)
+bson_append_int32_array_from_s (bson_t     *bson,
+                                const char *key,
+                                const char *value,
+                                size_t      len)
 {
-    struct timeval timeval;
     bool ret = true;
+    bson_t child;
+    const char *p, *q, *end;
+    char index_buf[16];
+    const char *index_key;
+    uint32_t index = 0;
+    int32_t i;
+
+    if (value) {
+        end = value + len;
+        p = (len > 0 && *value == '{') ? value + 1 : value;
+        end = (end > p && end[-1] == '}') ? end - 1 : end;
+        BSON_APPEND_ARRAY_BEGIN (bson, key, &child);
+        while (p < end) {
+            for (q = p; q < end && *q != ','; q++)
+                ;
+            ret = parse_int32 (p, q - p, &i) && ret;
+            bson_uint32_to_string (index++, &index_key, index_buf, sizeof index_buf);
+            BSON_APPEND_INT32 (&child, index_key, i);
+            p = q + 1;
+        }
+        bson_append_array_end (bson, &child);
+    }
+    return ret;
+}
 
-    if (value && strcmp ("\\N", value) != 0) {
-        ret = pg_timestamp_with_time_zone_from_s (value, &timeval);
-        ret = ret && bson_append_timeval (bson, key, -1, &timeval);
+/* POINT - "(x,y)" */
+bool
+bson_append_point_from_s (bson_t     *bson,
+                          const char *key,
+                          const char *value,
+                          size_t      len)
+{
+    bool ret = true;
+    bson_t child;
+    const char *p, *comma, *end;
+    double d;
+
+    if (value) {
+        end = value + len;
+        p = (len > 0 && *value == '(') ? value + 1 : value;
+        end = (end > p && end[-1] == ')') ? end - 1 : end;
+        comma = memchr (p, ',', end - p);
+        if (!comma) DIE;
+        BSON_APPEND_ARRAY_BEGIN (bson, key, &child);
+        ret = parse_double (p, comma - p, &d);
+        BSON_APPEND_DOUBLE (&child, "0", d);
+        ret = parse_double (comma + 1, end - (comma + 1), &d) && ret;
+        BSON_APPEND_DOUBLE (&child, "1", d);
+        bson_append_array_end (bson, &child);
     }
     return ret;
 }
 
+/*
+ * libc reference converters - the original atoi/atof versions,
+ * kept so test_suite can check the converters above against them
+ */
+
 bool
-bson_append_int32_array_from_s (bson_t     *bson,
+bson_append_int32_from_s_libc (bson_t     *bson,
+                               const char *key,
+                               const char *value,
+                               size_t      len)
+{
+    char s[SPAN_S_SIZE];
+    bool ret = true;
+
+    if (value)
+        ret = BSON_APPEND_INT32 (bson, key, atoi (span_to_s (s, sizeof s, value, len)));
+    return ret;
+}
+
+bool
+bson_append_double_from_s_libc (bson_t    *bson,
                                 const char *key,
-                                const char *value)
+                                const char *value,
+                                size_t      len)
+{
+    char s[SPAN_S_SIZE];
+    bool ret = true;
+
+    if (value)
+        ret = BSON_APPEND_DOUBLE (bson, key, atof (span_to_s (s, sizeof s, value, len)));
+    return ret;
+}
+
+bool
+bson_append_int32_array_from_s_libc (bson_t     *bson,
+                                     const char *key,
+                                     const char *value,
+                                     size_t      len)
 {
     bool ret = true;
     bson_t child;
     char *s, *p;
 
-    if (value && strcmp ("\\N", value) != 0) {
-        s = strdup (value);
+    if (value) {
+        s = bson_strndup (value, len);
         BSON_APPEND_ARRAY_BEGIN (bson, key, &child);
         p = strtok (s, "{,}");
         while (p) {
-            ret = bson_append_int32_from_s (&child, "0", p);
+            ret = bson_append_int32_from_s_libc (&child, "0", p, strlen (p));
             p = strtok (NULL, "{,}");
         }
         bson_append_array_end (bson, &child);
-        free (s);
+        bson_free (s);
     }
     return ret;
 }
 
 bool
-bson_append_point_from_s (bson_t     *bson,
-                          const char *key,
-                          const char *value)
+bson_append_point_from_s_libc (bson_t     *bson,
+                               const char *key,
+                               const char *value,
+                               size_t      len)
 {
     bool ret = true;
     bson_t child;
     char *s, *p;
 
-    if (value && strcmp ("\\N", value) != 0) {
-        s = strdup (value);
+    if (value) {
+        s = bson_strndup (value, len);
         BSON_APPEND_ARRAY_BEGIN (bson, key, &child);
         p = strtok (s, "(,)");
         if (!p) DIE;
-        ret = bson_append_double_from_s (&child, "0", p);
+        ret = bson_append_double_from_s_libc (&child, "0", p, strlen (p));
         p = strtok (NULL, "(,)");
         if (!p) DIE;
-        ret = ret && bson_append_double_from_s (&child, "1", p);
+        ret = ret && bson_append_double_from_s_libc (&child, "1", p, strlen (p));
         bson_append_array_end (bson, &child);
-        free (s);
+        bson_free (s);
     }
     return ret;
 }
 
+typedef bool (*bson_append_from_s_t) (bson_t *bson, const char *key, const char *value, size_t len);
+
+typedef enum {
+    CONVERTER_UTF8,
+    CONVERTER_BOOL,
+    CONVERTER_INT32,
+    CONVERTER_DATE_TIME,
+    CONVERTER_INT32_ARRAY,
+    CONVERTER_POINT,
+    CONVERTER_COUNT
+} converter_id_t;
+
+bson_append_from_s_t converters[CONVERTER_COUNT] = {
+    bson_append_utf8_from_s,
+    bson_append_bool_from_s,
+    bson_append_int32_from_s,
+    bson_append_date_time_from_s,
+    bson_append_int32_array_from_s,
+    bson_append_point_from_s
+};
+
+/* data types not listed here load as UTF-8 */
 typedef struct {
     const char *data_type;
-    bool (*bson_append_from_s) (bson_t *bson, const char *key, const char *value);
+    converter_id_t converter;
 } data_type_map_t;
 
 data_type_map_t data_type_map[] = {
-    { "BOOLEAN",       bson_append_bool_from_s },
-    { "CHAR(2)",       NULL },
-    { "CHAR(3)",       NULL },
-    { "CHAR(4)",       NULL },
-    { "CHAR(8)",       NULL },
-    { "CHAR(11)",      NULL },
-    { "CHAR(12)",      NULL },
-    { "CHAR(16)",      NULL },
-    { "CHAR(28)",      NULL },
-    { "CHARACTER(15)", NULL },
-    { "INT",           bson_append_int32_from_s },
-    { "INTEGER",       bson_append_int32_from_s },
-    { "SERIAL",        bson_append_int32_from_s },
-    { "SMALLINT",      bson_append_int32_from_s },
-    { "TEXT",          NULL },
-    { "TIMESTAMP",     bson_append_timeval_from_s },
-    { "UUID",          NULL },
-    { "uuid",          NULL },
-    { "VARCHAR",       NULL },
-    { "VARCHAR(10)",   NULL },
-    { "VARCHAR(50)",   NULL },
-    { "VARCHAR(100)",  NULL },
-    { "VARCHAR(255)",  NULL },
-    { "INTEGER[]",     bson_append_int32_array_from_s },
-    { "POINT",         bson_append_point_from_s }
+    { "BOOLEAN",       CONVERTER_BOOL },
+    { "CHAR(2)",       CONVERTER_UTF8 },
+    { "CHAR(3)",       CONVERTER_UTF8 },
+    { "CHAR(4)",       CONVERTER_UTF8 },
+    { "CHAR(8)",       CONVERTER_UTF8 },
+    { "CHAR(11)",      CONVERTER_UTF8 },
+    { "CHAR(12)",      CONVERTER_UTF8 },
+    { "CHAR(16)",      CONVERTER_UTF8 },
+    { "CHAR(28)",      CONVERTER_UTF8 },
+    { "CHARACTER(15)", CONVERTER_UTF8 },
+    { "INT",           CONVERTER_INT32 },
+    { "INTEGER",       CONVERTER_INT32 },
+    { "SERIAL",        CONVERTER_INT32 },
+    { "SMALLINT",      CONVERTER_INT32 },
+    { "TEXT",          CONVERTER_UTF8 },
+    { "TIMESTAMP",     CONVERTER_DATE_TIME },
+    { "timestamptz",   CONVERTER_DATE_TIME },
+    { "UUID",          CONVERTER_UTF8 },
+    { "uuid",          CONVERTER_UTF8 },
+    { "VARCHAR",       CONVERTER_UTF8 },
+    { "VARCHAR(10)",   CONVERTER_UTF8 },
+    { "VARCHAR(50)",   CONVERTER_UTF8 },
+    { "VARCHAR(100)",  CONVERTER_UTF8 },
+    { "VARCHAR(255)",  CONVERTER_UTF8 },
+    { "INTEGER[]",     CONVERTER_INT32_ARRAY },
+    { "POINT",         CONVERTER_POINT }
 };
 
+converter_id_t
+data_type_converter (const char *data_type)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof data_type_map / sizeof data_type_map[0]; i++) {
+        if (strcmp (data_type_map[i].data_type, data_type) == 0)
+            return data_type_map[i].converter;
+    }
+    return CONVERTER_UTF8;
+}
+
+typedef struct _embed_table_t embed_table_t;
+
 typedef struct {
     const char *column_name;
     const char *data_type;
-    bool (*bson_append_from_s) (bson_t *bson, const char *key, const char *value);
+    bson_append_from_s_t bson_append_from_s;
+    const embed_table_t *embed;
+    bool pk;
+    bool id; /* the table's only primary key column, named "id" - stored as _id */
 } column_map_t;
 
-int
-get_column_map (bson_t        *bson_schema,
-                const char    *table_name,
-                column_map_t **column_map,
-                int           *column_map_size)
-{
-    bson_iter_t iter_col, iter_dup;
-    int size;
-    column_map_t *column_map_p;
-    const char *data_type;
-    data_type_map_t *data_type_map_p;
+/*
+ * Merge-one embedding - with --merge-spec, the "1" entries of the merge
+ * spec whose child table has no "n" entries of its own are resolved
+ * while loading.  The child table is converted into memory first, keyed
+ * by its id column, and the parent column gets the child document in
+ * place of the id, as mongomerge would embed it.  Children with "n"
+ * entries are left to mongomerge, their final form depends on those
+ * merges.
+ */
 
-    bson_find_create_table (bson_schema, table_name, &iter_col) || DIE;
-    for (iter_dup = iter_col, size = 0; bson_iter_next (&iter_dup); size++)
-        ;
-    *column_map = calloc (sizeof (column_map_t), size);
-    *column_map_size = size;
-    column_map_p = *column_map;
-    while (bson_iter_next (&iter_col)) {
-        bson_iter_t iter_col_prop;
-
-        BSON_ITER_HOLDS_DOCUMENT (&iter_col) || DIE;
-        bson_iter_recurse (&iter_col, &iter_col_prop) || DIE;
-        bson_iter_find (&iter_col_prop, "column_name") || DIE;
-        BSON_ITER_HOLDS_UTF8 (&iter_col_prop) || DIE;
-        column_map_p->column_name = bson_iter_dup_utf8 (&iter_col_prop, NULL);
-        bson_iter_find (&iter_col_prop, "data_type") || DIE;
-        BSON_ITER_HOLDS_UTF8 (&iter_col_prop) || DIE;
-        data_type = bson_iter_utf8 (&iter_col_prop, NULL);
-        column_map_p->data_type = data_type;
-        for (data_type_map_p = data_type_map;
-             data_type_map_p < (data_type_map + sizeof (data_type_map)) &&
-             strcmp (data_type_map_p->data_type, data_type) != 0;
-             data_type_map_p++)
-            ;
-        if (data_type_map < (data_type_map + sizeof (data_type_map)))
-            column_map_p->bson_append_from_s = data_type_map_p->bson_append_from_s ?
-                data_type_map_p->bson_append_from_s : bson_append_utf8_from_s;
-        else
-            DIE;
-        column_map_p++;
-    }
-    return true;
-}
+typedef struct {
+    int32_t key;
+    uint32_t len;
+    size_t offset;
+} embed_entry_t;
+
+struct _embed_table_t {
+    char *table_name;
+    char *key_column;
+    bool has_many;
+    uint8_t *data;
+    size_t len;
+    size_t size;
+    embed_entry_t *entries;
+    uint32_t mask;
+};
 
-char *
-strtok_single (char       *str,
-               char const *delims)
+typedef struct {
+    char *parent_table;
+    char *parent_column;
+    embed_table_t *child;
+} embed_spec_t;
+
+embed_spec_t *embed_specs = NULL;
+int n_embed_specs = 0;
+embed_table_t **embed_tables = NULL;
+int n_embed_tables = 0;
+
+embed_entry_t *
+embed_table_find (const embed_table_t *table,
+                  int32_t              key)
 {
-    static char *src = NULL;
-    char *ret = NULL;
-    char *p;
+    uint32_t h;
 
-    if (str != NULL)
-        src = str;
-    if (src == NULL)
-        return NULL;
-    if ((p = strpbrk (src, delims)) != NULL) {
-        *p  = '\0';
-        ret = src;
-        src = ++p;
+    for (h = ((uint32_t)key * 2654435761u) & table->mask; table->entries[h].len != 0; h = (h + 1) & table->mask) {
+        if (table->entries[h].key == key)
+            break;
     }
-    return ret;
+    return &table->entries[h];
 }
 
-int64_t
-load_table (mongoc_database_t *db,
-            const char        *table_name,
-            bson_t            *bson_schema)
+/* the first document for a key is kept, later duplicates are dropped */
+void
+embed_table_insert (embed_table_t *table,
+                    int32_t        key,
+                    const bson_t  *bson)
 {
-    int64_t ret = true;
-    column_map_t *column_map, *column_map_p;
-    int column_map_size, i;
-    double start_time, end_time, delta_time;
-    FILE *fp;
-    mongoc_collection_t *collection;
-    mongoc_bulk_operation_t *bulk;
-    size_t n_docs = 0;
-    char *token;
-    bson_t bson, reply;
-    int64_t count = 0;
-    bson_error_t error;
-
-    fprintf (stderr, "load_table table_name: \"%s\"\n", table_name);
-    get_column_map (bson_schema, table_name, &column_map, &column_map_size) || DIE;
-    snprintf (mbdump_file, MAXPATHLEN, "%s/%s", mbdump_dir, table_name);
-    /* fprintf (stderr, "mbdump_file: \"%s\"\n", mbdump_file); */
-    start_time = dtimeofday ();
-    fp = fopen (mbdump_file, "r");
-    if (!fp) DIE;
-    collection = mongoc_database_get_collection (db, table_name);
-    bulk = mongoc_collection_create_bulk_operation (collection, true, NULL);
-    bson_init (&bson);
-    while (ret && fgets (buf, BUFSIZ, fp)) {
-        /*
-        fputs (buf, stdout);
-        */
-        chomp (buf);
-        for (i = 0, column_map_p = column_map, token = strtok_single (buf, "\t");
-             i < column_map_size;
-             i++, column_map_p++, token = strtok_single (NULL, "\t")) {
-             bool ret;
-             /*
-             fprintf (stderr, "%s: \"%s\" [%d/%d](%s)\n", column_map_p->column_name, token, i, column_map_size, column_map_p->data_type);
-             fflush (stdout);
-             */
-             ret = (*column_map_p->bson_append_from_s) (&bson, column_map_p->column_name, token);
-             ret || fprintf (stderr, "WARNING: column_map_p->bson_append_from_s failed column %s: \"%s\" [%d/%d](%s)\n",
-                            column_map_p->column_name, token, i, column_map_size, column_map_p->data_type);
-        }
-        /*
-        bson_printf ("bson: %s\n", &bson);
-        */
-        mongoc_bulk_operation_insert (bulk, &bson);
-        bson_reinit (&bson);
-        if (++n_docs == BULK_OPS_SIZE) {
-           ret = mongoc_bulk_operation_execute (bulk, &reply, &error);
-           if (ret) {
-              count += n_docs;
-              if (count % PROGRESS_SIZE == 0) {
-                  fputc('.', stdout);
-                  fflush(stdout);
-              }
-           }
-           else
-              fprintf (stderr, "mongoc_cursor_bulk_insert execute failure: %s\n", error.message);
-           n_docs = 0;
-           mongoc_bulk_operation_destroy (bulk);
-           bulk = mongoc_collection_create_bulk_operation (collection, true, NULL);
-        }
-    }
-    if (ret && n_docs > 0) {
-       ret = mongoc_bulk_operation_execute (bulk, &reply, &error);
-       if (ret)
-          count += n_docs;
-       else
-          fprintf (stderr, "mongoc_cursor_bulk_insert execute failure: %s\n", error.message);
+    embed_entry_t *entry;
+
+    entry = embed_table_find (table, key);
+    if (entry->len != 0)
+        return;
+    if (table->len + bson->len > table->size) {
+        table->size = BSON_MAX (table->len + bson->len, 2 * table->size);
+        table->data = realloc (table->data, table->size);
     }
-    fputc('.', stdout);
-    fputc('\n', stdout);
-    fflush(stdout);
-    bson_destroy (&bson);
-    mongoc_bulk_operation_destroy (bulk);
-    mongoc_collection_destroy (collection);
-    fclose (fp);
-    end_time = dtimeofday ();
-    delta_time = end_time - start_time + 0.0000001;
-    fprintf (stderr, "info: real: %.2f, count: %"PRId64", %"PRId64" docs/sec\n", delta_time, count, (int64_t)round (count/delta_time));
-    fflush (stderr);
-    free (column_map);
-    return ret ? count : -1;
+    memcpy (table->data + table->len, bson_get_data (bson), bson->len);
+    entry->key = key;
+    entry->offset = table->len;
+    entry->len = bson->len;
+    table->len += bson->len;
 }
 
-int64_t
-execute (int   argc,
-         char *argv[])
+/* the loaded child table embedded into table_name.column_name, or NULL */
+const embed_table_t *
+embed_find (const char *table_name,
+            const char *column_name)
 {
-    int64_t count = 0;
-    const char *uristr = MONGODB_DEFAULT_URI;
-    const char *database_name;
-    mongoc_uri_t *uri;
-    mongoc_client_t *client;
-    mongoc_database_t *db;
-
-    bson_t bson_schema;
-    bson_error_t error;
-    int argi;
-
-    uristr = getenv ("MONGODB_URI");
-    uri = mongoc_uri_new (uristr);
-    client = mongoc_client_new (uristr);
-    database_name = mongoc_uri_get_database (uri);
-    db = mongoc_client_get_database (client, database_name);
+    int i;
 
-    bson_init_from_json_file (&bson_schema, schema_file) || WARN_ERROR;
-    for (argi = 0; argi < argc; argi++) {
-        fprintf (stderr, "[%d/%d] %s\n", argi + 1, argc, argv[argi]);
-        count += load_table (db, argv[argi], &bson_schema);
+    for (i = 0; i < n_embed_specs; i++) {
+        if (embed_specs[i].child->entries &&
+            strcmp (embed_specs[i].parent_table, table_name) == 0 &&
+            strcmp (embed_specs[i].parent_column, column_name) == 0)
+            return embed_specs[i].child;
     }
-    bson_destroy (&bson_schema);
-
-    mongoc_database_destroy (db);
-    mongoc_client_destroy (client);
-    mongoc_uri_destroy (uri);
-    return count;
+    return NULL;
 }
 
+/* append the child document for the id in value, false when there is none */
 bool
-test_pg_timestamp_with_time_zone_from_s (void)
+embed_table_append (const embed_table_t *table,
+                    bson_t              *bson,
+                    const char          *key,
+                    const char          *value,
+                    size_t               len)
 {
-    struct timeval timeval;
-    char *s = "2013-07-21 22:47:57.660809+00";
-    time_t utime;
-    struct tm *tm;
-    char stime_f_t[64], stime_usec_z[64];
+    const embed_entry_t *entry;
+    int32_t id;
+    bson_t child;
 
-    pg_timestamp_with_time_zone_from_s (s, &timeval) || DIE;
-    utime = (time_t) timeval.tv_sec;
-    tm = gmtime (&utime);
-    strftime (stime_f_t, 64, FORMAT_PG_TIMESTAMP_F_T, tm);
-    sprintf (stime_usec_z, "%s.%06ld+00", stime_f_t, (long)timeval.tv_usec);
-    if (strcmp (s, stime_usec_z) != 0) {
-        fprintf (stderr, "Test pg_timestamp_with_time_zone_from_s failed, TIMESTAMP: \"%s\", sec:%ld, usec:%ld, strftime: \"%s\"\n",
-                s, timeval.tv_sec, (long)timeval.tv_usec, stime_usec_z);
+    if (!value || !parse_int32 (value, len, &id))
         return false;
-    }
-    return true;
+    entry = embed_table_find (table, id);
+    if (entry->len == 0)
+        return false;
+    bson_init_static (&child, table->data + entry->offset, entry->len) || DIE;
+    return bson_append_document (bson, key, -1, &child);
 }
 
 bool
-test_bson_append_int32_array_from_s (void)
+column_map_append (const column_map_t *column,
+                   bson_t             *bson,
+                   const char         *value,
+                   size_t              len)
 {
-    bson_t bson;
-    const char *input = "{150,77950}";
-    const char *expected = "{ \"track_offset\" : [ 150, 77950 ] }";
-    const char *actual;
-
-    bson_init (&bson);
-    bson_append_int32_array_from_s (&bson, "track_offset", input);
-    actual = bson_as_json (&bson, NULL);
-    if (strcmp (expected, actual) != 0) {
-        fprintf (stderr, "Test test_bson_append_int32_array_from_s failed, input: \"%s\", bson expected: \"%s\", bson actual: \"%s\"\n",
-                input, expected, actual);
-        return false;
-    }
-    bson_free ((void*)actual);
-    return true;
+    if (column->id || (column->embed && embed_table_append (column->embed, bson, column->column_name, value, len)))
+        return true;
+    return (*column->bson_append_from_s) (bson, column->column_name, value, len);
 }
 
+/*
+ * mbdump row source - the table file is mapped read-only and rows are
+ * handed out as (pointer, length) slices into the mapping, so there is
+ * no stdio copy and no line length limit.
+ */
+
+typedef struct {
+    int fd;
+    char *data;
+    size_t size;
+} mbdump_map_t;
+
+typedef struct {
+    const char *p;
+    const char *end;
+    const char *advised;
+} row_reader_t;
+
 bool
-test_bson_append_point_from_s (void)
+mbdump_map_open (mbdump_map_t *map,
+                 const char   *file_name)
 {
-    bson_t bson;
-    const char *input = "(35.585673,139.728101)";
-    const char *expected = "{ \"point\" : [ 35.585673, 139.728101 ] }";
-    const char *actual;
+    struct stat st;
 
-    bson_init (&bson);
-    bson_append_point_from_s (&bson, "point", input);
-    actual = bson_as_json (&bson, NULL);
-    if (strcmp (expected, actual) != 0) {
-        fprintf (stderr, "Test test_bson_append_point_from_s failed, input: \"%s\", bson expected: \"%s\", bson actual: \"%s\"\n",
-                input, expected, actual);
+    map->data = NULL;
+    map->fd = open (file_name, O_RDONLY);
+    if (map->fd < 0)
         return false;
+    fstat (map->fd, &st) == 0 || DIE;
+    map->size = st.st_size;
+    if (map->size > 0) {
+        map->data = mmap (NULL, map->size, PROT_READ, MAP_PRIVATE, map->fd, 0);
+        if (map->data == MAP_FAILED) {
+            close (map->fd);
+            return false;
+        }
+        madvise (map->data, map->size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+        madvise (map->data, map->size, MADV_HUGEPAGE);
+#endif
     }
-    bson_free ((void*)actual);
     return true;
 }
 
 void
-test_suite (void)
+mbdump_map_close (mbdump_map_t *map)
 {
-    test_pg_timestamp_with_time_zone_from_s ();
-    test_bson_append_int32_array_from_s ();
-    test_bson_append_point_from_s ();
+    if (map->data)
+        munmap (map->data, map->size);
+    close (map->fd);
 }
 
-void
-log_local_handler (mongoc_log_level_t log_level,
-                   const char        *log_domain,
-                   const char        *message,
-                   void              *user_data)
+off_t
+mbdump_map_next_line_offset (const mbdump_map_t *map,
+                             off_t               offset)
+{
+    const char *newline;
+
+    if (offset == 0 || (size_t)offset >= map->size)
+        return offset == 0 ? 0 : map->size;
+    newline = memchr (map->data + offset - 1, '\n', map->size - offset + 1);
+    return newline ? (newline + 1) - map->data : (off_t)map->size;
+}
+
+uint64_t
+mbdump_map_count_lines (const mbdump_map_t *map)
+{
+    const char *p = map->data, *end = map->data + map->size;
+    uint64_t n_lines = 0;
+
+    while (p < end && (p = memchr (p, '\n', end - p)) != NULL) {
+        n_lines++;
+        p++;
+    }
+    return n_lines;
+}
+
+void
+row_reader_init (row_reader_t       *reader,
+                 const mbdump_map_t *map,
+                 off_t               start,
+                 off_t               end)
+{
+    reader->p = map->data + start;
+    reader->end = map->data + end;
+    reader->advised = reader->p;
+}
+
+/*
+ * keep READ_AHEAD_SIZE of the mapping ahead of the reader in flight,
+ * advised in HUGE_PAGE_SIZE aligned steps
+ */
+void
+row_reader_read_ahead (row_reader_t *reader)
+{
+    uintptr_t from, to;
+
+    if (reader->advised - reader->p > READ_AHEAD_SIZE/2 || reader->advised >= reader->end)
+        return;
+    from = (uintptr_t)reader->advised & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    to = (uintptr_t)reader->p + READ_AHEAD_SIZE;
+    to = BSON_MIN (to, (uintptr_t)reader->end);
+    from = BSON_MAX (from, (uintptr_t)reader->p & ~(uintptr_t)(getpagesize () - 1));
+    madvise ((void*)from, to - from, MADV_WILLNEED);
+    reader->advised = (const char*)to;
+}
+
+bool
+row_reader_next (row_reader_t  *reader,
+                 const char   **row,
+                 size_t        *len)
+{
+    const char *newline;
+
+    if (reader->p >= reader->end)
+        return false;
+    row_reader_read_ahead (reader);
+    newline = memchr (reader->p, '\n', reader->end - reader->p);
+    *row = reader->p;
+    *len = (newline ? newline : reader->end) - reader->p;
+    reader->p = newline ? newline + 1 : reader->end;
+    return true;
+}
+
+/*
+ * Schema plan - create_tables.json compiled to a flat binary file of
+ * tables, columns and converter ids that is mapped at startup.
+ * Tables are found through an open-addressed hash on the table name.
+ * The plan records a hash of the schema file and is rebuilt whenever
+ * the schema no longer matches it; when the plan file cannot be written
+ * the compiled plan is used from memory.
+ *
+ *   plan_header_t
+ *   uint32_t hash[hash_size]     table index + 1, 0 for empty
+ *   plan_table_t tables[n_tables]
+ *   plan_column_t columns[n_columns]
+ *   char strings[]               NUL-terminated names
+ */
+
+#define PLAN_MAGIC "MBPLAN03"
+#define PLAN_COLUMN_PK 0x1
+
+typedef struct {
+    char magic[8];
+    uint32_t n_tables;
+    uint32_t n_columns;
+    uint32_t hash_size;
+    uint32_t hash_offset;
+    uint32_t tables_offset;
+    uint32_t columns_offset;
+    uint32_t strings_offset;
+    uint32_t size;
+    uint32_t schema_hash;
+} plan_header_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t column;
+    uint32_t n_columns;
+} plan_table_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t data_type;
+    uint32_t converter;
+    uint32_t flags;
+} plan_column_t;
+
+typedef struct {
+    mbdump_map_t map;
+    const plan_header_t *header;
+    const uint32_t *hash;
+    const plan_table_t *tables;
+    const plan_column_t *columns;
+    const char *strings;
+} schema_plan_t;
+
+uint32_t
+plan_hash (const char *s)
+{
+    uint32_t h = 2166136261u;
+
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+uint32_t
+plan_hash_bytes (const char *s,
+                 size_t      len)
+{
+    uint32_t h = 2166136261u;
+
+    while (len-- > 0) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+typedef struct {
+    char *str;
+    size_t len;
+    size_t size;
+} plan_strings_t;
+
+uint32_t
+plan_string_append (plan_strings_t *strings,
+                    const char     *s)
+{
+    uint32_t offset = strings->len;
+    size_t len = strlen (s) + 1;
+
+    if (strings->len + len > strings->size) {
+        strings->size = BSON_MAX (strings->len + len, 2 * strings->size);
+        strings->str = realloc (strings->str, strings->size);
+    }
+    memcpy (strings->str + strings->len, s, len);
+    strings->len += len;
+    return offset;
+}
+
+/* true when n items of size at offset lie inside the plan */
+bool
+plan_region_fits (const plan_header_t *header,
+                  uint32_t             offset,
+                  uint32_t             n,
+                  size_t               size)
+{
+    return offset >= sizeof (plan_header_t) && offset % sizeof (uint32_t) == 0 &&
+           (uint64_t)offset + (uint64_t)n * size <= header->size;
+}
+
+/* a truncated or foreign plan file fails the checks and is rebuilt */
+bool
+schema_plan_check (schema_plan_t *plan)
+{
+    const plan_header_t *header = (const plan_header_t *)plan->map.data;
+    uint32_t i, strings_len;
+
+    if (plan->map.size < sizeof (plan_header_t) ||
+        memcmp (header->magic, PLAN_MAGIC, sizeof header->magic) != 0 ||
+        header->size != plan->map.size ||
+        header->hash_size == 0 || (header->hash_size & (header->hash_size - 1)) != 0 ||
+        header->hash_size <= header->n_tables ||
+        !plan_region_fits (header, header->hash_offset, header->hash_size, sizeof (uint32_t)) ||
+        !plan_region_fits (header, header->tables_offset, header->n_tables, sizeof (plan_table_t)) ||
+        !plan_region_fits (header, header->columns_offset, header->n_columns, sizeof (plan_column_t)) ||
+        !plan_region_fits (header, header->strings_offset, 0, 1))
+        return false;
+    plan->header = header;
+    plan->hash = (const uint32_t *)(plan->map.data + header->hash_offset);
+    plan->tables = (const plan_table_t *)(plan->map.data + header->tables_offset);
+    plan->columns = (const plan_column_t *)(plan->map.data + header->columns_offset);
+    plan->strings = plan->map.data + header->strings_offset;
+    strings_len = header->size - header->strings_offset;
+    if (strings_len > 0 && plan->strings[strings_len - 1] != '\0')
+        return false;
+    for (i = 0; i < header->hash_size; i++) {
+        if (plan->hash[i] > header->n_tables)
+            return false;
+    }
+    for (i = 0; i < header->n_tables; i++) {
+        if (plan->tables[i].name >= strings_len || plan->tables[i].column > header->n_columns ||
+            plan->tables[i].n_columns > header->n_columns - plan->tables[i].column)
+            return false;
+    }
+    for (i = 0; i < header->n_columns; i++) {
+        if (plan->columns[i].name >= strings_len || plan->columns[i].data_type >= strings_len)
+            return false;
+    }
+    return true;
+}
+
+/* compile into memory, then try to write the plan file for the next run */
+bool
+schema_plan_compile (schema_plan_t *plan,
+                     const char    *schema_file,
+                     const char    *plan_file,
+                     uint32_t       schema_hash)
+{
+    bson_t bson_schema;
+    bson_iter_t iter_json, iter_ary, iter_sql, iter_table_prop, iter_col, iter_col_prop;
+    plan_header_t header;
+    plan_table_t *tables = NULL;
+    plan_column_t *columns = NULL;
+    uint32_t *hash;
+    size_t tables_size = 0, columns_size = 0;
+    plan_strings_t strings = { NULL, 0, 0 };
+    char temp_file[MAXPATHLEN], *data;
+    FILE *fp;
+    uint32_t i, h;
+    bool ret;
+
+    bson_init_from_json_file (&bson_schema, schema_file) || DIE;
+    memset (&header, 0, sizeof header);
+    memcpy (header.magic, PLAN_MAGIC, sizeof header.magic);
+    header.schema_hash = schema_hash;
+    bson_iter_init_find (&iter_json, &bson_schema, "json") || DIE;
+    BSON_ITER_HOLDS_ARRAY (&iter_json) || DIE;
+    bson_iter_recurse (&iter_json, &iter_ary) || DIE;
+    while (bson_iter_next (&iter_ary)) {
+        plan_table_t *table;
+
+        bson_iter_recurse (&iter_ary, &iter_sql) || DIE;
+        if (!bson_iter_find (&iter_sql, "create_table"))
+            continue;
+        bson_iter_recurse (&iter_sql, &iter_table_prop) || DIE;
+        if (header.n_tables == tables_size) {
+            tables_size = BSON_MAX (64, 2 * tables_size);
+            tables = realloc (tables, tables_size * sizeof (plan_table_t));
+        }
+        table = &tables[header.n_tables++];
+        bson_iter_find (&iter_table_prop, "table_name") || DIE;
+        table->name = plan_string_append (&strings, bson_iter_utf8 (&iter_table_prop, NULL));
+        table->column = header.n_columns;
+        table->n_columns = 0;
+        bson_iter_find (&iter_table_prop, "columns") || DIE;
+        bson_iter_recurse (&iter_table_prop, &iter_col) || DIE;
+        while (bson_iter_next (&iter_col)) {
+            plan_column_t *column;
+            const char *data_type;
+
+            if (header.n_columns == columns_size) {
+                columns_size = BSON_MAX (1024, 2 * columns_size);
+                columns = realloc (columns, columns_size * sizeof (plan_column_t));
+            }
+            column = &columns[header.n_columns++];
+            table->n_columns++;
+            bson_iter_recurse (&iter_col, &iter_col_prop) || DIE;
+            bson_iter_find (&iter_col_prop, "column_name") || DIE;
+            column->name = plan_string_append (&strings, bson_iter_utf8 (&iter_col_prop, NULL));
+            bson_iter_find (&iter_col_prop, "data_type") || DIE;
+            data_type = bson_iter_utf8 (&iter_col_prop, NULL);
+            column->data_type = plan_string_append (&strings, data_type);
+            column->converter = data_type_converter (data_type);
+            column->flags = 0;
+            if (bson_iter_recurse (&iter_col, &iter_col_prop) && bson_iter_find (&iter_col_prop, "comment") &&
+                BSON_ITER_HOLDS_UTF8 (&iter_col_prop) && strstr (bson_iter_utf8 (&iter_col_prop, NULL), "PK"))
+                column->flags |= PLAN_COLUMN_PK;
+        }
+    }
+    bson_destroy (&bson_schema);
+
+    for (header.hash_size = 16; header.hash_size < 2 * header.n_tables; header.hash_size *= 2)
+        ;
+    hash = calloc (header.hash_size, sizeof (uint32_t));
+    for (i = 0; i < header.n_tables; i++) {
+        for (h = plan_hash (strings.str + tables[i].name) & (header.hash_size - 1);
+             hash[h] != 0;
+             h = (h + 1) & (header.hash_size - 1))
+            ;
+        hash[h] = i + 1;
+    }
+    header.hash_offset = sizeof header;
+    header.tables_offset = header.hash_offset + header.hash_size * sizeof (uint32_t);
+    header.columns_offset = header.tables_offset + header.n_tables * sizeof (plan_table_t);
+    header.strings_offset = header.columns_offset + header.n_columns * sizeof (plan_column_t);
+    header.size = header.strings_offset + strings.len;
+
+    data = malloc (header.size);
+    memcpy (data, &header, sizeof header);
+    memcpy (data + header.hash_offset, hash, header.hash_size * sizeof (uint32_t));
+    memcpy (data + header.tables_offset, tables, header.n_tables * sizeof (plan_table_t));
+    memcpy (data + header.columns_offset, columns, header.n_columns * sizeof (plan_column_t));
+    memcpy (data + header.strings_offset, strings.str, strings.len);
+    free (hash);
+    free (tables);
+    free (columns);
+    free (strings.str);
+
+    snprintf (temp_file, MAXPATHLEN, "%s.%d", plan_file, (int)getpid ());
+    fp = fopen (temp_file, "w");
+    ret = fp && fwrite (data, 1, header.size, fp) == header.size;
+    if (fp)
+        ret = (fclose (fp) == 0) && ret;
+    ret = ret && rename (temp_file, plan_file) == 0;
+    if (!ret) {
+        fprintf (stderr, "WARNING: schema plan \"%s\" not written, using it from memory\n", plan_file);
+        unlink (temp_file);
+    }
+    fprintf (stderr, "info: schema plan \"%s\", tables: %u, columns: %u, bytes: %u\n",
+             plan_file, header.n_tables, header.n_columns, header.size);
+    plan->map.fd = -1;
+    plan->map.data = data;
+    plan->map.size = header.size;
+    return schema_plan_check (plan);
+}
+
+bool
+schema_plan_open (schema_plan_t *plan,
+                  const char    *plan_file)
+{
+    if (!mbdump_map_open (&plan->map, plan_file))
+        return false;
+    if (!schema_plan_check (plan)) {
+        fprintf (stderr, "WARNING: schema plan \"%s\" is invalid, it is rebuilt\n", plan_file);
+        mbdump_map_close (&plan->map);
+        return false;
+    }
+    return true;
+}
+
+void
+schema_plan_close (schema_plan_t *plan)
+{
+    if (plan->map.fd < 0)
+        free (plan->map.data);
+    else
+        mbdump_map_close (&plan->map);
+}
+
+bool
+schema_plan_load (schema_plan_t *plan,
+                  const char    *schema_file,
+                  const char    *plan_file)
+{
+    mbdump_map_t schema_map;
+    uint32_t schema_hash;
+
+    mbdump_map_open (&schema_map, schema_file) || DIE;
+    schema_hash = plan_hash_bytes (schema_map.data, schema_map.size);
+    mbdump_map_close (&schema_map);
+    if (schema_plan_open (plan, plan_file)) {
+        if (plan->header->schema_hash == schema_hash)
+            return true;
+        schema_plan_close (plan);
+    }
+    return schema_plan_compile (plan, schema_file, plan_file, schema_hash);
+}
+
+const plan_table_t *
+schema_plan_find_table (const schema_plan_t *plan,
+                        const char          *table_name)
+{
+    uint32_t h, mask = plan->header->hash_size - 1;
+
+    for (h = plan_hash (table_name) & mask; plan->hash[h] != 0; h = (h + 1) & mask) {
+        const plan_table_t *table = &plan->tables[plan->hash[h] - 1];
+
+        if (strcmp (plan->strings + table->name, table_name) == 0)
+            return table;
+    }
+    return NULL;
+}
+
+bool
+get_column_map (const schema_plan_t *plan,
+                const char          *table_name,
+                column_map_t       **column_map,
+                int                 *column_map_size)
+{
+    const plan_table_t *table;
+    const plan_column_t *column;
+    uint32_t i;
+    int n_pk = 0, pk_column = 0;
+
+    table = schema_plan_find_table (plan, table_name);
+    if (!table) {
+        fprintf (stderr, "ERROR: table \"%s\" not in schema\n", table_name);
+        return false;
+    }
+    *column_map = calloc (table->n_columns, sizeof (column_map_t));
+    *column_map_size = table->n_columns;
+    for (i = 0, column = &plan->columns[table->column]; i < table->n_columns; i++, column++) {
+        (*column_map)[i].column_name = plan->strings + column->name;
+        (*column_map)[i].data_type = plan->strings + column->data_type;
+        (*column_map)[i].bson_append_from_s = converters[column->converter < CONVERTER_COUNT ? column->converter : CONVERTER_UTF8];
+        (*column_map)[i].embed = embed_find (table_name, (*column_map)[i].column_name);
+        (*column_map)[i].pk = (column->flags & PLAN_COLUMN_PK) != 0;
+        if ((*column_map)[i].pk) {
+            n_pk++;
+            pk_column = i;
+        }
+    }
+    if (n_pk == 1 && strcmp ((*column_map)[pk_column].column_name, "id") == 0)
+        (*column_map)[pk_column].id = true;
+    return true;
+}
+
+/*
+ * Row tokenizer - one pass over a row finds the column separators with
+ * SSE2/AVX2 compares (scalar on other targets) and decodes PostgreSQL
+ * COPY text escapes on the way.  Unescaped columns are spans into the
+ * mapping; escaped columns are decoded into a per-chunk buffer.
+ */
+
+typedef enum {
+    SPAN_NULL,
+    SPAN_ROW,
+    SPAN_DECODED
+} span_source_t;
+
+typedef struct {
+    const char *value;
+    size_t len;
+    size_t offset;
+    span_source_t source;
+} column_span_t;
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t len;
+} decode_buf_t;
+
+const char *
+row_scan_scalar (const char *p,
+                 const char *end)
+{
+    while (p < end && *p != '\t' && *p != '\n' && *p != '\\')
+        p++;
+    return p;
+}
+
+#ifdef ROW_SCAN_X86
+const char *
+row_scan_sse2 (const char *p,
+               const char *end)
+{
+    const __m128i tab = _mm_set1_epi8 ('\t');
+    const __m128i newline = _mm_set1_epi8 ('\n');
+    const __m128i backslash = _mm_set1_epi8 ('\\');
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *)p);
+        int mask = _mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, tab),
+                                                                  _mm_cmpeq_epi8 (v, newline)),
+                                                    _mm_cmpeq_epi8 (v, backslash)));
+        if (mask)
+            return p + __builtin_ctz (mask);
+        p += 16;
+    }
+    return row_scan_scalar (p, end);
+}
+
+__attribute__ ((target ("avx2")))
+const char *
+row_scan_avx2 (const char *p,
+               const char *end)
+{
+    const __m256i tab = _mm256_set1_epi8 ('\t');
+    const __m256i newline = _mm256_set1_epi8 ('\n');
+    const __m256i backslash = _mm256_set1_epi8 ('\\');
+
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256 ((const __m256i *)p);
+        unsigned int mask = _mm256_movemask_epi8 (_mm256_or_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, tab),
+                                                                                    _mm256_cmpeq_epi8 (v, newline)),
+                                                                   _mm256_cmpeq_epi8 (v, backslash)));
+        if (mask)
+            return p + __builtin_ctz (mask);
+        p += 32;
+    }
+    return row_scan_sse2 (p, end);
+}
+#endif
+
+const char *(*row_scan) (const char *p, const char *end) = row_scan_scalar;
+
+void
+row_scan_init (void)
+{
+#ifdef ROW_SCAN_X86
+    __builtin_cpu_init ();
+    row_scan = __builtin_cpu_supports ("avx2") ? row_scan_avx2 : row_scan_sse2;
+#endif
+}
+
+void
+decode_buf_append (decode_buf_t *decode_buf,
+                   const char   *s,
+                   size_t        len)
+{
+    if (len == 0)
+        return;
+    if (decode_buf->len + len > decode_buf->size) {
+        decode_buf->size = BSON_MAX (decode_buf->len + len, 2 * decode_buf->size);
+        decode_buf->data = realloc (decode_buf->data, decode_buf->size);
+    }
+    memcpy (decode_buf->data + decode_buf->len, s, len);
+    decode_buf->len += len;
+}
+
+char
+pg_copy_unescape (char c)
+{
+    switch (c) {
+    case 'b': return '\b';
+    case 'f': return '\f';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 't': return '\t';
+    case 'v': return '\v';
+    default:  return c;
+    }
+}
+
+/*
+ * tokenize the next row into spans[0..n_spans), return the number of
+ * columns in the row or -1 at the end of the chunk;
+ * columns beyond n_spans are counted but not stored
+ */
+int
+row_tokenize (row_reader_t  *reader,
+              column_span_t *spans,
+              int            n_spans,
+              decode_buf_t  *decode_buf)
+{
+    const char *row, *field, *p, *q;
+    column_span_t span;
+    int n = 0, i;
+
+    if (reader->p >= reader->end)
+        return -1;
+    row_reader_read_ahead (reader);
+    row = field = p = reader->p;
+    decode_buf->len = 0;
+    span.source = SPAN_ROW;
+    for (;;) {
+        q = row_scan (p, reader->end);
+        if (q + 1 < reader->end && *q == '\\') {
+            if (q == field && q[1] == 'N') {
+                span.source = SPAN_NULL;
+            }
+            else {
+                char c = pg_copy_unescape (q[1]);
+
+                if (span.source != SPAN_DECODED) {
+                    span.source = SPAN_DECODED;
+                    span.offset = decode_buf->len;
+                    p = field;
+                }
+                decode_buf_append (decode_buf, p, q - p);
+                decode_buf_append (decode_buf, &c, 1);
+            }
+            p = q + 2;
+            continue;
+        }
+        if (q < reader->end && *q == '\\') {
+            p = q + 1;
+            continue;
+        }
+        if (span.source == SPAN_DECODED) {
+            decode_buf_append (decode_buf, p, q - p);
+            span.len = decode_buf->len - span.offset;
+        }
+        else if (span.source == SPAN_ROW) {
+            span.offset = field - row;
+            span.len = q - field;
+        }
+        if (n < n_spans)
+            spans[n] = span;
+        n++;
+        if (q >= reader->end || *q == '\n') {
+            reader->p = (q < reader->end) ? q + 1 : reader->end;
+            break;
+        }
+        field = p = q + 1;
+        span.source = SPAN_ROW;
+    }
+    for (i = 0; i < n && i < n_spans; i++) {
+        switch (spans[i].source) {
+        case SPAN_ROW:     spans[i].value = row + spans[i].offset; break;
+        case SPAN_DECODED: spans[i].value = decode_buf->data + spans[i].offset; break;
+        default:           spans[i].value = NULL; spans[i].len = 0; break;
+        }
+    }
+    for (; i < n_spans; i++) {
+        spans[i].value = NULL;
+        spans[i].len = 0;
+    }
+    return n;
+}
+
+/*
+ * rows get a deterministic _id, loaded or resumed alike: the primary
+ * key, as a document for a compound key.  Tables without one get the
+ * row offset when it is given (>= 0, a resumed chunk re-sends rows the
+ * server may already hold), the server's ObjectId otherwise
+ */
+bool
+row_id_append (const column_map_t  *column_map,
+               int                  column_map_size,
+               const column_span_t *spans,
+               bson_t              *bson,
+               off_t                row_offset)
+{
+    bson_t pk;
+    int i, n_pk = 0, pk_column = 0;
+    bool ret = true;
+
+    for (i = 0; i < column_map_size; i++) {
+        if (column_map[i].pk) {
+            if (!spans[i].value)
+                return row_offset < 0 || BSON_APPEND_INT64 (bson, "_id", (int64_t)row_offset);
+            n_pk++;
+            pk_column = i;
+        }
+    }
+    if (n_pk == 0)
+        return row_offset < 0 || BSON_APPEND_INT64 (bson, "_id", (int64_t)row_offset);
+    if (n_pk == 1)
+        return (*column_map[pk_column].bson_append_from_s) (bson, "_id", spans[pk_column].value, spans[pk_column].len);
+    bson_append_document_begin (bson, "_id", -1, &pk);
+    for (i = 0; i < column_map_size; i++) {
+        if (column_map[i].pk)
+            ret = (*column_map[i].bson_append_from_s) (&pk, column_map[i].column_name, spans[i].value, spans[i].len) && ret;
+    }
+    return bson_append_document_end (bson, &pk) && ret;
+}
+
+/*
+ * Merge-one embedding, loading - the merge spec is read into
+ * embed_specs, then every resolvable child table is converted into
+ * memory before any parent table is loaded.
+ */
+
+embed_table_t *
+embed_table_add (const char *table_name)
+{
+    embed_table_t *table;
+    int i;
+
+    for (i = 0; i < n_embed_tables; i++) {
+        if (strcmp (embed_tables[i]->table_name, table_name) == 0)
+            return embed_tables[i];
+    }
+    table = calloc (1, sizeof (embed_table_t));
+    table->table_name = bson_strdup (table_name);
+    embed_tables = realloc (embed_tables, (n_embed_tables + 1) * sizeof (embed_table_t*));
+    embed_tables[n_embed_tables++] = table;
+    return table;
+}
+
+/* split "table.column" at the first dot */
+char *
+embed_spec_split (const char *s,
+                  char      **column)
+{
+    char *table_name = bson_strdup (s), *dot;
+
+    (dot = strchr (table_name, '.')) || DIE;
+    *dot = '\0';
+    *column = dot + 1;
+    return table_name;
+}
+
+bool
+embed_spec_read (const char *merge_spec_file)
+{
+    bson_t bson_spec;
+    bson_iter_t iter_json, iter_ary, iter_spec;
+    const char *type, *parent, *child;
+    char *child_table, *child_key;
+    embed_spec_t *spec;
+    int i;
+
+    if (!bson_init_from_json_file (&bson_spec, merge_spec_file))
+        return false;
+    bson_iter_init_find (&iter_json, &bson_spec, "json") || DIE;
+    BSON_ITER_HOLDS_ARRAY (&iter_json) || DIE;
+    bson_iter_recurse (&iter_json, &iter_ary) || DIE;
+    while (bson_iter_next (&iter_ary)) {
+        bson_iter_recurse (&iter_ary, &iter_spec) || DIE;
+        bson_iter_next (&iter_spec) || DIE;
+        type = bson_iter_utf8 (&iter_spec, NULL);
+        bson_iter_next (&iter_spec) || DIE;
+        parent = bson_iter_utf8 (&iter_spec, NULL);
+        bson_iter_next (&iter_spec) || DIE;
+        child = bson_iter_utf8 (&iter_spec, NULL);
+        (type && parent && child) || DIE;
+        if (strcmp (type, "1") != 0)
+            continue;
+        /* a child with a field list is embedded by mongomerge, projected */
+        if (bson_iter_next (&iter_spec) && BSON_ITER_HOLDS_UTF8 (&iter_spec) && *bson_iter_utf8 (&iter_spec, NULL) != '\0')
+            continue;
+        embed_specs = realloc (embed_specs, (n_embed_specs + 1) * sizeof (embed_spec_t));
+        spec = &embed_specs[n_embed_specs++];
+        spec->parent_table = embed_spec_split (parent, &spec->parent_column);
+        child_table = embed_spec_split (child, &child_key);
+        spec->child = embed_table_add (child_table);
+        /* mbdump_to_mongo keeps the id column name */
+        if (!spec->child->key_column)
+            spec->child->key_column = bson_strdup (strcmp (child_key, "_id") == 0 ? "id" : child_key);
+        bson_free (child_table);
+    }
+    bson_iter_recurse (&iter_json, &iter_ary) || DIE;
+    while (bson_iter_next (&iter_ary)) {
+        bson_iter_recurse (&iter_ary, &iter_spec) || DIE;
+        bson_iter_next (&iter_spec) || DIE;
+        type = bson_iter_utf8 (&iter_spec, NULL);
+        bson_iter_next (&iter_spec) || DIE;
+        parent = bson_iter_utf8 (&iter_spec, NULL);
+        if (strcmp (type, "n") != 0)
+            continue;
+        for (i = 0; i < n_embed_tables; i++) {
+            size_t len = strlen (embed_tables[i]->table_name);
+
+            if (strncmp (parent, embed_tables[i]->table_name, len) == 0 && parent[len] == '.')
+                embed_tables[i]->has_many = true;
+        }
+    }
+    bson_destroy (&bson_spec);
+    return true;
+}
+
+/* no "n" entries for the table or, through "1" entries, for any table it embeds */
+bool
+embed_resolvable (const embed_table_t *table,
+                  int                  depth)
+{
+    int i;
+
+    if (table->has_many || depth > 16)
+        return false;
+    for (i = 0; i < n_embed_specs; i++) {
+        if (strcmp (embed_specs[i].parent_table, table->table_name) == 0 &&
+            !embed_resolvable (embed_specs[i].child, depth + 1))
+            return false;
+    }
+    return true;
+}
+
+void
+embed_table_load (embed_table_t *table,
+                  schema_plan_t *plan)
+{
+    column_map_t *column_map;
+    int column_map_size, key_column = -1, i;
+    char file[MAXPATHLEN];
+    mbdump_map_t map;
+    column_span_t *spans;
+    decode_buf_t decode_buf = { NULL, 0, 0 };
+    row_reader_t reader;
+    uint64_t size;
+    int32_t key;
+    bson_t bson;
+
+    if (table->entries)
+        return;
+    /* the child's own children first, get_column_map picks them up */
+    for (i = 0; i < n_embed_specs; i++) {
+        if (strcmp (embed_specs[i].parent_table, table->table_name) == 0)
+            embed_table_load (embed_specs[i].child, plan);
+    }
+    get_column_map (plan, table->table_name, &column_map, &column_map_size) || DIE;
+    for (i = 0; i < column_map_size; i++) {
+        if (strcmp (column_map[i].column_name, table->key_column) == 0)
+            key_column = i;
+    }
+    if (key_column < 0) {
+        fprintf (stderr, "ERROR: merge spec column \"%s.%s\" not in schema\n", table->table_name, table->key_column);
+        DIE;
+    }
+    snprintf (file, MAXPATHLEN, "%s/%s", mbdump_dir, table->table_name);
+    mbdump_map_open (&map, file) || DIE;
+    for (size = 16; size < 2 * mbdump_map_count_lines (&map) + 2; size *= 2)
+        ;
+    table->entries = calloc (size, sizeof (embed_entry_t));
+    table->mask = size - 1;
+    spans = calloc (column_map_size, sizeof (column_span_t));
+    bson_init (&bson);
+    row_reader_init (&reader, &map, 0, map.size);
+    while (row_tokenize (&reader, spans, column_map_size, &decode_buf) >= 0) {
+        if (!spans[key_column].value || !parse_int32 (spans[key_column].value, spans[key_column].len, &key))
+            continue;
+        row_id_append (column_map, column_map_size, spans, &bson, -1);
+        for (i = 0; i < column_map_size; i++)
+            column_map_append (&column_map[i], &bson, spans[i].value, spans[i].len);
+        embed_table_insert (table, key, &bson);
+        bson_reinit (&bson);
+    }
+    fprintf (stderr, "info: embed table: \"%s\", bytes: %zu\n", table->table_name, table->len);
+    fflush (stderr);
+    bson_destroy (&bson);
+    free (decode_buf.data);
+    free (spans);
+    free (column_map);
+    mbdump_map_close (&map);
+}
+
+void
+embed_load (schema_plan_t *plan)
+{
+    int i;
+
+    for (i = 0; i < n_embed_specs; i++) {
+        if (embed_resolvable (embed_specs[i].child, 0))
+            embed_table_load (embed_specs[i].child, plan);
+        else
+            fprintf (stderr, "info: merge spec \"%s.%s\" left to mongomerge, \"%s\" has \"n\" entries\n",
+                     embed_specs[i].parent_table, embed_specs[i].parent_column, embed_specs[i].child->table_name);
+    }
+}
+
+/* stamp the embedded specs in the merged collection, rake merge skips them */
+void
+embed_stamp (mongoc_database_t *db,
+             int                argc,
+             char              *argv[])
+{
+    mongoc_collection_t *merged;
+    bson_t *doc;
+    bson_error_t error;
+    char stamp[MAXPATHLEN];
+    int i, argi;
+
+    merged = mongoc_database_get_collection (db, "merged");
+    for (i = 0; i < n_embed_specs; i++) {
+        if (!embed_specs[i].child->entries)
+            continue;
+        for (argi = 0; argi < argc && strcmp (argv[argi], embed_specs[i].parent_table) != 0; argi++)
+            ;
+        if (argi == argc)
+            continue;
+        snprintf (stamp, MAXPATHLEN, "%s.%s", embed_specs[i].parent_table, embed_specs[i].parent_column);
+        doc = BCON_NEW ("merged", BCON_UTF8 (stamp));
+        if (!mongoc_collection_insert (merged, MONGOC_INSERT_NONE, doc, NULL, &error))
+            fprintf (stderr, "WARNING: merged stamp \"%s\" not inserted: %s\n", stamp, error.message);
+        bson_destroy (doc);
+    }
+    mongoc_collection_destroy (merged);
+}
+
+/*
+ * Offline output - with --out-bson each table is written to
+ * <table>.bson, the concatenated documents mongorestore reads, and
+ * <table>.metadata.json with the _id and primary key indexes.  Chunks
+ * convert into their own BSON_OUT_BUFFER_SIZE buffer and append whole
+ * buffers under the table's lock, so no server connection is needed.
+ */
+
+typedef struct {
+    int fd;
+    pthread_mutex_t mutex;
+} bson_out_t;
+
+bool
+bson_out_open (bson_out_t *out,
+               const char *table_name)
+{
+    char bson_file[MAXPATHLEN];
+
+    snprintf (bson_file, MAXPATHLEN, "%s/%s.bson", out_bson_dir, table_name);
+    out->fd = open (bson_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out->fd < 0) {
+        fprintf (stderr, "ERROR: open \"%s\": %s\n", bson_file, strerror (errno));
+        return false;
+    }
+    pthread_mutex_init (&out->mutex, NULL);
+    return true;
+}
+
+bool
+bson_out_write (bson_out_t   *out,
+                bulk_batch_t *batch)
+{
+    const uint8_t *p = batch->data;
+    size_t len = batch->len;
+    ssize_t n;
+
+    pthread_mutex_lock (&out->mutex);
+    while (len > 0) {
+        n = write (out->fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        p += n;
+        len -= n;
+    }
+    pthread_mutex_unlock (&out->mutex);
+    if (len > 0)
+        fprintf (stderr, "ERROR: write bson: %s\n", strerror (errno));
+    batch->len = 0;
+    batch->n_docs = 0;
+    return len == 0;
+}
+
+bool
+bson_out_close (bson_out_t *out)
+{
+    bool ret = fsync (out->fd) == 0;
+
+    ret = close (out->fd) == 0 && ret;
+    pthread_mutex_destroy (&out->mutex);
+    return ret;
+}
+
+/* the primary key columns of a table form one unique compound index */
+bool
+bson_out_write_metadata (const schema_plan_t *plan,
+                         const char          *table_name)
+{
+    const plan_table_t *table;
+    const plan_column_t *column;
+    char metadata_file[MAXPATHLEN], ns[MAXPATHLEN];
+    bson_t metadata, indexes, index, key;
+    char *json;
+    FILE *fp;
+    uint32_t i;
+    int n_pk = 0;
+    bool ret;
+
+    table = schema_plan_find_table (plan, table_name);
+    if (!table)
+        return false;
+    snprintf (ns, MAXPATHLEN, "%s.%s", database_name, table_name);
+    bson_init (&metadata);
+    BCON_APPEND (&metadata, "options", "{", "}");
+    bson_append_array_begin (&metadata, "indexes", -1, &indexes);
+    BCON_APPEND (&indexes, "0", "{", "v", BCON_INT32 (1), "key", "{", "_id", BCON_INT32 (1), "}",
+                 "name", "_id_", "ns", ns, "}");
+    bson_init (&key);
+    for (i = 0, column = &plan->columns[table->column]; i < table->n_columns; i++, column++) {
+        if (column->flags & PLAN_COLUMN_PK) {
+            BSON_APPEND_INT32 (&key, plan->strings + column->name, 1);
+            n_pk++;
+        }
+    }
+    /* a lone "id" primary key is the _id itself */
+    if (n_pk > 1 || (n_pk == 1 && !bson_has_field (&key, "id"))) {
+        bson_append_document_begin (&indexes, "1", -1, &index);
+        BSON_APPEND_INT32 (&index, "v", 1);
+        BSON_APPEND_DOCUMENT (&index, "key", &key);
+        BSON_APPEND_UTF8 (&index, "name", "primary_key");
+        BSON_APPEND_UTF8 (&index, "ns", ns);
+        BSON_APPEND_BOOL (&index, "unique", true);
+        bson_append_document_end (&indexes, &index);
+    }
+    bson_append_array_end (&metadata, &indexes);
+    bson_destroy (&key);
+
+    snprintf (metadata_file, MAXPATHLEN, "%s/%s.metadata.json", out_bson_dir, table_name);
+    json = bson_as_json (&metadata, NULL);
+    fp = fopen (metadata_file, "w");
+    ret = fp && fputs (json, fp) >= 0;
+    if (fp)
+        ret = fclose (fp) == 0 && ret;
+    if (!ret)
+        fprintf (stderr, "ERROR: metadata \"%s\" not written\n", metadata_file);
+    bson_free (json);
+    bson_destroy (&metadata);
+    return ret;
+}
+
+/*
+ * Checkpoints - with --checkpoint DIR each table keeps
+ * DIR/<table>.checkpoint holding, per chunk, the offset below which every
+ * row has been acknowledged by the server and the count of those rows.
+ * Rows are keyed by their primary key _id, tables without one get the
+ * row's byte offset as a deterministic _id, so --resume restarts
+ * each chunk at its offset and replays the batches that were in flight
+ * as unordered inserts that tolerate duplicate keys.  Resume with the
+ * same --jobs setting so the chunk boundaries match.
+ */
+
+typedef struct _checkpoint_t checkpoint_t;
+
+typedef struct {
+    checkpoint_t *checkpoint;
+    off_t start;
+    off_t end;
+    off_t acked;
+    int64_t count;
+} checkpoint_chunk_t;
+
+struct _checkpoint_t {
+    char file[MAXPATHLEN];
+    off_t size;
+    int n_chunks;
+    int max_chunks;
+    checkpoint_chunk_t *chunks;
+    pthread_mutex_t mutex;
+};
+
+checkpoint_chunk_t *
+checkpoint_chunk_add (checkpoint_t *checkpoint,
+                      off_t         start,
+                      off_t         end)
+{
+    checkpoint_chunk_t *chunk;
+
+    if (checkpoint->n_chunks == checkpoint->max_chunks)
+        return NULL;
+    chunk = &checkpoint->chunks[checkpoint->n_chunks++];
+    chunk->checkpoint = checkpoint;
+    chunk->start = start;
+    chunk->end = end;
+    chunk->acked = start;
+    chunk->count = 0;
+    return chunk;
+}
+
+void
+checkpoint_open (checkpoint_t *checkpoint,
+                 const char   *table_name,
+                 off_t         size)
+{
+    FILE *fp;
+    long long file_size, start, end, acked, count;
+    checkpoint_chunk_t *chunk;
+
+    snprintf (checkpoint->file, MAXPATHLEN, "%s/%s.checkpoint", checkpoint_dir, table_name);
+    checkpoint->size = size;
+    checkpoint->n_chunks = 0;
+    checkpoint->max_chunks = size / CHUNK_SIZE + 2;
+    checkpoint->chunks = calloc (checkpoint->max_chunks, sizeof (checkpoint_chunk_t));
+    pthread_mutex_init (&checkpoint->mutex, NULL);
+    if (!resume || !(fp = fopen (checkpoint->file, "r")))
+        return;
+    if (fscanf (fp, "size %lld\n", &file_size) != 1 || file_size != (long long)size) {
+        fprintf (stderr, "WARNING: checkpoint \"%s\" is for another file size, table reloads from the start\n", checkpoint->file);
+        fclose (fp);
+        return;
+    }
+    while (fscanf (fp, "chunk %lld %lld %lld %lld\n", &start, &end, &acked, &count) == 4) {
+        chunk = checkpoint_chunk_add (checkpoint, start, end);
+        if (!chunk)
+            break;
+        chunk->acked = acked;
+        chunk->count = count;
+    }
+    fclose (fp);
+}
+
+/* called with the checkpoint mutex held */
+void
+checkpoint_write (checkpoint_t *checkpoint)
+{
+    char temp_file[MAXPATHLEN];
+    FILE *fp;
+    int i;
+    bool ret;
+
+    snprintf (temp_file, MAXPATHLEN, "%s.%d", checkpoint->file, (int)getpid ());
+    fp = fopen (temp_file, "w");
+    ret = fp && fprintf (fp, "size %lld\n", (long long)checkpoint->size) > 0;
+    for (i = 0; ret && i < checkpoint->n_chunks; i++) {
+        checkpoint_chunk_t *chunk = &checkpoint->chunks[i];
+
+        ret = fprintf (fp, "chunk %lld %lld %lld %lld\n", (long long)chunk->start, (long long)chunk->end,
+                       (long long)chunk->acked, (long long)chunk->count) > 0;
+    }
+    if (fp)
+        ret = fclose (fp) == 0 && ret;
+    if (!ret || rename (temp_file, checkpoint->file) != 0) {
+        fprintf (stderr, "WARNING: checkpoint \"%s\" not written\n", checkpoint->file);
+        unlink (temp_file);
+    }
+}
+
+/* the saved chunk for [start, end), or a new one starting at start */
+checkpoint_chunk_t *
+checkpoint_chunk (checkpoint_t *checkpoint,
+                  off_t         start,
+                  off_t         end)
+{
+    checkpoint_chunk_t *chunk = NULL;
+    int i;
+
+    pthread_mutex_lock (&checkpoint->mutex);
+    for (i = 0; i < checkpoint->n_chunks && !chunk; i++) {
+        if (checkpoint->chunks[i].start == start && checkpoint->chunks[i].end == end)
+            chunk = &checkpoint->chunks[i];
+    }
+    if (!chunk)
+        chunk = checkpoint_chunk_add (checkpoint, start, end);
+    pthread_mutex_unlock (&checkpoint->mutex);
+    return chunk;
+}
+
+/* bulk_pipeline ack callback, batch->tag is the offset after its last row */
+void
+checkpoint_ack (void               *ctx,
+                const bulk_batch_t *batch)
+{
+    checkpoint_chunk_t *chunk = ctx;
+
+    pthread_mutex_lock (&chunk->checkpoint->mutex);
+    chunk->acked = batch->tag;
+    chunk->count += batch->n_docs;
+    checkpoint_write (chunk->checkpoint);
+    pthread_mutex_unlock (&chunk->checkpoint->mutex);
+}
+
+void
+checkpoint_close (checkpoint_t *checkpoint)
+{
+    pthread_mutex_destroy (&checkpoint->mutex);
+    free (checkpoint->chunks);
+}
+
+int64_t
+load_chunk (mongoc_collection_t *collection,
+            const mbdump_map_t  *map,
+            off_t                start,
+            off_t                end,
+            column_map_t        *column_map,
+            int                  column_map_size,
+            bson_out_t          *out,
+            checkpoint_chunk_t  *checkpoint)
+{
+    int64_t ret = true;
+    column_map_t *column_map_p;
+    column_span_t *spans, *span;
+    decode_buf_t decode_buf = { NULL, 0, 0 };
+    int i;
+    row_reader_t reader;
+    bulk_pipeline_t *pipeline = NULL;
+    bulk_batch_t *batch, out_batch = { NULL, 0, 0, 0, 0 };
+    bson_t bson;
+    int64_t count = 0;
+    bson_error_t error;
+    bulk_batch_size_t chunk_batch_size;
+    off_t row_offset;
+
+    if (checkpoint) {
+        pthread_mutex_lock (&checkpoint->checkpoint->mutex);
+        start = checkpoint->acked;
+        count = checkpoint->count;
+        pthread_mutex_unlock (&checkpoint->checkpoint->mutex);
+        if (start >= end)
+            return count;
+    }
+    spans = calloc (column_map_size, sizeof (column_span_t));
+    row_reader_init (&reader, map, start, end);
+    if (out) {
+        batch = &out_batch;
+    }
+    else {
+        pipeline = bulk_pipeline_new (collection, writer_pool, database_name, writers, in_flight);
+        bulk_pipeline_set_progress (pipeline, stdout, PROGRESS_SIZE, ".");
+        pthread_mutex_lock (&batch_size_mutex);
+        chunk_batch_size = batch_size;
+        pthread_mutex_unlock (&batch_size_mutex);
+        bulk_pipeline_set_batch_size (pipeline, &chunk_batch_size);
+        if (checkpoint)
+            bulk_pipeline_set_ack (pipeline, checkpoint_ack, checkpoint, resume);
+        batch = bulk_pipeline_batch (pipeline);
+    }
+    bson_init (&bson);
+    while (ret) {
+        row_offset = reader.p - map->data;
+        if (row_tokenize (&reader, spans, column_map_size, &decode_buf) < 0)
+            break;
+        if (!row_id_append (column_map, column_map_size, spans, &bson, checkpoint ? row_offset : -1))
+            fprintf (stderr, "WARNING: row at offset %lld has no usable _id\n", (long long)row_offset);
+        for (i = 0, column_map_p = column_map, span = spans;
+             i < column_map_size;
+             i++, column_map_p++, span++) {
+             bool ret;
+             /*
+             fprintf (stderr, "%s: \"%.*s\" [%d/%d](%s)\n", column_map_p->column_name, (int)span->len, span->value, i, column_map_size, column_map_p->data_type);
+             fflush (stdout);
+             */
+             ret = column_map_append (column_map_p, &bson, span->value, span->len);
+             ret || fprintf (stderr, "WARNING: column_map_p->bson_append_from_s failed column %s: \"%.*s\" [%d/%d](%s)\n",
+                            column_map_p->column_name, (int)span->len, span->value ? span->value : "", i, column_map_size, column_map_p->data_type);
+        }
+        /*
+        bson_printf ("bson: %s\n", &bson);
+        */
+        if (out) {
+           if (batch->len + bson.len > BSON_OUT_BUFFER_SIZE) {
+              count += batch->n_docs;
+              ret = bson_out_write (out, batch);
+           }
+        }
+        else if (bulk_pipeline_batch_full (pipeline, &bson)) {
+           ret = bulk_pipeline_submit (pipeline);
+           batch = bulk_pipeline_batch (pipeline);
+        }
+        bulk_batch_append (batch, &bson);
+        batch->tag = reader.p - map->data;
+        bson_reinit (&bson);
+    }
+    if (out) {
+        count += batch->n_docs;
+        ret = ret && bson_out_write (out, batch);
+        bson_free (out_batch.data);
+    }
+    else {
+        count = bulk_pipeline_destroy (pipeline, &error, &chunk_batch_size);
+        if (checkpoint && count >= 0) {
+            pthread_mutex_lock (&checkpoint->checkpoint->mutex);
+            count = checkpoint->count;
+            pthread_mutex_unlock (&checkpoint->checkpoint->mutex);
+        }
+        /* the next chunk starts from the tuned size */
+        pthread_mutex_lock (&batch_size_mutex);
+        batch_size = chunk_batch_size;
+        pthread_mutex_unlock (&batch_size_mutex);
+    }
+    bson_destroy (&bson);
+    free (decode_buf.data);
+    free (spans);
+    return ret ? count : -1;
+}
+
+int64_t
+load_table (mongoc_database_t *db,
+            const char        *table_name,
+            schema_plan_t     *plan)
+{
+    column_map_t *column_map;
+    int column_map_size;
+    double start_time, end_time, delta_time;
+    mbdump_map_t map;
+    char mbdump_file[MAXPATHLEN];
+    mongoc_collection_t *collection = NULL;
+    bson_out_t out;
+    checkpoint_t checkpoint;
+    bool checkpointed;
+    int64_t count;
+
+    fprintf (stderr, "load_table table_name: \"%s\"\n", table_name);
+    get_column_map (plan, table_name, &column_map, &column_map_size) || DIE;
+    snprintf (mbdump_file, MAXPATHLEN, "%s/%s", mbdump_dir, table_name);
+    /* fprintf (stderr, "mbdump_file: \"%s\"\n", mbdump_file); */
+    start_time = dtimeofday ();
+    mbdump_map_open (&map, mbdump_file) || DIE;
+    if (*out_bson_dir) {
+        bson_out_open (&out, table_name) || DIE;
+        bson_out_write_metadata (plan, table_name) || DIE;
+    }
+    else
+        collection = mongoc_database_get_collection (db, table_name);
+    checkpointed = collection && *checkpoint_dir;
+    if (checkpointed)
+        checkpoint_open (&checkpoint, table_name, map.size);
+    count = load_chunk (collection, &map, 0, map.size, column_map, column_map_size, *out_bson_dir ? &out : NULL,
+                        checkpointed ? checkpoint_chunk (&checkpoint, 0, map.size) : NULL);
+    if (checkpointed)
+        checkpoint_close (&checkpoint);
+    fputc('.', stdout);
+    fputc('\n', stdout);
+    fflush(stdout);
+    if (collection)
+        mongoc_collection_destroy (collection);
+    else if (!bson_out_close (&out))
+        count = -1;
+    mbdump_map_close (&map);
+    end_time = dtimeofday ();
+    delta_time = end_time - start_time + 0.0000001;
+    fprintf (stderr, "info: real: %.2f, count: %"PRId64", %"PRId64" docs/sec\n", delta_time, count, (int64_t)round (count/delta_time));
+    fflush (stderr);
+    free (column_map);
+    return count;
+}
+
+/*
+ * Parallel loading - each table file is cut into newline-aligned byte
+ * ranges of about CHUNK_SIZE, smaller tables are a single chunk.
+ * Chunks are dealt largest table first into per-worker deques; a worker
+ * pops from the head of its own deque and steals from the tail of the
+ * others when it runs dry.
+ */
+
+typedef struct {
+    const char *table_name;
+    char mbdump_file[MAXPATHLEN];
+    mbdump_map_t map;
+    column_map_t *column_map;
+    int column_map_size;
+    off_t size;
+    int n_chunks;
+    int n_chunks_done;
+    int64_t count;
+    double start_time;
+    pthread_mutex_t mutex;
+    bson_out_t out;
+    checkpoint_t checkpoint;
+} table_load_t;
+
+typedef struct {
+    table_load_t *table;
+    off_t start;
+    off_t end;
+} chunk_t;
+
+typedef struct {
+    chunk_t *chunks;
+    size_t head;
+    size_t tail;
+    pthread_mutex_t mutex;
+} chunk_deque_t;
+
+typedef struct {
+    int id;
+    int n_workers;
+    chunk_deque_t *deques;
+    mongoc_client_pool_t *pool;
+    const char *database_name;
+    int64_t count;
+    pthread_t thread;
+} worker_t;
+
+bool
+chunk_deque_pop_head (chunk_deque_t *deque,
+                      chunk_t       *chunk)
+{
+    bool ret = false;
+
+    pthread_mutex_lock (&deque->mutex);
+    if (deque->head < deque->tail) {
+        *chunk = deque->chunks[deque->head++];
+        ret = true;
+    }
+    pthread_mutex_unlock (&deque->mutex);
+    return ret;
+}
+
+bool
+chunk_deque_steal_tail (chunk_deque_t *deque,
+                        chunk_t       *chunk)
+{
+    bool ret = false;
+
+    pthread_mutex_lock (&deque->mutex);
+    if (deque->head < deque->tail) {
+        *chunk = deque->chunks[--deque->tail];
+        ret = true;
+    }
+    pthread_mutex_unlock (&deque->mutex);
+    return ret;
+}
+
+bool
+worker_next_chunk (worker_t *worker,
+                   chunk_t  *chunk)
+{
+    int i;
+
+    if (chunk_deque_pop_head (&worker->deques[worker->id], chunk))
+        return true;
+    for (i = 1; i < worker->n_workers; i++) {
+        if (chunk_deque_steal_tail (&worker->deques[(worker->id + i) % worker->n_workers], chunk))
+            return true;
+    }
+    return false;
+}
+
+void *
+worker_run (void *arg)
+{
+    worker_t *worker = arg;
+    mongoc_client_t *client = NULL;
+    mongoc_database_t *db = NULL;
+    chunk_t chunk;
+
+    if (worker->pool) {
+        client = mongoc_client_pool_pop (worker->pool);
+        db = mongoc_client_get_database (client, worker->database_name);
+    }
+    while (worker_next_chunk (worker, &chunk)) {
+        table_load_t *table = chunk.table;
+        mongoc_collection_t *collection = NULL;
+        int64_t count;
+
+        if (db)
+            collection = mongoc_database_get_collection (db, table->table_name);
+        count = load_chunk (collection, &table->map, chunk.start, chunk.end,
+                            table->column_map, table->column_map_size, db ? NULL : &table->out,
+                            db && *checkpoint_dir ? checkpoint_chunk (&table->checkpoint, chunk.start, chunk.end) : NULL);
+        if (collection)
+            mongoc_collection_destroy (collection);
+        if (count < 0)
+            fprintf (stderr, "WARNING: table \"%s\" chunk [%"PRId64", %"PRId64") failed\n",
+                     table->table_name, (int64_t)chunk.start, (int64_t)chunk.end);
+        else
+            worker->count += count;
+        pthread_mutex_lock (&table->mutex);
+        table->count += count < 0 ? 0 : count;
+        if (++table->n_chunks_done == table->n_chunks) {
+            double delta_time = dtimeofday () - table->start_time + 0.0000001;
+
+            fprintf (stderr, "info: table: \"%s\", chunks: %d, real: %.2f, count: %"PRId64", %"PRId64" docs/sec\n",
+                     table->table_name, table->n_chunks, delta_time, table->count, (int64_t)round (table->count/delta_time));
+            fflush (stderr);
+        }
+        pthread_mutex_unlock (&table->mutex);
+    }
+    if (worker->pool) {
+        mongoc_database_destroy (db);
+        mongoc_client_pool_push (worker->pool, client);
+    }
+    return NULL;
+}
+
+int
+table_load_size_compare (const void *a,
+                         const void *b)
+{
+    off_t size_a = ((const table_load_t *)a)->size;
+    off_t size_b = ((const table_load_t *)b)->size;
+
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+int64_t
+load_tables_parallel (mongoc_client_pool_t *pool,
+                      int                   argc,
+                      char                 *argv[],
+                      schema_plan_t        *plan,
+                      int                   n_workers)
+{
+    int64_t count = 0;
+    table_load_t *tables;
+    worker_t *workers;
+    chunk_deque_t *deques;
+    size_t n_chunks_max;
+    int argi, i, w;
+
+    tables = calloc (argc, sizeof (table_load_t));
+    n_chunks_max = 0;
+    for (argi = 0; argi < argc; argi++) {
+        table_load_t *table = &tables[argi];
+
+        table->table_name = argv[argi];
+        get_column_map (plan, table->table_name, &table->column_map, &table->column_map_size) || DIE;
+        snprintf (table->mbdump_file, MAXPATHLEN, "%s/%s", mbdump_dir, table->table_name);
+        mbdump_map_open (&table->map, table->mbdump_file) || DIE;
+        table->size = table->map.size;
+        n_chunks_max += table->size / CHUNK_SIZE + 1;
+    }
+    qsort (tables, argc, sizeof (table_load_t), table_load_size_compare);
+    /* the sort moves the structs, so nothing that must stay put is set up before it */
+    for (argi = 0; argi < argc; argi++) {
+        table_load_t *table = &tables[argi];
+
+        pthread_mutex_init (&table->mutex, NULL);
+        if (!pool) {
+            bson_out_open (&table->out, table->table_name) || DIE;
+            bson_out_write_metadata (plan, table->table_name) || DIE;
+        }
+        else if (*checkpoint_dir)
+            checkpoint_open (&table->checkpoint, table->table_name, table->size);
+    }
+
+    deques = calloc (n_workers, sizeof (chunk_deque_t));
+    for (w = 0; w < n_workers; w++) {
+        deques[w].chunks = calloc (n_chunks_max, sizeof (chunk_t));
+        pthread_mutex_init (&deques[w].mutex, NULL);
+    }
+    for (argi = 0, w = 0; argi < argc; argi++) {
+        table_load_t *table = &tables[argi];
+        chunk_t *chunk;
+        off_t start, end;
+
+        for (start = 0; start < table->size || table->n_chunks == 0; start = end) {
+            end = (table->size - start > CHUNK_SIZE) ? mbdump_map_next_line_offset (&table->map, start + CHUNK_SIZE) : table->size;
+            chunk = &deques[w].chunks[deques[w].tail++];
+            chunk->table = table;
+            chunk->start = start;
+            chunk->end = end;
+            table->n_chunks++;
+            w = (w + 1) % n_workers;
+        }
+        fprintf (stderr, "[%d/%d] %s %"PRId64" bytes, %d chunks\n", argi + 1, argc, table->table_name, (int64_t)table->size, table->n_chunks);
+    }
+
+    workers = calloc (n_workers, sizeof (worker_t));
+    for (w = 0; w < n_workers; w++) {
+        workers[w].id = w;
+        workers[w].n_workers = n_workers;
+        workers[w].deques = deques;
+        workers[w].pool = pool;
+        workers[w].database_name = database_name;
+    }
+    for (i = 0; i < argc; i++)
+        tables[i].start_time = dtimeofday ();
+    for (w = 0; w < n_workers; w++)
+        pthread_create (&workers[w].thread, NULL, worker_run, &workers[w]) == 0 || DIE;
+    for (w = 0; w < n_workers; w++) {
+        pthread_join (workers[w].thread, NULL);
+        count += workers[w].count;
+    }
+    fputc('\n', stdout);
+    fflush(stdout);
+
+    for (w = 0; w < n_workers; w++) {
+        pthread_mutex_destroy (&deques[w].mutex);
+        free (deques[w].chunks);
+    }
+    for (argi = 0; argi < argc; argi++) {
+        if (!pool && !bson_out_close (&tables[argi].out))
+            fprintf (stderr, "WARNING: table \"%s\" bson output not closed cleanly\n", tables[argi].table_name);
+        if (pool && *checkpoint_dir)
+            checkpoint_close (&tables[argi].checkpoint);
+        pthread_mutex_destroy (&tables[argi].mutex);
+        mbdump_map_close (&tables[argi].map);
+        free (tables[argi].column_map);
+    }
+    free (workers);
+    free (deques);
+    free (tables);
+    return count;
+}
+
+/*
+ * Archive loading - the mbdump argument may also be mbdump.tar.bz2, a
+ * plain tar, or "-" for either on stdin.  bzip2 input is decompressed
+ * block-parallel by bzip2_reader and the tar headers are walked here in
+ * member order.  Each mbdump/<table> member is cut into newline-aligned
+ * pieces of about ARCHIVE_PIECE_SIZE that loader threads take from a
+ * bounded queue, so a table loads while later members are still being
+ * decompressed.  Without table names every schema table found is loaded.
+ */
+
+#define ARCHIVE_PIECE_SIZE (16*1024*1024)
+#define TAR_BLOCK_SIZE 512
+
+typedef struct {
+    int fd;
+    bzip2_reader_t *bzip2;
+    char peek[4];
+    size_t peek_len;
+    size_t peek_pos;
+} archive_t;
+
+typedef struct {
+    char table_name[MAXPATHLEN];
+    column_map_t *column_map;
+    int column_map_size;
+    bson_out_t out;
+    int n_pieces;
+    int n_pieces_done;
+    bool read_done;
+    int64_t count;
+    double start_time;
+    pthread_mutex_t mutex;
+} archive_table_t;
+
+typedef struct {
+    archive_table_t *table;
+    char *data;
+    size_t len;
+} archive_piece_t;
+
+typedef struct {
+    archive_piece_t *pieces;
+    int size;
+    int head;
+    int n;
+    bool closing;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_ready;
+    pthread_cond_t cond_free;
+} archive_queue_t;
+
+typedef struct {
+    archive_queue_t *queue;
+    mongoc_client_pool_t *pool;
+    int64_t count;
+    pthread_t thread;
+} archive_loader_t;
+
+bool
+archive_open (archive_t  *archive,
+              const char *file_name)
+{
+    ssize_t n;
+
+    memset (archive, 0, sizeof *archive);
+    archive->fd = strcmp (file_name, "-") == 0 ? STDIN_FILENO : open (file_name, O_RDONLY);
+    if (archive->fd < 0) {
+        fprintf (stderr, "ERROR: open \"%s\": %s\n", file_name, strerror (errno));
+        return false;
+    }
+    while (archive->peek_len < sizeof archive->peek) {
+        n = read (archive->fd, archive->peek + archive->peek_len, sizeof archive->peek - archive->peek_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        archive->peek_len += n;
+    }
+    if (archive->peek_len >= 3 && memcmp (archive->peek, "BZh", 3) == 0) {
+        archive->bzip2 = bzip2_reader_new (archive->fd, archive->peek, archive->peek_len,
+                                           bzip2_threads > 0 ? bzip2_threads : (int)sysconf (_SC_NPROCESSORS_ONLN));
+        archive->peek_len = 0;
+        if (!archive->bzip2) {
+            if (archive->fd != STDIN_FILENO)
+                close (archive->fd);
+            return false;
+        }
+    }
+    return true;
+}
+
+ssize_t
+archive_read (archive_t *archive,
+              void      *buf,
+              size_t     len)
+{
+    size_t n;
+
+    if (archive->peek_pos < archive->peek_len) {
+        n = BSON_MIN (len, archive->peek_len - archive->peek_pos);
+        memcpy (buf, archive->peek + archive->peek_pos, n);
+        archive->peek_pos += n;
+        return n;
+    }
+    if (archive->bzip2)
+        return bzip2_reader_read (archive->bzip2, buf, len);
+    return read (archive->fd, buf, len);
+}
+
+/* false on a short read */
+bool
+archive_read_full (archive_t *archive,
+                   void      *buf,
+                   size_t     len)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = archive_read (archive, p, len);
+        if (n < 0 && errno == EINTR && !archive->bzip2)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool
+archive_skip (archive_t *archive,
+              uint64_t   len)
+{
+    char buf[64 * 1024];
+
+    while (len > 0) {
+        size_t n = BSON_MIN (len, sizeof buf);
+
+        if (!archive_read_full (archive, buf, n))
+            return false;
+        len -= n;
+    }
+    return true;
+}
+
+void
+archive_close (archive_t *archive)
+{
+    if (archive->bzip2)
+        bzip2_reader_destroy (archive->bzip2);
+    if (archive->fd != STDIN_FILENO)
+        close (archive->fd);
+}
+
+/* octal, or GNU base-256 for sizes of 8 GB and up */
+uint64_t
+tar_number (const char *field,
+            size_t      len)
+{
+    uint64_t value = 0;
+    size_t i;
+
+    if ((uint8_t)field[0] & 0x80) {
+        value = (uint8_t)field[0] & 0x7f;
+        for (i = 1; i < len; i++)
+            value = (value << 8) | (uint8_t)field[i];
+        return value;
+    }
+    for (i = 0; i < len && field[i] == ' '; i++)
+        ;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = (value << 3) | (field[i] - '0');
+    return value;
+}
+
+uint64_t
+tar_padding (uint64_t size)
+{
+    return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+/* pax extended header records "<len> <key>=<value>\n", path and size only */
+void
+tar_pax_parse (const char *data,
+               size_t      len,
+               char       *name,
+               size_t      name_size,
+               uint64_t   *size,
+               bool       *has_size)
+{
+    const char *p = data, *end = data + len, *key, *eq;
+    size_t record_len;
+
+    while (p < end) {
+        record_len = strtoul (p, NULL, 10);
+        key = memchr (p, ' ', end - p);
+        if (record_len == 0 || !key || p + record_len > end)
+            break;
+        key++;
+        eq = memchr (key, '=', p + record_len - key);
+        if (eq) {
+            size_t value_len = p + record_len - 1 - (eq + 1);
+
+            if (eq - key == 4 && memcmp (key, "path", 4) == 0 && value_len < name_size) {
+                memcpy (name, eq + 1, value_len);
+                name[value_len] = '\0';
+            }
+            else if (eq - key == 4 && memcmp (key, "size", 4) == 0) {
+                *size = (uint64_t)bson_ascii_strtoll (eq + 1, NULL, 10);
+                *has_size = true;
+            }
+        }
+        p += record_len;
+    }
+}
+
+/*
+ * read the next member header, following GNU long names and pax
+ * headers; false at the end of the archive or on a bad header
+ */
+bool
+tar_next_member (archive_t *archive,
+                 char      *name,
+                 size_t     name_size,
+                 uint64_t  *size,
+                 char      *type)
+{
+    char header[TAR_BLOCK_SIZE], *data;
+    char long_name[MAXPATHLEN] = "";
+    uint64_t pax_size = 0;
+    bool has_pax_size = false;
+    unsigned int checksum, i;
+
+    for (;;) {
+        if (!archive_read_full (archive, header, TAR_BLOCK_SIZE))
+            return false;
+        for (i = 0, checksum = 0; i < TAR_BLOCK_SIZE; i++)
+            checksum += (i >= 148 && i < 156) ? ' ' : (uint8_t)header[i];
+        if (checksum == 8 * ' ')
+            return false;
+        if (checksum != tar_number (header + 148, 8)) {
+            fprintf (stderr, "ERROR: tar header checksum mismatch\n");
+            return false;
+        }
+        *size = tar_number (header + 124, 12);
+        *type = header[156];
+        if (*type == 'L' || *type == 'x') {
+            if (*size > 1024 * 1024)
+                return false;
+            data = malloc (*size + tar_padding (*size) + 1);
+            if (!archive_read_full (archive, data, *size + tar_padding (*size))) {
+                free (data);
+                return false;
+            }
+            data[*size] = '\0';
+            if (*type == 'L')
+                snprintf (long_name, MAXPATHLEN, "%s", data);
+            else
+                tar_pax_parse (data, *size, long_name, MAXPATHLEN, &pax_size, &has_pax_size);
+            free (data);
+            continue;
+        }
+        if (*type == 'g') {
+            if (!archive_skip (archive, *size + tar_padding (*size)))
+                return false;
+            continue;
+        }
+        if (*long_name)
+            snprintf (name, name_size, "%s", long_name);
+        else if (memcmp (header + 257, "ustar", 5) == 0 && header[345])
+            snprintf (name, name_size, "%.155s/%.100s", header + 345, header);
+        else
+            snprintf (name, name_size, "%.100s", header);
+        if (has_pax_size)
+            *size = pax_size;
+        return true;
+    }
+}
+
+/* called with the table mutex held */
+void
+archive_table_done (archive_table_t *table)
+{
+    double delta_time;
+
+    if (!table->read_done || table->n_pieces_done < table->n_pieces)
+        return;
+    if (*out_bson_dir && !bson_out_close (&table->out))
+        fprintf (stderr, "WARNING: table \"%s\" bson output not closed cleanly\n", table->table_name);
+    delta_time = dtimeofday () - table->start_time + 0.0000001;
+    fprintf (stderr, "info: table: \"%s\", pieces: %d, real: %.2f, count: %"PRId64", %"PRId64" docs/sec\n",
+             table->table_name, table->n_pieces, delta_time, table->count, (int64_t)round (table->count/delta_time));
+    fflush (stderr);
+}
+
+void
+archive_queue_push (archive_queue_t *queue,
+                    archive_piece_t *piece)
+{
+    pthread_mutex_lock (&queue->mutex);
+    while (queue->n == queue->size)
+        pthread_cond_wait (&queue->cond_free, &queue->mutex);
+    queue->pieces[(queue->head + queue->n++) % queue->size] = *piece;
+    pthread_cond_signal (&queue->cond_ready);
+    pthread_mutex_unlock (&queue->mutex);
+}
+
+bool
+archive_queue_pop (archive_queue_t *queue,
+                   archive_piece_t *piece)
+{
+    bool ret = false;
+
+    pthread_mutex_lock (&queue->mutex);
+    while (queue->n == 0 && !queue->closing)
+        pthread_cond_wait (&queue->cond_ready, &queue->mutex);
+    if (queue->n > 0) {
+        *piece = queue->pieces[queue->head];
+        queue->head = (queue->head + 1) % queue->size;
+        queue->n--;
+        pthread_cond_signal (&queue->cond_free);
+        ret = true;
+    }
+    pthread_mutex_unlock (&queue->mutex);
+    return ret;
+}
+
+void *
+archive_loader_run (void *arg)
+{
+    archive_loader_t *loader = arg;
+    mongoc_client_t *client = NULL;
+    mongoc_database_t *db = NULL;
+    archive_piece_t piece;
+
+    if (loader->pool) {
+        client = mongoc_client_pool_pop (loader->pool);
+        db = mongoc_client_get_database (client, database_name);
+    }
+    while (archive_queue_pop (loader->queue, &piece)) {
+        archive_table_t *table = piece.table;
+        mongoc_collection_t *collection = NULL;
+        mbdump_map_t map;
+        int64_t count;
+
+        map.fd = -1;
+        map.data = piece.data;
+        map.size = piece.len;
+        if (db)
+            collection = mongoc_database_get_collection (db, table->table_name);
+        count = load_chunk (collection, &map, 0, map.size, table->column_map, table->column_map_size,
+                            db ? NULL : &table->out, NULL);
+        if (collection)
+            mongoc_collection_destroy (collection);
+        if (count < 0)
+            fprintf (stderr, "WARNING: table \"%s\" piece failed\n", table->table_name);
+        else
+            loader->count += count;
+        free (piece.data);
+        pthread_mutex_lock (&table->mutex);
+        table->count += count < 0 ? 0 : count;
+        table->n_pieces_done++;
+        archive_table_done (table);
+        pthread_mutex_unlock (&table->mutex);
+    }
+    if (loader->pool) {
+        mongoc_database_destroy (db);
+        mongoc_client_pool_push (loader->pool, client);
+    }
+    return NULL;
+}
+
+bool
+archive_table_wanted (const schema_plan_t *plan,
+                      const char          *table_name,
+                      int                  argc,
+                      char                *argv[])
+{
+    int argi;
+
+    if (argc == 0)
+        return schema_plan_find_table (plan, table_name) != NULL;
+    for (argi = 0; argi < argc; argi++) {
+        if (strcmp (argv[argi], table_name) == 0)
+            return true;
+    }
+    return false;
+}
+
+/* cut the member into pieces at the last newline, a partial line carries over */
+bool
+archive_table_read (archive_t       *archive,
+                    archive_queue_t *queue,
+                    archive_table_t *table,
+                    uint64_t         size)
+{
+    archive_piece_t piece;
+    char *carry = NULL, *newline;
+    size_t carry_len = 0, n;
+
+    piece.table = table;
+    while (size > 0 || carry_len > 0) {
+        n = BSON_MIN (size, ARCHIVE_PIECE_SIZE);
+        piece.data = malloc (carry_len + n);
+        memcpy (piece.data, carry, carry_len);
+        if (!archive_read_full (archive, piece.data + carry_len, n)) {
+            free (piece.data);
+            free (carry);
+            return false;
+        }
+        size -= n;
+        piece.len = carry_len + n;
+        free (carry);
+        carry = NULL;
+        carry_len = 0;
+        if (size > 0) {
+            for (newline = piece.data + piece.len; newline > piece.data && newline[-1] != '\n'; newline--)
+                ;
+            carry_len = piece.data + piece.len - newline;
+            if (carry_len > 0) {
+                carry = malloc (carry_len);
+                memcpy (carry, newline, carry_len);
+            }
+            piece.len -= carry_len;
+            if (piece.len == 0) {
+                free (piece.data);
+                continue;
+            }
+        }
+        pthread_mutex_lock (&table->mutex);
+        table->n_pieces++;
+        pthread_mutex_unlock (&table->mutex);
+        archive_queue_push (queue, &piece);
+    }
+    return true;
+}
+
+int64_t
+load_archive (mongoc_client_pool_t *pool,
+              const char           *archive_file,
+              int                   argc,
+              char                 *argv[],
+              schema_plan_t        *plan,
+              int                   n_loaders)
+{
+    int64_t count = 0;
+    archive_t archive;
+    archive_queue_t queue;
+    archive_loader_t *loaders;
+    archive_table_t **tables = NULL;
+    int n_tables = 0, i;
+    char name[MAXPATHLEN], type;
+    const char *table_name;
+    uint64_t size;
+    bool ok = true;
+
+    archive_open (&archive, archive_file) || DIE;
+    n_loaders = BSON_MAX (1, n_loaders);
+    memset (&queue, 0, sizeof queue);
+    queue.size = 2 * n_loaders;
+    queue.pieces = calloc (queue.size, sizeof (archive_piece_t));
+    pthread_mutex_init (&queue.mutex, NULL);
+    pthread_cond_init (&queue.cond_ready, NULL);
+    pthread_cond_init (&queue.cond_free, NULL);
+    loaders = calloc (n_loaders, sizeof (archive_loader_t));
+    for (i = 0; i < n_loaders; i++) {
+        loaders[i].queue = &queue;
+        loaders[i].pool = pool;
+        pthread_create (&loaders[i].thread, NULL, archive_loader_run, &loaders[i]) == 0 || DIE;
+    }
+
+    while (ok && tar_next_member (&archive, name, MAXPATHLEN, &size, &type)) {
+        archive_table_t *table;
+
+        table_name = strrchr (name, '/');
+        table_name = table_name ? table_name + 1 : name;
+        if ((type != '0' && type != '\0') || strncmp (name, "mbdump/", 7) != 0 ||
+            !archive_table_wanted (plan, table_name, argc, argv)) {
+            ok = archive_skip (&archive, size + tar_padding (size));
+            continue;
+        }
+        table = calloc (1, sizeof (archive_table_t));
+        tables = realloc (tables, (n_tables + 1) * sizeof (archive_table_t*));
+        tables[n_tables++] = table;
+        snprintf (table->table_name, MAXPATHLEN, "%s", table_name);
+        get_column_map (plan, table->table_name, &table->column_map, &table->column_map_size) || DIE;
+        if (!pool) {
+            bson_out_open (&table->out, table->table_name) || DIE;
+            bson_out_write_metadata (plan, table->table_name) || DIE;
+        }
+        pthread_mutex_init (&table->mutex, NULL);
+        table->start_time = dtimeofday ();
+        fprintf (stderr, "[%d] %s %"PRIu64" bytes\n", n_tables, table->table_name, size);
+        fflush (stderr);
+        ok = archive_table_read (&archive, &queue, table, size) &&
+             archive_skip (&archive, tar_padding (size));
+        pthread_mutex_lock (&table->mutex);
+        table->read_done = true;
+        archive_table_done (table);
+        pthread_mutex_unlock (&table->mutex);
+    }
+    if (!ok)
+        fprintf (stderr, "ERROR: archive \"%s\" truncated or corrupt\n", archive_file);
+
+    pthread_mutex_lock (&queue.mutex);
+    queue.closing = true;
+    pthread_cond_broadcast (&queue.cond_ready);
+    pthread_mutex_unlock (&queue.mutex);
+    for (i = 0; i < n_loaders; i++) {
+        pthread_join (loaders[i].thread, NULL);
+        count += loaders[i].count;
+    }
+    fputc('\n', stdout);
+    fflush(stdout);
+
+    for (i = 0; i < n_tables; i++) {
+        pthread_mutex_destroy (&tables[i]->mutex);
+        free (tables[i]->column_map);
+        free (tables[i]);
+    }
+    free (tables);
+    free (loaders);
+    pthread_mutex_destroy (&queue.mutex);
+    pthread_cond_destroy (&queue.cond_ready);
+    pthread_cond_destroy (&queue.cond_free);
+    free (queue.pieces);
+    archive_close (&archive);
+    return ok ? count : -1;
+}
+
+/*
+ * Delta loading - with --delta PREV_DIR each table is compared with its
+ * copy in the previous snapshot instead of being reloaded.  Previous
+ * rows go into an open-addressed index of 16 byte entries, the primary
+ * key hash (the whole row's for tables without one) and the row offset,
+ * at most 3/4 full.  A new row is compared byte for byte with the
+ * previous rows of its key, which the two dumps mostly keep in the same
+ * order, so the reads stay near sequential.  New rows with no match
+ * become inserts, changed rows become a $set/$unset of the changed
+ * columns, and previous rows left unmatched become deletes.  The
+ * primary key index is ensured first so updates and deletes do not scan.
+ */
+
+#define DELTA_SEED UINT64_C (0x9e3779b97f4a7c15)
+#define DELTA_MATCHED (UINT64_C (1) << 63)
+
+/* offset is the previous row's offset + 1, 0 for a free slot, DELTA_MATCHED once matched */
+typedef struct {
+    uint64_t key;
+    uint64_t offset;
+} delta_entry_t;
+
+typedef struct {
+    delta_entry_t *entries;
+    uint64_t mask;
+} delta_index_t;
+
+uint64_t
+delta_hash (const char *p,
+            size_t      len,
+            uint64_t    h)
+{
+    uint64_t v;
+
+    h ^= len * DELTA_SEED;
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy (&v, p, 8);
+        h = (h ^ v) * UINT64_C (0xff51afd7ed558ccd);
+        h ^= h >> 32;
+    }
+    v = 0;
+    memcpy (&v, p, len);
+    h = (h ^ v) * UINT64_C (0xc4ceb9fe1a85ec53);
+    return h ^ (h >> 29);
+}
+
+uint64_t
+delta_row_key (const column_span_t *spans,
+               const int           *key_columns,
+               int                  n_key_columns)
+{
+    uint64_t h = DELTA_SEED;
+    int i;
+
+    for (i = 0; i < n_key_columns; i++) {
+        const column_span_t *span = &spans[key_columns[i]];
+
+        h = span->value ? delta_hash (span->value, span->len, h) : (h ^ DELTA_SEED) * UINT64_C (0xff51afd7ed558ccd);
+    }
+    return h;
+}
+
+bool
+delta_span_equal (const column_span_t *a,
+                  const column_span_t *b)
+{
+    if (!a->value || !b->value)
+        return !a->value && !b->value;
+    return a->len == b->len && memcmp (a->value, b->value, a->len) == 0;
+}
+
+void
+delta_index_init (delta_index_t      *index,
+                  const mbdump_map_t *map)
+{
+    uint64_t n_rows = mbdump_map_count_lines (map) + 1, size;
+
+    for (size = 16; 3 * size < 4 * n_rows; size *= 2)
+        ;
+    index->entries = calloc (size, sizeof (delta_entry_t));
+    index->mask = size - 1;
+}
+
+/* every previous row gets its own entry, duplicate rows included */
+void
+delta_index_add (delta_index_t *index,
+                 uint64_t       key,
+                 off_t          offset)
+{
+    uint64_t h;
+
+    for (h = key & index->mask; index->entries[h].offset != 0; h = (h + 1) & index->mask)
+        ;
+    index->entries[h].key = key;
+    index->entries[h].offset = (uint64_t)offset + 1;
+}
+
+off_t
+delta_entry_offset (const delta_entry_t *entry)
+{
+    return (off_t)((entry->offset & ~DELTA_MATCHED) - 1);
+}
+
+/*
+ * the previous row for a new row: an identical unmatched one is marked
+ * matched and *unchanged set, otherwise the first unmatched row with the
+ * same key hash is returned for the caller to compare key columns and
+ * mark, NULL when there is none
+ */
+delta_entry_t *
+delta_index_match (delta_index_t      *index,
+                   const mbdump_map_t *prev_map,
+                   uint64_t            key,
+                   const char         *row,
+                   size_t              len,
+                   bool               *unchanged)
+{
+    delta_entry_t *entry, *candidate = NULL;
+    const char *prev_row;
+    size_t prev_len;
+    uint64_t h;
+
+    *unchanged = false;
+    if (len > 0 && row[len - 1] == '\n')
+        len--;
+    for (h = key & index->mask; index->entries[h].offset != 0; h = (h + 1) & index->mask) {
+        entry = &index->entries[h];
+        if (entry->key != key || (entry->offset & DELTA_MATCHED))
+            continue;
+        prev_row = prev_map->data + delta_entry_offset (entry);
+        prev_len = prev_map->data + prev_map->size - prev_row;
+        if (prev_len >= len && memcmp (prev_row, row, len) == 0 && (prev_len == len || prev_row[len] == '\n')) {
+            entry->offset |= DELTA_MATCHED;
+            *unchanged = true;
+            return entry;
+        }
+        if (!candidate)
+            candidate = entry;
+    }
+    return candidate;
+}
+
+/* append the key columns, NULL or empty as null so the filter matches a missing field */
+void
+delta_append_filter (bson_t              *filter,
+                     const column_map_t  *column_map,
+                     const column_span_t *spans,
+                     const int           *key_columns,
+                     int                  n_key_columns)
+{
+    const column_map_t *column;
+    const char *key;
+    uint32_t len;
+    int i;
+
+    for (i = 0; i < n_key_columns; i++) {
+        column = &column_map[key_columns[i]];
+        key = column->id ? "_id" : column->column_name;
+        len = filter->len;
+        (*column->bson_append_from_s) (filter, key, spans[key_columns[i]].value, spans[key_columns[i]].len);
+        if (filter->len == len)
+            BSON_APPEND_NULL (filter, key);
+    }
+}
+
+bool
+delta_bulk_flush (mongoc_collection_t      *collection,
+                  mongoc_bulk_operation_t **bulk,
+                  size_t                   *n_ops,
+                  size_t                   *n_bytes)
+{
+    bson_t reply;
+    bson_error_t error;
+    bool ret = true;
+
+    if (*n_ops > 0) {
+        ret = mongoc_bulk_operation_execute (*bulk, &reply, &error);
+        if (!ret)
+            fprintf (stderr, "delta bulk execute failure: %s\n", error.message);
+        bson_destroy (&reply);
+    }
+    mongoc_bulk_operation_destroy (*bulk);
+    *bulk = mongoc_collection_create_bulk_operation (collection, false, NULL);
+    *n_ops = 0;
+    *n_bytes = 0;
+    return ret;
+}
+
+int64_t
+delta_table (mongoc_database_t *db,
+             const char        *table_name,
+             schema_plan_t     *plan)
+{
+    const plan_table_t *table;
+    column_map_t *column_map;
+    int column_map_size, n_key_columns = 0, i;
+    int *key_columns;
+    char file[MAXPATHLEN];
+    mbdump_map_t prev_map, map;
+    column_span_t *spans, *prev_spans;
+    decode_buf_t decode_buf = { NULL, 0, 0 }, prev_decode_buf = { NULL, 0, 0 };
+    row_reader_t reader, prev_reader;
+    delta_index_t index;
+    delta_entry_t *entry;
+    mongoc_collection_t *collection;
+    mongoc_bulk_operation_t *bulk;
+    size_t n_ops = 0, n_bytes = 0;
+    int64_t n_inserted = 0, n_updated = 0, n_deleted = 0, n_unchanged = 0;
+    double start_time, delta_time;
+    off_t row_offset;
+    uint64_t key, h;
+    bson_t doc, filter, set, unset;
+    bson_error_t error;
+    bool ret = true, unchanged;
+
+    fprintf (stderr, "delta_table table_name: \"%s\"\n", table_name);
+    start_time = dtimeofday ();
+    get_column_map (plan, table_name, &column_map, &column_map_size) || DIE;
+    table = schema_plan_find_table (plan, table_name);
+    key_columns = calloc (column_map_size, sizeof (int));
+    for (i = 0; i < column_map_size; i++) {
+        if (plan->columns[table->column + i].flags & PLAN_COLUMN_PK)
+            key_columns[n_key_columns++] = i;
+    }
+    if (n_key_columns == 0) {
+        for (i = 0; i < column_map_size; i++)
+            key_columns[i] = i;
+        n_key_columns = column_map_size;
+    }
+    snprintf (file, MAXPATHLEN, "%s/%s", delta_dir, table_name);
+    mbdump_map_open (&prev_map, file) || DIE;
+    snprintf (file, MAXPATHLEN, "%s/%s", mbdump_dir, table_name);
+    mbdump_map_open (&map, file) || DIE;
+    spans = calloc (column_map_size, sizeof (column_span_t));
+    prev_spans = calloc (column_map_size, sizeof (column_span_t));
+    collection = mongoc_database_get_collection (db, table_name);
+
+    bson_init (&doc);
+    for (i = 0; i < n_key_columns; i++) {
+        if (!column_map[key_columns[i]].id)
+            BSON_APPEND_INT32 (&doc, column_map[key_columns[i]].column_name, 1);
+    }
+    if (!bson_empty (&doc) && !mongoc_collection_create_index (collection, &doc, NULL, &error))
+        fprintf (stderr, "WARNING: delta index on \"%s\" not created: %s\n", table_name, error.message);
+    bson_reinit (&doc);
+
+    delta_index_init (&index, &prev_map);
+    row_reader_init (&reader, &prev_map, 0, prev_map.size);
+    for (;;) {
+        row_offset = reader.p - prev_map.data;
+        if (row_tokenize (&reader, spans, column_map_size, &decode_buf) < 0)
+            break;
+        delta_index_add (&index, delta_row_key (spans, key_columns, n_key_columns), row_offset);
+    }
+
+    bulk = mongoc_collection_create_bulk_operation (collection, false, NULL);
+    row_reader_init (&reader, &map, 0, map.size);
+    while (ret) {
+        row_offset = reader.p - map.data;
+        if (row_tokenize (&reader, spans, column_map_size, &decode_buf) < 0)
+            break;
+        key = delta_row_key (spans, key_columns, n_key_columns);
+        entry = delta_index_match (&index, &prev_map, key, map.data + row_offset, reader.p - map.data - row_offset, &unchanged);
+        if (unchanged) {
+            n_unchanged++;
+            continue;
+        }
+        if (entry) {
+            row_reader_init (&prev_reader, &prev_map, delta_entry_offset (entry), prev_map.size);
+            row_tokenize (&prev_reader, prev_spans, column_map_size, &prev_decode_buf);
+            for (i = 0; i < n_key_columns && delta_span_equal (&spans[key_columns[i]], &prev_spans[key_columns[i]]); i++)
+                ;
+        }
+        if (entry && i == n_key_columns) {
+            entry->offset |= DELTA_MATCHED;
+            bson_init (&filter);
+            bson_init (&set);
+            bson_init (&unset);
+            delta_append_filter (&filter, column_map, spans, key_columns, n_key_columns);
+            for (i = 0; i < column_map_size; i++) {
+                uint32_t len = set.len;
+
+                if (delta_span_equal (&spans[i], &prev_spans[i]))
+                    continue;
+                column_map_append (&column_map[i], &set, spans[i].value, spans[i].len);
+                if (set.len == len)
+                    BSON_APPEND_UTF8 (&unset, column_map[i].column_name, "");
+            }
+            if (bson_empty (&set) && bson_empty (&unset))
+                n_unchanged++;
+            else {
+                if (!bson_empty (&set))
+                    BSON_APPEND_DOCUMENT (&doc, "$set", &set);
+                if (!bson_empty (&unset))
+                    BSON_APPEND_DOCUMENT (&doc, "$unset", &unset);
+                mongoc_bulk_operation_update_one (bulk, &filter, &doc, false);
+                n_ops++;
+                n_bytes += filter.len + doc.len;
+                n_updated++;
+            }
+            bson_destroy (&filter);
+            bson_destroy (&set);
+            bson_destroy (&unset);
+        }
+        else {
+            /* new key, or a key hash collision with an unrelated row */
+            row_id_append (column_map, column_map_size, spans, &doc, -1);
+            for (i = 0; i < column_map_size; i++)
+                column_map_append (&column_map[i], &doc, spans[i].value, spans[i].len);
+            mongoc_bulk_operation_insert (bulk, &doc);
+            n_ops++;
+            n_bytes += doc.len;
+            n_inserted++;
+        }
+        bson_reinit (&doc);
+        if (bulk_batch_size_full (&batch_size, n_bytes, n_ops, 0))
+            ret = delta_bulk_flush (collection, &bulk, &n_ops, &n_bytes);
+    }
+
+    for (h = 0; ret && h <= index.mask; h++) {
+        entry = &index.entries[h];
+        if (entry->offset == 0 || (entry->offset & DELTA_MATCHED))
+            continue;
+        row_reader_init (&prev_reader, &prev_map, delta_entry_offset (entry), prev_map.size);
+        row_tokenize (&prev_reader, prev_spans, column_map_size, &prev_decode_buf);
+        bson_init (&filter);
+        delta_append_filter (&filter, column_map, prev_spans, key_columns, n_key_columns);
+        mongoc_bulk_operation_remove_one (bulk, &filter);
+        n_ops++;
+        n_bytes += filter.len;
+        n_deleted++;
+        bson_destroy (&filter);
+        if (bulk_batch_size_full (&batch_size, n_bytes, n_ops, 0))
+            ret = delta_bulk_flush (collection, &bulk, &n_ops, &n_bytes);
+    }
+    ret = ret && delta_bulk_flush (collection, &bulk, &n_ops, &n_bytes);
+
+    delta_time = dtimeofday () - start_time + 0.0000001;
+    fprintf (stderr, "info: real: %.2f, inserted: %"PRId64", updated: %"PRId64", deleted: %"PRId64", unchanged: %"PRId64"\n",
+             delta_time, n_inserted, n_updated, n_deleted, n_unchanged);
+    fflush (stderr);
+    mongoc_bulk_operation_destroy (bulk);
+    mongoc_collection_destroy (collection);
+    bson_destroy (&doc);
+    free (index.entries);
+    free (decode_buf.data);
+    free (prev_decode_buf.data);
+    free (spans);
+    free (prev_spans);
+    free (key_columns);
+    free (column_map);
+    mbdump_map_close (&map);
+    mbdump_map_close (&prev_map);
+    return ret ? n_inserted + n_updated + n_deleted : -1;
+}
+
+/*
+ * a loaded or delta'd table replaces its documents without the merged
+ * children, drop its stamps, "table" and "table.key", so rake merge and
+ * mongomerge --spec merge it again - embed_stamp restamps the ones
+ * embedded by this load
+ */
+void
+embed_unstamp (mongoc_database_t   *db,
+               const schema_plan_t *plan,
+               bool                 archive,
+               int                  argc,
+               char                *argv[])
+{
+    mongoc_collection_t *merged;
+    mongoc_cursor_t *cursor;
+    const bson_t *doc;
+    bson_t *query, *fields, *remove;
+    bson_iter_t iter;
+    bson_error_t error;
+    char table_name[MAXPATHLEN];
+    const char *stamp;
+    size_t len;
+    int argi;
+
+    merged = mongoc_database_get_collection (db, "merged");
+    query = bson_new ();
+    fields = BCON_NEW ("merged", BCON_INT32 (1));
+    cursor = mongoc_collection_find (merged, MONGOC_QUERY_NONE, 0, 0, 0, query, fields, NULL);
+    while (mongoc_cursor_next (cursor, &doc)) {
+        if (!bson_iter_init_find (&iter, doc, "merged") || !BSON_ITER_HOLDS_UTF8 (&iter))
+            continue;
+        stamp = bson_iter_utf8 (&iter, NULL);
+        if ((len = strcspn (stamp, ".")) >= sizeof table_name)
+            continue;
+        memcpy (table_name, stamp, len);
+        table_name[len] = '\0';
+        if (archive) {
+            if (!archive_table_wanted (plan, table_name, argc, argv))
+                continue;
+        }
+        else {
+            for (argi = 0; argi < argc && strcmp (argv[argi], table_name) != 0; argi++)
+                ;
+            if (argi == argc)
+                continue;
+        }
+        remove = BCON_NEW ("merged", BCON_UTF8 (stamp));
+        if (mongoc_collection_remove (merged, MONGOC_REMOVE_NONE, remove, NULL, &error))
+            fprintf (stderr, "info: merged stamp \"%s\" removed, \"%s\" reloaded\n", stamp, table_name);
+        else
+            fprintf (stderr, "WARNING: merged stamp \"%s\" not removed: %s\n", stamp, error.message);
+        bson_destroy (remove);
+    }
+    if (mongoc_cursor_error (cursor, &error))
+        fprintf (stderr, "WARNING: merged stamps not read: %s\n", error.message);
+    mongoc_cursor_destroy (cursor);
+    bson_destroy (fields);
+    bson_destroy (query);
+    mongoc_collection_destroy (merged);
+}
+
+int64_t
+execute (int   argc,
+         char *argv[])
+{
+    int64_t count = 0;
+    const char *uristr = MONGODB_DEFAULT_URI;
+    mongoc_uri_t *uri;
+    mongoc_client_t *client;
+    mongoc_client_pool_t *pool = NULL;
+    mongoc_database_t *db;
+
+    schema_plan_t plan;
+    struct stat st;
+    bool archive, failed = false;
+    int64_t n;
+    int argi;
+
+    if (getenv ("MONGODB_URI"))
+        uristr = getenv ("MONGODB_URI");
+    uri = mongoc_uri_new (uristr);
+    database_name = mongoc_uri_get_database (uri);
+    schema_plan_load (&plan, schema_file, plan_file) || DIE;
+    archive = stat (mbdump_dir, &st) != 0 || !S_ISDIR (st.st_mode);
+    if (*delta_dir && (archive || *out_bson_dir)) {
+        fprintf (stderr, "ERROR: --delta needs an mbdump directory and a server\n");
+        DIE;
+    }
+    if (*merge_spec_file) {
+        if (archive) {
+            fprintf (stderr, "ERROR: --merge-spec needs an mbdump directory for the child tables\n");
+            DIE;
+        }
+        embed_spec_read (merge_spec_file) || DIE;
+        embed_load (&plan);
+    }
+    if (*out_bson_dir) {
+        if (mkdir (out_bson_dir, 0755) != 0 && errno != EEXIST) {
+            fprintf (stderr, "ERROR: mkdir \"%s\": %s\n", out_bson_dir, strerror (errno));
+            DIE;
+        }
+        if (archive)
+            count = load_archive (NULL, mbdump_dir, argc, argv, &plan, jobs);
+        else if (jobs > 1)
+            count = load_tables_parallel (NULL, argc, argv, &plan, jobs);
+        else {
+            for (argi = 0; argi < argc; argi++) {
+                fprintf (stderr, "[%d/%d] %s\n", argi + 1, argc, argv[argi]);
+                count += load_table (NULL, argv[argi], &plan);
+            }
+        }
+        schema_plan_close (&plan);
+        mongoc_uri_destroy (uri);
+        return count;
+    }
+    if (*checkpoint_dir && mkdir (checkpoint_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf (stderr, "ERROR: mkdir \"%s\": %s\n", checkpoint_dir, strerror (errno));
+        DIE;
+    }
+    client = mongoc_client_new (uristr);
+    bulk_batch_size_init (&batch_size, batch_bytes, bulk_max_message_size (client), auto_tune);
+    /* the writers get a pool of their own, workers holding clients cannot starve them */
+    if ((jobs > 1 || archive) && !*delta_dir)
+        pool = mongoc_client_pool_new (uri);
+    if (writers > 0 && !*delta_dir)
+        writer_pool = mongoc_client_pool_new (uri);
+    if (*delta_dir) {
+        db = mongoc_client_get_database (client, database_name);
+        for (argi = 0; argi < argc; argi++) {
+            fprintf (stderr, "[%d/%d] %s\n", argi + 1, argc, argv[argi]);
+            n = delta_table (db, argv[argi], &plan);
+            if (n < 0) {
+                fprintf (stderr, "ERROR: delta of \"%s\" failed\n", argv[argi]);
+                failed = true;
+            }
+            else
+                count += n;
+        }
+        mongoc_database_destroy (db);
+    }
+    else if (archive) {
+        count = load_archive (pool, mbdump_dir, argc, argv, &plan, jobs);
+    }
+    else if (jobs > 1) {
+        count = load_tables_parallel (pool, argc, argv, &plan, jobs);
+    }
+    else {
+        db = mongoc_client_get_database (client, database_name);
+        for (argi = 0; argi < argc; argi++) {
+            fprintf (stderr, "[%d/%d] %s\n", argi + 1, argc, argv[argi]);
+            count += load_table (db, argv[argi], &plan);
+        }
+        mongoc_database_destroy (db);
+    }
+    db = mongoc_client_get_database (client, database_name);
+    embed_unstamp (db, &plan, archive, argc, argv);
+    if (n_embed_specs > 0 && !*delta_dir)
+        embed_stamp (db, argc, argv);
+    mongoc_database_destroy (db);
+    mongoc_client_destroy (client);
+    schema_plan_close (&plan);
+
+    if (pool)
+        mongoc_client_pool_destroy (pool);
+    if (writer_pool)
+        mongoc_client_pool_destroy (writer_pool);
+    mongoc_uri_destroy (uri);
+    return failed ? -1 : count;
+}
+
+bool
+test_bson_append_int32_array_from_s (void)
+{
+    bson_t bson;
+    const char *input = "{150,77950}";
+    const char *expected = "{ \"track_offset\" : [ 150, 77950 ] }";
+    const char *actual;
+
+    bson_init (&bson);
+    bson_append_int32_array_from_s (&bson, "track_offset", input, strlen (input));
+    actual = bson_as_json (&bson, NULL);
+    if (strcmp (expected, actual) != 0) {
+        fprintf (stderr, "Test test_bson_append_int32_array_from_s failed, input: \"%s\", bson expected: \"%s\", bson actual: \"%s\"\n",
+                input, expected, actual);
+        return false;
+    }
+    bson_free ((void*)actual);
+    return true;
+}
+
+bool
+test_bson_append_point_from_s (void)
+{
+    bson_t bson;
+    const char *input = "(35.585673,139.728101)";
+    const char *expected = "{ \"point\" : [ 35.585673, 139.728101 ] }";
+    const char *actual;
+
+    bson_init (&bson);
+    bson_append_point_from_s (&bson, "point", input, strlen (input));
+    actual = bson_as_json (&bson, NULL);
+    if (strcmp (expected, actual) != 0) {
+        fprintf (stderr, "Test test_bson_append_point_from_s failed, input: \"%s\", bson expected: \"%s\", bson actual: \"%s\"\n",
+                input, expected, actual);
+        return false;
+    }
+    bson_free ((void*)actual);
+    return true;
+}
+
+bool
+test_converter_matches_libc (const char           *name,
+                             bson_append_from_s_t  converter,
+                             bson_append_from_s_t  converter_libc,
+                             const char           *inputs[])
+{
+    bson_t bson, bson_libc;
+    const char **input;
+    char *json, *json_libc;
+    bool ret = true;
+
+    for (input = inputs; *input; input++) {
+        bson_init (&bson);
+        bson_init (&bson_libc);
+        converter (&bson, "v", *input, strlen (*input));
+        converter_libc (&bson_libc, "v", *input, strlen (*input));
+        json = bson_as_json (&bson, NULL);
+        json_libc = bson_as_json (&bson_libc, NULL);
+        if (strcmp (json, json_libc) != 0) {
+            fprintf (stderr, "Test %s failed, input: \"%s\", bson libc: \"%s\", bson actual: \"%s\"\n",
+                    name, *input, json_libc, json);
+            ret = false;
+        }
+        bson_free (json);
+        bson_free (json_libc);
+        bson_destroy (&bson);
+        bson_destroy (&bson_libc);
+    }
+    return ret;
+}
+
+const char *test_int32_inputs[] = {
+    "0", "1", "-1", "42", "007", "+5", "2147483647", "-2147483648", "1234567", NULL
+};
+
+const char *test_double_inputs[] = {
+    "0", "-0", "35.585673", "139.728101", "-122.4194155", "0.000001", "1e3", "2.5E-3",
+    "12345678901234567890.5", "0.1234567890123456789", "-90", "180.000000", NULL
+};
+
+const char *test_int32_array_inputs[] = {
+    "{}", "{150}", "{150,77950}", "{150,17285,35037,53587,72335,89187}", NULL
+};
+
+const char *test_point_inputs[] = {
+    "(35.585673,139.728101)", "(-33.8688,151.2093)", "(0,0)", NULL
+};
+
+bool
+test_converters_match_libc (void)
+{
+    bool ret = true;
+
+    ret = test_converter_matches_libc ("bson_append_int32_from_s", bson_append_int32_from_s,
+                                       bson_append_int32_from_s_libc, test_int32_inputs) && ret;
+    ret = test_converter_matches_libc ("bson_append_double_from_s", bson_append_double_from_s,
+                                       bson_append_double_from_s_libc, test_double_inputs) && ret;
+    ret = test_converter_matches_libc ("bson_append_int32_array_from_s", bson_append_int32_array_from_s,
+                                       bson_append_int32_array_from_s_libc, test_int32_array_inputs) && ret;
+    ret = test_converter_matches_libc ("bson_append_point_from_s", bson_append_point_from_s,
+                                       bson_append_point_from_s_libc, test_point_inputs) && ret;
+    return ret;
+}
+
+bool
+test_pg_timestamp_parse (void)
+{
+    int64_t msec;
+    bool ret = true;
+    struct {
+        const char *input;
+        int64_t msec;
+    } *test, tests[] = {
+        { "2013-07-21 22:47:57.660809+00", INT64_C (1374446877660) },
+        { "2013-07-21 22:47:57.66+00",     INT64_C (1374446877660) },
+        { "2013-07-21 22:47:57+00",        INT64_C (1374446877000) },
+        { "2013-07-22 04:17:57.660809+05:30", INT64_C (1374446877660) },
+        { "2013-07-21 14:47:57.660809-08", INT64_C (1374446877660) },
+        { "1970-01-01 00:00:00.000001+00", INT64_C (0) },
+        { "2000-02-29 12:00:00.123456+00", INT64_C (951825600123) },
+        { "1969-12-31 23:59:59.999999+00", INT64_C (-1) },
+        { "2038-01-19 03:14:08.000000+00", INT64_C (2147483648000) },
+        { NULL, 0 }
+    };
+
+    for (test = tests; test->input; test++) {
+        if (!pg_timestamp_parse (test->input, strlen (test->input), &msec) || msec != test->msec) {
+            fprintf (stderr, "Test pg_timestamp_parse failed, TIMESTAMP: \"%s\", msec expected: %"PRId64", msec actual: %"PRId64"\n",
+                    test->input, test->msec, msec);
+            ret = false;
+        }
+    }
+    return ret;
+}
+
+bool
+test_bulk_batch_size (void)
+{
+    bulk_batch_size_t batch_size;
+    int i;
+    bool ret = true;
+
+    bulk_batch_size_init (&batch_size, 64 * 1024 * 1024, 48000000, true);
+    if (batch_size.target_bytes != 48000000 - BULK_BATCH_HEADROOM) {
+        fprintf (stderr, "Test bulk_batch_size_init failed, target not capped: %zu\n", batch_size.target_bytes);
+        ret = false;
+    }
+    if (bulk_batch_size_full (&batch_size, 0, 0, 64 * 1024 * 1024) ||
+        !bulk_batch_size_full (&batch_size, batch_size.target_bytes - 10, 1, 11)) {
+        fprintf (stderr, "Test bulk_batch_size_full failed\n");
+        ret = false;
+    }
+    /* flat throughput keeps reversing and never leaves the bounds */
+    for (i = 0; i < 100 * BULK_TUNE_WINDOW; i++) {
+        bulk_batch_size_observe (&batch_size, 1024 * 1024, 0.01);
+        if (batch_size.target_bytes < batch_size.min_bytes || batch_size.target_bytes > batch_size.max_bytes) {
+            fprintf (stderr, "Test bulk_batch_size_observe failed, target out of bounds: %zu\n", batch_size.target_bytes);
+            ret = false;
+            break;
+        }
+    }
+    return ret;
+}
+
+/*
+ * escapes, \N and empty columns; the chunk ends right after the last
+ * row's backslash, so the N beyond it must not make a \N
+ */
+bool
+test_row_tokenize_with (const char *name)
+{
+    char data[] = "1\tplain\\ttab\t\\N\tback\\\\slash\tthe long column that spans more than one vector\n"
+                  "2\t\t\\N\n"
+                  "3\ttrailing\\N\n";
+    struct {
+        int n;
+        const char *values[5];
+    } *test, tests[] = {
+        { 5, { "1", "plain\ttab", NULL, "back\\slash", "the long column that spans more than one vector" } },
+        { 3, { "2", "", NULL, NULL, NULL } },
+        { 2, { "3", "trailing\\", NULL, NULL, NULL } },
+        { -1, { NULL, NULL, NULL, NULL, NULL } }
+    };
+    mbdump_map_t map;
+    row_reader_t reader;
+    column_span_t spans[5];
+    decode_buf_t decode_buf = { NULL, 0, 0 };
+    int row, n, i;
+    bool ret = true;
+
+    map.fd = -1;
+    map.data = data;
+    map.size = strlen (data);
+    row_reader_init (&reader, &map, 0, map.size - 2);
+    for (row = 0, test = tests; ret && row < 4; row++, test++) {
+        n = row_tokenize (&reader, spans, 5, &decode_buf);
+        if (n != test->n) {
+            fprintf (stderr, "Test row_tokenize %s failed, row %d, columns expected: %d, columns actual: %d\n",
+                    name, row + 1, test->n, n);
+            ret = false;
+        }
+        for (i = 0; ret && n >= 0 && i < 5; i++) {
+            const char *expected = test->values[i];
+
+            if (expected ? !spans[i].value || spans[i].len != strlen (expected) || memcmp (spans[i].value, expected, spans[i].len) != 0
+                         : spans[i].value != NULL) {
+                fprintf (stderr, "Test row_tokenize %s failed, row %d column %d expected: \"%s\", actual: \"%.*s\"\n",
+                        name, row + 1, i + 1, expected ? expected : "\\N", (int)spans[i].len, spans[i].value ? spans[i].value : "\\N");
+                ret = false;
+            }
+        }
+    }
+    free (decode_buf.data);
+    return ret;
+}
+
+bool
+test_row_tokenize (void)
+{
+    bool ret;
+
+    row_scan = row_scan_scalar;
+    ret = test_row_tokenize_with ("scalar");
+#ifdef ROW_SCAN_X86
+    row_scan = row_scan_sse2;
+    ret = test_row_tokenize_with ("sse2") && ret;
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2")) {
+        row_scan = row_scan_avx2;
+        ret = test_row_tokenize_with ("avx2") && ret;
+    }
+#endif
+    row_scan = row_scan_scalar;
+    return ret;
+}
+
+/* a ustar member header with its checksum */
+void
+test_tar_header (char       *header,
+                 const char *name,
+                 size_t      size,
+                 char        type)
+{
+    unsigned int checksum, i;
+
+    memset (header, 0, TAR_BLOCK_SIZE);
+    snprintf (header, 100, "%s", name);
+    memcpy (header + 100, "0000644", 7);
+    snprintf (header + 124, 12, "%011o", (unsigned int)size);
+    header[156] = type;
+    memcpy (header + 257, "ustar\0" "00", 8);
+    memset (header + 148, ' ', 8);
+    for (i = 0, checksum = 0; i < TAR_BLOCK_SIZE; i++)
+        checksum += (uint8_t)header[i];
+    snprintf (header + 148, 8, "%06o", checksum);
+}
+
+typedef struct {
+    const char *name;
+    const char *data;
+} test_member_t;
+
+/* walk the archive in file and compare its members with members[0..n_members) */
+bool
+test_archive_walk (const char          *label,
+                   const char          *data,
+                   size_t               len,
+                   const test_member_t *members,
+                   int                  n_members)
+{
+    char file[] = "/tmp/mbdump_to_mongo_test_XXXXXX";
+    char name[MAXPATHLEN], type, buf[TAR_BLOCK_SIZE];
+    archive_t archive;
+    uint64_t size;
+    int fd, n = 0;
+    bool ret;
+
+    fd = mkstemp (file);
+    ret = fd >= 0 && write (fd, data, len) == (ssize_t)len;
+    if (fd >= 0)
+        close (fd);
+    ret = ret && archive_open (&archive, file);
+    if (!ret) {
+        fprintf (stderr, "Test archive %s failed, \"%s\" not written or opened\n", label, file);
+        unlink (file);
+        return false;
+    }
+    while (ret && tar_next_member (&archive, name, MAXPATHLEN, &size, &type)) {
+        if (n >= n_members || strcmp (name, members[n].name) != 0 || size != strlen (members[n].data) ||
+            size > sizeof buf || !archive_read_full (&archive, buf, size) || memcmp (buf, members[n].data, size) != 0 ||
+            !archive_skip (&archive, tar_padding (size))) {
+            fprintf (stderr, "Test archive %s failed, member %d \"%s\" %"PRIu64" bytes\n", label, n + 1, name, size);
+            ret = false;
+        }
+        n++;
+    }
+    if (ret && n != n_members) {
+        fprintf (stderr, "Test archive %s failed, members expected: %d, members actual: %d\n", label, n_members, n);
+        ret = false;
+    }
+    archive_close (&archive);
+    unlink (file);
+    return ret;
+}
+
+/*
+ * the same tar plain, as two bzip2 streams split inside a member, and
+ * an empty bzip2 stream that must end the walk without members
+ */
+bool
+test_archive (void)
+{
+    const test_member_t members[] = {
+        { "mbdump/artist", "1\tAlpha\n2\tBeta\n" },
+        { "mbdump/empty", "" },
+        { "mbdump/label", "1\tGamma\n" }
+    };
+    char tar[6 * TAR_BLOCK_SIZE + 2 * TAR_BLOCK_SIZE], *bz2;
+    unsigned int bz2_len, bz2_size, split_len;
+    size_t len = 0, i;
+    bool ret = true;
+
+    memset (tar, 0, sizeof tar);
+    for (i = 0; i < sizeof members / sizeof members[0]; i++) {
+        size_t size = strlen (members[i].data);
+
+        test_tar_header (tar + len, members[i].name, size, '0');
+        memcpy (tar + len + TAR_BLOCK_SIZE, members[i].data, size);
+        len += TAR_BLOCK_SIZE + size + tar_padding (size);
+    }
+    len += 2 * TAR_BLOCK_SIZE;
+    ret = test_archive_walk ("tar", tar, len, members, 3) && ret;
+
+    bz2_size = 2 * sizeof tar + 1024;
+    bz2 = malloc (bz2_size);
+    split_len = bz2_size;
+    BZ2_bzBuffToBuffCompress (bz2, &split_len, tar, TAR_BLOCK_SIZE + 7, 9, 0, 0) == BZ_OK || DIE;
+    bz2_len = bz2_size - split_len;
+    BZ2_bzBuffToBuffCompress (bz2 + split_len, &bz2_len, tar + TAR_BLOCK_SIZE + 7, len - TAR_BLOCK_SIZE - 7, 1, 0, 0) == BZ_OK || DIE;
+    ret = test_archive_walk ("multi-stream bzip2", bz2, split_len + bz2_len, members, 3) && ret;
+
+    bz2_len = bz2_size;
+    BZ2_bzBuffToBuffCompress (bz2, &bz2_len, tar, 0, 9, 0, 0) == BZ_OK || DIE;
+    ret = test_archive_walk ("empty bzip2", bz2, bz2_len, members, 0) && ret;
+    free (bz2);
+    return ret;
+}
+
+/* a one-level embed; an id with no child row and \N keep the plain column */
+bool
+test_embed (void)
+{
+    embed_table_t table;
+    column_map_t column;
+    bson_t bson;
+    char *json;
+    int i;
+    bool ret = true;
+    struct {
+        const char *value;
+        const char *expected;
+    } tests[] = {
+        { "1", "{ \"type\" : { \"id\" : 1, \"name\" : \"Person\" } }" },
+        { "3", "{ \"type\" : 3 }" },
+        { NULL, "{ }" }
+    };
+
+    memset (&table, 0, sizeof table);
+    table.table_name = "artist_type";
+    table.key_column = "id";
+    table.mask = 15;
+    table.entries = calloc (table.mask + 1, sizeof (embed_entry_t));
+    bson_init (&bson);
+    BSON_APPEND_INT32 (&bson, "id", 1);
+    BSON_APPEND_UTF8 (&bson, "name", "Person");
+    embed_table_insert (&table, 1, &bson);
+    bson_reinit (&bson);
+    BSON_APPEND_INT32 (&bson, "id", 2);
+    BSON_APPEND_UTF8 (&bson, "name", "Group");
+    embed_table_insert (&table, 2, &bson);
+    bson_reinit (&bson);
+    BSON_APPEND_INT32 (&bson, "id", 1);
+    BSON_APPEND_UTF8 (&bson, "name", "Duplicate");
+    embed_table_insert (&table, 1, &bson);
+    bson_reinit (&bson);
+
+    column.column_name = "type";
+    column.data_type = "integer";
+    column.bson_append_from_s = bson_append_int32_from_s;
+    column.embed = &table;
+    column.pk = false;
+    column.id = false;
+    for (i = 0; i < (int)(sizeof tests / sizeof tests[0]); i++) {
+        const char *value = tests[i].value;
+
+        column_map_append (&column, &bson, value, value ? strlen (value) : 0);
+        json = bson_as_json (&bson, NULL);
+        if (strcmp (json, tests[i].expected) != 0) {
+            fprintf (stderr, "Test embed failed, value: \"%s\", bson expected: \"%s\", bson actual: \"%s\"\n",
+                    value ? value : "\\N", tests[i].expected, json);
+            ret = false;
+        }
+        bson_free (json);
+        bson_reinit (&bson);
+    }
+    bson_destroy (&bson);
+    free (table.entries);
+    free (table.data);
+    return ret;
+}
+
+/* unchanged, changed, new and duplicate rows, the last previous row without a newline */
+bool
+test_delta_index (void)
+{
+    char prev_data[] = "1\ta\n2\tb\n3\tc\n3\tc\n5\te";
+    char data[] = "1\ta\n2\tB\n4\td\n3\tc\n5\te\n";
+    struct {
+        bool unchanged;
+        bool found;
+    } expected[] = {
+        { true, true }, { false, true }, { false, false }, { true, true }, { true, true }
+    };
+    int key_columns[] = { 0 };
+    mbdump_map_t prev_map, map;
+    row_reader_t reader;
+    column_span_t spans[2];
+    decode_buf_t decode_buf = { NULL, 0, 0 };
+    delta_index_t index;
+    delta_entry_t *entry;
+    off_t row_offset;
+    uint64_t h;
+    int row = 0, n_unmatched = 0;
+    bool ret = true, unchanged;
+
+    prev_map.fd = map.fd = -1;
+    prev_map.data = prev_data;
+    prev_map.size = strlen (prev_data);
+    map.data = data;
+    map.size = strlen (data);
+    delta_index_init (&index, &prev_map);
+    row_reader_init (&reader, &prev_map, 0, prev_map.size);
+    for (row_offset = 0; row_tokenize (&reader, spans, 2, &decode_buf) >= 0; row_offset = reader.p - prev_map.data)
+        delta_index_add (&index, delta_row_key (spans, key_columns, 1), row_offset);
+    row_reader_init (&reader, &map, 0, map.size);
+    for (row_offset = 0; row_tokenize (&reader, spans, 2, &decode_buf) >= 0; row_offset = reader.p - map.data, row++) {
+        entry = delta_index_match (&index, &prev_map, delta_row_key (spans, key_columns, 1),
+                                   map.data + row_offset, reader.p - map.data - row_offset, &unchanged);
+        if (unchanged != expected[row].unchanged || (entry != NULL) != expected[row].found) {
+            fprintf (stderr, "Test delta_index_match failed, row %d, unchanged: %d, found: %d\n", row + 1, unchanged, entry != NULL);
+            ret = false;
+        }
+        if (entry)
+            entry->offset |= DELTA_MATCHED;
+    }
+    for (h = 0; h <= index.mask; h++) {
+        if (index.entries[h].offset != 0 && !(index.entries[h].offset & DELTA_MATCHED))
+            n_unmatched++;
+    }
+    if (n_unmatched != 1) {
+        fprintf (stderr, "Test delta_index failed, deletes expected: 1, deletes actual: %d\n", n_unmatched);
+        ret = false;
+    }
+    free (index.entries);
+    free (decode_buf.data);
+    return ret;
+}
+
+void
+test_suite (void)
+{
+    test_bson_append_int32_array_from_s ();
+    test_bson_append_point_from_s ();
+    test_converters_match_libc ();
+    test_pg_timestamp_parse ();
+    test_bulk_batch_size ();
+    test_row_tokenize ();
+    test_archive ();
+    test_embed ();
+    test_delta_index ();
+}
+
+void
+log_local_handler (mongoc_log_level_t log_level,
+                   const char        *log_domain,
+                   const char        *message,
+                   void              *user_data)
 {
    /*
    fprintf (stderr, "log_local_handler MONGOC_LOG_LEVEL_INFO:%d log_level:%d\n", MONGOC_LOG_LEVEL_INFO, log_level);
@@ -616,25 +3921,99 @@ log_local_handler (mongoc_log_level_t log_level,
       mongoc_log_default_handler (log_level, log_domain, message, user_data);
 }
 
+void
+usage (const char *program_name)
+{
+   fprintf (stderr, "usage: %s [options] schema_file mbdump_dir table_names\n", program_name);
+   fprintf (stderr, "       %s [options] schema_file mbdump.tar.bz2|- [table_names]\n", program_name);
+   fprintf (stderr, "options:\n");
+   fprintf (stderr, "  --jobs N         load with N workers, large tables split into %d MB chunks\n", CHUNK_SIZE/(1024*1024));
+   fprintf (stderr, "  --writers N      insert batches on N writer threads while parsing continues\n");
+   fprintf (stderr, "  --in-flight N    batches queued or executing per table or chunk, default 2\n");
+   fprintf (stderr, "  --batch-bytes N  close insert batches at N bytes, default %d, capped by the server\n", BULK_BATCH_TARGET_BYTES);
+   fprintf (stderr, "  --auto-tune      adjust the batch size to the best measured throughput\n");
+   fprintf (stderr, "  --out-bson DIR   write DIR/<table>.bson and .metadata.json for mongorestore, no server\n");
+   fprintf (stderr, "  --bzip2-threads N  decompress an archive on N threads, default one per cpu\n");
+   fprintf (stderr, "  --checkpoint DIR record acknowledged offsets per table in DIR, rows without a primary key get their offset as _id\n");
+   fprintf (stderr, "  --resume         continue each table from its checkpoint, use the same --jobs\n");
+   fprintf (stderr, "  --delta PREV_DIR apply only the rows changed since the mbdump_dir in PREV_DIR\n");
+   fprintf (stderr, "  --merge-spec FILE embed the \"1\" children of merge_spec_flat.json while loading\n");
+   fprintf (stderr, "  --plan FILE      compiled schema plan, default schema_file.plan, rebuilt when stale\n");
+   DIE;
+}
+
 int
 main (int   argc,
       char *argv[])
 {
    double start_time, end_time, delta_time;
    int64_t count;
+   const char *program_name = argv[0];
 
-   if (argc < 3) {
-      fprintf(stderr, "usage: %s [options] schema_file mbdump_dir table_names", argv[0]);
-      DIE;
-   }
    argc--, argv++;
+   while (argc > 0 && strncmp (argv[0], "--", 2) == 0) {
+      if (strcmp (argv[0], "--jobs") == 0 && argc > 1) {
+         argc--, argv++;
+         jobs = atoi (argv[0]);
+      }
+      else if (strcmp (argv[0], "--writers") == 0 && argc > 1) {
+         argc--, argv++;
+         writers = atoi (argv[0]);
+      }
+      else if (strcmp (argv[0], "--in-flight") == 0 && argc > 1) {
+         argc--, argv++;
+         in_flight = BSON_MAX (1, atoi (argv[0]));
+      }
+      else if (strcmp (argv[0], "--batch-bytes") == 0 && argc > 1) {
+         argc--, argv++;
+         batch_bytes = strtoul (argv[0], NULL, 10);
+      }
+      else if (strcmp (argv[0], "--auto-tune") == 0) {
+         auto_tune = true;
+      }
+      else if (strcmp (argv[0], "--bzip2-threads") == 0 && argc > 1) {
+         argc--, argv++;
+         bzip2_threads = atoi (argv[0]);
+      }
+      else if (strcmp (argv[0], "--checkpoint") == 0 && argc > 1) {
+         argc--, argv++;
+         strcpy(checkpoint_dir, argv[0]);
+      }
+      else if (strcmp (argv[0], "--resume") == 0) {
+         resume = true;
+      }
+      else if (strcmp (argv[0], "--out-bson") == 0 && argc > 1) {
+         argc--, argv++;
+         strcpy(out_bson_dir, argv[0]);
+      }
+      else if (strcmp (argv[0], "--delta") == 0 && argc > 1) {
+         argc--, argv++;
+         strcpy(delta_dir, argv[0]);
+      }
+      else if (strcmp (argv[0], "--merge-spec") == 0 && argc > 1) {
+         argc--, argv++;
+         strcpy(merge_spec_file, argv[0]);
+      }
+      else if (strcmp (argv[0], "--plan") == 0 && argc > 1) {
+         argc--, argv++;
+         strcpy(plan_file, argv[0]);
+      }
+      else
+         usage (program_name);
+      argc--, argv++;
+   }
+   if (argc < 2 || (resume && *checkpoint_dir == '\0'))
+      usage (program_name);
    strcpy(schema_file, argv[0]);
+   if (*plan_file == '\0')
+      snprintf (plan_file, MAXPATHLEN, "%s.plan", schema_file);
    argc--, argv++;
    strcpy(mbdump_dir, argv[0]);
    argc--, argv++;
 
    test_suite ();
 
+   row_scan_init ();
    mongoc_init ();
    mongoc_log_set_handler (log_local_handler, NULL);
 
@@ -647,6 +4026,6 @@ main (int   argc,
 
    mongoc_cleanup ();
 
-   return 0;
+   return count < 0 ? 1 : 0;
 }
 
@@ -21,8 +21,31 @@
 
 #include <mongoc.h>
 #include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
 #include "mongomerge.h"
 
+int bulk_writers = 1;
+int bulk_in_flight = 2;
+size_t bulk_batch_bytes = 0;
+bool bulk_auto_tune = false;
+size_t hash_join_max_bytes = HASH_JOIN_MAX_BYTES;
+merge_join_t merge_join = MERGE_JOIN_SERVER;
+bool server_side = false;
+bool fused_merge = false;
+int merge_partitions = 1;
+bool shadow_rebuild = false;
+uint32_t cursor_batch_size = 0;
+bool incremental_merge = false;
+bool checkpoint_merge = false;
+bool explain_merge = false;
+bool merge_indexes = true;
+unsigned int merge_strategies = 0;
+pthread_mutex_t merge_strategies_mutex = PTHREAD_MUTEX_INITIALIZER;
+bulk_batch_size_t merge_batch_size;
+mongoc_client_pool_t *merge_pool = NULL;
+const char *merge_database_name = NULL;
+
 char *
 str_compose (const char *s1,
              const char *s2)
@@ -36,6 +59,30 @@ str_compose (const char *s1,
    return s;
 }
 
+/* merges run on several threads under --spec */
+void
+merge_strategy_used (unsigned int strategy)
+{
+   pthread_mutex_lock (&merge_strategies_mutex);
+   merge_strategies |= strategy;
+   pthread_mutex_unlock (&merge_strategies_mutex);
+}
+
+void
+merge_strategies_print (void)
+{
+   static const char *names[] = {"temp", "hash_join", "sort_merge", "server", "partitions", "shadow", "fused", "incremental"};
+   size_t i;
+
+   fprintf (stderr, "info: strategies used:");
+   for (i = 0; i < sizeof names / sizeof (char*); i++) {
+      if (merge_strategies & (1 << i))
+         fprintf (stderr, " %s", names[i]);
+   }
+   fprintf (stderr, "%s\n", merge_strategies ? "" : " none");
+   fflush (stderr);
+}
+
 bson_t *
 bson_new_from_iter_document (bson_iter_t *iter)
 {
@@ -194,36 +241,45 @@ mongoc_cursor_bulk_insert (mongoc_cursor_t              *cursor,
                            mongoc_collection_t          *dest_coll,
                            const mongoc_write_concern_t *write_concern,
                            bson_error_t                 *error,
-                           size_t                        bulk_ops_size)
+                           bulk_batch_size_t            *batch_size)
 {
    int64_t ret = true;
    int64_t count = 0;
    const bson_t *doc;
-   size_t n_docs = 0;
+   size_t n_docs = 0, n_bytes = 0;
    mongoc_bulk_operation_t *bulk;
    bson_t reply;
+   int64_t start;
 
    bulk = mongoc_collection_create_bulk_operation (dest_coll, true, NULL);
    while (ret && mongoc_cursor_next (cursor, &doc)) {
-      mongoc_bulk_operation_insert (bulk, doc);
-      if (++n_docs == bulk_ops_size) {
+      if (bulk_batch_size_full (batch_size, n_bytes, n_docs, doc->len)) {
+         start = bson_get_monotonic_time ();
          ret = mongoc_bulk_operation_execute (bulk, &reply, error);
+         bson_destroy (&reply);
          if (ret) {
+            bulk_batch_size_observe (batch_size, n_bytes, (bson_get_monotonic_time () - start) / 1000000.0);
             count += n_docs;
-            if (count % PROGRESS_SIZE == 0) {
+            if ((count - n_docs) / PROGRESS_SIZE < count / PROGRESS_SIZE) {
                fprintf (stderr, PROGRESS_SIZE_FORMAT, n_docs, count);
                fflush (stderr);
             }
          }
          else
             fprintf (stderr, "mongoc_cursor_bulk_insert execute failure: %s\n", error->message);
-         n_docs = 0;
+         n_docs = n_bytes = 0;
          mongoc_bulk_operation_destroy (bulk);
          bulk = mongoc_collection_create_bulk_operation (dest_coll, true, NULL);
+         if (!ret)
+            break;
       }
+      mongoc_bulk_operation_insert (bulk, doc);
+      n_docs++;
+      n_bytes += doc->len;
    }
    if (ret && n_docs > 0) {
       ret = mongoc_bulk_operation_execute (bulk, &reply, error);
+      bson_destroy (&reply);
       if (ret) {
          count += n_docs;
          fprintf (stderr, PROGRESS_END_FORMAT, n_docs, count);
@@ -236,27 +292,122 @@ mongoc_cursor_bulk_insert (mongoc_cursor_t              *cursor,
    return ret ? count : -1;
 }
 
+/*
+ * cursor reads overlap with bulk writes - batches go to the pipeline's
+ * writer threads while the next batch is read from the cursor, the
+ * batch size is tuned across calls through batch_size
+ */
+int64_t
+mongoc_cursor_bulk_insert_pipeline (mongoc_cursor_t   *cursor,
+                                    bulk_pipeline_t   *pipeline,
+                                    bson_error_t      *error,
+                                    bulk_batch_size_t *batch_size)
+{
+   bool ret = true;
+   int64_t count;
+   size_t n_docs;
+   const bson_t *doc;
+   bulk_batch_t *batch;
+
+   bulk_pipeline_set_progress (pipeline, stderr, PROGRESS_SIZE, PROGRESS_SIZE_FORMAT);
+   bulk_pipeline_set_batch_size (pipeline, batch_size);
+   batch = bulk_pipeline_batch (pipeline);
+   while (ret && mongoc_cursor_next (cursor, &doc)) {
+      if (bulk_pipeline_batch_full (pipeline, doc)) {
+         ret = bulk_pipeline_submit (pipeline);
+         batch = bulk_pipeline_batch (pipeline);
+      }
+      bulk_batch_append (batch, doc);
+   }
+   if (mongoc_cursor_error (cursor, error)) {
+      fprintf (stderr, "mongoc_cursor_bulk_insert_pipeline cursor failure: %s\n", error->message);
+      ret = false;
+   }
+   n_docs = batch->n_docs;
+   count = bulk_pipeline_destroy (pipeline, error, batch_size);
+   if (count >= 0) {
+      fprintf (stderr, PROGRESS_END_FORMAT, n_docs, count);
+      fflush (stderr);
+   }
+   return ret ? count : -1;
+}
+
+/* append stage to the pipeline array stages and destroy it */
+void
+pipeline_stage_append (bson_t   *stages,
+                       uint32_t *n_stages,
+                       bson_t   *stage)
+{
+   const char *key;
+   char key_s[16];
+
+   bson_uint32_to_string ((*n_stages)++, &key, key_s, sizeof key_s);
+   bson_append_document (stages, key, -1, stage);
+   bson_destroy (stage);
+}
+
+/*
+ * the projection of a spec's field list - "+a+b" keeps only a and b,
+ * "-a-b" drops them - false for an empty list, the whole child.  The
+ * child key is always kept, the merge and any re-merge read it.  Mixed
+ * lists are rejected by merge_spec_check before a merge starts.
+ */
+bool
+merge_fields_projection (const char *fields,
+                         const char *child_key,
+                         bson_t     *projection)
+{
+   const char *field, *end;
+   char *name;
+   bool include;
+
+   if (*fields == '\0')
+      return false;
+   include = *fields == '+';
+   bson_init (projection);
+   for (field = fields; *field != '\0'; field = end) {
+      field++;
+      if ((end = strpbrk (field, "+-")) == NULL)
+         end = field + strlen (field);
+      name = bson_strndup (field, end - field);
+      if ((field[-1] == '+') == include && (include || strcmp (name, child_key) != 0))
+         BSON_APPEND_INT32 (projection, name, include ? 1 : 0);
+      bson_free (name);
+   }
+   if (include && !bson_has_field (projection, child_key))
+      BSON_APPEND_INT32 (projection, child_key, 1);
+   if (bson_empty (projection)) {
+      bson_destroy (projection);
+      return false;
+   }
+   return true;
+}
+
 bson_t *
 child_by_merge_key (const char *parent_key,
                     const char *child_name,
-                    const char *child_key)
+                    const char *child_key,
+                    const char *fields)
 {
-   bson_t *bson;
+   bson_t *bson, stages, projection;
    const char *dollar_child_key;
+   uint32_t n_stages = 0;
 
    dollar_child_key = str_compose ("$", child_key);
-   bson = BCON_NEW (
-      "pipeline", "[",
-         "{",
-            "$project", "{",
-               "_id", BCON_INT32 (0),
-               "child_name", "{", "$literal", child_name, "}",
-               "merge_id", dollar_child_key,
-               parent_key, "$$ROOT",
-            "}",
-         "}",
-      "]"
-   );
+   bson = bson_new ();
+   bson_append_array_begin (bson, "pipeline", -1, &stages);
+   if (merge_fields_projection (fields, child_key, &projection)) {
+      pipeline_stage_append (&stages, &n_stages, BCON_NEW ("$project", BCON_DOCUMENT (&projection)));
+      bson_destroy (&projection);
+   }
+   pipeline_stage_append (&stages, &n_stages, BCON_NEW (
+      "$project", "{",
+         "_id", BCON_INT32 (0),
+         "child_name", "{", "$literal", child_name, "}",
+         "merge_id", dollar_child_key,
+         parent_key, "$$ROOT",
+      "}"));
+   bson_append_array_end (bson, &stages);
    bson_free ((void*)dollar_child_key);
    return bson;
 }
@@ -326,25 +477,50 @@ merge_one_all (bson_t *accumulators,
 bson_t *
 copy_many_with_parent_id (const char *parent_key,
                           const char *child_name,
-                          const char *child_key)
+                          const char *child_key,
+                          const char *fields)
 {
    char *dollar_child_key;
-   bson_t *bson;
+   bson_t *bson, stages, projection;
+   uint32_t n_stages = 0;
 
    dollar_child_key = str_compose ("$", child_key);
-   bson = BCON_NEW (
-      "pipeline", "[",
-          "{", "$match", "{", child_key, "{", "$ne", BCON_NULL, "}", "}", "}",
-          "{", "$project", "{",
-                  "_id", BCON_INT32 (0),
-                  "parent_id", dollar_child_key,
-                  parent_key, "$$ROOT", "}", "}",
-      "]"
-   );
+   bson = bson_new ();
+   bson_append_array_begin (bson, "pipeline", -1, &stages);
+   pipeline_stage_append (&stages, &n_stages, BCON_NEW ("$match", "{", child_key, "{", "$ne", BCON_NULL, "}", "}"));
+   if (merge_fields_projection (fields, child_key, &projection)) {
+      pipeline_stage_append (&stages, &n_stages, BCON_NEW ("$project", BCON_DOCUMENT (&projection)));
+      bson_destroy (&projection);
+   }
+   pipeline_stage_append (&stages, &n_stages, BCON_NEW (
+      "$project", "{",
+         "_id", BCON_INT32 (0),
+         "parent_id", dollar_child_key,
+         parent_key, "$$ROOT",
+      "}"));
+   bson_append_array_end (bson, &stages);
    bson_free ((void*)dollar_child_key);
    return bson;
 }
 
+/* aggregate options for merge cursors, with the getMore batchSize when set */
+bson_t *
+merge_aggregate_options (void)
+{
+   bson_t *options;
+
+   options = BCON_NEW ("allowDiskUse", BCON_BOOL (true));
+   if (cursor_batch_size > 0)
+      BSON_APPEND_INT32 (options, "batchSize", (int32_t)cursor_batch_size);
+   return options;
+}
+
+/*
+ * the copy overlaps cursor reads with bulk writes by default - the
+ * calling thread reads the cursor into batches while bulk_writers
+ * threads, on their own pooled clients, insert up to bulk_in_flight
+ * batches; --writers 0 copies inline
+ */
 int64_t
 agg_copy (mongoc_collection_t *source_coll,
           mongoc_collection_t *dest_coll,
@@ -355,37 +531,199 @@ agg_copy (mongoc_collection_t *source_coll,
    int64_t count;
    bson_error_t error;
 
-   options = BCON_NEW ("allowDiskUse", BCON_BOOL (true));
+   options = merge_aggregate_options ();
    cursor = mongoc_collection_aggregate (source_coll, MONGOC_QUERY_NONE, pipeline, options, NULL);
    bson_destroy (options);
    /*
    count = mongoc_cursor_insert (cursor, dest_coll, NULL, &error);
-   count = mongoc_cursor_insert_batch (cursor, dest_coll, NULL, &error, INSERT_BATCH_SIZE);
+   count = mongoc_cursor_insert_batch (cursor, dest_coll, NULL, &error, 1000);
    */
-   count = mongoc_cursor_bulk_insert (cursor, dest_coll, NULL, &error, BULK_OPS_SIZE);
+   if (merge_pool && bulk_writers > 0) {
+      bulk_pipeline_t *pipeline;
+
+      pipeline = bulk_pipeline_new (dest_coll, merge_pool, merge_database_name, bulk_writers, bulk_in_flight);
+      count = mongoc_cursor_bulk_insert_pipeline (cursor, pipeline, &error, &merge_batch_size);
+   }
+   else
+      count = mongoc_cursor_bulk_insert (cursor, dest_coll, NULL, &error, &merge_batch_size);
    mongoc_cursor_destroy (cursor);
    return count;
 }
 
+/*
+ * Checkpoints - with --checkpoint, merge_parent records its progress in
+ * the merge_checkpoint collection, one document per parent: the phases
+ * done, the "one" keys already hash joined, and the last parent _id
+ * applied by group_and_update, whose group is then sorted by _id.  A
+ * rerun with --checkpoint and the same specs keeps <parent>_merge_temp,
+ * skips the phases done, clears the part of the temp collection an
+ * interrupted "many" copy wrote, and resumes the group after that _id.
+ * The group of --partitions and --shadow is not resumed, it reruns in
+ * full.  The document is removed once the merge is done.
+ */
+
+typedef struct {
+   mongoc_collection_t *coll;
+   bson_t *selector;
+   bson_t *saved;
+} merge_checkpoint_t;
+
+/* true when a checkpoint of the same specs is resumed */
+bool
+merge_checkpoint_open (merge_checkpoint_t *checkpoint,
+                       mongoc_database_t  *db,
+                       const char         *parent_name,
+                       const char         *specs)
+{
+   mongoc_cursor_t *cursor;
+   const bson_t *doc;
+   bson_t *fresh;
+   bson_iter_t iter;
+   bson_error_t error;
+
+   checkpoint->coll = mongoc_database_get_collection (db, "merge_checkpoint");
+   checkpoint->selector = BCON_NEW ("_id", BCON_UTF8 (parent_name));
+   checkpoint->saved = NULL;
+   cursor = mongoc_collection_find (checkpoint->coll, MONGOC_QUERY_NONE, 0, 1, 0, checkpoint->selector, NULL, NULL);
+   if (mongoc_cursor_next (cursor, &doc) && bson_iter_init_find (&iter, doc, "specs") &&
+       BSON_ITER_HOLDS_UTF8 (&iter) && strcmp (bson_iter_utf8 (&iter, NULL), specs) == 0)
+      checkpoint->saved = bson_copy (doc);
+   mongoc_cursor_destroy (cursor);
+   if (!checkpoint->saved) {
+      mongoc_collection_remove (checkpoint->coll, MONGOC_REMOVE_NONE, checkpoint->selector, NULL, &error);
+      fresh = BCON_NEW ("_id", BCON_UTF8 (parent_name), "specs", BCON_UTF8 (specs));
+      if (!mongoc_collection_insert (checkpoint->coll, MONGOC_INSERT_NONE, fresh, NULL, &error))
+         fprintf (stderr, "WARNING: checkpoint \"%s\" not inserted: %s\n", parent_name, error.message);
+      bson_destroy (fresh);
+   }
+   return checkpoint->saved != NULL;
+}
+
+bool
+merge_checkpoint_done (const merge_checkpoint_t *checkpoint,
+                       const char               *phase)
+{
+   bson_iter_t iter, iter_done;
+
+   if (!checkpoint || !checkpoint->saved || !bson_iter_init_find (&iter, checkpoint->saved, "done") ||
+       !BSON_ITER_HOLDS_ARRAY (&iter) || !bson_iter_recurse (&iter, &iter_done))
+      return false;
+   while (bson_iter_next (&iter_done)) {
+      if (BSON_ITER_HOLDS_UTF8 (&iter_done) && strcmp (bson_iter_utf8 (&iter_done, NULL), phase) == 0)
+         return true;
+   }
+   return false;
+}
+
+/* update is an update document for the checkpoint, destroyed here */
+void
+merge_checkpoint_update (merge_checkpoint_t *checkpoint,
+                         bson_t             *update)
+{
+   bson_error_t error;
+
+   if (!mongoc_collection_update (checkpoint->coll, MONGOC_UPDATE_NONE, checkpoint->selector, update, NULL, &error))
+      fprintf (stderr, "WARNING: checkpoint not updated: %s\n", error.message);
+   bson_destroy (update);
+}
+
+void
+merge_checkpoint_mark (merge_checkpoint_t *checkpoint,
+                       const char         *phase)
+{
+   if (checkpoint)
+      merge_checkpoint_update (checkpoint, BCON_NEW ("$addToSet", "{", "done", BCON_UTF8 (phase), "}"));
+}
+
+/* the last _id applied by an interrupted group */
+bool
+merge_checkpoint_group_last_id (const merge_checkpoint_t *checkpoint,
+                                int64_t                  *last_id)
+{
+   bson_iter_t iter;
+
+   if (!checkpoint || !checkpoint->saved || !bson_iter_init_find (&iter, checkpoint->saved, "group_last_id"))
+      return false;
+   *last_id = bson_iter_as_int64 (&iter);
+   return true;
+}
+
+void
+merge_checkpoint_close (merge_checkpoint_t *checkpoint,
+                        bool                finished)
+{
+   bson_error_t error;
+
+   if (finished && !mongoc_collection_remove (checkpoint->coll, MONGOC_REMOVE_NONE, checkpoint->selector, NULL, &error))
+      fprintf (stderr, "WARNING: checkpoint not removed: %s\n", error.message);
+   if (checkpoint->saved)
+      bson_destroy (checkpoint->saved);
+   bson_destroy (checkpoint->selector);
+   mongoc_collection_destroy (checkpoint->coll);
+}
+
+/* true when a parent_id in the temp collection is missing or not an int32 or int64 */
+bool
+group_non_integer_ids (mongoc_collection_t *source_coll)
+{
+   bson_t *query;
+   bson_error_t error;
+   int64_t n;
+
+   query = BCON_NEW ("$and", "[", "{", "parent_id", "{", "$not", "{", "$type", BCON_INT32 (16), "}", "}", "}",
+                                  "{", "parent_id", "{", "$not", "{", "$type", BCON_INT32 (18), "}", "}", "}", "]");
+   n = mongoc_collection_count (source_coll, MONGOC_QUERY_NONE, query, 0, 1, NULL, &error);
+   bson_destroy (query);
+   return n != 0;
+}
+
+/*
+ * match, when not NULL, limits the group to a range of parent_id; with a
+ * checkpoint the group is sorted by _id and resumes after the last _id
+ * applied, unless some parent_id is not an integer - those groups sort
+ * around the integers and a $gt resume would pass them over
+ */
 int64_t
 group_and_update (mongoc_collection_t *source_coll,
                   mongoc_collection_t *dest_coll,
-                  bson_t              *accumulators)
+                  bson_t              *accumulators,
+                  const bson_t        *match,
+                  merge_checkpoint_t  *checkpoint)
 {
    bson_t *options;
-   bson_t *pipeline;
+   bson_t *pipeline, stages, range = BSON_INITIALIZER;
+   uint32_t n_stages = 0;
+   int64_t last_id = 0;
+   bool has_last_id;
    mongoc_cursor_t *cursor;
    bool ret = true;
    int64_t count = 0;
    const bson_t *doc;
    bson_error_t error;
-   size_t n_docs = 0;
+   size_t n_docs = 0, n_bytes = 0;
    mongoc_bulk_operation_t *bulk;
    bson_t reply;
    bson_t q, fields, u;
+   int64_t start;
 
-   options = BCON_NEW ("allowDiskUse", BCON_BOOL (true));
-   pipeline = BCON_NEW ("pipeline", "[", "{", "$group", "{", "_id", "$parent_id", BCON (accumulators), "}", "}", "]");
+   options = merge_aggregate_options ();
+   if ((has_last_id = merge_checkpoint_group_last_id (checkpoint, &last_id)) && group_non_integer_ids (source_coll)) {
+      fprintf (stderr, "not resumed, some parent_ids are not integers: ");
+      has_last_id = false;
+   }
+   if (has_last_id) {
+      fprintf (stderr, "resumed after _id %"PRId64": ", last_id);
+      BSON_APPEND_INT64 (&range, "$gt", last_id);
+      match = &range;
+   }
+   pipeline = bson_new ();
+   bson_append_array_begin (pipeline, "pipeline", -1, &stages);
+   if (match)
+      pipeline_stage_append (&stages, &n_stages, BCON_NEW ("$match", "{", "parent_id", BCON_DOCUMENT (match), "}"));
+   pipeline_stage_append (&stages, &n_stages, BCON_NEW ("$group", "{", "_id", "$parent_id", BCON (accumulators), "}"));
+   if (checkpoint)
+      pipeline_stage_append (&stages, &n_stages, BCON_NEW ("$sort", "{", "_id", BCON_INT32 (1), "}"));
+   bson_append_array_end (pipeline, &stages);
    cursor = mongoc_collection_aggregate (source_coll, MONGOC_QUERY_NONE, pipeline, options, NULL);
    bson_destroy (options);
    bson_destroy (pipeline);
@@ -397,8 +735,11 @@ group_and_update (mongoc_collection_t *source_coll,
    while (ret && mongoc_cursor_next (cursor, &doc)) {
       bson_iter_t iter, iter_ary;
       bool do_update = false;
+      int64_t id = INT64_MIN;
 
       bson_iter_init_find (&iter, doc, "_id");
+      if (checkpoint && (BSON_ITER_HOLDS_INT32 (&iter) || BSON_ITER_HOLDS_INT64 (&iter)))
+         id = bson_iter_as_int64 (&iter);
       bson_init (&q);
       bson_append_iter (&q, NULL, -1, &iter);
       bson_init (&fields);
@@ -415,23 +756,31 @@ group_and_update (mongoc_collection_t *source_coll,
       if (do_update)
          ret = mongoc_collection_update (dest_coll, MONGOC_UPDATE_NONE, &q, u, NULL, &error);
       */
-      if (do_update) {
-         mongoc_bulk_operation_update_one (bulk, &q, &u, false);
-         if (++n_docs == BULK_OPS_SIZE) {
-            ret = mongoc_bulk_operation_execute (bulk, &reply, &error);
-            if (ret) {
-               count += n_docs;
-               if (count % PROGRESS_SIZE == 0) {
-                  fprintf (stderr, PROGRESS_SIZE_FORMAT, n_docs, count);
-                  fflush (stderr);
-               }
+      if (do_update && bulk_batch_size_full (&merge_batch_size, n_bytes, n_docs, q.len + u.len)) {
+         start = bson_get_monotonic_time ();
+         ret = mongoc_bulk_operation_execute (bulk, &reply, &error);
+         bson_destroy (&reply);
+         if (ret) {
+            bulk_batch_size_observe (&merge_batch_size, n_bytes, (bson_get_monotonic_time () - start) / 1000000.0);
+            count += n_docs;
+            if ((count - n_docs) / PROGRESS_SIZE < count / PROGRESS_SIZE) {
+               fprintf (stderr, PROGRESS_SIZE_FORMAT, n_docs, count);
+               fflush (stderr);
             }
-            else
-               fprintf (stderr, "group_and_update bulk execute failure: %s\n", (char*)&error.message);
-            n_docs = 0;
-            mongoc_bulk_operation_destroy (bulk);
-            bulk = mongoc_collection_create_bulk_operation (dest_coll, true, NULL);
+            /* every group before this one is applied */
+            if (checkpoint && has_last_id)
+               merge_checkpoint_update (checkpoint, BCON_NEW ("$set", "{", "group_last_id", BCON_INT64 (last_id), "}"));
          }
+         else
+            fprintf (stderr, "group_and_update bulk execute failure: %s\n", (char*)&error.message);
+         n_docs = n_bytes = 0;
+         mongoc_bulk_operation_destroy (bulk);
+         bulk = mongoc_collection_create_bulk_operation (dest_coll, true, NULL);
+      }
+      if (do_update && ret) {
+         mongoc_bulk_operation_update_one (bulk, &q, &u, false);
+         n_docs++;
+         n_bytes += q.len + u.len;
       }
       bson_reinit (&q);
       bson_reinit (&fields);
@@ -440,9 +789,12 @@ group_and_update (mongoc_collection_t *source_coll,
          fprintf (stderr, "mongoc_collection_update failure: %s\n", (char*)&error.message);
       else
          ++count;
+      has_last_id = id != INT64_MIN;
+      last_id = id;
    }
    if (ret && n_docs > 0) {
       ret = mongoc_bulk_operation_execute (bulk, &reply, &error);
+      bson_destroy (&reply);
       if (ret) {
          count += n_docs;
          fprintf (stderr, PROGRESS_END_FORMAT, n_docs, count);
@@ -458,220 +810,3191 @@ group_and_update (mongoc_collection_t *source_coll,
    bson_destroy (&q);
    bson_destroy (&fields);
    bson_destroy (&u);
+   bson_destroy (&range);
    mongoc_cursor_destroy (cursor);
    mongoc_bulk_operation_destroy (bulk);
    return ret ? count : -1;
 }
 
-bson_t *
-expand_spec (const char *parent_name,
-             int         merge_spec_count,
-             char      **merge_spec)
+/*
+ * execute bulk and start the next one, or finish when last; the count
+ * and progress are kept as in group_and_update
+ */
+bool
+merge_bulk_flush (mongoc_bulk_operation_t **bulk,
+                  mongoc_collection_t      *collection,
+                  size_t                   *n_docs,
+                  size_t                   *n_bytes,
+                  int64_t                  *count,
+                  const char               *name,
+                  bool                      last)
 {
-   bson_t *bson, bson_array;
-   int i;
-
-   bson = bson_new ();
-   bson_append_array_begin (bson, "merge_spec", -1, &bson_array);
-   for (i = 0; i < merge_spec_count; i++) {
-      char *s, *relation, *parent_key, *child_s, *child_name, *child_key, *colon, *dot;
+   bson_t reply;
+   bson_error_t error;
+   int64_t start;
+   bool ret = true;
 
-      s = bson_malloc (strlen (merge_spec[i]) + 1);
-      strcpy (s, merge_spec[i]);
-      parent_key = child_name = child_s = s;
-      colon = strchr (s, ':');
-      if (colon != NULL) {
-         *colon = '\0';
-         child_s = colon + 1;
+   if (*n_docs > 0) {
+      start = bson_get_monotonic_time ();
+      ret = mongoc_bulk_operation_execute (*bulk, &reply, &error);
+      bson_destroy (&reply);
+      if (ret) {
+         bulk_batch_size_observe (&merge_batch_size, *n_bytes, (bson_get_monotonic_time () - start) / 1000000.0);
+         *count += *n_docs;
+         if (last)
+            fprintf (stderr, PROGRESS_END_FORMAT, *n_docs, *count);
+         else if ((*count - *n_docs) / PROGRESS_SIZE < *count / PROGRESS_SIZE)
+            fputs (PROGRESS_SIZE_FORMAT, stderr);
+         fflush (stderr);
       }
-      if (*child_s != '[') {
-         relation = "one";
-         child_key = "_id";
+      else
+         fprintf (stderr, "%s bulk execute failure: %s\n", name, error.message);
+   }
+   mongoc_bulk_operation_destroy (*bulk);
+   *bulk = last ? NULL : mongoc_collection_create_bulk_operation (collection, false, NULL);
+   *n_docs = *n_bytes = 0;
+   return ret;
+}
+
+/*
+ * Hash join for "one" specs - a child collection that fits in
+ * hash_join_max_bytes is read once into memory keyed by its child key,
+ * then the parent collection is streamed once and each parent gets a
+ * $set of its child documents, no temp collections.  Dense int32 keys
+ * index a direct-address array, other integer keys an open-addressed
+ * hash.  Children with other key types fall back to the server path,
+ * as do children whose collStats size already exceeds the budget.
+ */
+
+typedef struct {
+   int64_t key;
+   uint32_t len;
+   size_t offset;
+} hash_join_entry_t;
+
+typedef struct {
+   const char *parent_key;
+   const char *child_key;
+   const char *fields;
+   uint8_t *data;
+   size_t len;
+   size_t size;
+   hash_join_entry_t *entries;
+   size_t n_entries;
+   size_t entries_size;
+   int64_t min_key;
+   int64_t max_key;
+   uint32_t *direct;
+   uint32_t *hash;
+   size_t mask;
+} hash_join_t;
+
+bool
+hash_join_key (const bson_iter_t *iter,
+               int64_t           *key)
+{
+   if (BSON_ITER_HOLDS_INT32 (iter))
+      *key = bson_iter_int32 (iter);
+   else if (BSON_ITER_HOLDS_INT64 (iter))
+      *key = bson_iter_int64 (iter);
+   else
+      return false;
+   return true;
+}
+
+size_t
+hash_join_slot (const hash_join_t *join,
+                int64_t            key)
+{
+   uint64_t h = (uint64_t)key * UINT64_C (0x9e3779b97f4a7c15);
+
+   return (size_t)(h ^ (h >> 32)) & join->mask;
+}
+
+/* entry index + 1 for key, 0 when the key is not in the child */
+uint32_t
+hash_join_find (const hash_join_t *join,
+                int64_t            key)
+{
+   size_t h;
+
+   if (join->direct)
+      return (key >= join->min_key && key <= join->max_key) ? join->direct[key - join->min_key] : 0;
+   for (h = hash_join_slot (join, key); join->hash[h] != 0; h = (h + 1) & join->mask) {
+      if (join->entries[join->hash[h] - 1].key == key)
+         return join->hash[h];
+   }
+   return 0;
+}
+
+void
+hash_join_index (hash_join_t *join)
+{
+   size_t i, h, size;
+
+   if (join->n_entries > 0 && join->min_key >= INT32_MIN && join->max_key <= INT32_MAX &&
+       (uint64_t)(join->max_key - join->min_key) < 2 * join->n_entries + 1024) {
+      join->direct = bson_malloc0 ((join->max_key - join->min_key + 1) * sizeof (uint32_t));
+      for (i = 0; i < join->n_entries; i++)
+         join->direct[join->entries[i].key - join->min_key] = i + 1;
+      return;
+   }
+   for (size = 16; size < 2 * join->n_entries + 2; size *= 2)
+      ;
+   join->hash = bson_malloc0 (size * sizeof (uint32_t));
+   join->mask = size - 1;
+   for (i = 0; i < join->n_entries; i++) {
+      for (h = hash_join_slot (join, join->entries[i].key); join->hash[h] != 0; h = (h + 1) & join->mask) {
+         if (join->entries[join->hash[h] - 1].key == join->entries[i].key)
+            break;
       }
-      else {
-         char *terminator;
+      if (join->hash[h] == 0)
+         join->hash[h] = i + 1;
+   }
+}
 
-         child_s += 1;
-         terminator = strchr (child_s, ']');
-         (terminator != NULL && *(terminator + 1) == '\0') || DIE;
-         *terminator = '\0';
-         relation = "many";
-         child_key = (char*)parent_name;
+/*
+ * false when the child does not fit in max_bytes or has a non-integer
+ * key, query limits the children loaded when not NULL
+ */
+bool
+hash_join_load (hash_join_t         *join,
+                mongoc_collection_t *child_coll,
+                const bson_t        *query,
+                size_t               max_bytes)
+{
+   bson_t all = BSON_INITIALIZER, projection;
+   mongoc_cursor_t *cursor;
+   const bson_t *doc;
+   bson_iter_t iter;
+   hash_join_entry_t *entry;
+   bson_error_t error;
+   int64_t key;
+   bool ret = true, projected;
+
+   projected = join->fields && merge_fields_projection (join->fields, join->child_key, &projection);
+   cursor = mongoc_collection_find (child_coll, MONGOC_QUERY_NONE, 0, 0, cursor_batch_size, query ? query : &all,
+                                    projected ? &projection : NULL, NULL);
+   while (ret && mongoc_cursor_next (cursor, &doc)) {
+      if (!bson_iter_init_find (&iter, doc, join->child_key))
+         continue;
+      if (!hash_join_key (&iter, &key) || join->len + doc->len > max_bytes) {
+         ret = false;
+         break;
       }
-      dot = strchr (child_s, '.');
-      if (dot != NULL) {
-         *dot = '\0';
-         child_key = dot + 1;
+      if (join->len + doc->len > join->size) {
+         join->size = BSON_MAX (join->len + doc->len, 2 * join->size);
+         join->data = bson_realloc (join->data, join->size);
       }
-      if (*child_s != '\0')
-         child_name = child_s;
-      /* check non-empty, legal chars */
-      BCON_APPEND (&bson_array, "0", "[", relation, parent_key, child_name, child_key, "]");
-      bson_free (s);
+      if (join->n_entries == join->entries_size) {
+         join->entries_size = BSON_MAX (1024, 2 * join->entries_size);
+         join->entries = bson_realloc (join->entries, join->entries_size * sizeof (hash_join_entry_t));
+      }
+      memcpy (join->data + join->len, bson_get_data (doc), doc->len);
+      entry = &join->entries[join->n_entries++];
+      entry->key = key;
+      entry->offset = join->len;
+      entry->len = doc->len;
+      join->len += doc->len;
+      join->min_key = join->n_entries == 1 ? key : BSON_MIN (join->min_key, key);
+      join->max_key = join->n_entries == 1 ? key : BSON_MAX (join->max_key, key);
    }
-   bson_append_array_end (bson, &bson_array);
-   return bson;
+   if (mongoc_cursor_error (cursor, &error)) {
+      fprintf (stderr, "hash_join_load failure: %s\n", error.message);
+      ret = false;
+   }
+   mongoc_cursor_destroy (cursor);
+   bson_destroy (&all);
+   if (projected)
+      bson_destroy (&projection);
+   if (ret)
+      hash_join_index (join);
+   return ret;
 }
 
 void
-one_children_append (const char          *parent_name,
-                     bson_iter_t         *iter_spec_top,
-                     mongoc_database_t   *db,
-                     mongoc_collection_t *parent_coll,
-                     mongoc_collection_t *temp_coll,
-                     bson_t              *all_accumulators)
+hash_join_destroy (hash_join_t *join)
 {
-   const char *temp_one_name;
-   mongoc_collection_t *child_coll, *temp_one_coll;
-   bson_t *one_accumulators, *one_projectors, *pipeline;
-   bson_iter_t iter_spec, iter;
+   bson_free (join->data);
+   bson_free (join->entries);
+   bson_free (join->direct);
+   bson_free (join->hash);
+}
+
+/* stream the parent once and $set the joined child documents */
+int64_t
+hash_join_update (mongoc_collection_t *parent_coll,
+                  hash_join_t         *joins,
+                  int                  n_joins)
+{
+   bson_t query = BSON_INITIALIZER, fields = BSON_INITIALIZER;
+   mongoc_cursor_t *cursor;
+   mongoc_bulk_operation_t *bulk;
+   const bson_t *doc;
+   bson_t q, set, u, child;
+   bson_iter_t iter, iter_key;
    bson_error_t error;
+   hash_join_entry_t *entry;
+   size_t n_docs = 0, n_bytes = 0;
+   int64_t count = 0, key;
+   uint32_t found;
+   bool ret = true;
+   int i;
 
-   temp_one_name = str_compose (parent_name, "_merge_temp_one");
-   temp_one_coll = mongoc_database_get_collection (db, temp_one_name);
+   for (i = 0; i < n_joins; i++)
+      BSON_APPEND_INT32 (&fields, joins[i].parent_key, 1);
+   cursor = mongoc_collection_find (parent_coll, MONGOC_QUERY_NONE, 0, 0, cursor_batch_size, &query, &fields, NULL);
+   bulk = mongoc_collection_create_bulk_operation (parent_coll, false, NULL);
+   bson_init (&q);
+   bson_init (&set);
+   bson_init (&u);
+   while (ret && mongoc_cursor_next (cursor, &doc)) {
+      for (i = 0; i < n_joins; i++) {
+         if (!bson_iter_init_find (&iter, doc, joins[i].parent_key))
+            continue;
+         /* an already merged parent holds the child document */
+         if (BSON_ITER_HOLDS_DOCUMENT (&iter) && bson_iter_recurse (&iter, &iter_key) &&
+             bson_iter_find (&iter_key, joins[i].child_key))
+            iter = iter_key;
+         if (!hash_join_key (&iter, &key) || (found = hash_join_find (&joins[i], key)) == 0)
+            continue;
+         entry = &joins[i].entries[found - 1];
+         bson_init_static (&child, joins[i].data + entry->offset, entry->len) || DIE;
+         BSON_APPEND_DOCUMENT (&set, joins[i].parent_key, &child);
+      }
+      if (bson_empty (&set))
+         continue;
+      bson_iter_init_find (&iter, doc, "_id") || DIE;
+      bson_append_iter (&q, NULL, -1, &iter);
+      BSON_APPEND_DOCUMENT (&u, "$set", &set);
+      if (bulk_batch_size_full (&merge_batch_size, n_bytes, n_docs, q.len + u.len))
+         ret = merge_bulk_flush (&bulk, parent_coll, &n_docs, &n_bytes, &count, "hash_join_update", false);
+      if (ret) {
+         mongoc_bulk_operation_update_one (bulk, &q, &u, false);
+         n_docs++;
+         n_bytes += q.len + u.len;
+      }
+      bson_reinit (&q);
+      bson_reinit (&set);
+      bson_reinit (&u);
+   }
+   if (!ret)
+      n_docs = 0;
+   ret = merge_bulk_flush (&bulk, parent_coll, &n_docs, &n_bytes, &count, "hash_join_update", true) && ret;
+   if (mongoc_cursor_error (cursor, &error)) {
+      fprintf (stderr, "hash_join_update failure: %s\n", error.message);
+      ret = false;
+   }
+   bson_destroy (&q);
+   bson_destroy (&set);
+   bson_destroy (&u);
+   bson_destroy (&query);
+   bson_destroy (&fields);
+   mongoc_cursor_destroy (cursor);
+   return ret ? count : -1;
+}
+
+/*
+ * hash join every "one" spec whose child fits, the parent keys done are
+ * appended to joined for one_children_append to skip
+ */
+void
+one_children_hash_join (const char          *parent_name,
+                        bson_iter_t         *iter_spec_top,
+                        mongoc_database_t   *db,
+                        mongoc_collection_t *parent_coll,
+                        bson_t              *joined)
+{
+   mongoc_collection_t *child_coll;
+   bson_iter_t iter_spec, iter;
+   hash_join_t *joins = NULL;
+   merge_stats_t stats;
+   size_t max_bytes = hash_join_max_bytes;
+   int n_joins = 0, i;
+   bool updated;
+
+   bson_iter_recurse (iter_spec_top, &iter_spec) || DIE;
+   while (max_bytes > 0 && bson_iter_next (&iter_spec)) {
+      const char *type, *parent_key, *child_name, *child_key;
+      hash_join_t *join;
+
+      BSON_ITER_HOLDS_ARRAY (&iter_spec) || DIE;
+      bson_iter_recurse (&iter_spec, &iter) || DIE;
+      type = bson_iter_next_utf8 (&iter, NULL);
+      if (strcmp ("one", type) != 0)
+         continue;
+      parent_key = bson_iter_next_utf8 (&iter, NULL);
+      child_name = bson_iter_next_utf8 (&iter, NULL);
+      child_key = bson_iter_next_utf8 (&iter, NULL);
+      /* a child larger than the budget is not streamed in just to be dropped */
+      merge_stats (db, child_name, &stats);
+      if (stats.bytes > (int64_t)max_bytes) {
+         fprintf (stderr, "info: parent: \"%s\", child \"%s\" left to the server, bytes: %"PRId64" over the %zu left\n",
+                  parent_name, child_name, stats.bytes, max_bytes);
+         fflush (stderr);
+         continue;
+      }
+      joins = bson_realloc (joins, (n_joins + 1) * sizeof (hash_join_t));
+      join = &joins[n_joins];
+      memset (join, 0, sizeof (hash_join_t));
+      join->parent_key = parent_key;
+      join->child_key = child_key;
+      join->fields = bson_iter_next_utf8 (&iter, NULL);
+      child_coll = mongoc_database_get_collection (db, child_name);
+      if (hash_join_load (join, child_coll, NULL, max_bytes)) {
+         fprintf (stderr, "info: parent: \"%s\", hash join: {parent_key: \"%s\", child_name: \"%s\", child_key: \"%s\", docs: %zu, bytes: %zu, index: \"%s\"}\n",
+                  parent_name, parent_key, child_name, child_key, join->n_entries, join->len, join->direct ? "direct" : "hash");
+         max_bytes -= join->len;
+         BSON_APPEND_BOOL (joined, parent_key, true);
+         n_joins++;
+      }
+      else {
+         fprintf (stderr, "info: parent: \"%s\", child \"%s\" left to the server, it does not fit or has non-integer keys\n",
+                  parent_name, child_name);
+         hash_join_destroy (join);
+      }
+      fflush (stderr);
+      mongoc_collection_destroy (child_coll);
+   }
+   if (n_joins > 0) {
+      fprintf (stderr, "info: hash join progress: ");
+      fflush (stderr);
+      updated = hash_join_update (parent_coll, joins, n_joins) >= 0;
+      fprintf (stderr, "\n");
+      if (!updated) {
+         fprintf (stderr, "WARNING: parent: \"%s\", hash join failed, its children go through the temp collection\n", parent_name);
+         bson_reinit (joined);
+      }
+      fflush (stderr);
+   }
+   for (i = 0; i < n_joins; i++)
+      hash_join_destroy (&joins[i]);
+   bson_free (joins);
+}
+
+/*
+ * Shadow rebuild - with --shadow, the grouped fields are not $set into
+ * the parent in place.  The parent is streamed in _id order alongside
+ * the group sorted by _id, and each merged document is written whole
+ * into a fresh <parent>_merged collection with unordered bulk inserts.
+ * The parent's indexes are then built on it, and it is renamed over the
+ * parent with dropTarget.  Parents with non-integer _ids are copied
+ * unmerged with a warning.
+ */
+
+/* doc with the fields of set replacing or following its own, as $set leaves it */
+void
+merge_set_doc (const bson_t *doc,
+               const bson_t *set,
+               bson_t       *out)
+{
+   bson_iter_t iter, iter_set;
+
+   bson_iter_init (&iter, doc) || DIE;
+   while (bson_iter_next (&iter)) {
+      if (bson_iter_init_find (&iter_set, set, bson_iter_key (&iter)))
+         bson_append_iter (out, NULL, -1, &iter_set);
+      else
+         bson_append_iter (out, NULL, -1, &iter);
+   }
+   bson_iter_init (&iter_set, set) || DIE;
+   while (bson_iter_next (&iter_set)) {
+      if (!bson_has_field (doc, bson_iter_key (&iter_set)))
+         bson_append_iter (out, NULL, -1, &iter_set);
+   }
+}
+
+/* the next grouped document with an integer _id, NULL at the end, the others counted in n_skipped */
+const bson_t *
+group_rebuild_next (mongoc_cursor_t *cursor,
+                    int64_t         *key,
+                    int64_t         *n_skipped)
+{
+   const bson_t *doc;
+   bson_iter_t iter;
+
+   while (mongoc_cursor_next (cursor, &doc)) {
+      if (bson_iter_init_find (&iter, doc, "_id") && hash_join_key (&iter, key))
+         return doc;
+      (*n_skipped)++;
+   }
+   return NULL;
+}
+
+int64_t
+group_and_rebuild (mongoc_collection_t *source_coll,
+                   mongoc_collection_t *parent_coll,
+                   mongoc_collection_t *shadow_coll,
+                   bson_t              *accumulators,
+                   const bson_t        *match)
+{
+   bson_t *options, *pipeline, *query;
+   mongoc_cursor_t *group_cursor, *cursor;
+   mongoc_bulk_operation_t *bulk;
+   const bson_t *doc, *group_doc;
+   bson_t set, out;
+   bson_iter_t iter, iter_ary;
+   bson_error_t error;
+   size_t n_docs = 0, n_bytes = 0;
+   int64_t count = 0, key, group_key = 0, n_skipped = 0, n_unmerged = 0;
+   bool ret = true;
+
+   options = merge_aggregate_options ();
+   if (match) {
+      pipeline = BCON_NEW ("pipeline", "[", "{", "$match", "{", "parent_id", BCON_DOCUMENT (match), "}", "}",
+                                            "{", "$group", "{", "_id", "$parent_id", BCON (accumulators), "}", "}",
+                                            "{", "$sort", "{", "_id", BCON_INT32 (1), "}", "}", "]");
+      query = BCON_NEW ("$query", "{", "_id", BCON_DOCUMENT (match), "}", "$orderby", "{", "_id", BCON_INT32 (1), "}");
+   }
+   else {
+      pipeline = BCON_NEW ("pipeline", "[", "{", "$group", "{", "_id", "$parent_id", BCON (accumulators), "}", "}",
+                                            "{", "$sort", "{", "_id", BCON_INT32 (1), "}", "}", "]");
+      query = BCON_NEW ("$query", "{", "}", "$orderby", "{", "_id", BCON_INT32 (1), "}");
+   }
+   group_cursor = mongoc_collection_aggregate (source_coll, MONGOC_QUERY_NONE, pipeline, options, NULL);
+   cursor = mongoc_collection_find (parent_coll, MONGOC_QUERY_NONE, 0, 0, cursor_batch_size, query, NULL, NULL);
+   bulk = mongoc_collection_create_bulk_operation (shadow_coll, false, NULL);
+   bson_init (&set);
+   bson_init (&out);
+   group_doc = group_rebuild_next (group_cursor, &group_key, &n_skipped);
+   while (ret && mongoc_cursor_next (cursor, &doc)) {
+      bson_iter_init_find (&iter, doc, "_id") || DIE;
+      if (!hash_join_key (&iter, &key))
+         n_unmerged++;
+      else {
+         /* groups without a parent are passed over */
+         while (group_doc && group_key < key)
+            group_doc = group_rebuild_next (group_cursor, &group_key, &n_skipped);
+         if (group_doc && group_key == key) {
+            bson_iter_init_find (&iter, group_doc, "_id") || DIE;
+            while (bson_iter_next (&iter)) {
+               if (BSON_ITER_HOLDS_NULL (&iter))
+                  continue;
+               if (BSON_ITER_HOLDS_ARRAY (&iter) && bson_iter_recurse (&iter, &iter_ary) && !bson_iter_next (&iter_ary))
+                  continue;
+               bson_append_iter (&set, NULL, -1, &iter);
+            }
+            merge_set_doc (doc, &set, &out);
+            doc = &out;
+            group_doc = group_rebuild_next (group_cursor, &group_key, &n_skipped);
+         }
+      }
+      if (bulk_batch_size_full (&merge_batch_size, n_bytes, n_docs, doc->len))
+         ret = merge_bulk_flush (&bulk, shadow_coll, &n_docs, &n_bytes, &count, "group_and_rebuild", false);
+      if (ret) {
+         mongoc_bulk_operation_insert (bulk, doc);
+         n_docs++;
+         n_bytes += doc->len;
+      }
+      bson_reinit (&set);
+      bson_reinit (&out);
+   }
+   if (!ret)
+      n_docs = 0;
+   ret = merge_bulk_flush (&bulk, shadow_coll, &n_docs, &n_bytes, &count, "group_and_rebuild", true) && ret;
+   if (mongoc_cursor_error (group_cursor, &error) || mongoc_cursor_error (cursor, &error)) {
+      fprintf (stderr, "group_and_rebuild failure: %s\n", error.message);
+      ret = false;
+   }
+   if (n_unmerged > 0)
+      fprintf (stderr, "WARNING: group_and_rebuild %"PRId64" parents with non-integer _ids copied unmerged\n", n_unmerged);
+   if (n_skipped > 0)
+      fprintf (stderr, "WARNING: group_and_rebuild %"PRId64" groups with non-integer parent_ids skipped\n", n_skipped);
+   bson_destroy (&set);
+   bson_destroy (&out);
+   bson_destroy (query);
+   bson_destroy (pipeline);
+   bson_destroy (options);
+   mongoc_cursor_destroy (cursor);
+   mongoc_cursor_destroy (group_cursor);
+   return ret ? count : -1;
+}
+
+/* parents whose _id is not a number, which no _id range of a partition matches, copied unmerged */
+int64_t
+shadow_copy_non_numeric (mongoc_collection_t *parent_coll,
+                         mongoc_collection_t *shadow_coll)
+{
+   bson_t *pipeline;
+   int64_t count;
+
+   pipeline = BCON_NEW ("pipeline", "[", "{", "$match", "{", "_id", "{", "$not", "{", "$type", "number", "}", "}", "}", "}", "]");
+   count = agg_copy (parent_coll, shadow_coll, pipeline);
+   bson_destroy (pipeline);
+   if (count > 0)
+      fprintf (stderr, "WARNING: group_and_rebuild %"PRId64" parents with non-numeric _ids copied unmerged\n", count);
+   return count;
+}
+
+/* build the parent's indexes on the shadow and rename it over the parent */
+bool
+shadow_rename (mongoc_database_t   *db,
+               mongoc_collection_t *parent_coll,
+               mongoc_collection_t *shadow_coll)
+{
+   bson_t *command, reply, indexes = BSON_INITIALIZER, index, ignore;
+   bson_iter_t iter, iter_batch, iter_index;
+   bson_error_t error;
+   const char *index_key;
+   char index_s[16];
+   uint32_t n = 0;
+   bool ret;
+
+   command = BCON_NEW ("listIndexes", BCON_UTF8 (mongoc_collection_get_name (parent_coll)));
+   ret = mongoc_database_command_simple (db, command, NULL, &reply, &error);
+   bson_destroy (command);
+   if (!ret || !bson_iter_init (&iter, &reply) || !bson_iter_find_descendant (&iter, "cursor.firstBatch", &iter_batch) ||
+       !bson_iter_recurse (&iter_batch, &iter)) {
+      fprintf (stderr, "ERROR: shadow_rename listIndexes on \"%s\": %s\n", mongoc_collection_get_name (parent_coll), ret ? "no cursor" : error.message);
+      bson_destroy (&reply);
+      bson_destroy (&indexes);
+      return false;
+   }
+   while (bson_iter_next (&iter)) {
+      bson_iter_recurse (&iter, &iter_index) || DIE;
+      bson_init (&index);
+      while (bson_iter_next (&iter_index)) {
+         if (strcmp (bson_iter_key (&iter_index), "ns") != 0 && strcmp (bson_iter_key (&iter_index), "v") != 0)
+            bson_append_iter (&index, NULL, -1, &iter_index);
+      }
+      if (!bson_iter_init_find (&iter_index, &index, "name") || strcmp (bson_iter_utf8 (&iter_index, NULL), "_id_") != 0) {
+         bson_uint32_to_string (n++, &index_key, index_s, sizeof index_s);
+         bson_append_document (&indexes, index_key, -1, &index);
+      }
+      bson_destroy (&index);
+   }
+   bson_destroy (&reply);
+   if (n > 0) {
+      fprintf (stderr, "info: shadow \"%s\" building %u indexes\n", mongoc_collection_get_name (shadow_coll), n);
+      fflush (stderr);
+      command = BCON_NEW ("createIndexes", BCON_UTF8 (mongoc_collection_get_name (shadow_coll)), "indexes", BCON_ARRAY (&indexes));
+      ret = mongoc_database_command_simple (db, command, NULL, &ignore, &error);
+      bson_destroy (&ignore);
+      bson_destroy (command);
+      if (!ret)
+         fprintf (stderr, "ERROR: shadow_rename createIndexes on \"%s\": %s\n", mongoc_collection_get_name (shadow_coll), error.message);
+   }
+   bson_destroy (&indexes);
+   if (ret && !(ret = mongoc_collection_rename (shadow_coll, mongoc_database_get_name (db), mongoc_collection_get_name (parent_coll), true, &error)))
+      fprintf (stderr, "ERROR: shadow_rename rename to \"%s\": %s\n", mongoc_collection_get_name (parent_coll), error.message);
+   return ret;
+}
+
+/*
+ * Range-partitioned group - with --partitions N, the parent_id space of
+ * the temp collection is split into N equal integer ranges between its
+ * min and max, the first and last left open, and each range is grouped
+ * and $set by its own thread on a client from merge_pool, so the server
+ * works on N aggregations and N bulk streams at once.  An index on
+ * parent_id keeps each $match to its range.  Non-integer parent ids are
+ * grouped in one stream.  With --shadow the _id ranges match only
+ * numeric parents, the others are copied unmerged after the ranges.
+ */
+
+typedef struct {
+   const char *source_name;
+   const char *dest_name;
+   const char *shadow_name;
+   bson_t *accumulators;
+   bson_t match;
+   int64_t count;
+   pthread_t thread;
+} group_partition_t;
+
+/* the first parent_id in order, false when there is none or it is not an integer */
+bool
+group_partition_bound (mongoc_collection_t *source_coll,
+                       int                  order,
+                       int64_t             *bound)
+{
+   mongoc_cursor_t *cursor;
+   const bson_t *doc;
+   bson_t *query, fields = BSON_INITIALIZER;
+   bson_iter_t iter;
+   bool ret = false;
+
+   query = BCON_NEW ("$query", "{", "}", "$orderby", "{", "parent_id", BCON_INT32 (order), "}");
+   BSON_APPEND_INT32 (&fields, "parent_id", 1);
+   cursor = mongoc_collection_find (source_coll, MONGOC_QUERY_NONE, 0, 1, 0, query, &fields, NULL);
+   if (mongoc_cursor_next (cursor, &doc) && bson_iter_init_find (&iter, doc, "parent_id"))
+      ret = hash_join_key (&iter, bound);
+   mongoc_cursor_destroy (cursor);
+   bson_destroy (&fields);
+   bson_destroy (query);
+   return ret;
+}
+
+/* a group of the parent_id range match, all when NULL, in place or into shadow_coll */
+int64_t
+group_range (mongoc_collection_t *source_coll,
+             mongoc_collection_t *dest_coll,
+             mongoc_collection_t *shadow_coll,
+             bson_t              *accumulators,
+             const bson_t        *match)
+{
+   if (shadow_coll)
+      return group_and_rebuild (source_coll, dest_coll, shadow_coll, accumulators, match);
+   return group_and_update (source_coll, dest_coll, accumulators, match, NULL);
+}
+
+void *
+group_partition_run (void *arg)
+{
+   group_partition_t *partition = arg;
+   mongoc_client_t *client;
+   mongoc_collection_t *source_coll, *dest_coll, *shadow_coll = NULL;
+
+   client = mongoc_client_pool_pop (merge_pool);
+   source_coll = mongoc_client_get_collection (client, merge_database_name, partition->source_name);
+   dest_coll = mongoc_client_get_collection (client, merge_database_name, partition->dest_name);
+   if (partition->shadow_name)
+      shadow_coll = mongoc_client_get_collection (client, merge_database_name, partition->shadow_name);
+   partition->count = group_range (source_coll, dest_coll, shadow_coll, partition->accumulators, &partition->match);
+   if (shadow_coll)
+      mongoc_collection_destroy (shadow_coll);
+   mongoc_collection_destroy (source_coll);
+   mongoc_collection_destroy (dest_coll);
+   mongoc_client_pool_push (merge_pool, client);
+   return NULL;
+}
+
+int64_t
+group_and_update_partitioned (mongoc_collection_t *source_coll,
+                              mongoc_collection_t *dest_coll,
+                              mongoc_collection_t *shadow_coll,
+                              bson_t              *accumulators)
+{
+   group_partition_t *partitions;
+   bson_t keys = BSON_INITIALIZER;
+   bson_error_t error;
+   int64_t min, max, step, count = 0, n_copied;
+   int n, i;
+
+   if (merge_partitions <= 1 || !merge_pool)
+      return group_range (source_coll, dest_coll, shadow_coll, accumulators, NULL);
+   BSON_APPEND_INT32 (&keys, "parent_id", 1);
+   if (!mongoc_collection_create_index (source_coll, &keys, NULL, &error))
+      fprintf (stderr, "WARNING: group index on \"%s.parent_id\" not created: %s\n", mongoc_collection_get_name (source_coll), error.message);
+   bson_destroy (&keys);
+   if (!group_partition_bound (source_coll, 1, &min) || !group_partition_bound (source_coll, -1, &max) ||
+       (n = (int)BSON_MIN ((int64_t)merge_partitions, max - min + 1)) < 2)
+      count = group_range (source_coll, dest_coll, shadow_coll, accumulators, NULL);
+   else {
+      merge_strategy_used (MERGE_STRATEGY_PARTITIONS);
+      step = (max - min) / n + 1;
+      partitions = bson_malloc0 (n * sizeof (group_partition_t));
+      for (i = 0; i < n; i++) {
+         partitions[i].source_name = mongoc_collection_get_name (source_coll);
+         partitions[i].dest_name = mongoc_collection_get_name (dest_coll);
+         partitions[i].shadow_name = shadow_coll ? mongoc_collection_get_name (shadow_coll) : NULL;
+         partitions[i].accumulators = accumulators;
+         bson_init (&partitions[i].match);
+         /* the outer ranges are open, a shadow rebuild copies parents without children too */
+         if (i > 0)
+            BSON_APPEND_INT64 (&partitions[i].match, "$gte", min + i * step);
+         if (i < n - 1)
+            BSON_APPEND_INT64 (&partitions[i].match, "$lt", min + (i + 1) * step);
+         pthread_create (&partitions[i].thread, NULL, group_partition_run, &partitions[i]) == 0 || DIE;
+      }
+      for (i = 0; i < n; i++) {
+         pthread_join (partitions[i].thread, NULL);
+         if (count >= 0)
+            count = partitions[i].count < 0 ? -1 : count + partitions[i].count;
+         bson_destroy (&partitions[i].match);
+      }
+      bson_free (partitions);
+      /* the rename over the parent would drop what no range copied */
+      if (shadow_coll && count >= 0 && (n_copied = shadow_copy_non_numeric (dest_coll, shadow_coll)) >= 0)
+         count += n_copied;
+      else if (shadow_coll)
+         count = -1;
+   }
+   /* a temp collection kept by a checkpoint does not keep the index */
+   if (!mongoc_collection_drop_index (source_coll, "parent_id_1", &error))
+      fprintf (stderr, "WARNING: group index on \"%s.parent_id\" not dropped: %s\n", mongoc_collection_get_name (source_coll), error.message);
+   return count;
+}
+
+/*
+ * Sort-merge join for "many" specs - the parent _ids are streamed in
+ * order along with each child sorted by its foreign key, backed by a
+ * {child_key: 1} index that is created if missing.  One merge pass
+ * assembles the child arrays of each parent and $sets them together,
+ * holding only one parent's children in memory, with no temp
+ * collection and no server $group.  Keys must be integers: a parent
+ * sampled with another _id goes through the temp collection, and the
+ * documents left over are counted and skipped with one WARNING.
+ */
+
+typedef struct {
+   const char *parent_key;
+   const char *child_name;
+   const char *child_key;
+   const char *fields;
+   mongoc_cursor_t *cursor;
+   const bson_t *doc;
+   int64_t key;
+   external_sort_t *sorted;
+   bson_t sorted_doc;
+   int64_t n_skipped;
+} sort_merge_child_t;
+
+/* the next child with an integer key, doc is NULL at the end */
+void
+sort_merge_child_next (sort_merge_child_t *child)
+{
+   bson_iter_t iter;
+
+   if (child->sorted) {
+      child->doc = external_sort_next (child->sorted, &child->key, &child->sorted_doc) ? &child->sorted_doc : NULL;
+      return;
+   }
+   while (mongoc_cursor_next (child->cursor, &child->doc)) {
+      if (bson_iter_init_find (&iter, child->doc, child->child_key) && hash_join_key (&iter, &child->key))
+         return;
+      child->n_skipped++;
+   }
+   child->doc = NULL;
+}
+
+/* one WARNING for the children passed over by sort_merge_child_next */
+void
+sort_merge_child_warn (const sort_merge_child_t *child,
+                       const char               *name)
+{
+   if (child->n_skipped > 0)
+      fprintf (stderr, "WARNING: %s %"PRId64" children of \"%s\" with non-integer \"%s\" skipped\n",
+               name, child->n_skipped, child->child_name, child->child_key);
+}
+
+/* parent_ids, when not NULL, is an array limiting the children to those parents */
+void
+sort_merge_child_open (sort_merge_child_t  *child,
+                       mongoc_database_t   *db,
+                       const bson_t        *parent_ids)
+{
+   mongoc_collection_t *child_coll;
+   bson_t keys = BSON_INITIALIZER, *query, projection;
+   bson_error_t error;
+   bool projected;
+
+   child_coll = mongoc_database_get_collection (db, child->child_name);
+   BSON_APPEND_INT32 (&keys, child->child_key, 1);
+   if (!mongoc_collection_create_index (child_coll, &keys, NULL, &error))
+      fprintf (stderr, "WARNING: sort merge index on \"%s.%s\" not created: %s\n", child->child_name, child->child_key, error.message);
+   if (parent_ids)
+      query = BCON_NEW ("$query", "{", child->child_key, "{", "$in", BCON_ARRAY (parent_ids), "}", "}",
+                        "$orderby", "{", child->child_key, BCON_INT32 (1), "}");
+   else
+      query = BCON_NEW ("$query", "{", child->child_key, "{", "$ne", BCON_NULL, "}", "}",
+                        "$orderby", "{", child->child_key, BCON_INT32 (1), "}");
+   projected = child->fields && merge_fields_projection (child->fields, child->child_key, &projection);
+   child->cursor = mongoc_collection_find (child_coll, MONGOC_QUERY_NONE, 0, 0, cursor_batch_size, query,
+                                           projected ? &projection : NULL, NULL);
+   if (projected)
+      bson_destroy (&projection);
+   bson_destroy (query);
+   bson_destroy (&keys);
+   mongoc_collection_destroy (child_coll);
+   sort_merge_child_next (child);
+}
+
+int64_t
+sort_merge_update (mongoc_collection_t *parent_coll,
+                   sort_merge_child_t  *children,
+                   int                  n_children)
+{
+   bson_t *query, fields = BSON_INITIALIZER;
+   mongoc_cursor_t *cursor;
+   mongoc_bulk_operation_t *bulk;
+   const bson_t *doc;
+   bson_t q, set, u, array;
+   bson_iter_t iter;
+   bson_error_t error;
+   size_t n_docs = 0, n_bytes = 0;
+   int64_t count = 0, key, n_skipped = 0;
+   uint32_t n;
+   const char *index_key;
+   char index_s[16];
+   bool ret = true;
+   int i;
+
+   query = BCON_NEW ("$query", "{", "}", "$orderby", "{", "_id", BCON_INT32 (1), "}");
+   BSON_APPEND_INT32 (&fields, "_id", 1);
+   cursor = mongoc_collection_find (parent_coll, MONGOC_QUERY_NONE, 0, 0, cursor_batch_size, query, &fields, NULL);
+   bulk = mongoc_collection_create_bulk_operation (parent_coll, false, NULL);
+   bson_init (&q);
+   bson_init (&set);
+   bson_init (&u);
+   while (ret && mongoc_cursor_next (cursor, &doc)) {
+      bson_iter_init_find (&iter, doc, "_id") || DIE;
+      if (!hash_join_key (&iter, &key)) {
+         n_skipped++;
+         continue;
+      }
+      for (i = 0; i < n_children; i++) {
+         sort_merge_child_t *child = &children[i];
+
+         /* children without a parent are passed over */
+         while (child->doc && child->key < key)
+            sort_merge_child_next (child);
+         if (!child->doc || child->key != key)
+            continue;
+         bson_append_array_begin (&set, child->parent_key, -1, &array);
+         for (n = 0; child->doc && child->key == key; n++) {
+            bson_uint32_to_string (n, &index_key, index_s, sizeof index_s);
+            bson_append_document (&array, index_key, -1, child->doc);
+            sort_merge_child_next (child);
+         }
+         bson_append_array_end (&set, &array);
+      }
+      if (bson_empty (&set))
+         continue;
+      bson_append_iter (&q, NULL, -1, &iter);
+      BSON_APPEND_DOCUMENT (&u, "$set", &set);
+      if (bulk_batch_size_full (&merge_batch_size, n_bytes, n_docs, q.len + u.len))
+         ret = merge_bulk_flush (&bulk, parent_coll, &n_docs, &n_bytes, &count, "sort_merge_update", false);
+      if (ret) {
+         mongoc_bulk_operation_update_one (bulk, &q, &u, false);
+         n_docs++;
+         n_bytes += q.len + u.len;
+      }
+      bson_reinit (&q);
+      bson_reinit (&set);
+      bson_reinit (&u);
+   }
+   if (!ret)
+      n_docs = 0;
+   ret = merge_bulk_flush (&bulk, parent_coll, &n_docs, &n_bytes, &count, "sort_merge_update", true) && ret;
+   if (mongoc_cursor_error (cursor, &error)) {
+      fprintf (stderr, "sort_merge_update failure: %s\n", error.message);
+      ret = false;
+   }
+   for (i = 0; i < n_children; i++) {
+      if (mongoc_cursor_error (children[i].cursor, &error)) {
+         fprintf (stderr, "sort_merge_update child \"%s\" failure: %s\n", children[i].child_name, error.message);
+         ret = false;
+      }
+      sort_merge_child_warn (&children[i], "sort_merge_update");
+   }
+   if (n_skipped > 0)
+      fprintf (stderr, "WARNING: sort_merge_update %"PRId64" parents with non-integer _ids skipped\n", n_skipped);
+   bson_destroy (&q);
+   bson_destroy (&set);
+   bson_destroy (&u);
+   bson_destroy (query);
+   bson_destroy (&fields);
+   mongoc_cursor_destroy (cursor);
+   return ret ? count : -1;
+}
+
+int64_t
+many_children_sort_merge (const char          *parent_name,
+                          bson_iter_t         *iter_spec_top,
+                          mongoc_database_t   *db,
+                          mongoc_collection_t *parent_coll)
+{
+   sort_merge_child_t *children = NULL;
+   bson_iter_t iter_spec, iter;
+   int64_t count = 0;
+   int n_children = 0, i;
+
+   bson_iter_recurse (iter_spec_top, &iter_spec) || DIE;
+   while (bson_iter_next (&iter_spec)) {
+      sort_merge_child_t *child;
+
+      BSON_ITER_HOLDS_ARRAY (&iter_spec) || DIE;
+      bson_iter_recurse (&iter_spec, &iter) || DIE;
+      if (strcmp ("many", bson_iter_next_utf8 (&iter, NULL)) != 0)
+         continue;
+      children = bson_realloc (children, (n_children + 1) * sizeof (sort_merge_child_t));
+      child = &children[n_children++];
+      memset (child, 0, sizeof (sort_merge_child_t));
+      child->parent_key = bson_iter_next_utf8 (&iter, NULL);
+      child->child_name = bson_iter_next_utf8 (&iter, NULL);
+      child->child_key = bson_iter_next_utf8 (&iter, NULL);
+      child->fields = bson_iter_next_utf8 (&iter, NULL);
+      fprintf (stderr, "info: parent: \"%s\", sort merge: {parent_key: \"%s\", child_name: \"%s\", child_key: \"%s\"}\n",
+               parent_name, child->parent_key, child->child_name, child->child_key);
+      fflush (stderr);
+      sort_merge_child_open (child, db, NULL);
+   }
+   if (n_children > 0) {
+      fprintf (stderr, "info: sort merge progress: ");
+      fflush (stderr);
+      count = sort_merge_update (parent_coll, children, n_children);
+      fprintf (stderr, "\n");
+      fflush (stderr);
+   }
+   for (i = 0; i < n_children; i++)
+      mongoc_cursor_destroy (children[i].cursor);
+   bson_free (children);
+   return count;
+}
+
+/*
+ * Server-side merge - on a server that can $merge into the collection
+ * being aggregated (4.4), the whole spec runs as one aggregation over
+ * the parent: a $lookup per child, stages that reshape the result as
+ * the temp collection path would, and a $merge that replaces each
+ * parent in place.  No document passes through the client.
+ */
+
+/* major * 100 + minor from buildInfo, 0 when it cannot be read */
+int
+server_version (mongoc_client_t *client)
+{
+   bson_t *command, reply;
+   bson_iter_t iter, iter_version;
+   bson_error_t error;
+   int version = 0;
+
+   command = BCON_NEW ("buildInfo", BCON_INT32 (1));
+   if (mongoc_client_command_simple (client, "admin", command, NULL, &reply, &error)) {
+      if (bson_iter_init_find (&iter, &reply, "versionArray") && bson_iter_recurse (&iter, &iter_version) &&
+          bson_iter_next (&iter_version) && BSON_ITER_HOLDS_INT32 (&iter_version)) {
+         version = 100 * bson_iter_int32 (&iter_version);
+         if (bson_iter_next (&iter_version) && BSON_ITER_HOLDS_INT32 (&iter_version))
+            version += bson_iter_int32 (&iter_version);
+      }
+   }
+   else
+      fprintf (stderr, "WARNING: buildInfo failure: %s\n", error.message);
+   bson_destroy (&reply);
+   bson_destroy (command);
+   return version;
+}
+
+/* the stage applying a field list to the looked-up array "as", NULL for whole children */
+bson_t *
+server_side_fields_stage (const char *as,
+                          const char *child_key,
+                          const char *fields)
+{
+   bson_t projection, in, array, *stage;
+   bson_iter_t iter;
+   const char *key;
+   char key_s[16], *value, *dollar_as;
+   uint32_t n = 0;
+
+   if (!merge_fields_projection (fields, child_key, &projection))
+      return NULL;
+   bson_iter_init (&iter, &projection) || DIE;
+   if (bson_iter_next (&iter) && bson_iter_int32 (&iter) == 1) {
+      /* an include list keeps _id as $project does */
+      bson_init (&in);
+      if (!bson_has_field (&projection, "_id"))
+         BSON_APPEND_UTF8 (&in, "_id", "$$this._id");
+      bson_iter_init (&iter, &projection) || DIE;
+      while (bson_iter_next (&iter)) {
+         value = bson_strdup_printf ("$$this.%s", bson_iter_key (&iter));
+         BSON_APPEND_UTF8 (&in, bson_iter_key (&iter), value);
+         bson_free (value);
+      }
+      dollar_as = str_compose ("$", as);
+      stage = BCON_NEW ("$addFields", "{", as, "{", "$map", "{", "input", BCON_UTF8 (dollar_as), "in", BCON_DOCUMENT (&in), "}", "}", "}");
+      bson_free (dollar_as);
+      bson_destroy (&in);
+   }
+   else {
+      bson_init (&array);
+      bson_iter_init (&iter, &projection) || DIE;
+      while (bson_iter_next (&iter)) {
+         bson_uint32_to_string (n++, &key, key_s, sizeof key_s);
+         value = bson_strdup_printf ("%s.%s", as, bson_iter_key (&iter));
+         bson_append_utf8 (&array, key, -1, value, -1);
+         bson_free (value);
+      }
+      stage = BCON_NEW ("$unset", BCON_ARRAY (&array));
+      bson_destroy (&array);
+   }
+   bson_destroy (&projection);
+   return stage;
+}
+
+/* {pipeline: [...]} for the spec, ending in a $merge into parent_name */
+bson_t *
+server_side_pipeline (const char  *parent_name,
+                      bson_iter_t *iter_spec_top)
+{
+   bson_t *bson, stages;
+   bson_iter_t iter_spec, iter;
+   uint32_t n_stages = 0;
+
+   bson = bson_new ();
+   bson_append_array_begin (bson, "pipeline", -1, &stages);
+   bson_iter_recurse (iter_spec_top, &iter_spec) || DIE;
+   while (bson_iter_next (&iter_spec)) {
+      const char *type, *parent_key, *child_name, *child_key, *fields;
+      char *temp_key, *dollar_temp_key, *dollar_parent_key, *dollar_parent_key_dot_child_key;
+      bson_t *stage;
+
+      BSON_ITER_HOLDS_ARRAY (&iter_spec) || DIE;
+      bson_iter_recurse (&iter_spec, &iter) || DIE;
+      type = bson_iter_next_utf8 (&iter, NULL);
+      parent_key = bson_iter_next_utf8 (&iter, NULL);
+      child_name = bson_iter_next_utf8 (&iter, NULL);
+      child_key = bson_iter_next_utf8 (&iter, NULL);
+      fields = bson_iter_next_utf8 (&iter, NULL);
+      dollar_parent_key = str_compose ("$", parent_key);
+      if (strcmp ("one", type) == 0) {
+         /* the id, or the child's id when the parent is already merged */
+         temp_key = str_compose ("_merge_", parent_key);
+         dollar_temp_key = str_compose ("$", temp_key);
+         dollar_parent_key_dot_child_key = bson_strdup_printf ("$%s.%s", parent_key, child_key);
+         pipeline_stage_append (&stages, &n_stages, BCON_NEW (
+            "$addFields", "{", temp_key, "{", "$ifNull", "[", dollar_parent_key_dot_child_key, dollar_parent_key, "]", "}", "}"));
+         pipeline_stage_append (&stages, &n_stages, BCON_NEW (
+            "$lookup", "{", "from", BCON_UTF8 (child_name), "localField", BCON_UTF8 (temp_key),
+                            "foreignField", BCON_UTF8 (child_key), "as", BCON_UTF8 (temp_key), "}"));
+         if ((stage = server_side_fields_stage (temp_key, child_key, fields)) != NULL)
+            pipeline_stage_append (&stages, &n_stages, stage);
+         pipeline_stage_append (&stages, &n_stages, BCON_NEW (
+            "$addFields", "{", parent_key, "{", "$ifNull", "[", "{", "$arrayElemAt", "[", dollar_temp_key, BCON_INT32 (0), "]", "}",
+                                                                dollar_parent_key, "]", "}", "}"));
+         pipeline_stage_append (&stages, &n_stages, BCON_NEW ("$unset", BCON_UTF8 (temp_key)));
+         bson_free (dollar_parent_key_dot_child_key);
+         bson_free (dollar_temp_key);
+         bson_free (temp_key);
+      }
+      else {
+         /* empty arrays are left out as group_and_update does */
+         pipeline_stage_append (&stages, &n_stages, BCON_NEW (
+            "$lookup", "{", "from", BCON_UTF8 (child_name), "localField", "_id",
+                            "foreignField", BCON_UTF8 (child_key), "as", BCON_UTF8 (parent_key), "}"));
+         if ((stage = server_side_fields_stage (parent_key, child_key, fields)) != NULL)
+            pipeline_stage_append (&stages, &n_stages, stage);
+         pipeline_stage_append (&stages, &n_stages, BCON_NEW (
+            "$addFields", "{", parent_key, "{", "$cond", "[", "{", "$eq", "[", "{", "$size", dollar_parent_key, "}", BCON_INT32 (0), "]", "}",
+                                                             "$$REMOVE", dollar_parent_key, "]", "}", "}"));
+      }
+      bson_free (dollar_parent_key);
+   }
+   pipeline_stage_append (&stages, &n_stages, BCON_NEW (
+      "$merge", "{", "into", BCON_UTF8 (parent_name), "on", "_id", "whenMatched", "replace", "whenNotMatched", "discard", "}"));
+   bson_append_array_end (bson, &stages);
+   return bson;
+}
+
+bool
+server_side_merge (const char          *parent_name,
+                   bson_iter_t         *iter_spec_top,
+                   mongoc_collection_t *parent_coll)
+{
+   bson_t *options, *pipeline;
+   mongoc_cursor_t *cursor;
+   const bson_t *doc;
+   bson_error_t error;
+   bool ret = true;
+
+   pipeline = server_side_pipeline (parent_name, iter_spec_top);
+   bson_printf ("info: server-side pipeline: %s\n", pipeline);
+   options = merge_aggregate_options ();
+   cursor = mongoc_collection_aggregate (parent_coll, MONGOC_QUERY_NONE, pipeline, options, NULL);
+   while (mongoc_cursor_next (cursor, &doc))
+      ;
+   if (mongoc_cursor_error (cursor, &error)) {
+      fprintf (stderr, "server_side_merge failure: %s\n", error.message);
+      ret = false;
+   }
+   mongoc_cursor_destroy (cursor);
+   bson_destroy (options);
+   bson_destroy (pipeline);
+   return ret;
+}
+
+/* where the optional field list of a spec starts - after the "]" of a "many" child, in the name of a "one" */
+const char *
+merge_spec_fields (const char *spec)
+{
+   const char *child_s, *end;
+
+   child_s = (child_s = strchr (spec, ':')) != NULL ? child_s + 1 : spec;
+   if (*child_s == '[')
+      return (end = strchr (child_s, ']')) != NULL ? end + 1 : child_s + strlen (child_s);
+   return (end = strpbrk (child_s, "+-")) != NULL ? end : child_s + strlen (child_s);
+}
+
+/* false, with an error, when a field list mixes "+" and "-" */
+bool
+merge_spec_check (int    merge_spec_count,
+                  char **merge_spec)
+{
+   const char *fields;
+   int i;
+
+   for (i = 0; i < merge_spec_count; i++) {
+      fields = merge_spec_fields (merge_spec[i]);
+      if (*fields != '\0' && strchr (fields, *fields == '+' ? '-' : '+') != NULL) {
+         fprintf (stderr, "ERROR: merge spec \"%s\": field list \"%s\" mixes + and -, use one or the other\n", merge_spec[i], fields);
+         return false;
+      }
+   }
+   return true;
+}
+
+bson_t *
+expand_spec (const char *parent_name,
+             int         merge_spec_count,
+             char      **merge_spec)
+{
+   bson_t *bson, bson_array;
+   int i;
+
+   bson = bson_new ();
+   bson_append_array_begin (bson, "merge_spec", -1, &bson_array);
+   for (i = 0; i < merge_spec_count; i++) {
+      char *s, *relation, *parent_key, *child_s, *child_name, *child_key, *colon, *dot, *sign, *fields = NULL;
+
+      s = bson_malloc (strlen (merge_spec[i]) + 1);
+      strcpy (s, merge_spec[i]);
+      /* an optional trailing field list, "+a+b" or "-a-b" */
+      sign = s + (merge_spec_fields (merge_spec[i]) - merge_spec[i]);
+      (*sign == '\0' || *sign == '+' || *sign == '-') || DIE;
+      if (*sign != '\0') {
+         fields = bson_strdup (sign);
+         *sign = '\0';
+      }
+      parent_key = child_name = child_s = s;
+      colon = strchr (s, ':');
+      if (colon != NULL) {
+         *colon = '\0';
+         child_s = colon + 1;
+      }
+      if (*child_s != '[') {
+         relation = "one";
+         child_key = "_id";
+      }
+      else {
+         char *terminator;
+
+         child_s += 1;
+         terminator = strchr (child_s, ']');
+         (terminator != NULL && *(terminator + 1) == '\0') || DIE;
+         *terminator = '\0';
+         relation = "many";
+         child_key = (char*)parent_name;
+      }
+      dot = strchr (child_s, '.');
+      if (dot != NULL) {
+         *dot = '\0';
+         child_key = dot + 1;
+      }
+      if (*child_s != '\0')
+         child_name = child_s;
+      /* check non-empty, legal chars */
+      BCON_APPEND (&bson_array, "0", "[", relation, parent_key, child_name, child_key, fields ? fields : "", "]");
+      bson_free (fields);
+      bson_free (s);
+   }
+   bson_append_array_end (bson, &bson_array);
+   return bson;
+}
+
+/* false when a copy failed; a phase done by a checkpoint only adds its accumulators */
+bool
+one_children_append (const char          *parent_name,
+                     bson_iter_t         *iter_spec_top,
+                     mongoc_database_t   *db,
+                     mongoc_collection_t *parent_coll,
+                     mongoc_collection_t *temp_coll,
+                     bson_t              *all_accumulators,
+                     const bson_t        *joined,
+                     merge_checkpoint_t  *checkpoint)
+{
+   const char *temp_one_name;
+   mongoc_collection_t *child_coll, *temp_one_coll;
+   bson_t *one_accumulators, *one_projectors, *pipeline;
+   bson_iter_t iter_spec, iter, iter_joined;
+   bson_error_t error;
+   int n_one = 0;
+   bool skip, ret = true;
+
+   bson_iter_recurse (iter_spec_top, &iter_spec) || DIE;
+   while (bson_iter_next (&iter_spec)) {
+      bson_iter_recurse (&iter_spec, &iter) || DIE;
+      if (strcmp ("one", bson_iter_next_utf8 (&iter, NULL)) == 0 &&
+          !bson_iter_init_find (&iter_joined, joined, bson_iter_next_utf8 (&iter, NULL)))
+         n_one++;
+   }
+   if (n_one == 0)
+      return true;
+
+   skip = merge_checkpoint_done (checkpoint, "one");
+   temp_one_name = str_compose (parent_name, "_merge_temp_one");
+   temp_one_coll = mongoc_database_get_collection (db, temp_one_name);
    mongoc_collection_drop (temp_one_coll, &error);
    bson_free ((void*)temp_one_name);
 
-   one_accumulators = bson_new ();
-   one_projectors = bson_new ();
+   one_accumulators = bson_new ();
+   one_projectors = bson_new ();
+
+   bson_iter_recurse (iter_spec_top, &iter_spec) || DIE;
+   while (bson_iter_next (&iter_spec)) {
+      const char *type, *parent_key, *child_name, *child_key, *fields, *dollar_parent_key;
+
+      BSON_ITER_HOLDS_ARRAY (&iter_spec) || DIE;
+      bson_iter_recurse (&iter_spec, &iter) || DIE;
+      type = bson_iter_next_utf8 (&iter, NULL);
+      if (strcmp ("one", type) != 0)
+         continue;
+      parent_key = bson_iter_next_utf8 (&iter, NULL);
+      if (bson_iter_init_find (&iter_joined, joined, parent_key))
+         continue;
+      child_name = bson_iter_next_utf8 (&iter, NULL);
+      child_key = bson_iter_next_utf8 (&iter, NULL);
+      fields = bson_iter_next_utf8 (&iter, NULL);
+      fprintf (stderr, "info: parent: \"%s\", child spec: {type: \"%s\", parent_key: \"%s\", child_name: \"%s\", child_key: \"%s\"}\ninfo: child progress: ",
+              parent_name, type, parent_key, child_name, child_key);
+      fflush (stderr);
+      if (!skip) {
+         child_coll = mongoc_database_get_collection (db, child_name);
+         pipeline = child_by_merge_key (parent_key, child_name, child_key, fields);
+         ret = agg_copy (child_coll, temp_one_coll, pipeline) >= 0 && ret;
+         bson_destroy (pipeline);
+         fprintf (stderr, "\ninfo: parent progress: ");
+         fflush (stderr);
+         pipeline = parent_child_merge_key (parent_key, child_name, child_key);
+         ret = agg_copy (parent_coll, temp_one_coll, pipeline) >= 0 && ret;
+         bson_destroy (pipeline);
+         mongoc_collection_destroy (child_coll);
+      }
+      else
+         fprintf (stderr, "done by checkpoint");
+      dollar_parent_key = str_compose ("$", parent_key);
+      BCON_APPEND (all_accumulators, parent_key, "{", "$max", dollar_parent_key, "}");
+      BCON_APPEND (one_accumulators, parent_key, "{", "$max", dollar_parent_key, "}");
+      BCON_APPEND (one_projectors, parent_key, dollar_parent_key);
+      bson_free ((void*)dollar_parent_key);
+      fprintf (stderr, "\n");
+      fflush (stderr);
+   }
+   if (ret && !skip) {
+      fprintf (stderr, "info: merge_one_all progress: ", parent_name);
+      fflush (stderr);
+      pipeline = merge_one_all (one_accumulators, one_projectors);
+      ret = agg_copy (temp_one_coll, temp_coll, pipeline) >= 0;
+      bson_destroy (pipeline);
+      fprintf (stderr, "\n");
+      fflush (stderr);
+   }
+   bson_destroy (one_accumulators);
+   bson_destroy (one_projectors);
+   mongoc_collection_drop (temp_one_coll, &error);
+   mongoc_collection_destroy (temp_one_coll);
+   return ret;
+}
+
+/* false when a copy failed, each child is a checkpoint phase "many.<parent_key>" */
+bool
+many_children_append (const char         *parent_name,
+                     bson_iter_t         *iter_spec_top,
+                     mongoc_database_t   *db,
+                     mongoc_collection_t *temp_coll,
+                     bson_t              *all_accumulators,
+                     merge_checkpoint_t  *checkpoint)
+{
+   mongoc_collection_t *child_coll;
+   bson_iter_t iter_spec, iter;
+   bson_t *pipeline, *partial;
+   bson_error_t error;
+   char *phase;
+   bool ret = true;
+
+   bson_iter_recurse (iter_spec_top, &iter_spec) || DIE;
+   while (bson_iter_next (&iter_spec)) {
+      const char *type, *parent_key, *child_name, *child_key, *fields, *dollar_parent_key;
+
+      BSON_ITER_HOLDS_ARRAY (&iter_spec) || DIE;
+      bson_iter_recurse (&iter_spec, &iter) || DIE;
+      type = bson_iter_next_utf8 (&iter, NULL);
+      if (strcmp ("many", type) != 0)
+         continue;
+      parent_key = bson_iter_next_utf8 (&iter, NULL);
+      child_name = bson_iter_next_utf8 (&iter, NULL);
+      child_key = bson_iter_next_utf8 (&iter, NULL);
+      fields = bson_iter_next_utf8 (&iter, NULL);
+      fprintf (stderr, "info: parent: \"%s\", child spec: {type: \"%s\", parent_key: \"%s\", child_name: \"%s\", child_key: \"%s\"}\ninfo: child progress: ",
+              parent_name, type, parent_key, child_name, child_key);
+      fflush (stderr);
+      phase = bson_strdup_printf ("many.%s", parent_key);
+      if (merge_checkpoint_done (checkpoint, phase))
+         fprintf (stderr, "done by checkpoint");
+      else if (ret) {
+         /* what an interrupted copy left in the temp collection */
+         if (checkpoint && checkpoint->saved) {
+            partial = BCON_NEW (parent_key, "{", "$exists", BCON_BOOL (true), "}");
+            mongoc_collection_remove (temp_coll, MONGOC_REMOVE_NONE, partial, NULL, &error);
+            bson_destroy (partial);
+         }
+         child_coll = mongoc_database_get_collection (db, child_name);
+         pipeline = copy_many_with_parent_id (parent_key, child_name, child_key, fields);
+         ret = agg_copy (child_coll, temp_coll, pipeline) >= 0;
+         bson_destroy (pipeline);
+         mongoc_collection_destroy (child_coll);
+         if (ret)
+            merge_checkpoint_mark (checkpoint, phase);
+      }
+      bson_free (phase);
+      dollar_parent_key = str_compose ("$", parent_key);
+      BCON_APPEND (all_accumulators, parent_key, "{", "$push", dollar_parent_key, "}");
+      bson_free ((void*)dollar_parent_key);
+      fprintf (stderr, "\n");
+      fflush (stderr);
+   }
+   return ret;
+}
+
+/*
+ * Cost-based planner - with --join=plan, each spec edge gets the
+ * strategy with the fewest estimated bytes read and written, from the
+ * collStats count and average document size of the parent and the
+ * child, whether the child key is indexed, and whether the keys are
+ * integers.  A "one" child that fits hash_join_max_bytes is hash
+ * joined, a "many" child is sort-merged, either can be $lookup'd on a
+ * server that can $merge when the child key is indexed, and the rest go
+ * through the temp collection.  --explain prints the plan and stops.
+ */
+
+#define MERGE_EDGE_MASK(edge) (1 << (edge))
+/* an _id or key with the document around it in an id stream or a temp row */
+#define PLAN_KEY_BYTES 32
+#define PLAN_MB(bytes) ((bytes) / (1024.0 * 1024.0))
+
+const char *merge_edge_names[] = {"temp", "hash_join", "sort_merge", "server"};
+
+void
+merge_stats (mongoc_database_t *db,
+             const char        *name,
+             merge_stats_t     *stats)
+{
+   bson_t *command, reply;
+   bson_iter_t iter;
+   bson_error_t error;
+
+   memset (stats, 0, sizeof (merge_stats_t));
+   command = BCON_NEW ("collStats", BCON_UTF8 (name));
+   if (mongoc_database_command_simple (db, command, NULL, &reply, &error)) {
+      if (bson_iter_init_find (&iter, &reply, "count"))
+         stats->count = bson_iter_as_int64 (&iter);
+      if (bson_iter_init_find (&iter, &reply, "size"))
+         stats->bytes = bson_iter_as_int64 (&iter);
+      if (bson_iter_init_find (&iter, &reply, "avgObjSize"))
+         stats->avg = bson_iter_as_int64 (&iter);
+   }
+   else
+      fprintf (stderr, "WARNING: collStats on \"%s\": %s\n", name, error.message);
+   if (stats->avg == 0 && stats->count > 0)
+      stats->avg = stats->bytes / stats->count;
+   bson_destroy (&reply);
+   bson_destroy (command);
+}
+
+/* true when an index on name leads with key */
+bool
+merge_indexed (mongoc_database_t *db,
+               const char        *name,
+               const char        *key)
+{
+   bson_t *command, reply;
+   bson_iter_t iter, iter_batch, iter_index, iter_key;
+   bson_error_t error;
+   bool ret = false;
+
+   if (strcmp (key, "_id") == 0)
+      return true;
+   command = BCON_NEW ("listIndexes", BCON_UTF8 (name));
+   if (mongoc_database_command_simple (db, command, NULL, &reply, &error) && bson_iter_init (&iter, &reply) &&
+       bson_iter_find_descendant (&iter, "cursor.firstBatch", &iter_batch) && bson_iter_recurse (&iter_batch, &iter)) {
+      while (!ret && bson_iter_next (&iter)) {
+         if (bson_iter_recurse (&iter, &iter_index) && bson_iter_find (&iter_index, "key") &&
+             bson_iter_recurse (&iter_index, &iter_key) && bson_iter_next (&iter_key))
+            ret = strcmp (bson_iter_key (&iter_key), key) == 0;
+      }
+   }
+   bson_destroy (&reply);
+   bson_destroy (command);
+   return ret;
+}
+
+/* true when a sampled key of name is an integer, as the hash and sort-merge joins need */
+bool
+merge_integer_key (mongoc_database_t *db,
+                   const char        *name,
+                   const char        *key)
+{
+   mongoc_collection_t *coll;
+   mongoc_cursor_t *cursor;
+   const bson_t *doc;
+   bson_t *query, fields = BSON_INITIALIZER;
+   bson_iter_t iter;
+   int64_t value;
+   bool ret = false;
+
+   coll = mongoc_database_get_collection (db, name);
+   query = BCON_NEW (key, "{", "$ne", BCON_NULL, "}");
+   BSON_APPEND_INT32 (&fields, key, 1);
+   cursor = mongoc_collection_find (coll, MONGOC_QUERY_NONE, 0, 1, 0, query, &fields, NULL);
+   if (mongoc_cursor_next (cursor, &doc) && bson_iter_init_find (&iter, doc, key))
+      ret = hash_join_key (&iter, &value);
+   mongoc_cursor_destroy (cursor);
+   bson_destroy (&fields);
+   bson_destroy (query);
+   mongoc_collection_destroy (coll);
+   return ret;
+}
+
+void
+merge_plan_consider (merge_plan_t *plan,
+                     merge_edge_t  edge,
+                     int64_t       moved,
+                     int64_t       memory)
+{
+   if (moved < plan->moved) {
+      plan->edge = edge;
+      plan->moved = moved;
+      plan->memory = memory;
+   }
+}
+
+/*
+ * the cheapest strategy for one edge - bytes moved counts each read and
+ * write, client or server side, and memory is what the client holds
+ */
+void
+merge_plan_edge (const char          *type,
+                 const merge_stats_t *parent,
+                 const merge_stats_t *child,
+                 bool                 indexed,
+                 bool                 integer_keys,
+                 bool                 server,
+                 size_t               hash_bytes,
+                 merge_plan_t        *plan)
+{
+   int64_t looked_up;
+
+   if (strcmp ("one", type) == 0) {
+      /* the child and the parent keys into temp_one, merge_one_all, then the group */
+      plan->edge = MERGE_EDGE_TEMP;
+      plan->moved = 2 * child->bytes + 2 * parent->count * PLAN_KEY_BYTES + 3 * parent->count * child->avg;
+      plan->memory = 0;
+      if (integer_keys && child->bytes <= (int64_t)hash_bytes)
+         merge_plan_consider (plan, MERGE_EDGE_HASH_JOIN, child->bytes + parent->count * (PLAN_KEY_BYTES + child->avg), child->bytes);
+      looked_up = parent->count * child->avg;
+   }
+   else {
+      /* copied into the temp collection, then grouped and $set */
+      plan->edge = MERGE_EDGE_TEMP;
+      plan->moved = 4 * child->bytes + parent->count * PLAN_KEY_BYTES;
+      plan->memory = 0;
+      if (integer_keys)
+         merge_plan_consider (plan, MERGE_EDGE_SORT_MERGE, (indexed ? 2 : 3) * child->bytes + parent->count * PLAN_KEY_BYTES,
+                              BSON_MAX (child->avg, child->bytes / BSON_MAX (parent->count, 1)));
+      looked_up = child->bytes;
+   }
+   /* the parent read and replaced whole by $merge, with what it looked up */
+   if (server && indexed)
+      merge_plan_consider (plan, MERGE_EDGE_SERVER, 2 * parent->bytes + 2 * looked_up, 0);
+}
+
+/* plans each spec of iter_spec_top into plans, in spec order, printed to stdout for --explain */
+void
+merge_plan (mongoc_client_t   *client,
+            mongoc_database_t *db,
+            const char        *parent_name,
+            bson_iter_t       *iter_spec_top,
+            merge_plan_t      *plans)
+{
+   merge_stats_t parent, child;
+   bson_iter_t iter_spec, iter;
+   size_t hash_bytes = hash_join_max_bytes;
+   int64_t moved = 0, memory = 0;
+   int version, i = 0;
+   bool parent_integer;
+
+   version = server_version (client);
+   merge_stats (db, parent_name, &parent);
+   parent_integer = merge_integer_key (db, parent_name, "_id");
+   if (explain_merge)
+      printf ("plan: \"%s\" docs: %"PRId64", avg bytes: %"PRId64", server: %d.%d\n",
+              parent_name, parent.count, parent.avg, version / 100, version % 100);
+   bson_iter_recurse (iter_spec_top, &iter_spec) || DIE;
+   while (bson_iter_next (&iter_spec)) {
+      const char *type, *parent_key, *child_name, *child_key;
+      merge_plan_t *plan = &plans[i++];
+      bool indexed, would_build, integer_keys;
+
+      BSON_ITER_HOLDS_ARRAY (&iter_spec) || DIE;
+      bson_iter_recurse (&iter_spec, &iter) || DIE;
+      type = bson_iter_next_utf8 (&iter, NULL);
+      parent_key = bson_iter_next_utf8 (&iter, NULL);
+      child_name = bson_iter_next_utf8 (&iter, NULL);
+      child_key = bson_iter_next_utf8 (&iter, NULL);
+      merge_stats (db, child_name, &child);
+      /* merge_indexes_build has run unless --explain, which plans the index it would build */
+      indexed = merge_indexed (db, child_name, child_key);
+      would_build = !indexed && explain_merge && merge_indexes;
+      integer_keys = merge_integer_key (db, child_name, child_key) && (strcmp ("one", type) == 0 || parent_integer);
+      merge_plan_edge (type, &parent, &child, indexed || would_build, integer_keys, version >= SERVER_SIDE_MIN_VERSION, hash_bytes, plan);
+      if (plan->edge == MERGE_EDGE_HASH_JOIN)
+         hash_bytes -= plan->memory;
+      moved += plan->moved;
+      memory += plan->memory;
+      if (explain_merge)
+         printf ("  %-4s %s:%s.%s - %s, docs: %"PRId64", avg bytes: %"PRId64", index: %s, moved: %.1f MB, memory: %.1f MB\n",
+                 type, parent_key, child_name, child_key, merge_edge_names[plan->edge], child.count, child.avg,
+                 indexed ? "yes" : would_build ? "would build" : "no", PLAN_MB (plan->moved), PLAN_MB (plan->memory));
+   }
+   if (explain_merge) {
+      printf ("  total moved: %.1f MB, memory: %.1f MB\n", PLAN_MB (moved), PLAN_MB (memory));
+      fflush (stdout);
+   }
+}
+
+/* the plan of the other --join options: hash join what fits, many by merge_join when the parent _ids are integers */
+void
+merge_plan_fixed (bson_iter_t  *iter_spec_top,
+                  bool          parent_integer,
+                  merge_plan_t *plans)
+{
+   bson_iter_t iter_spec, iter;
+   int i = 0;
+
+   bson_iter_recurse (iter_spec_top, &iter_spec) || DIE;
+   while (bson_iter_next (&iter_spec)) {
+      BSON_ITER_HOLDS_ARRAY (&iter_spec) || DIE;
+      bson_iter_recurse (&iter_spec, &iter) || DIE;
+      memset (&plans[i], 0, sizeof (merge_plan_t));
+      if (strcmp ("one", bson_iter_next_utf8 (&iter, NULL)) == 0)
+         plans[i].edge = MERGE_EDGE_HASH_JOIN;
+      else
+         plans[i].edge = merge_join == MERGE_JOIN_SORTMERGE && parent_integer ? MERGE_EDGE_SORT_MERGE : MERGE_EDGE_TEMP;
+      i++;
+   }
+}
+
+/* the specs whose edge is in mask, as {merge_spec: [...]} like expand_spec */
+bson_t *
+merge_plan_spec (bson_iter_t        *iter_spec_top,
+                 const merge_plan_t *plans,
+                 int                 mask,
+                 int                *n_specs)
+{
+   bson_t *bson, bson_array;
+   bson_iter_t iter_spec;
+   const char *key;
+   char key_s[16];
+   int i = 0;
+
+   *n_specs = 0;
+   bson = bson_new ();
+   bson_append_array_begin (bson, "merge_spec", -1, &bson_array);
+   bson_iter_recurse (iter_spec_top, &iter_spec) || DIE;
+   while (bson_iter_next (&iter_spec)) {
+      if (mask & MERGE_EDGE_MASK (plans[i++].edge)) {
+         bson_uint32_to_string ((*n_specs)++, &key, key_s, sizeof key_s);
+         bson_append_iter (&bson_array, key, -1, &iter_spec);
+      }
+   }
+   bson_append_array_end (bson, &bson_array);
+   return bson;
+}
+
+int64_t
+merge_parent (mongoc_client_t *client,
+              const char      *database_name,
+              const char      *parent_name,
+              int              merge_spec_count,
+              char           **merge_spec)
+{
+   int64_t count;
+   mongoc_database_t *db;
+   const char *temp_name, *shadow_name;
+   mongoc_collection_t *parent_coll, *temp_coll, *shadow_coll;
+   bson_t *bson_spec, *all_accumulators, *joined, *spec_server, *spec_hash, *spec_sort, *spec_temp;
+   bson_iter_t iter_spec_top, iter, iter_joined, iter_server, iter_hash, iter_sort, iter_temp;
+   bson_error_t error;
+   merge_checkpoint_t checkpoint_s, *checkpoint = NULL;
+   merge_plan_t *plans;
+   char *specs, *s;
+   bool server_side_done = false, resumed = false, grouped, ok = true;
+   int version, i, n_server, n_sort, n_specs;
+
+   db = mongoc_client_get_database (client, database_name);
+   parent_coll = mongoc_database_get_collection (db, parent_name);
+
+   bson_spec = expand_spec (parent_name, merge_spec_count, merge_spec);
+   bson_iter_init_find (&iter_spec_top, bson_spec, "merge_spec") || DIE;
+   BSON_ITER_HOLDS_ARRAY (&iter_spec_top) || DIE;
+   plans = bson_malloc (BSON_MAX (merge_spec_count, 1) * sizeof (merge_plan_t));
+   if (merge_join == MERGE_JOIN_PLAN)
+      merge_plan (client, db, parent_name, &iter_spec_top, plans);
+   else
+      merge_plan_fixed (&iter_spec_top, merge_join != MERGE_JOIN_SORTMERGE || merge_integer_key (db, parent_name, "_id"), plans);
+   if (explain_merge) {
+      bson_free (plans);
+      bson_destroy (bson_spec);
+      mongoc_collection_destroy (parent_coll);
+      mongoc_database_destroy (db);
+      return 0;
+   }
+
+   if (checkpoint_merge) {
+      specs = bson_strdup ("");
+      for (i = 0; i < merge_spec_count; i++) {
+         s = bson_strdup_printf ("%s%s%s", specs, i > 0 ? " " : "", merge_spec[i]);
+         bson_free (specs);
+         specs = s;
+      }
+      checkpoint = &checkpoint_s;
+      if ((resumed = merge_checkpoint_open (checkpoint, db, parent_name, specs))) {
+         fprintf (stderr, "info: merge \"%s\" resumed from collection \"merge_checkpoint\"\n", parent_name);
+         fflush (stderr);
+      }
+      bson_free (specs);
+   }
+
+   temp_name = str_compose (parent_name, "_merge_temp");
+   temp_coll = mongoc_database_get_collection (db, temp_name);
+   /* the "one" phase writes first, the temp collection is kept once it is done */
+   if (!resumed || !merge_checkpoint_done (checkpoint, "one"))
+      mongoc_collection_drop (temp_coll, &error);
+   bson_free ((void*)temp_name);
+
+   /* a hash join that does not load falls back to the temp collection */
+   spec_server = merge_plan_spec (&iter_spec_top, plans, MERGE_EDGE_MASK (MERGE_EDGE_SERVER), &n_server);
+   spec_hash = merge_plan_spec (&iter_spec_top, plans, MERGE_EDGE_MASK (MERGE_EDGE_HASH_JOIN), &n_specs);
+   spec_sort = merge_plan_spec (&iter_spec_top, plans, MERGE_EDGE_MASK (MERGE_EDGE_SORT_MERGE), &n_sort);
+   spec_temp = merge_plan_spec (&iter_spec_top, plans, MERGE_EDGE_MASK (MERGE_EDGE_HASH_JOIN) | MERGE_EDGE_MASK (MERGE_EDGE_TEMP), &n_specs);
+   (bson_iter_init_find (&iter_server, spec_server, "merge_spec") && bson_iter_init_find (&iter_hash, spec_hash, "merge_spec") &&
+    bson_iter_init_find (&iter_sort, spec_sort, "merge_spec") && bson_iter_init_find (&iter_temp, spec_temp, "merge_spec")) || DIE;
+   all_accumulators = bson_new ();
+   joined = bson_new ();
+
+   if (server_side) {
+      version = server_version (client);
+      if (version >= SERVER_SIDE_MIN_VERSION)
+         server_side_done = server_side_merge (parent_name, &iter_spec_top, parent_coll);
+      else
+         fprintf (stderr, "info: server version %d.%d cannot $merge into the aggregated collection, merging through the client\n",
+                  version / 100, version % 100);
+   }
+   if (server_side_done) {
+      merge_strategy_used (MERGE_STRATEGY_SERVER);
+      count = mongoc_collection_count (parent_coll, MONGOC_QUERY_NONE, NULL, 0, 0, NULL, &error);
+   }
+   else {
+      if (n_server > 0 && !merge_checkpoint_done (checkpoint, "server")) {
+         ok = server_side_merge (parent_name, &iter_server, parent_coll);
+         if (ok) {
+            merge_strategy_used (MERGE_STRATEGY_SERVER);
+            merge_checkpoint_mark (checkpoint, "server");
+         }
+      }
+
+      if (ok && merge_checkpoint_done (checkpoint, "hash_join")) {
+         if (bson_iter_init_find (&iter, checkpoint->saved, "joined") && BSON_ITER_HOLDS_DOCUMENT (&iter) &&
+             bson_iter_recurse (&iter, &iter_joined)) {
+            while (bson_iter_next (&iter_joined))
+               bson_append_iter (joined, NULL, -1, &iter_joined);
+         }
+      }
+      else if (ok) {
+         one_children_hash_join (parent_name, &iter_hash, db, parent_coll, joined);
+         if (!bson_empty (joined))
+            merge_strategy_used (MERGE_STRATEGY_HASH_JOIN);
+         if (checkpoint)
+            merge_checkpoint_update (checkpoint, BCON_NEW ("$set", "{", "joined", BCON_DOCUMENT (joined), "}",
+                                                           "$addToSet", "{", "done", "hash_join", "}"));
+      }
+
+      if (ok)
+         ok = one_children_append (parent_name, &iter_temp, db, parent_coll, temp_coll, all_accumulators, joined, checkpoint);
+      if (ok)
+         merge_checkpoint_mark (checkpoint, "one");
+
+      if (ok && n_sort > 0 && !merge_checkpoint_done (checkpoint, "sort_merge")) {
+         ok = many_children_sort_merge (parent_name, &iter_sort, db, parent_coll) >= 0;
+         if (ok) {
+            merge_strategy_used (MERGE_STRATEGY_SORT_MERGE);
+            merge_checkpoint_mark (checkpoint, "sort_merge");
+         }
+      }
+      if (ok)
+         ok = many_children_append (parent_name, &iter_temp, db, temp_coll, all_accumulators, checkpoint);
+      grouped = ok && mongoc_collection_count (temp_coll, MONGOC_QUERY_NONE, NULL, 0, 1, NULL, &error) > 0;
+      if (grouped)
+         merge_strategy_used (MERGE_STRATEGY_TEMP);
+
+      if (!ok) {
+         fprintf (stderr, "info: merge \"%s\" stopped before the group, a child copy failed\n", parent_name);
+         count = -1;
+      }
+      else if (shadow_rebuild && grouped) {
+         fprintf (stderr, "info: group progress: ");
+         fflush (stderr);
+         shadow_name = str_compose (parent_name, "_merged");
+         shadow_coll = mongoc_database_get_collection (db, shadow_name);
+         mongoc_collection_drop (shadow_coll, &error);
+         bson_free ((void*)shadow_name);
+         count = group_and_update_partitioned (temp_coll, parent_coll, shadow_coll, all_accumulators);
+         if (count >= 0 && !shadow_rename (db, parent_coll, shadow_coll))
+            count = -1;
+         else if (count >= 0)
+            merge_strategy_used (MERGE_STRATEGY_SHADOW);
+         if (count < 0)
+            mongoc_collection_drop (shadow_coll, &error);
+         mongoc_collection_destroy (shadow_coll);
+      }
+      else {
+         fprintf (stderr, "info: group progress: ");
+         fflush (stderr);
+         if (merge_partitions > 1)
+            count = group_and_update_partitioned (temp_coll, parent_coll, NULL, all_accumulators);
+         else
+            count = group_and_update (temp_coll, parent_coll, all_accumulators, NULL, checkpoint);
+      }
+      fprintf (stderr, "\n");
+      fflush (stderr);
+   }
+
+   bson_destroy (all_accumulators);
+   bson_destroy (joined);
+   bson_destroy (spec_server);
+   bson_destroy (spec_hash);
+   bson_destroy (spec_sort);
+   bson_destroy (spec_temp);
+   bson_destroy (bson_spec);
+   bson_free (plans);
+   /* a failed merge with a checkpoint keeps its temp collection for the rerun */
+   if (checkpoint)
+      merge_checkpoint_close (checkpoint, count >= 0);
+   if (!checkpoint || count >= 0)
+      mongoc_collection_drop (temp_coll, &error);
+   mongoc_collection_destroy (temp_coll);
+   mongoc_collection_destroy (parent_coll);
+   mongoc_database_destroy (db);
+
+   return count;
+}
+
+/*
+ * Supporting indexes - before merging, the {child_key: 1} index of each
+ * "many" spec, and of each "one" spec not keyed by _id, is built, all
+ * of them at once on MERGE_INDEX_THREADS clients from their own pool.
+ * Existing indexes are left as they are.  The sort-merge join and the
+ * server $lookup then scan the children in key order, and the planner
+ * counts the keys as indexed.
+ */
+
+#define MERGE_INDEX_THREADS 4
+
+typedef struct {
+   char **names;
+   char **keys;
+   int n;
+   int next;
+   mongoc_client_pool_t *pool;
+   const char *database_name;
+   pthread_mutex_t mutex;
+} merge_indexes_t;
+
+/* add the child keys of an expand_spec result, each collection and key once */
+void
+merge_indexes_add (merge_indexes_t *indexes,
+                   const bson_t    *bson_spec)
+{
+   bson_iter_t iter_spec_top, iter_spec, iter;
+   int i;
+
+   bson_iter_init_find (&iter_spec_top, bson_spec, "merge_spec") || DIE;
+   bson_iter_recurse (&iter_spec_top, &iter_spec) || DIE;
+   while (bson_iter_next (&iter_spec)) {
+      const char *child_name, *child_key;
+
+      bson_iter_recurse (&iter_spec, &iter) || DIE;
+      bson_iter_next_utf8 (&iter, NULL);
+      bson_iter_next_utf8 (&iter, NULL);
+      child_name = bson_iter_next_utf8 (&iter, NULL);
+      child_key = bson_iter_next_utf8 (&iter, NULL);
+      if (strcmp (child_key, "_id") == 0)
+         continue;
+      for (i = 0; i < indexes->n && (strcmp (indexes->names[i], child_name) != 0 || strcmp (indexes->keys[i], child_key) != 0); i++)
+         ;
+      if (i < indexes->n)
+         continue;
+      indexes->names = bson_realloc (indexes->names, (indexes->n + 1) * sizeof (char*));
+      indexes->keys = bson_realloc (indexes->keys, (indexes->n + 1) * sizeof (char*));
+      indexes->names[indexes->n] = bson_strdup (child_name);
+      indexes->keys[indexes->n++] = bson_strdup (child_key);
+   }
+}
+
+void *
+merge_indexes_run (void *arg)
+{
+   merge_indexes_t *indexes = arg;
+   mongoc_client_t *client;
+   mongoc_collection_t *coll;
+   bson_t keys;
+   bson_error_t error;
+   int64_t start;
+   int i;
+
+   client = mongoc_client_pool_pop (indexes->pool);
+   for (;;) {
+      pthread_mutex_lock (&indexes->mutex);
+      i = indexes->next++;
+      pthread_mutex_unlock (&indexes->mutex);
+      if (i >= indexes->n)
+         break;
+      start = bson_get_monotonic_time ();
+      coll = mongoc_client_get_collection (client, indexes->database_name, indexes->names[i]);
+      bson_init (&keys);
+      BSON_APPEND_INT32 (&keys, indexes->keys[i], 1);
+      if (mongoc_collection_create_index (coll, &keys, NULL, &error))
+         fprintf (stderr, "info: index \"%s.%s\" ready, %.2f sec\n", indexes->names[i], indexes->keys[i],
+                  (bson_get_monotonic_time () - start) / 1000000.0);
+      else
+         fprintf (stderr, "WARNING: index on \"%s.%s\" not created: %s\n", indexes->names[i], indexes->keys[i], error.message);
+      fflush (stderr);
+      bson_destroy (&keys);
+      mongoc_collection_destroy (coll);
+   }
+   mongoc_client_pool_push (indexes->pool, client);
+   return NULL;
+}
+
+/* build the indexes added, then free them */
+void
+merge_indexes_build (merge_indexes_t    *indexes,
+                     const mongoc_uri_t *uri,
+                     const char         *database_name)
+{
+   pthread_t threads[MERGE_INDEX_THREADS];
+   int n_threads, i;
+
+   n_threads = BSON_MIN (indexes->n, MERGE_INDEX_THREADS);
+   if (n_threads > 0) {
+      fprintf (stderr, "info: building %d child key indexes\n", indexes->n);
+      fflush (stderr);
+      indexes->pool = mongoc_client_pool_new (uri);
+      indexes->database_name = database_name;
+      indexes->next = 0;
+      pthread_mutex_init (&indexes->mutex, NULL);
+      for (i = 0; i < n_threads; i++)
+         pthread_create (&threads[i], NULL, merge_indexes_run, indexes) == 0 || DIE;
+      for (i = 0; i < n_threads; i++)
+         pthread_join (threads[i], NULL);
+      pthread_mutex_destroy (&indexes->mutex);
+      mongoc_client_pool_destroy (indexes->pool);
+   }
+   for (i = 0; i < indexes->n; i++) {
+      bson_free (indexes->names[i]);
+      bson_free (indexes->keys[i]);
+   }
+   bson_free (indexes->names);
+   bson_free (indexes->keys);
+   memset (indexes, 0, sizeof (merge_indexes_t));
+}
+
+int64_t
+execute (const char *parent_name,
+         int         merge_spec_count,
+         char      **merge_spec)
+{
+   int64_t count;
+   const char *uristr = "mongodb://localhost/test";
+   const char *database_name;
+   mongoc_uri_t *uri;
+   mongoc_client_t *client;
+   merge_indexes_t indexes;
+   bson_t *bson_spec;
+
+   if (!merge_spec_check (merge_spec_count, merge_spec))
+      return -1;
+   uristr = getenv ("MONGODB_URI");
+   uri = mongoc_uri_new (uristr);
+   client = mongoc_client_new (uristr);
+   database_name = mongoc_uri_get_database (uri);
+   if (merge_indexes && !explain_merge) {
+      memset (&indexes, 0, sizeof indexes);
+      bson_spec = expand_spec (parent_name, merge_spec_count, merge_spec);
+      merge_indexes_add (&indexes, bson_spec);
+      bson_destroy (bson_spec);
+      merge_indexes_build (&indexes, uri, database_name);
+   }
+   bulk_batch_size_init (&merge_batch_size, bulk_batch_bytes, bulk_max_message_size (client), bulk_auto_tune && merge_partitions <= 1);
+   if (bulk_writers > 0 || merge_partitions > 1) {
+      merge_pool = mongoc_client_pool_new (uri);
+      merge_database_name = database_name;
+   }
+
+   merge_strategies = 0;
+   count = merge_parent (client, database_name, parent_name, merge_spec_count, merge_spec);
+   if (!explain_merge)
+      merge_strategies_print ();
+
+   mongoc_client_destroy (client);
+   if (merge_pool) {
+      mongoc_client_pool_destroy (merge_pool);
+      merge_pool = NULL;
+   }
+   mongoc_uri_destroy (uri);
+
+   return count;
+}
+
+/*
+ * Spec scheduler - with --spec, the whole merge_spec_flat.json runs in
+ * one process.  Entries are grouped by parent into merge nodes; a node
+ * depends on every child that is itself a parent, and is ready when
+ * those are done.  N threads take ready nodes and merge each on a client
+ * from one pool.  Completion is stamped {merged: parent} in the merged
+ * collection as rake merge does, stamped parents are skipped, and
+ * entries stamped "parent.key" by mbdump_to_mongo --merge-spec are left
+ * out.
+ */
+
+/* _ids re-merged by an incremental run */
+typedef struct {
+   int64_t *ids;
+   size_t n_ids;
+   size_t size;
+} merge_ids_t;
+
+typedef struct {
+   char *parent_name;
+   char **merge_spec;
+   char **child_names;
+   int merge_spec_count;
+   int n_deps;
+   bool absorbed;
+   const char *referrer; /* the parent an absorbed node is fused into */
+   bool failed;
+   merge_ids_t remerged;
+   bool remerged_all;
+} merge_node_t;
+
+typedef struct {
+   merge_node_t *nodes;
+   int n_nodes;
+   int *ready;
+   int n_ready;
+   int n_running;
+   int n_done;
+   mongoc_client_pool_t *pool;
+   const char *database_name;
+   int64_t count;
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+} merge_scheduler_t;
+
+merge_node_t *
+merge_node_find (merge_scheduler_t *scheduler,
+                 const char        *parent_name)
+{
+   int i;
+
+   for (i = 0; i < scheduler->n_nodes; i++) {
+      if (strcmp (scheduler->nodes[i].parent_name, parent_name) == 0)
+         return &scheduler->nodes[i];
+   }
+   return NULL;
+}
+
+/* ["1"|"n", "parent.key", "child.key"] to the mongomerge argument form */
+void
+merge_node_add (merge_scheduler_t *scheduler,
+                const char        *type,
+                const char        *parent,
+                const char        *child,
+                const char        *fields)
+{
+   merge_node_t *node;
+   char *parent_name, *parent_key, *child_name, *child_key;
+
+   parent_name = bson_strdup (parent);
+   (parent_key = strchr (parent_name, '.')) || DIE;
+   *parent_key++ = '\0';
+   child_name = bson_strdup (child);
+   (child_key = strchr (child_name, '.')) || DIE;
+   *child_key++ = '\0';
+   node = merge_node_find (scheduler, parent_name);
+   if (!node) {
+      scheduler->nodes = bson_realloc (scheduler->nodes, (scheduler->n_nodes + 1) * sizeof (merge_node_t));
+      node = &scheduler->nodes[scheduler->n_nodes++];
+      memset (node, 0, sizeof (merge_node_t));
+      node->parent_name = bson_strdup (parent_name);
+   }
+   node->merge_spec = bson_realloc (node->merge_spec, (node->merge_spec_count + 1) * sizeof (char*));
+   node->child_names = bson_realloc (node->child_names, (node->merge_spec_count + 1) * sizeof (char*));
+   node->merge_spec[node->merge_spec_count] = strcmp (type, "1") == 0 ?
+      bson_strdup_printf ("%s:%s.%s%s", parent_key, child_name, child_key, fields) :
+      bson_strdup_printf ("%s:[%s.%s]%s", parent_key, child_name, child_key, fields);
+   node->child_names[node->merge_spec_count++] = bson_strdup (child_name);
+   bson_free (parent_name);
+   bson_free (child_name);
+}
+
+bool
+merge_scheduler_read (merge_scheduler_t *scheduler,
+                      const char        *spec_file)
+{
+   bson_t bson_spec = BSON_INITIALIZER;
+   bson_iter_t iter_entry, iter;
+   bson_error_t error;
+   char *json;
+   const char *type, *parent, *child, *fields;
+   FILE *fp;
+   long len;
+   int i, j;
+
+   if ((fp = fopen (spec_file, "r")) == NULL) {
+      fprintf (stderr, "ERROR: spec file \"%s\": %s\n", spec_file, strerror (errno));
+      return false;
+   }
+   fseek (fp, 0, SEEK_END);
+   len = ftell (fp);
+   fseek (fp, 0, SEEK_SET);
+   json = bson_malloc (len + 16);
+   strcpy (json, "{\"spec\":");
+   len = fread (json + 8, 1, len, fp) + 8;
+   fclose (fp);
+   strcpy (json + len, "}");
+   if (!bson_init_from_json (&bson_spec, json, len + 1, &error)) {
+      fprintf (stderr, "ERROR: spec file \"%s\": %s\n", spec_file, error.message);
+      bson_free (json);
+      return false;
+   }
+   bson_free (json);
+   bson_iter_init_find (&iter_entry, &bson_spec, "spec") || DIE;
+   bson_iter_recurse (&iter_entry, &iter_entry) || DIE;
+   while (bson_iter_next (&iter_entry)) {
+      bson_iter_recurse (&iter_entry, &iter) || DIE;
+      type = bson_iter_next_utf8 (&iter, NULL);
+      parent = bson_iter_next_utf8 (&iter, NULL);
+      child = bson_iter_next_utf8 (&iter, NULL);
+      /* an optional field list, "+a+b" or "-a-b" */
+      fields = bson_iter_next (&iter) && BSON_ITER_HOLDS_UTF8 (&iter) ? bson_iter_utf8 (&iter, NULL) : "";
+      merge_node_add (scheduler, type, parent, child, fields);
+   }
+   bson_destroy (&bson_spec);
+   for (i = 0; i < scheduler->n_nodes; i++) {
+      merge_node_t *node = &scheduler->nodes[i];
+
+      if (!merge_spec_check (node->merge_spec_count, node->merge_spec))
+         return false;
+      for (j = 0; j < node->merge_spec_count; j++) {
+         if (merge_node_find (scheduler, node->child_names[j]) && strcmp (node->child_names[j], node->parent_name) != 0)
+            node->n_deps++;
+      }
+   }
+   /* a parent that is only ever the "many" child of one other parent */
+   for (i = 0; i < scheduler->n_nodes; i++) {
+      merge_node_t *node = &scheduler->nodes[i], *referrer = NULL;
+      int n_refs = 0, k;
+
+      for (j = 0; j < scheduler->n_nodes; j++) {
+         for (k = 0; k < scheduler->nodes[j].merge_spec_count; k++) {
+            if (strcmp (scheduler->nodes[j].child_names[k], node->parent_name) == 0) {
+               n_refs += strstr (scheduler->nodes[j].merge_spec[k], ":[") ? 1 : 2;
+               referrer = &scheduler->nodes[j];
+            }
+         }
+      }
+      node->absorbed = n_refs == 1 && referrer != node;
+      node->referrer = node->absorbed ? referrer->parent_name : NULL;
+   }
+   return true;
+}
+
+/* true when merged holds {merged: stamp} */
+bool
+merge_stamped (mongoc_collection_t *merged,
+               const char          *stamp)
+{
+   bson_t *query;
+   bson_error_t error;
+   int64_t n;
+
+   query = BCON_NEW ("merged", BCON_UTF8 (stamp));
+   n = mongoc_collection_count (merged, MONGOC_QUERY_NONE, query, 0, 1, NULL, &error);
+   bson_destroy (query);
+   return n > 0;
+}
+
+#define STAMP_NO_MARK (-1)
+#define STAMP_NONE (-2)
+
+/* the last_updated mark of stamp, STAMP_NO_MARK when it has none, STAMP_NONE when not stamped */
+int64_t
+merge_stamp_mark (mongoc_collection_t *merged,
+                  const char          *stamp)
+{
+   mongoc_cursor_t *cursor;
+   const bson_t *doc;
+   bson_t *query;
+   bson_iter_t iter;
+   int64_t mark = STAMP_NONE;
+
+   query = BCON_NEW ("merged", BCON_UTF8 (stamp));
+   cursor = mongoc_collection_find (merged, MONGOC_QUERY_NONE, 0, 1, 0, query, NULL, NULL);
+   if (mongoc_cursor_next (cursor, &doc))
+      mark = bson_iter_init_find (&iter, doc, "last_updated") && BSON_ITER_HOLDS_DATE_TIME (&iter) ? bson_iter_date_time (&iter) : STAMP_NO_MARK;
+   mongoc_cursor_destroy (cursor);
+   bson_destroy (query);
+   return mark;
+}
+
+/*
+ * Fused merge - with --fused, a parent that is the "many" child of
+ * exactly one other parent and of nothing else is merged inside that
+ * parent's pass, e.g. release_group <- release <- medium.  The levels
+ * run bottom-up: each streams its collection by _id, hash joins its
+ * "one" children, sort merges its "many" children, $sets each of its
+ * documents once and feeds the merged documents to an external sort on
+ * the key of the level above, which reads that sort as an ordinary
+ * child stream.  No level is read back from the server after it is
+ * merged.  A tree whose "one" children do not fit in
+ * hash_join_max_bytes is merged level by level as before.
+ */
+
+#define FUSED_NOT_FUSABLE (-2)
+
+typedef struct _fused_level_t fused_level_t;
+
+struct _fused_level_t {
+   const char *name;
+   const char *parent_fk;
+   bson_t *bson_spec;
+   hash_join_t *ones;
+   int n_ones;
+   sort_merge_child_t *manys;
+   fused_level_t **levels;
+   int n_manys;
+   external_sort_t *sorted;
+};
+
+/* the specs of node not stamped "parent.key" by mbdump_to_mongo --merge-spec */
+char **
+merge_node_pending (merge_node_t        *node,
+                    mongoc_collection_t *merged,
+                    int                 *n_pending)
+{
+   char **pending, *stamp, *colon;
+   int i;
+
+   pending = bson_malloc (node->merge_spec_count * sizeof (char*));
+   *n_pending = 0;
+   for (i = 0; i < node->merge_spec_count; i++) {
+      colon = strchr (node->merge_spec[i], ':');
+      stamp = bson_strdup_printf ("%s.%.*s", node->parent_name, (int)(colon - node->merge_spec[i]), node->merge_spec[i]);
+      if (!merge_stamped (merged, stamp))
+         pending[(*n_pending)++] = node->merge_spec[i];
+      bson_free (stamp);
+   }
+   return pending;
+}
+
+/* mark, unless STAMP_NO_MARK, is the last_updated high-water mark for --incremental */
+void
+merge_node_stamp (mongoc_collection_t *merged,
+                  const char          *stamp,
+                  int64_t              mark)
+{
+   bson_t *doc, *update;
+   bson_error_t error;
+
+   /* upserted, a parent merged in full again keeps one stamp */
+   doc = BCON_NEW ("merged", BCON_UTF8 (stamp));
+   if (mark >= 0)
+      update = BCON_NEW ("$set", "{", "last_updated", BCON_DATE_TIME (mark), "}");
+   else
+      update = BCON_NEW ("$unset", "{", "last_updated", BCON_UTF8 (""), "}");
+   if (!mongoc_collection_update (merged, MONGOC_UPDATE_UPSERT, doc, update, NULL, &error))
+      fprintf (stderr, "WARNING: merged stamp \"%s\" not updated: %s\n", stamp, error.message);
+   bson_destroy (update);
+   bson_destroy (doc);
+}
+
+/* the absorbed, not yet merged node behind spec j of node, or NULL */
+merge_node_t *
+merge_node_absorbed_child (merge_scheduler_t   *scheduler,
+                           merge_node_t        *node,
+                           int                  j,
+                           mongoc_collection_t *merged)
+{
+   merge_node_t *child;
+
+   if (!strstr (node->merge_spec[j], ":["))
+      return NULL;
+   child = merge_node_find (scheduler, node->child_names[j]);
+   return child && child->absorbed && !merge_stamped (merged, child->parent_name) ? child : NULL;
+}
+
+void
+fused_level_destroy (fused_level_t *level)
+{
+   int i;
+
+   for (i = 0; i < level->n_ones; i++)
+      hash_join_destroy (&level->ones[i]);
+   for (i = 0; i < level->n_manys; i++) {
+      if (level->manys[i].cursor)
+         mongoc_cursor_destroy (level->manys[i].cursor);
+      if (level->levels[i])
+         fused_level_destroy (level->levels[i]);
+   }
+   if (level->sorted)
+      external_sort_destroy (level->sorted);
+   bson_free (level->ones);
+   bson_free (level->manys);
+   bson_free (level->levels);
+   bson_destroy (level->bson_spec);
+   bson_free (level);
+}
+
+/* the level tree under node, NULL when a "one" child does not fit in budget */
+fused_level_t *
+fused_level_new (merge_scheduler_t   *scheduler,
+                 merge_node_t        *node,
+                 const char          *parent_fk,
+                 mongoc_database_t   *db,
+                 mongoc_collection_t *merged,
+                 size_t              *budget)
+{
+   fused_level_t *level;
+   mongoc_collection_t *child_coll;
+   merge_node_t *child_node;
+   merge_stats_t stats;
+   bson_iter_t iter_spec_top, iter_spec, iter;
+   char **pending;
+   int n_pending, j;
+   bool ok = true;
+
+   level = bson_malloc0 (sizeof (fused_level_t));
+   level->name = node->parent_name;
+   level->parent_fk = parent_fk;
+   pending = merge_node_pending (node, merged, &n_pending);
+   level->bson_spec = expand_spec (node->parent_name, n_pending, pending);
+   bson_free (pending);
+   level->ones = bson_malloc0 (n_pending * sizeof (hash_join_t) + 1);
+   level->manys = bson_malloc0 (n_pending * sizeof (sort_merge_child_t) + 1);
+   level->levels = bson_malloc0 (n_pending * sizeof (fused_level_t*) + 1);
+   bson_iter_init_find (&iter_spec_top, level->bson_spec, "merge_spec") || DIE;
+   bson_iter_recurse (&iter_spec_top, &iter_spec) || DIE;
+   while (ok && bson_iter_next (&iter_spec)) {
+      const char *type, *parent_key, *child_name, *child_key, *fields;
+
+      bson_iter_recurse (&iter_spec, &iter) || DIE;
+      type = bson_iter_next_utf8 (&iter, NULL);
+      parent_key = bson_iter_next_utf8 (&iter, NULL);
+      child_name = bson_iter_next_utf8 (&iter, NULL);
+      child_key = bson_iter_next_utf8 (&iter, NULL);
+      fields = bson_iter_next_utf8 (&iter, NULL);
+      if (strcmp ("one", type) == 0) {
+         hash_join_t *join = &level->ones[level->n_ones];
+
+         join->parent_key = parent_key;
+         join->child_key = child_key;
+         join->fields = fields;
+         merge_stats (db, child_name, &stats);
+         child_coll = mongoc_database_get_collection (db, child_name);
+         ok = stats.bytes <= (int64_t)*budget && hash_join_load (join, child_coll, NULL, *budget);
+         mongoc_collection_destroy (child_coll);
+         level->n_ones++;
+         *budget -= ok ? join->len : 0;
+      }
+      else {
+         sort_merge_child_t *child = &level->manys[level->n_manys];
+
+         child->parent_key = parent_key;
+         child->child_name = child_name;
+         child->child_key = child_key;
+         child->fields = fields;
+         for (child_node = NULL, j = 0; !child_node && j < node->merge_spec_count; j++) {
+            if (strcmp (node->child_names[j], child_name) == 0)
+               child_node = merge_node_absorbed_child (scheduler, node, j, merged);
+         }
+         /* the levels are walked in key order, as the sort-merge join is */
+         if (!merge_integer_key (db, child_name, child_key) || !merge_integer_key (db, node->parent_name, parent_key))
+            ok = false;
+         /* a level feeds up its merged documents whole */
+         else if (child_node && *fields != '\0')
+            ok = false;
+         else if (child_node) {
+            level->levels[level->n_manys] = fused_level_new (scheduler, child_node, child_key, db, merged, budget);
+            ok = level->levels[level->n_manys] != NULL;
+         }
+         level->n_manys++;
+      }
+   }
+   if (!ok) {
+      fprintf (stderr, "info: merge \"%s\" not fused, a child does not fit or has non-integer keys, or a fused child has a field list\n",
+               node->parent_name);
+      fused_level_destroy (level);
+      return NULL;
+   }
+   return level;
+}
+
+int64_t
+fused_level_run (fused_level_t     *level,
+                 mongoc_database_t *db)
+{
+   mongoc_collection_t *coll;
+   mongoc_cursor_t *cursor;
+   mongoc_bulk_operation_t *bulk;
+   const bson_t *doc;
+   bson_t *query, fields = BSON_INITIALIZER, q, set, u, array, child, out;
+   bson_iter_t iter, iter_key, iter_fk;
+   bson_error_t error;
+   hash_join_entry_t *entry;
+   size_t n_docs = 0, n_bytes = 0;
+   int64_t count = 0, key, fk;
+   uint32_t found, n;
+   const char *index_key;
+   char index_s[16];
+   bool ret = true;
+   int i;
+
+   for (i = 0; ret && i < level->n_manys; i++) {
+      if (level->levels[i]) {
+         ret = fused_level_run (level->levels[i], db) >= 0;
+         level->manys[i].sorted = level->levels[i]->sorted;
+         sort_merge_child_next (&level->manys[i]);
+      }
+      else
+         sort_merge_child_open (&level->manys[i], db, NULL);
+   }
+   if (!ret)
+      return -1;
+   fprintf (stderr, "info: fused merge \"%s\" progress: ", level->name);
+   fflush (stderr);
+   if (level->parent_fk)
+      level->sorted = external_sort_new (EXTERNAL_SORT_RUN_BYTES);
+   else {
+      /* the top level is not passed on, it only needs the joined keys */
+      BSON_APPEND_INT32 (&fields, "_id", 1);
+      for (i = 0; i < level->n_ones; i++)
+         BSON_APPEND_INT32 (&fields, level->ones[i].parent_key, 1);
+   }
+   coll = mongoc_database_get_collection (db, level->name);
+   query = BCON_NEW ("$query", "{", "}", "$orderby", "{", "_id", BCON_INT32 (1), "}");
+   cursor = mongoc_collection_find (coll, MONGOC_QUERY_NONE, 0, 0, cursor_batch_size, query, level->parent_fk ? NULL : &fields, NULL);
+   bulk = mongoc_collection_create_bulk_operation (coll, false, NULL);
+   bson_init (&q);
+   bson_init (&set);
+   bson_init (&u);
+   bson_init (&out);
+   while (ret && mongoc_cursor_next (cursor, &doc)) {
+      for (i = 0; i < level->n_ones; i++) {
+         if (!bson_iter_init_find (&iter, doc, level->ones[i].parent_key))
+            continue;
+         if (BSON_ITER_HOLDS_DOCUMENT (&iter) && bson_iter_recurse (&iter, &iter_key) &&
+             bson_iter_find (&iter_key, level->ones[i].child_key))
+            iter = iter_key;
+         if (!hash_join_key (&iter, &key) || (found = hash_join_find (&level->ones[i], key)) == 0)
+            continue;
+         entry = &level->ones[i].entries[found - 1];
+         bson_init_static (&child, level->ones[i].data + entry->offset, entry->len) || DIE;
+         BSON_APPEND_DOCUMENT (&set, level->ones[i].parent_key, &child);
+      }
+      bson_iter_init_find (&iter, doc, "_id") || DIE;
+      for (i = 0; hash_join_key (&iter, &key) && i < level->n_manys; i++) {
+         sort_merge_child_t *many = &level->manys[i];
+
+         while (many->doc && many->key < key)
+            sort_merge_child_next (many);
+         if (!many->doc || many->key != key)
+            continue;
+         bson_append_array_begin (&set, many->parent_key, -1, &array);
+         for (n = 0; many->doc && many->key == key; n++) {
+            bson_uint32_to_string (n, &index_key, index_s, sizeof index_s);
+            bson_append_document (&array, index_key, -1, many->doc);
+            sort_merge_child_next (many);
+         }
+         bson_append_array_end (&set, &array);
+      }
+      if (level->sorted && bson_iter_init_find (&iter_fk, doc, level->parent_fk) && hash_join_key (&iter_fk, &fk)) {
+         merge_set_doc (doc, &set, &out);
+         ret = external_sort_add (level->sorted, fk, &out);
+         bson_reinit (&out);
+      }
+      if (!bson_empty (&set)) {
+         bson_append_iter (&q, NULL, -1, &iter);
+         BSON_APPEND_DOCUMENT (&u, "$set", &set);
+         if (ret && bulk_batch_size_full (&merge_batch_size, n_bytes, n_docs, q.len + u.len))
+            ret = merge_bulk_flush (&bulk, coll, &n_docs, &n_bytes, &count, "fused_level_run", false);
+         if (ret) {
+            mongoc_bulk_operation_update_one (bulk, &q, &u, false);
+            n_docs++;
+            n_bytes += q.len + u.len;
+         }
+      }
+      bson_reinit (&q);
+      bson_reinit (&set);
+      bson_reinit (&u);
+   }
+   if (!ret)
+      n_docs = 0;
+   ret = merge_bulk_flush (&bulk, coll, &n_docs, &n_bytes, &count, "fused_level_run", true) && ret;
+   if (mongoc_cursor_error (cursor, &error)) {
+      fprintf (stderr, "fused_level_run \"%s\" failure: %s\n", level->name, error.message);
+      ret = false;
+   }
+   for (i = 0; i < level->n_manys; i++) {
+      if (level->manys[i].cursor && mongoc_cursor_error (level->manys[i].cursor, &error)) {
+         fprintf (stderr, "fused_level_run child \"%s\" failure: %s\n", level->manys[i].child_name, error.message);
+         ret = false;
+      }
+      sort_merge_child_warn (&level->manys[i], "fused_level_run");
+   }
+   if (level->sorted)
+      ret = external_sort_finish (level->sorted) && ret;
+   fprintf (stderr, "\n");
+   fflush (stderr);
+   bson_destroy (&q);
+   bson_destroy (&set);
+   bson_destroy (&u);
+   bson_destroy (&out);
+   bson_destroy (&fields);
+   bson_destroy (query);
+   mongoc_cursor_destroy (cursor);
+   mongoc_collection_destroy (coll);
+   return ret ? count : -1;
+}
+
+void
+fused_level_stamp (fused_level_t       *level,
+                   mongoc_collection_t *merged)
+{
+   int i;
+
+   for (i = 0; i < level->n_manys; i++) {
+      if (level->levels[i]) {
+         fused_level_stamp (level->levels[i], merged);
+         merge_node_stamp (merged, level->levels[i]->name, STAMP_NO_MARK);
+      }
+   }
+}
+
+int64_t
+fused_merge_node (merge_scheduler_t   *scheduler,
+                  merge_node_t        *node,
+                  mongoc_database_t   *db,
+                  mongoc_collection_t *merged)
+{
+   fused_level_t *top;
+   size_t budget = hash_join_max_bytes;
+   int64_t count;
+
+   if ((top = fused_level_new (scheduler, node, NULL, db, merged, &budget)) == NULL)
+      return FUSED_NOT_FUSABLE;
+   count = fused_level_run (top, db);
+   if (count >= 0) {
+      merge_strategy_used (MERGE_STRATEGY_FUSED);
+      fused_level_stamp (top, merged);
+   }
+   fused_level_destroy (top);
+   return count;
+}
+
+/*
+ * Incremental re-merge - each {merged: parent} stamp of an --incremental
+ * spec merge also holds last_updated, the high-water mark of last_updated
+ * over the parent and its children taken when the merge started, read
+ * through a {last_updated: 1} index built only then.  A later run
+ * with --incremental re-merges only the parents whose own row changed
+ * since, or that have a child that changed or was re-merged earlier in
+ * the same run; the re-merged _ids are kept on the node for the parents
+ * above it, and a child merged in full makes its parents merge in full.
+ * The parents are re-merged in batches of _ids with restricted hash
+ * joins and sort merges.  A stamp without last_updated, from rake merge,
+ * a spec merge without --incremental or a fused level, is merged in full.  Collections without
+ * last_updated are taken as unchanged, and rows removed by
+ * mbdump_to_mongo --delta do not mark their parents.
+ */
+
+#define INCREMENTAL_BATCH_SIZE 1000
+
+void
+merge_ids_add (merge_ids_t *ids,
+               int64_t      id)
+{
+   if (ids->n_ids == ids->size) {
+      ids->size = BSON_MAX (1024, 2 * ids->size);
+      ids->ids = bson_realloc (ids->ids, ids->size * sizeof (int64_t));
+   }
+   ids->ids[ids->n_ids++] = id;
+}
+
+int
+merge_ids_compare (const void *a,
+                   const void *b)
+{
+   int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+
+   return x < y ? -1 : x > y;
+}
+
+/* sorted, without duplicates */
+void
+merge_ids_sort (merge_ids_t *ids)
+{
+   size_t i, n = 0;
+
+   qsort (ids->ids, ids->n_ids, sizeof (int64_t), merge_ids_compare);
+   for (i = 0; i < ids->n_ids; i++) {
+      if (n == 0 || ids->ids[i] != ids->ids[n - 1])
+         ids->ids[n++] = ids->ids[i];
+   }
+   ids->n_ids = n;
+}
+
+void
+merge_ids_append_array (bson_t            *array,
+                        const merge_ids_t *ids,
+                        size_t             from,
+                        size_t             to)
+{
+   const char *index_key;
+   char index_s[16];
+   size_t i;
+
+   for (i = from; i < to; i++) {
+      bson_uint32_to_string ((uint32_t)(i - from), &index_key, index_s, sizeof index_s);
+      bson_append_int64 (array, index_key, -1, ids->ids[i]);
+   }
+}
+
+/* the integer key, dotted or not, of each document matching query */
+void
+merge_ids_collect (merge_ids_t         *ids,
+                   mongoc_collection_t *coll,
+                   const bson_t        *query,
+                   const char          *key)
+{
+   bson_t fields = BSON_INITIALIZER;
+   mongoc_cursor_t *cursor;
+   const bson_t *doc;
+   bson_iter_t iter, iter_key;
+   bson_error_t error;
+   int64_t id;
+
+   BSON_APPEND_INT32 (&fields, key, 1);
+   cursor = mongoc_collection_find (coll, MONGOC_QUERY_NONE, 0, 0, cursor_batch_size, query, &fields, NULL);
+   while (mongoc_cursor_next (cursor, &doc)) {
+      if (bson_iter_init (&iter, doc) && bson_iter_find_descendant (&iter, key, &iter_key) && hash_join_key (&iter_key, &id))
+         merge_ids_add (ids, id);
+   }
+   if (mongoc_cursor_error (cursor, &error))
+      fprintf (stderr, "WARNING: merge_ids_collect \"%s\" failure: %s\n", mongoc_collection_get_name (coll), error.message);
+   mongoc_cursor_destroy (cursor);
+   bson_destroy (&fields);
+}
+
+/* the key of each child changed after mark, or re-merged in this run */
+void
+merge_ids_changed (merge_ids_t         *keys,
+                   mongoc_collection_t *child_coll,
+                   const char          *key,
+                   int64_t              mark,
+                   const merge_ids_t   *remerged)
+{
+   bson_t *query, in;
+   size_t from;
+
+   query = BCON_NEW ("last_updated", "{", "$gt", BCON_DATE_TIME (mark), "}");
+   merge_ids_collect (keys, child_coll, query, key);
+   bson_destroy (query);
+   for (from = 0; remerged && from < remerged->n_ids; from += INCREMENTAL_BATCH_SIZE) {
+      bson_init (&in);
+      merge_ids_append_array (&in, remerged, from, BSON_MIN (from + INCREMENTAL_BATCH_SIZE, remerged->n_ids));
+      query = BCON_NEW ("_id", "{", "$in", BCON_ARRAY (&in), "}");
+      merge_ids_collect (keys, child_coll, query, key);
+      bson_destroy (query);
+      bson_destroy (&in);
+   }
+}
+
+/* the max last_updated of a collection in msec, 0 when it has none */
+int64_t
+merge_high_water (mongoc_database_t *db,
+                  const char        *name)
+{
+   mongoc_collection_t *coll;
+   mongoc_cursor_t *cursor;
+   const bson_t *doc;
+   bson_t keys = BSON_INITIALIZER, fields = BSON_INITIALIZER, *query;
+   bson_iter_t iter;
+   bson_error_t error;
+   int64_t mark = 0;
+
+   coll = mongoc_database_get_collection (db, name);
+   BSON_APPEND_INT32 (&keys, "last_updated", 1);
+   if (!mongoc_collection_create_index (coll, &keys, NULL, &error))
+      fprintf (stderr, "WARNING: incremental index on \"%s.last_updated\" not created: %s\n", name, error.message);
+   BSON_APPEND_INT32 (&fields, "last_updated", 1);
+   query = BCON_NEW ("$query", "{", "}", "$orderby", "{", "last_updated", BCON_INT32 (-1), "}");
+   cursor = mongoc_collection_find (coll, MONGOC_QUERY_NONE, 0, 1, 0, query, &fields, NULL);
+   if (mongoc_cursor_next (cursor, &doc) && bson_iter_init_find (&iter, doc, "last_updated") && BSON_ITER_HOLDS_DATE_TIME (&iter))
+      mark = bson_iter_date_time (&iter);
+   mongoc_cursor_destroy (cursor);
+   bson_destroy (query);
+   bson_destroy (&fields);
+   bson_destroy (&keys);
+   mongoc_collection_destroy (coll);
+   return mark;
+}
+
+int64_t
+merge_node_high_water (mongoc_database_t *db,
+                       merge_node_t      *node)
+{
+   int64_t mark;
+   int i;
+
+   mark = merge_high_water (db, node->parent_name);
+   for (i = 0; i < node->merge_spec_count; i++)
+      mark = BSON_MAX (mark, merge_high_water (db, node->child_names[i]));
+   return mark;
+}
+
+/* the parents to re-merge into dirty, false when a child was merged in full */
+bool
+incremental_dirty (merge_scheduler_t *scheduler,
+                   merge_node_t      *node,
+                   mongoc_database_t *db,
+                   bson_iter_t       *iter_spec_top,
+                   int64_t            mark,
+                   merge_ids_t       *dirty)
+{
+   mongoc_collection_t *parent_coll, *child_coll;
+   merge_node_t *child_node;
+   merge_ids_t keys;
+   bson_iter_t iter_spec, iter;
+   bson_t *query, in;
+   char *dotted;
+   size_t from;
+   bool ret = true;
 
+   parent_coll = mongoc_database_get_collection (db, node->parent_name);
+   query = BCON_NEW ("last_updated", "{", "$gt", BCON_DATE_TIME (mark), "}");
+   merge_ids_collect (dirty, parent_coll, query, "_id");
+   bson_destroy (query);
    bson_iter_recurse (iter_spec_top, &iter_spec) || DIE;
-   while (bson_iter_next (&iter_spec)) {
-      const char *type, *parent_key, *child_name, *child_key, *dollar_parent_key;
+   while (ret && bson_iter_next (&iter_spec)) {
+      const char *type, *parent_key, *child_name, *child_key;
 
-      BSON_ITER_HOLDS_ARRAY (&iter_spec) || DIE;
       bson_iter_recurse (&iter_spec, &iter) || DIE;
       type = bson_iter_next_utf8 (&iter, NULL);
-      if (strcmp ("one", type) != 0)
-         continue;
       parent_key = bson_iter_next_utf8 (&iter, NULL);
       child_name = bson_iter_next_utf8 (&iter, NULL);
       child_key = bson_iter_next_utf8 (&iter, NULL);
-      fprintf (stderr, "info: parent: \"%s\", child spec: {type: \"%s\", parent_key: \"%s\", child_name: \"%s\", child_key: \"%s\"}\ninfo: child progress: ",
-              parent_name, type, parent_key, child_name, child_key);
-      fflush (stderr);
+      child_node = strcmp (child_name, node->parent_name) == 0 ? NULL : merge_node_find (scheduler, child_name);
+      if (child_node && child_node->remerged_all) {
+         ret = false;
+         break;
+      }
       child_coll = mongoc_database_get_collection (db, child_name);
-      pipeline = child_by_merge_key (parent_key, child_name, child_key);
-      agg_copy (child_coll, temp_one_coll, pipeline);
-      bson_destroy (pipeline);
-      fprintf (stderr, "\ninfo: parent progress: ");
-      fflush (stderr);
-      pipeline = parent_child_merge_key (parent_key, child_name, child_key);
-      agg_copy (parent_coll, temp_one_coll, pipeline);
-      bson_destroy (pipeline);
+      if (strcmp ("many", type) == 0) {
+         merge_ids_changed (dirty, child_coll, child_key, mark, child_node ? &child_node->remerged : NULL);
+         mongoc_collection_destroy (child_coll);
+         continue;
+      }
+      /* a "one" child marks the parents that hold its key, plain or merged */
+      memset (&keys, 0, sizeof keys);
+      merge_ids_changed (&keys, child_coll, child_key, mark, child_node ? &child_node->remerged : NULL);
+      merge_ids_sort (&keys);
+      dotted = bson_strdup_printf ("%s.%s", parent_key, child_key);
+      for (from = 0; from < keys.n_ids; from += INCREMENTAL_BATCH_SIZE) {
+         bson_init (&in);
+         merge_ids_append_array (&in, &keys, from, BSON_MIN (from + INCREMENTAL_BATCH_SIZE, keys.n_ids));
+         query = BCON_NEW ("$or", "[", "{", parent_key, "{", "$in", BCON_ARRAY (&in), "}", "}",
+                                       "{", dotted, "{", "$in", BCON_ARRAY (&in), "}", "}", "]");
+         merge_ids_collect (dirty, parent_coll, query, "_id");
+         bson_destroy (query);
+         bson_destroy (&in);
+      }
+      bson_free (dotted);
+      bson_free (keys.ids);
       mongoc_collection_destroy (child_coll);
-      dollar_parent_key = str_compose ("$", parent_key);
-      BCON_APPEND (all_accumulators, parent_key, "{", "$max", dollar_parent_key, "}");
-      BCON_APPEND (one_accumulators, parent_key, "{", "$max", dollar_parent_key, "}");
-      BCON_APPEND (one_projectors, parent_key, dollar_parent_key);
-      bson_free ((void*)dollar_parent_key);
-      fprintf (stderr, "\n");
-      fflush (stderr);
    }
-   fprintf (stderr, "info: merge_one_all progress: ", parent_name);
-   fflush (stderr);
-   pipeline = merge_one_all (one_accumulators, one_projectors);
-   agg_copy (temp_one_coll, temp_coll, pipeline);
-   bson_destroy (pipeline);
-   bson_destroy (one_accumulators);
-   bson_destroy (one_projectors);
-   mongoc_collection_drop (temp_one_coll, &error);
-   mongoc_collection_destroy (temp_one_coll);
-   fprintf (stderr, "\n");
-   fflush (stderr);
+   mongoc_collection_destroy (parent_coll);
+   merge_ids_sort (dirty);
+   return ret;
 }
 
-void
-many_children_append (const char         *parent_name,
-                     bson_iter_t         *iter_spec_top,
-                     mongoc_database_t   *db,
-                     mongoc_collection_t *temp_coll,
-                     bson_t              *all_accumulators)
+/* the integer key of join in a parent, from the merged child document once merged */
+bool
+incremental_one_key (const bson_t      *parent,
+                     const hash_join_t *join,
+                     int64_t           *key)
 {
-   mongoc_collection_t *child_coll;
+   bson_iter_t iter, iter_key;
+
+   if (!bson_iter_init_find (&iter, parent, join->parent_key))
+      return false;
+   if (BSON_ITER_HOLDS_DOCUMENT (&iter) && bson_iter_recurse (&iter, &iter_key) &&
+       bson_iter_find (&iter_key, join->child_key))
+      iter = iter_key;
+   return hash_join_key (&iter, key);
+}
+
+/* re-merge the parents with _ids in ids, "many" keys left without children are $unset */
+int64_t
+incremental_update (mongoc_database_t *db,
+                    const char        *parent_name,
+                    bson_iter_t       *iter_spec_top,
+                    const merge_ids_t *ids)
+{
+   mongoc_collection_t *parent_coll, *child_coll;
+   mongoc_cursor_t *cursor;
+   mongoc_bulk_operation_t *bulk;
+   hash_join_t *ones = NULL;
+   const char **one_names = NULL;
+   sort_merge_child_t *manys = NULL;
+   const bson_t *doc;
+   bson_t **parents;
+   bson_t *query, fields = BSON_INITIALIZER, in, keys, q, set, unset, u, array, child;
    bson_iter_t iter_spec, iter;
-   bson_t *pipeline;
+   bson_error_t error;
+   hash_join_entry_t *entry;
+   size_t n_parents, from, to, n_docs = 0, n_bytes = 0, j;
+   int64_t count = 0, key, parent_id, n_skipped = 0;
+   uint32_t found, n;
+   const char *index_key;
+   char index_s[16];
+   bool ret = true;
+   int n_ones = 0, n_manys = 0, i;
 
+   BSON_APPEND_INT32 (&fields, "_id", 1);
    bson_iter_recurse (iter_spec_top, &iter_spec) || DIE;
    while (bson_iter_next (&iter_spec)) {
-      const char *type, *parent_key, *child_name, *child_key, *dollar_parent_key;
+      const char *type, *parent_key, *child_name, *child_key, *child_fields;
 
-      BSON_ITER_HOLDS_ARRAY (&iter_spec) || DIE;
       bson_iter_recurse (&iter_spec, &iter) || DIE;
       type = bson_iter_next_utf8 (&iter, NULL);
-      if (strcmp ("many", type) != 0)
-         continue;
       parent_key = bson_iter_next_utf8 (&iter, NULL);
       child_name = bson_iter_next_utf8 (&iter, NULL);
       child_key = bson_iter_next_utf8 (&iter, NULL);
-      fprintf (stderr, "info: parent: \"%s\", child spec: {type: \"%s\", parent_key: \"%s\", child_name: \"%s\", child_key: \"%s\"}\ninfo: child progress: ",
-              parent_name, type, parent_key, child_name, child_key);
+      child_fields = bson_iter_next_utf8 (&iter, NULL);
+      if (strcmp ("one", type) == 0) {
+         ones = bson_realloc (ones, (n_ones + 1) * sizeof (hash_join_t));
+         one_names = bson_realloc (one_names, (n_ones + 1) * sizeof (char*));
+         memset (&ones[n_ones], 0, sizeof (hash_join_t));
+         ones[n_ones].parent_key = parent_key;
+         ones[n_ones].child_key = child_key;
+         ones[n_ones].fields = child_fields;
+         one_names[n_ones++] = child_name;
+         BSON_APPEND_INT32 (&fields, parent_key, 1);
+      }
+      else {
+         manys = bson_realloc (manys, (n_manys + 1) * sizeof (sort_merge_child_t));
+         memset (&manys[n_manys], 0, sizeof (sort_merge_child_t));
+         manys[n_manys].parent_key = parent_key;
+         manys[n_manys].child_name = child_name;
+         manys[n_manys].child_key = child_key;
+         manys[n_manys++].fields = child_fields;
+      }
+   }
+   fprintf (stderr, "info: incremental progress: ");
+   fflush (stderr);
+   parent_coll = mongoc_database_get_collection (db, parent_name);
+   bulk = mongoc_collection_create_bulk_operation (parent_coll, false, NULL);
+   parents = bson_malloc (INCREMENTAL_BATCH_SIZE * sizeof (bson_t*));
+   bson_init (&q);
+   bson_init (&set);
+   bson_init (&unset);
+   bson_init (&u);
+   for (from = 0; ret && from < ids->n_ids; from = to) {
+      to = BSON_MIN (from + INCREMENTAL_BATCH_SIZE, ids->n_ids);
+      bson_init (&in);
+      merge_ids_append_array (&in, ids, from, to);
+      query = BCON_NEW ("$query", "{", "_id", "{", "$in", BCON_ARRAY (&in), "}", "}", "$orderby", "{", "_id", BCON_INT32 (1), "}");
+      cursor = mongoc_collection_find (parent_coll, MONGOC_QUERY_NONE, 0, 0, cursor_batch_size, query, &fields, NULL);
+      for (n_parents = 0; n_parents < to - from && mongoc_cursor_next (cursor, &doc); n_parents++)
+         parents[n_parents] = bson_copy (doc);
+      mongoc_cursor_destroy (cursor);
+      bson_destroy (query);
+      for (i = 0; ret && i < n_ones; i++) {
+         bson_init (&keys);
+         for (j = 0, n = 0; j < n_parents; j++) {
+            if (incremental_one_key (parents[j], &ones[i], &key)) {
+               bson_uint32_to_string (n++, &index_key, index_s, sizeof index_s);
+               bson_append_int64 (&keys, index_key, -1, key);
+            }
+         }
+         query = BCON_NEW (ones[i].child_key, "{", "$in", BCON_ARRAY (&keys), "}");
+         child_coll = mongoc_database_get_collection (db, one_names[i]);
+         if (!hash_join_load (&ones[i], child_coll, query, SIZE_MAX)) {
+            fprintf (stderr, "incremental_update child \"%s\" failure: keys are not integers\n", one_names[i]);
+            ret = false;
+         }
+         mongoc_collection_destroy (child_coll);
+         bson_destroy (query);
+         bson_destroy (&keys);
+      }
+      for (i = 0; ret && i < n_manys; i++)
+         sort_merge_child_open (&manys[i], db, &in);
+      for (j = 0; ret && j < n_parents; j++) {
+         bson_iter_init_find (&iter, parents[j], "_id") || DIE;
+         if (!hash_join_key (&iter, &parent_id)) {
+            n_skipped++;
+            continue;
+         }
+         for (i = 0; i < n_ones; i++) {
+            if (!incremental_one_key (parents[j], &ones[i], &key) || (found = hash_join_find (&ones[i], key)) == 0)
+               continue;
+            entry = &ones[i].entries[found - 1];
+            bson_init_static (&child, ones[i].data + entry->offset, entry->len) || DIE;
+            BSON_APPEND_DOCUMENT (&set, ones[i].parent_key, &child);
+         }
+         for (i = 0; i < n_manys; i++) {
+            sort_merge_child_t *many = &manys[i];
+
+            while (many->doc && many->key < parent_id)
+               sort_merge_child_next (many);
+            if (!many->doc || many->key != parent_id) {
+               BSON_APPEND_UTF8 (&unset, many->parent_key, "");
+               continue;
+            }
+            bson_append_array_begin (&set, many->parent_key, -1, &array);
+            for (n = 0; many->doc && many->key == parent_id; n++) {
+               bson_uint32_to_string (n, &index_key, index_s, sizeof index_s);
+               bson_append_document (&array, index_key, -1, many->doc);
+               sort_merge_child_next (many);
+            }
+            bson_append_array_end (&set, &array);
+         }
+         if (!bson_empty (&set))
+            BSON_APPEND_DOCUMENT (&u, "$set", &set);
+         if (!bson_empty (&unset))
+            BSON_APPEND_DOCUMENT (&u, "$unset", &unset);
+         if (!bson_empty (&u)) {
+            bson_append_iter (&q, NULL, -1, &iter);
+            if (bulk_batch_size_full (&merge_batch_size, n_bytes, n_docs, q.len + u.len))
+               ret = merge_bulk_flush (&bulk, parent_coll, &n_docs, &n_bytes, &count, "incremental_update", false);
+            if (ret) {
+               mongoc_bulk_operation_update_one (bulk, &q, &u, false);
+               n_docs++;
+               n_bytes += q.len + u.len;
+            }
+         }
+         bson_reinit (&q);
+         bson_reinit (&set);
+         bson_reinit (&unset);
+         bson_reinit (&u);
+      }
+      for (i = 0; i < n_manys; i++) {
+         if (manys[i].cursor && mongoc_cursor_error (manys[i].cursor, &error)) {
+            fprintf (stderr, "incremental_update child \"%s\" failure: %s\n", manys[i].child_name, error.message);
+            ret = false;
+         }
+         if (manys[i].cursor)
+            mongoc_cursor_destroy (manys[i].cursor);
+         manys[i].cursor = NULL;
+         manys[i].doc = NULL;
+      }
+      for (i = 0; i < n_ones; i++) {
+         const char *parent_key = ones[i].parent_key, *child_key = ones[i].child_key, *child_fields = ones[i].fields;
+
+         hash_join_destroy (&ones[i]);
+         memset (&ones[i], 0, sizeof (hash_join_t));
+         ones[i].parent_key = parent_key;
+         ones[i].child_key = child_key;
+         ones[i].fields = child_fields;
+      }
+      for (j = 0; j < n_parents; j++)
+         bson_destroy (parents[j]);
+      bson_destroy (&in);
+   }
+   if (!ret)
+      n_docs = 0;
+   ret = merge_bulk_flush (&bulk, parent_coll, &n_docs, &n_bytes, &count, "incremental_update", true) && ret;
+   fprintf (stderr, "\n");
+   if (n_skipped > 0)
+      fprintf (stderr, "WARNING: incremental_update %"PRId64" parents with non-integer _ids skipped\n", n_skipped);
+   for (i = 0; i < n_manys; i++)
+      sort_merge_child_warn (&manys[i], "incremental_update");
+   fflush (stderr);
+   bson_destroy (&q);
+   bson_destroy (&set);
+   bson_destroy (&unset);
+   bson_destroy (&u);
+   bson_destroy (&fields);
+   bson_free (parents);
+   bson_free (ones);
+   bson_free (one_names);
+   bson_free (manys);
+   mongoc_collection_destroy (parent_coll);
+   return ret ? count : -1;
+}
+
+int64_t
+incremental_merge_node (merge_scheduler_t   *scheduler,
+                        merge_node_t        *node,
+                        mongoc_client_t     *client,
+                        mongoc_database_t   *db,
+                        mongoc_collection_t *merged,
+                        int64_t              mark)
+{
+   bson_t *bson_spec;
+   bson_iter_t iter_spec_top;
+   char **pending;
+   int n_pending;
+   int64_t high_water, count;
+
+   /* taken first, rows changed while merging are picked up by the next run */
+   high_water = BSON_MAX (mark, merge_node_high_water (db, node));
+   pending = merge_node_pending (node, merged, &n_pending);
+   bson_spec = expand_spec (node->parent_name, n_pending, pending);
+   bson_iter_init_find (&iter_spec_top, bson_spec, "merge_spec") || DIE;
+   if (incremental_dirty (scheduler, node, db, &iter_spec_top, mark, &node->remerged)) {
+      fprintf (stderr, "info: merge \"%s\" incremental, parents changed: %zu\n", node->parent_name, node->remerged.n_ids);
       fflush (stderr);
-      child_coll = mongoc_database_get_collection (db, child_name);
-      pipeline = copy_many_with_parent_id (parent_key, child_name, child_key);
-      agg_copy (child_coll, temp_coll, pipeline);
-      bson_destroy (pipeline);
-      mongoc_collection_destroy (child_coll);
-      dollar_parent_key = str_compose ("$", parent_key);
-      BCON_APPEND (all_accumulators, parent_key, "{", "$push", dollar_parent_key, "}");
-      bson_free ((void*)dollar_parent_key);
-      fprintf (stderr, "\n");
+      count = node->remerged.n_ids > 0 ? incremental_update (db, node->parent_name, &iter_spec_top, &node->remerged) : 0;
+      if (count >= 0)
+         merge_strategy_used (MERGE_STRATEGY_INCREMENTAL);
+   }
+   else {
+      fprintf (stderr, "info: merge \"%s\" in full, a child was merged in full\n", node->parent_name);
       fflush (stderr);
+      node->remerged_all = true;
+      count = n_pending > 0 ? merge_parent (client, scheduler->database_name, node->parent_name, n_pending, pending) : 0;
    }
+   if (count >= 0)
+      merge_node_stamp (merged, node->parent_name, high_water);
+   bson_destroy (bson_spec);
+   bson_free (pending);
+   return count;
 }
 
 int64_t
-execute (const char *parent_name,
-         int         merge_spec_count,
-         char      **merge_spec)
+merge_node_run (merge_scheduler_t *scheduler,
+                merge_node_t      *node,
+                mongoc_client_t   *client)
 {
-   int64_t count;
-   const char *uristr = "mongodb://localhost/test";
-   const char *database_name;
-   mongoc_uri_t *uri;
-   mongoc_client_t *client;
    mongoc_database_t *db;
-   const char *temp_name;
-   mongoc_collection_t *parent_coll, *temp_coll;
-   bson_t *bson_spec, *all_accumulators;
-   bson_iter_t iter_spec_top;
-   bson_error_t error;
-
-   uristr = getenv ("MONGODB_URI");
-   uri = mongoc_uri_new (uristr);
-   client = mongoc_client_new (uristr);
-   database_name = mongoc_uri_get_database (uri);
-   db = mongoc_client_get_database (client, database_name);
-   parent_coll = mongoc_database_get_collection (db, parent_name);
+   mongoc_collection_t *merged;
+   merge_node_t *child;
+   char **pending;
+   int n_pending = 0, i;
+   int64_t count = 0, mark, high_water;
 
-   temp_name = str_compose (parent_name, "_merge_temp");
-   temp_coll = mongoc_database_get_collection (db, temp_name);
-   mongoc_collection_drop (temp_coll, &error);
-   bson_free ((void*)temp_name);
+   db = mongoc_client_get_database (client, scheduler->database_name);
+   merged = mongoc_database_get_collection (db, "merged");
+   mark = merge_stamp_mark (merged, node->parent_name);
+   if (mark >= 0 && incremental_merge && !explain_merge) {
+      count = incremental_merge_node (scheduler, node, client, db, merged, mark);
+      fprintf (stderr, "info: merge \"%s\" %s, count: %"PRId64"\n", node->parent_name, count >= 0 ? "done" : "failed", count);
+      fflush (stderr);
+   }
+   /* --explain plans stamped parents too */
+   else if (mark != STAMP_NONE && !(mark == STAMP_NO_MARK && incremental_merge) && !explain_merge) {
+      fprintf (stderr, "info: merge \"%s\" skipped - already stamped in collection \"merged\"\n", node->parent_name);
+   }
+   else {
+      if (mark == STAMP_NO_MARK)
+         fprintf (stderr, "info: merge \"%s\" in full, its stamp has no last_updated\n", node->parent_name);
+      /* the mark and its index only for --incremental, a stamp without one is merged in full */
+      high_water = incremental_merge && !explain_merge ? merge_node_high_water (db, node) : STAMP_NO_MARK;
+      node->remerged_all = true;
+      pending = merge_node_pending (node, merged, &n_pending);
+      fprintf (stderr, "info: merge \"%s\" started, specs: %d\n", node->parent_name, n_pending);
+      fflush (stderr);
+      count = FUSED_NOT_FUSABLE;
+      if (fused_merge && !explain_merge) {
+         for (i = 0; i < node->merge_spec_count && !merge_node_absorbed_child (scheduler, node, i, merged); i++)
+            ;
+         if (i < node->merge_spec_count)
+            count = fused_merge_node (scheduler, node, db, merged);
+         /* not fusable, the absorbed children are merged on their own first */
+         for (i = 0; count == FUSED_NOT_FUSABLE && i < node->merge_spec_count; i++) {
+            if ((child = merge_node_absorbed_child (scheduler, node, i, merged)) && merge_node_run (scheduler, child, client) < 0)
+               count = -1;
+         }
+      }
+      if (count == FUSED_NOT_FUSABLE)
+         count = n_pending > 0 ? merge_parent (client, scheduler->database_name, node->parent_name, n_pending, pending) : 0;
+      /* --explain only plans, nothing is merged or stamped */
+      if (count >= 0 && !explain_merge)
+         merge_node_stamp (merged, node->parent_name, high_water);
+      fprintf (stderr, "info: merge \"%s\" %s, count: %"PRId64"\n", node->parent_name, count >= 0 ? "done" : "failed", count);
+      fflush (stderr);
+      bson_free (pending);
+   }
+   mongoc_collection_destroy (merged);
+   mongoc_database_destroy (db);
+   return count;
+}
 
-   bson_spec = expand_spec (parent_name, merge_spec_count, merge_spec);
-   bson_iter_init_find (&iter_spec_top, bson_spec, "merge_spec") || DIE;
-   BSON_ITER_HOLDS_ARRAY (&iter_spec_top) || DIE;
-   all_accumulators = bson_new ();
+/* a finished node releases, or on failure fails, the nodes that depend on it */
+void
+merge_node_done (merge_scheduler_t *scheduler,
+                 merge_node_t      *node,
+                 bool               ok)
+{
+   int i, j;
 
-   one_children_append (parent_name, &iter_spec_top, db, parent_coll, temp_coll, all_accumulators);
+   for (i = 0; i < scheduler->n_nodes; i++) {
+      merge_node_t *dependent = &scheduler->nodes[i];
 
-   many_children_append (parent_name, &iter_spec_top, db, temp_coll, all_accumulators);
+      if (dependent == node)
+         continue;
+      for (j = 0; j < dependent->merge_spec_count; j++) {
+         if (strcmp (dependent->child_names[j], node->parent_name) != 0)
+            continue;
+         if (!ok)
+            dependent->failed = true;
+         if (--dependent->n_deps == 0)
+            scheduler->ready[scheduler->n_ready++] = i;
+      }
+   }
+}
 
-   fprintf (stderr, "info: group progress: ", parent_name);
-   fflush (stderr);
-   count = group_and_update (temp_coll, parent_coll, all_accumulators);
-   fprintf (stderr, "\n");
-   fflush (stderr);
+/*
+ * true when an absorbed node is left to the fused merge of its referrer,
+ * which only runs while the referrer is not stamped
+ */
+bool
+merge_node_fused_away (merge_scheduler_t *scheduler,
+                       merge_node_t      *node,
+                       mongoc_client_t   *client)
+{
+   mongoc_database_t *db;
+   mongoc_collection_t *merged;
+   bool ret;
 
-   bson_destroy (all_accumulators);
-   bson_destroy (bson_spec);
-   mongoc_collection_drop (temp_coll, &error);
-   mongoc_collection_destroy (temp_coll);
-   mongoc_collection_destroy (parent_coll);
+   if (!fused_merge || explain_merge || !node->absorbed)
+      return false;
+   db = mongoc_client_get_database (client, scheduler->database_name);
+   merged = mongoc_database_get_collection (db, "merged");
+   ret = !merge_stamped (merged, node->referrer);
+   mongoc_collection_destroy (merged);
    mongoc_database_destroy (db);
-   mongoc_client_destroy (client);
-   mongoc_uri_destroy (uri);
+   return ret;
+}
 
-   return count;
+void *
+merge_scheduler_run (void *arg)
+{
+   merge_scheduler_t *scheduler = arg;
+   mongoc_client_t *client;
+   merge_node_t *node;
+   int64_t count;
+
+   pthread_mutex_lock (&scheduler->mutex);
+   for (;;) {
+      while (scheduler->n_ready == 0 && scheduler->n_running > 0)
+         pthread_cond_wait (&scheduler->cond, &scheduler->mutex);
+      if (scheduler->n_ready == 0)
+         break;
+      node = &scheduler->nodes[scheduler->ready[--scheduler->n_ready]];
+      scheduler->n_running++;
+      pthread_mutex_unlock (&scheduler->mutex);
+      if (node->failed) {
+         fprintf (stderr, "WARNING: merge \"%s\" not run, a child merge failed\n", node->parent_name);
+         count = -1;
+      }
+      else {
+         client = mongoc_client_pool_pop (scheduler->pool);
+         if (merge_node_fused_away (scheduler, node, client)) {
+            fprintf (stderr, "info: merge \"%s\" fused into its parent merge\n", node->parent_name);
+            count = 0;
+         }
+         else
+            count = merge_node_run (scheduler, node, client);
+         mongoc_client_pool_push (scheduler->pool, client);
+      }
+      pthread_mutex_lock (&scheduler->mutex);
+      scheduler->n_running--;
+      scheduler->n_done++;
+      scheduler->count += count < 0 ? 0 : count;
+      merge_node_done (scheduler, node, count >= 0);
+      pthread_cond_broadcast (&scheduler->cond);
+   }
+   pthread_mutex_unlock (&scheduler->mutex);
+   return NULL;
+}
+
+int64_t
+execute_spec (const char *spec_file,
+              int         jobs)
+{
+   merge_scheduler_t scheduler;
+   const char *uristr;
+   mongoc_uri_t *uri;
+   mongoc_client_t *client;
+   merge_indexes_t indexes;
+   bson_t *bson_spec;
+   pthread_t *threads;
+   int i, j;
+
+   memset (&scheduler, 0, sizeof scheduler);
+   if (!merge_scheduler_read (&scheduler, spec_file))
+      return -1;
+   /* an incremental run merges each parent on its own */
+   if (incremental_merge)
+      fused_merge = false;
+   uristr = getenv ("MONGODB_URI");
+   uri = mongoc_uri_new (uristr);
+   scheduler.database_name = mongoc_uri_get_database (uri);
+   if (merge_indexes && !explain_merge) {
+      memset (&indexes, 0, sizeof indexes);
+      for (i = 0; i < scheduler.n_nodes; i++) {
+         bson_spec = expand_spec (scheduler.nodes[i].parent_name, scheduler.nodes[i].merge_spec_count, scheduler.nodes[i].merge_spec);
+         merge_indexes_add (&indexes, bson_spec);
+         bson_destroy (bson_spec);
+      }
+      merge_indexes_build (&indexes, uri, scheduler.database_name);
+   }
+   scheduler.pool = mongoc_client_pool_new (uri);
+   client = mongoc_client_pool_pop (scheduler.pool);
+   /* the tuner is not shared between threads, concurrent merges use a fixed size */
+   bulk_batch_size_init (&merge_batch_size, bulk_batch_bytes, bulk_max_message_size (client), bulk_auto_tune && jobs <= 1 && merge_partitions <= 1);
+   mongoc_client_pool_push (scheduler.pool, client);
+   if (bulk_writers > 0 || merge_partitions > 1) {
+      merge_pool = scheduler.pool;
+      merge_database_name = scheduler.database_name;
+   }
+   scheduler.ready = bson_malloc (scheduler.n_nodes * sizeof (int));
+   for (i = scheduler.n_nodes - 1; i >= 0; i--) {
+      if (scheduler.nodes[i].n_deps == 0)
+         scheduler.ready[scheduler.n_ready++] = i;
+   }
+   pthread_mutex_init (&scheduler.mutex, NULL);
+   pthread_cond_init (&scheduler.cond, NULL);
+   jobs = BSON_MAX (1, jobs);
+   merge_strategies = 0;
+   threads = bson_malloc (jobs * sizeof (pthread_t));
+   for (i = 0; i < jobs; i++)
+      pthread_create (&threads[i], NULL, merge_scheduler_run, &scheduler) == 0 || DIE;
+   for (i = 0; i < jobs; i++)
+      pthread_join (threads[i], NULL);
+   if (scheduler.n_done < scheduler.n_nodes)
+      fprintf (stderr, "WARNING: %d merges not run, the spec has a dependency cycle\n", scheduler.n_nodes - scheduler.n_done);
+   if (!explain_merge)
+      merge_strategies_print ();
+   pthread_mutex_destroy (&scheduler.mutex);
+   pthread_cond_destroy (&scheduler.cond);
+   for (i = 0; i < scheduler.n_nodes; i++) {
+      for (j = 0; j < scheduler.nodes[i].merge_spec_count; j++) {
+         bson_free (scheduler.nodes[i].merge_spec[j]);
+         bson_free (scheduler.nodes[i].child_names[j]);
+      }
+      bson_free (scheduler.nodes[i].merge_spec);
+      bson_free (scheduler.nodes[i].child_names);
+      bson_free (scheduler.nodes[i].remerged.ids);
+      bson_free (scheduler.nodes[i].parent_name);
+   }
+   bson_free (scheduler.nodes);
+   bson_free (scheduler.ready);
+   bson_free (threads);
+   merge_pool = NULL;
+   mongoc_client_pool_destroy (scheduler.pool);
+   mongoc_uri_destroy (uri);
+   return scheduler.count;
 }
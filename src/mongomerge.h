@@ -23,12 +23,13 @@
 #define MONGOMERGE_H
 #include <mongoc.h>
 #include <stdio.h>
+#include "bulk_pipeline.h"
+#include "external_sort.h"
 
-#define INSERT_BATCH_SIZE 1000
-#define BULK_OPS_SIZE 1000
-#define PROGRESS_SIZE (1000*BULK_OPS_SIZE)
+#define PROGRESS_SIZE 1000000
 #define PROGRESS_SIZE_FORMAT "M"
 #define PROGRESS_END_FORMAT ">%zd=%"PRId64
+#define HASH_JOIN_MAX_BYTES (512*1024*1024)
 
 #define WARN_ERROR \
     (MONGOC_WARNING ("%s\n", error.message), true);
@@ -41,6 +42,61 @@
 #define ASSERT(e) \
     assert (e)
 
+typedef enum {
+   MERGE_JOIN_SERVER,
+   MERGE_JOIN_SORTMERGE,
+   MERGE_JOIN_PLAN
+} merge_join_t;
+
+/* what a merge actually ran, a planned strategy that falls back is not set */
+#define MERGE_STRATEGY_TEMP        (1 << 0)
+#define MERGE_STRATEGY_HASH_JOIN   (1 << 1)
+#define MERGE_STRATEGY_SORT_MERGE  (1 << 2)
+#define MERGE_STRATEGY_SERVER      (1 << 3)
+#define MERGE_STRATEGY_PARTITIONS  (1 << 4)
+#define MERGE_STRATEGY_SHADOW      (1 << 5)
+#define MERGE_STRATEGY_FUSED       (1 << 6)
+#define MERGE_STRATEGY_INCREMENTAL (1 << 7)
+
+#define SERVER_SIDE_MIN_VERSION 404
+
+typedef enum {
+   MERGE_EDGE_TEMP,
+   MERGE_EDGE_HASH_JOIN,
+   MERGE_EDGE_SORT_MERGE,
+   MERGE_EDGE_SERVER
+} merge_edge_t;
+
+/* collStats of a collection for the planner */
+typedef struct {
+   int64_t count;
+   int64_t bytes;
+   int64_t avg;
+} merge_stats_t;
+
+typedef struct {
+   merge_edge_t edge;
+   int64_t moved;
+   int64_t memory;
+} merge_plan_t;
+
+extern int bulk_writers;
+extern int bulk_in_flight;
+extern size_t bulk_batch_bytes;
+extern bool bulk_auto_tune;
+extern size_t hash_join_max_bytes;
+extern merge_join_t merge_join;
+extern bool server_side;
+extern bool fused_merge;
+extern int merge_partitions;
+extern bool shadow_rebuild;
+extern uint32_t cursor_batch_size;
+extern bool incremental_merge;
+extern bool checkpoint_merge;
+extern bool explain_merge;
+extern bool merge_indexes;
+extern unsigned int merge_strategies;
+
 bson_t *
 bson_new_from_iter_document (bson_iter_t *iter) BSON_GNUC_WARN_UNUSED_RESULT;
 
@@ -77,11 +133,64 @@ mongoc_cursor_bulk_insert (mongoc_cursor_t              *cursor,
                            mongoc_collection_t          *dest_coll,
                            const mongoc_write_concern_t *write_concern,
                            bson_error_t                 *error,
-                           size_t                        bulk_ops_size);
+                           bulk_batch_size_t            *batch_size);
+
+int64_t
+mongoc_cursor_bulk_insert_pipeline (mongoc_cursor_t   *cursor,
+                                    bulk_pipeline_t   *pipeline,
+                                    bson_error_t      *error,
+                                    bulk_batch_size_t *batch_size);
+
+void
+merge_strategy_used (unsigned int strategy);
+
+void
+merge_strategies_print (void);
+
+int
+server_version (mongoc_client_t *client);
+
+void
+merge_stats (mongoc_database_t *db,
+             const char        *name,
+             merge_stats_t     *stats);
+
+bool
+merge_indexed (mongoc_database_t *db,
+               const char        *name,
+               const char        *key);
+
+void
+merge_plan_edge (const char          *type,
+                 const merge_stats_t *parent,
+                 const merge_stats_t *child,
+                 bool                 indexed,
+                 bool                 integer_keys,
+                 bool                 server,
+                 size_t               hash_bytes,
+                 merge_plan_t        *plan);
+
+const char *
+merge_spec_fields (const char *spec);
+
+bool
+merge_spec_check (int    merge_spec_count,
+                  char **merge_spec);
+
+int64_t
+merge_parent (mongoc_client_t *client,
+              const char      *database_name,
+              const char      *parent_name,
+              int              merge_spec_count,
+              char           **merge_spec);
 
 int64_t
 execute (const char *parent_name,
          int merge_spec_count,
          char **merge_spec);
 
+int64_t
+execute_spec (const char *spec_file,
+              int         jobs);
+
 #endif
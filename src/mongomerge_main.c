@@ -51,27 +51,108 @@ main (int   argc,
       char *argv[])
 {
    char *parent_name;
+   const char *spec_file = NULL;
+   int jobs = 1;
    double start_time;
    int64_t count;
    double end_time;
    double delta_time;
 
-   if (argc < 3) {
+   argc--, argv++;
+   while (argc > 0 && strncmp (argv[0], "--", 2) == 0) {
+      if (strcmp (argv[0], "--spec") == 0 && argc > 1) {
+         argc--, argv++;
+         spec_file = argv[0];
+      }
+      else if (strcmp (argv[0], "--jobs") == 0 && argc > 1) {
+         argc--, argv++;
+         jobs = atoi (argv[0]);
+      }
+      else if (strcmp (argv[0], "--writers") == 0 && argc > 1) {
+         argc--, argv++;
+         bulk_writers = atoi (argv[0]);
+      }
+      else if (strcmp (argv[0], "--in-flight") == 0 && argc > 1) {
+         argc--, argv++;
+         bulk_in_flight = BSON_MAX (1, atoi (argv[0]));
+      }
+      else if (strcmp (argv[0], "--cursor-batch-size") == 0 && argc > 1) {
+         argc--, argv++;
+         cursor_batch_size = strtoul (argv[0], NULL, 10);
+      }
+      else if (strcmp (argv[0], "--batch-bytes") == 0 && argc > 1) {
+         argc--, argv++;
+         bulk_batch_bytes = strtoul (argv[0], NULL, 10);
+      }
+      else if (strcmp (argv[0], "--auto-tune") == 0) {
+         bulk_auto_tune = true;
+      }
+      else if (strcmp (argv[0], "--join=server") == 0) {
+         merge_join = MERGE_JOIN_SERVER;
+      }
+      else if (strcmp (argv[0], "--join=sortmerge") == 0) {
+         merge_join = MERGE_JOIN_SORTMERGE;
+      }
+      else if (strcmp (argv[0], "--join=plan") == 0) {
+         merge_join = MERGE_JOIN_PLAN;
+      }
+      else if (strcmp (argv[0], "--explain") == 0) {
+         merge_join = MERGE_JOIN_PLAN;
+         explain_merge = true;
+      }
+      else if (strcmp (argv[0], "--server-side") == 0) {
+         server_side = true;
+      }
+      else if (strcmp (argv[0], "--partitions") == 0 && argc > 1) {
+         argc--, argv++;
+         merge_partitions = BSON_MAX (1, atoi (argv[0]));
+      }
+      else if (strcmp (argv[0], "--shadow") == 0) {
+         shadow_rebuild = true;
+      }
+      else if (strcmp (argv[0], "--checkpoint") == 0) {
+         checkpoint_merge = true;
+      }
+      else if (strcmp (argv[0], "--incremental") == 0) {
+         incremental_merge = true;
+      }
+      else if (strcmp (argv[0], "--fused") == 0) {
+         fused_merge = true;
+      }
+      else if (strcmp (argv[0], "--no-indexes") == 0) {
+         merge_indexes = false;
+      }
+      else if (strcmp (argv[0], "--hash-join-bytes") == 0 && argc > 1) {
+         argc--, argv++;
+         hash_join_max_bytes = strtoul (argv[0], NULL, 10);
+      }
+      else {
+         DIE; /* pending - usage */
+      }
+      argc--, argv++;
+   }
+   if (argc < 2 && !spec_file) {
       DIE; /* pending - usage */
    }
+   if (checkpoint_merge && (merge_partitions > 1 || shadow_rebuild))
+      fprintf (stderr, "WARNING: --checkpoint resumes the copy phases only, the group of --partitions or --shadow restarts from the beginning\n");
    mongoc_init ();
    mongoc_log_set_handler (log_local_handler, NULL);
 
-   parent_name = argv[1];
-
    start_time = dtimeofday ();
-   count = execute (parent_name, argc - 2, &argv[2]);
+   if (spec_file) {
+      count = execute_spec (spec_file, jobs);
+   }
+   else {
+      parent_name = argv[0];
+      count = execute (parent_name, argc - 1, &argv[1]);
+   }
    end_time = dtimeofday ();
    delta_time = end_time - start_time + 0.0000001;
    fprintf (stderr, "info: real: %.2f, count: %"PRId64", %"PRId64" docs/sec\n", delta_time, count, (int64_t)round (count/delta_time));
 
    mongoc_cleanup ();
 
-   return 0;
+   return count < 0 ? 1 : 0;
 }
 
@@ -113,6 +113,251 @@ const char *merge_many_spec[] = {
    "alias:[]"
 };
 
+const char *projection_fixture = "\
+{\
+    \"before\": {\
+        \"owner\": [\
+            {\"_id\": 11, \"name\": \"Joe\", \"type\": 1},\
+            {\"_id\": 22, \"name\": \"Jane\"}\
+        ],\
+        \"owner_type\": [\
+            {\"_id\": 1, \"name\": \"Person\", \"edits_pending\": 0}\
+        ],\
+        \"pet\": [\
+            {\"_id\": 1, \"name\": \"Lassie\", \"owner\": 11, \"edits_pending\": 0},\
+            {\"_id\": 2, \"name\": \"Flipper\", \"owner\": 22, \"edits_pending\": 1}\
+        ],\
+        \"alias\": [\
+            {\"_id\": 1, \"name\": \"Joseph\", \"sort_name\": \"Joseph\", \"owner\": 11}\
+        ]\
+    },\
+    \"after\": {\
+        \"owner\": [\
+            {\"_id\": 11, \"name\": \"Joe\", \"type\": {\"_id\": 1, \"name\": \"Person\"},\
+             \"pet\": [\
+                {\"_id\": 1, \"name\": \"Lassie\", \"owner\": 11}\
+             ],\
+             \"alias\": [\
+                {\"_id\": 1, \"name\": \"Joseph\", \"owner\": 11}\
+             ]\
+            },\
+            {\"_id\": 22, \"name\": \"Jane\",\
+             \"pet\": [\
+                {\"_id\": 2, \"name\": \"Flipper\", \"owner\": 22}\
+             ]\
+            }\
+        ]\
+    }\
+}";
+
+const char *merge_projection_spec[] = {
+   "type:owner_type-edits_pending",
+   "pet:[]-edits_pending",
+   "alias:[]+name"
+};
+
+const char *fused_fixture = "\
+{\
+    \"before\": {\
+        \"merged\": [],\
+        \"owner\": [\
+            {\"_id\": 11, \"name\": \"Joe\"},\
+            {\"_id\": 22, \"name\": \"Jane\"},\
+            {\"_id\": 33, \"name\": \"Other\"}\
+        ],\
+        \"pet\": [\
+            {\"_id\": 1, \"name\": \"Lassie\", \"owner\": 11, \"type\": 1},\
+            {\"_id\": 2, \"name\": \"Flipper\", \"owner\": 22, \"type\": 2},\
+            {\"_id\": 3, \"name\": \"Snoopy\", \"owner\": 22, \"type\": 1},\
+            {\"_id\": 4, \"name\": \"Marmaduke\"}\
+        ],\
+        \"pet_type\": [\
+            {\"_id\": 1, \"name\": \"Dog\"},\
+            {\"_id\": 2, \"name\": \"Dolphin\"}\
+        ]\
+    },\
+    \"after\": {\
+        \"owner\": [\
+            {\"_id\": 11, \"name\": \"Joe\",\
+             \"pet\": [\
+                {\"_id\": 1, \"name\": \"Lassie\", \"owner\": 11, \"type\": {\"_id\": 1, \"name\": \"Dog\"}}\
+             ]\
+            },\
+            {\"_id\": 22, \"name\": \"Jane\",\
+             \"pet\": [\
+                {\"_id\": 2, \"name\": \"Flipper\", \"owner\": 22, \"type\": {\"_id\": 2, \"name\": \"Dolphin\"}},\
+                {\"_id\": 3, \"name\": \"Snoopy\", \"owner\": 22, \"type\": {\"_id\": 1, \"name\": \"Dog\"}}\
+             ]\
+            },\
+            {\"_id\": 33, \"name\": \"Other\"}\
+        ],\
+        \"pet\": [\
+            {\"_id\": 1, \"name\": \"Lassie\", \"owner\": 11, \"type\": {\"_id\": 1, \"name\": \"Dog\"}},\
+            {\"_id\": 2, \"name\": \"Flipper\", \"owner\": 22, \"type\": {\"_id\": 2, \"name\": \"Dolphin\"}},\
+            {\"_id\": 3, \"name\": \"Snoopy\", \"owner\": 22, \"type\": {\"_id\": 1, \"name\": \"Dog\"}},\
+            {\"_id\": 4, \"name\": \"Marmaduke\"}\
+        ]\
+    }\
+}";
+
+/* owner is stamped and skipped, so its absorbed child pet is merged on its own */
+const char *fused_stamped_fixture = "\
+{\
+    \"before\": {\
+        \"merged\": [\
+            {\"merged\": \"owner\"}\
+        ],\
+        \"owner\": [\
+            {\"_id\": 11, \"name\": \"Joe\"}\
+        ],\
+        \"pet\": [\
+            {\"_id\": 1, \"name\": \"Lassie\", \"owner\": 11, \"type\": 1}\
+        ],\
+        \"pet_type\": [\
+            {\"_id\": 1, \"name\": \"Dog\"}\
+        ]\
+    },\
+    \"after\": {\
+        \"owner\": [\
+            {\"_id\": 11, \"name\": \"Joe\"}\
+        ],\
+        \"pet\": [\
+            {\"_id\": 1, \"name\": \"Lassie\", \"owner\": 11, \"type\": {\"_id\": 1, \"name\": \"Dog\"}}\
+        ]\
+    }\
+}";
+
+/* as merge_spec_flat.json, pet is the "many" child of owner only and can be fused into it */
+const char *fused_spec = "[\
+    [\"n\", \"owner.pet\", \"pet.owner\"],\
+    [\"1\", \"pet.type\", \"pet_type._id\"]\
+]";
+
+/* interrupted after the "one" phase and the group of _id 11, which the resume passes over */
+const char *checkpoint_fixture = "\
+{\
+    \"before\": {\
+        \"merge_checkpoint\": [\
+            {\"_id\": \"owner\", \"specs\": \"pet:[] alias:[]\", \"done\": [\"hash_join\", \"one\"], \"group_last_id\": 11}\
+        ],\
+        \"owner\": [\
+            {\"_id\": 11, \"name\": \"Joe\"},\
+            {\"_id\": 22, \"name\": \"Jane\"},\
+            {\"_id\": 33, \"name\": \"Jack\"}\
+        ],\
+        \"pet\": [\
+            {\"_id\": 1, \"name\": \"Lassie\", \"owner\": 11},\
+            {\"_id\": 2, \"name\": \"Flipper\", \"owner\": 22},\
+            {\"_id\": 4, \"name\": \"Garfield\", \"owner\": 33}\
+        ],\
+        \"alias\": [\
+            {\"_id\": 2, \"name\": \"Janey\", \"owner\": 22}\
+        ]\
+    },\
+    \"after\": {\
+        \"owner\": [\
+            {\"_id\": 11, \"name\": \"Joe\"},\
+            {\"_id\": 22, \"name\": \"Jane\",\
+             \"pet\": [\
+                {\"_id\": 2, \"name\": \"Flipper\", \"owner\": 22}\
+             ],\
+             \"alias\": [\
+                {\"_id\": 2, \"name\": \"Janey\", \"owner\": 22}\
+             ]\
+            },\
+            {\"_id\": 33, \"name\": \"Jack\",\
+             \"pet\": [\
+                {\"_id\": 4, \"name\": \"Garfield\", \"owner\": 33}\
+             ]\
+            }\
+        ]\
+    }\
+}";
+
+/* with a non-integer parent_id the group is not resumed, all of it is applied */
+const char *checkpoint_mixed_fixture = "\
+{\
+    \"before\": {\
+        \"merge_checkpoint\": [\
+            {\"_id\": \"owner\", \"specs\": \"pet:[] alias:[]\", \"done\": [\"hash_join\", \"one\"], \"group_last_id\": 33}\
+        ],\
+        \"owner\": [\
+            {\"_id\": 11, \"name\": \"Joe\"},\
+            {\"_id\": 33, \"name\": \"Jack\"},\
+            {\"_id\": \"x\", \"name\": \"Xavier\"}\
+        ],\
+        \"pet\": [\
+            {\"_id\": 1, \"name\": \"Lassie\", \"owner\": 11},\
+            {\"_id\": 4, \"name\": \"Garfield\", \"owner\": 33},\
+            {\"_id\": 5, \"name\": \"Rex\", \"owner\": \"x\"}\
+        ],\
+        \"alias\": []\
+    },\
+    \"after\": {\
+        \"owner\": [\
+            {\"_id\": 11, \"name\": \"Joe\",\
+             \"pet\": [\
+                {\"_id\": 1, \"name\": \"Lassie\", \"owner\": 11}\
+             ]\
+            },\
+            {\"_id\": 33, \"name\": \"Jack\",\
+             \"pet\": [\
+                {\"_id\": 4, \"name\": \"Garfield\", \"owner\": 33}\
+             ]\
+            },\
+            {\"_id\": \"x\", \"name\": \"Xavier\",\
+             \"pet\": [\
+                {\"_id\": 5, \"name\": \"Rex\", \"owner\": \"x\"}\
+             ]\
+            }\
+        ]\
+    }\
+}";
+
+/* "refreshed" after pet 1 changes and owner 22 is marked, which a re-merge would overwrite */
+const char *incremental_fixture = "\
+{\
+    \"before\": {\
+        \"merged\": [],\
+        \"owner\": [\
+            {\"_id\": 11, \"name\": \"Joe\", \"last_updated\": {\"$date\": 1000}},\
+            {\"_id\": 22, \"name\": \"Jane\", \"last_updated\": {\"$date\": 1000}}\
+        ],\
+        \"pet\": [\
+            {\"_id\": 1, \"name\": \"Lassie\", \"owner\": 11, \"last_updated\": {\"$date\": 1000}},\
+            {\"_id\": 2, \"name\": \"Flipper\", \"owner\": 22, \"last_updated\": {\"$date\": 1000}}\
+        ]\
+    },\
+    \"after\": {\
+        \"owner\": [\
+            {\"_id\": 11, \"name\": \"Joe\", \"last_updated\": {\"$date\": 1000},\
+             \"pet\": [\
+                {\"_id\": 1, \"name\": \"Lassie\", \"owner\": 11, \"last_updated\": {\"$date\": 1000}}\
+             ]\
+            },\
+            {\"_id\": 22, \"name\": \"Jane\", \"last_updated\": {\"$date\": 1000},\
+             \"pet\": [\
+                {\"_id\": 2, \"name\": \"Flipper\", \"owner\": 22, \"last_updated\": {\"$date\": 1000}}\
+             ]\
+            }\
+        ]\
+    },\
+    \"refreshed\": {\
+        \"owner\": [\
+            {\"_id\": 11, \"name\": \"Joe\", \"last_updated\": {\"$date\": 1000},\
+             \"pet\": [\
+                {\"_id\": 1, \"name\": \"Lassie II\", \"owner\": 11, \"last_updated\": {\"$date\": 2000}}\
+             ]\
+            },\
+            {\"_id\": 22, \"name\": \"Jane\", \"last_updated\": {\"$date\": 1000}, \"pet\": \"not re-merged\"}\
+        ]\
+    }\
+}";
+
+const char *incremental_spec = "[\
+    [\"n\", \"owner.pet\", \"pet.owner\"]\
+]";
+
 bool
 do_fixture (mongoc_database_t *db,
             const char *fixture,
@@ -223,20 +468,294 @@ clear_fixture_fn (mongoc_database_t *db,
    return true;
 }
 
+/* keys 0..9 added out of order, n / 10 documents each, spilled every run_bytes */
+bool
+test_external_sort_with (size_t run_bytes,
+                         int    n)
+{
+   external_sort_t *sort;
+   bson_t *bson, doc;
+   bson_iter_t iter;
+   int64_t key, last_key = -1;
+   int seq, last_seq = -1, n_sorted = 0, i;
+   bool ret = true;
+
+   sort = external_sort_new (run_bytes);
+   for (i = 0; i < n; i++) {
+      bson = BCON_NEW ("seq", BCON_INT32 (i));
+      ret = external_sort_add (sort, (i * 7) % 10, bson) && ret;
+      bson_destroy (bson);
+   }
+   ret = external_sort_finish (sort) && ret;
+   while (ret && external_sort_next (sort, &key, &doc)) {
+      bson_iter_init_find (&iter, &doc, "seq") || DIE;
+      seq = bson_iter_int32 (&iter);
+      /* in key order, equal keys in the order they were added */
+      if (key != (seq * 7) % 10 || key < last_key || (key == last_key && seq <= last_seq)) {
+         printf ("external sort run_bytes %zu: key %"PRId64" seq %d after key %"PRId64" seq %d\n", run_bytes, key, seq, last_key, last_seq);
+         ret = false;
+      }
+      last_key = key;
+      last_seq = seq;
+      n_sorted++;
+   }
+   if (ret && (n_sorted != n || external_sort_count (sort) != n)) {
+      printf ("external sort run_bytes %zu: %d of %d documents sorted\n", run_bytes, n_sorted, n);
+      ret = false;
+   }
+   external_sort_destroy (sort);
+   return ret;
+}
+
+/* in memory, spilled to many runs and merged, and empty */
 void
-test_merge (mongoc_database_t *db)
+test_external_sort (void)
 {
-   do_fixture (db, one_to_one_fixture, "before", load_fixture_fn) || DIE;
-   execute ("people", sizeof merge_one_spec / sizeof (char*), (char**) merge_one_spec);
-   do_fixture (db, one_to_one_fixture, "after", check_fixture_fn) || DIE;
-   do_fixture (db, one_to_one_fixture, "before", clear_fixture_fn);
+   test_external_sort_with (EXTERNAL_SORT_RUN_BYTES, 1000) || DIE;
+   test_external_sort_with (256, 1000) || DIE;
+   test_external_sort_with (1, 100) || DIE;
+   test_external_sort_with (256, 0) || DIE;
+}
+
+/* the planner's pick for an edge, from collStats as {count, bytes, avg} */
+void
+test_merge_plan (void)
+{
+   merge_stats_t parent = {1000, 100000, 100};
+   merge_stats_t small = {10, 500, 50};
+   merge_stats_t many = {5000, 500000, 100};
+   merge_stats_t large = {100000, 10000000, 100};
+   merge_plan_t plan;
+
+   /* a small "one" child is hash joined, one that does not fit is not */
+   merge_plan_edge ("one", &parent, &small, true, true, false, HASH_JOIN_MAX_BYTES, &plan);
+   EX (plan.edge == MERGE_EDGE_HASH_JOIN && plan.memory == small.bytes);
+   merge_plan_edge ("one", &parent, &small, true, false, false, HASH_JOIN_MAX_BYTES, &plan);
+   EX (plan.edge == MERGE_EDGE_TEMP);
+   merge_plan_edge ("one", &parent, &large, true, true, false, 1024 * 1024, &plan);
+   EX (plan.edge == MERGE_EDGE_TEMP);
+   /* a "many" child with integer keys is sort-merged */
+   merge_plan_edge ("many", &parent, &many, false, true, false, HASH_JOIN_MAX_BYTES, &plan);
+   EX (plan.edge == MERGE_EDGE_SORT_MERGE);
+   merge_plan_edge ("many", &parent, &many, false, false, false, HASH_JOIN_MAX_BYTES, &plan);
+   EX (plan.edge == MERGE_EDGE_TEMP);
+   /* an indexed child on a server that can $merge is looked up there */
+   merge_plan_edge ("one", &parent, &large, true, true, true, 1024 * 1024, &plan);
+   EX (plan.edge == MERGE_EDGE_SERVER && plan.memory == 0);
+   merge_plan_edge ("many", &parent, &many, true, false, true, HASH_JOIN_MAX_BYTES, &plan);
+   EX (plan.edge == MERGE_EDGE_SERVER);
+   merge_plan_edge ("one", &parent, &large, false, true, true, 1024 * 1024, &plan);
+   EX (plan.edge == MERGE_EDGE_TEMP);
+}
+
+/* field lists follow the "]" or the child name, and do not mix + and - */
+void
+test_merge_spec (void)
+{
+   const char *mixed_spec[] = {"pet:[]", "alias:[]+name-sort_name"};
+
+   EX (strcmp (merge_spec_fields ("type:owner_type-edits_pending"), "-edits_pending") == 0);
+   EX (strcmp (merge_spec_fields ("gender-edits_pending"), "-edits_pending") == 0);
+   EX (strcmp (merge_spec_fields ("pet:[pet-x.owner]+name"), "+name") == 0);
+   EX (strcmp (merge_spec_fields ("pet:[]"), "") == 0);
+   EX (merge_spec_check (sizeof merge_projection_spec / sizeof (char*), (char**) merge_projection_spec));
+   EX (!merge_spec_check (sizeof mixed_spec / sizeof (char*), (char**) mixed_spec));
+   EX (execute ("owner", sizeof mixed_spec / sizeof (char*), (char**) mixed_spec) < 0);
+}
+
+#define SPEC_COUNT(spec) ((int)(sizeof spec / sizeof (char*)))
+
+/* the strategies expected ran rather than fell back, --explain runs none */
+void
+check_strategies (const char   *name,
+                  unsigned int  strategies)
+{
+   if ((merge_strategies & strategies) != strategies || (explain_merge && merge_strategies != 0)) {
+      printf ("merge \"%s\" strategies: expected 0x%x, used 0x%x\n", name, strategies, merge_strategies);
+      abort ();
+   }
+}
+
+/* load, merge and check a fixture */
+void
+run_fixture (mongoc_database_t *db,
+             const char        *fixture,
+             const char        *parent_name,
+             const char       **merge_spec,
+             int                merge_spec_count,
+             unsigned int       strategies)
+{
+   do_fixture (db, fixture, "before", load_fixture_fn) || DIE;
+   execute (parent_name, merge_spec_count, (char**) merge_spec);
+   /* --explain only plans, the parents are left as they were */
+   do_fixture (db, fixture, explain_merge ? "before" : "after", check_fixture_fn) || DIE;
+   check_strategies (parent_name, strategies);
+   do_fixture (db, fixture, "before", clear_fixture_fn);
+}
+
+/* execute_spec over spec entries given as merge_spec_flat.json */
+int64_t
+execute_spec_json (const char *spec_json)
+{
+   const char *spec_file = "test-mongomerge-spec.json";
+   FILE *fp;
+   int64_t count;
+
+   (fp = fopen (spec_file, "w")) || DIE;
+   fputs (spec_json, fp);
+   fclose (fp);
+   count = execute_spec (spec_file, 1);
+   remove (spec_file);
+   return count;
+}
+
+/* as run_fixture for a whole spec, the fixture clears the merged collection */
+void
+run_spec_fixture (mongoc_database_t *db,
+                  const char        *fixture,
+                  const char        *spec_json,
+                  unsigned int       strategies)
+{
+   do_fixture (db, fixture, "before", load_fixture_fn) || DIE;
+   execute_spec_json (spec_json) >= 0 || DIE;
+   do_fixture (db, fixture, "after", check_fixture_fn) || DIE;
+   check_strategies ("spec", strategies);
+   do_fixture (db, fixture, "before", clear_fixture_fn);
+}
 
+/* an incremental spec merge stamps last_updated, a refresh re-merges only the parent of the changed child */
+void
+test_incremental (mongoc_database_t *db)
+{
+   mongoc_collection_t *collection;
+   bson_t *selector, *update;
+   bson_error_t error;
+
+   /* the first --incremental run merges in full and records the mark */
+   do_fixture (db, incremental_fixture, "before", load_fixture_fn) || DIE;
+   incremental_merge = true;
+   execute_spec_json (incremental_spec) >= 0 || DIE;
+   incremental_merge = false;
+   do_fixture (db, incremental_fixture, "after", check_fixture_fn) || DIE;
+
+   collection = mongoc_database_get_collection (db, "pet");
+   selector = BCON_NEW ("_id", BCON_INT32 (1));
+   update = BCON_NEW ("$set", "{", "name", BCON_UTF8 ("Lassie II"), "last_updated", BCON_DATE_TIME (2000), "}");
+   mongoc_collection_update (collection, MONGOC_UPDATE_NONE, selector, update, NULL, &error) || WARN_ERROR;
+   bson_destroy (update);
+   bson_destroy (selector);
+   mongoc_collection_destroy (collection);
+   collection = mongoc_database_get_collection (db, "owner");
+   selector = BCON_NEW ("_id", BCON_INT32 (22));
+   update = BCON_NEW ("$set", "{", "pet", BCON_UTF8 ("not re-merged"), "}");
+   mongoc_collection_update (collection, MONGOC_UPDATE_NONE, selector, update, NULL, &error) || WARN_ERROR;
+   bson_destroy (update);
+   bson_destroy (selector);
+   mongoc_collection_destroy (collection);
+
+   incremental_merge = true;
+   execute_spec_json (incremental_spec) >= 0 || DIE;
+   incremental_merge = false;
+   do_fixture (db, incremental_fixture, "refreshed", check_fixture_fn) || DIE;
+   check_strategies ("owner", MERGE_STRATEGY_INCREMENTAL);
+   do_fixture (db, incremental_fixture, "before", clear_fixture_fn);
+}
+
+/* the supporting indexes are built, and the partitioned group's index on the temp collection is dropped */
+void
+test_merge_indexes (mongoc_database_t *db)
+{
    do_fixture (db, one_to_many_fixture, "before", load_fixture_fn) || DIE;
-   execute ("owner", sizeof merge_many_spec / sizeof (char*), (char**) merge_many_spec);
+   merge_partitions = 3;
+   execute ("owner", SPEC_COUNT (merge_many_spec), (char**) merge_many_spec);
+   merge_partitions = 1;
    do_fixture (db, one_to_many_fixture, "after", check_fixture_fn) || DIE;
+   check_strategies ("owner", MERGE_STRATEGY_PARTITIONS);
+   EX (merge_indexed (db, "pet", "owner"));
+   EX (merge_indexed (db, "alias", "owner"));
+   EX (!merge_indexed (db, "owner_merge_temp", "parent_id"));
    do_fixture (db, one_to_many_fixture, "before", clear_fixture_fn);
+}
 
-   printf ("tests passed\n");
+void
+test_merge (mongoc_client_t   *client,
+            mongoc_database_t *db)
+{
+   unsigned int server_one, server_many;
+
+   /* the client path on servers before 4.4 */
+   server_one = server_version (client) >= SERVER_SIDE_MIN_VERSION ? MERGE_STRATEGY_SERVER : MERGE_STRATEGY_HASH_JOIN;
+   server_many = server_one == MERGE_STRATEGY_SERVER ? MERGE_STRATEGY_SERVER : MERGE_STRATEGY_TEMP;
+
+   run_fixture (db, one_to_one_fixture, "people", merge_one_spec, SPEC_COUNT (merge_one_spec), MERGE_STRATEGY_HASH_JOIN);
+   hash_join_max_bytes = 0; /* server path */
+   run_fixture (db, one_to_one_fixture, "people", merge_one_spec, SPEC_COUNT (merge_one_spec), MERGE_STRATEGY_TEMP);
+   hash_join_max_bytes = HASH_JOIN_MAX_BYTES;
+
+   run_fixture (db, one_to_many_fixture, "owner", merge_many_spec, SPEC_COUNT (merge_many_spec), MERGE_STRATEGY_TEMP);
+   merge_indexes = false; /* child keys scanned without supporting indexes */
+   run_fixture (db, one_to_many_fixture, "owner", merge_many_spec, SPEC_COUNT (merge_many_spec), MERGE_STRATEGY_TEMP);
+   merge_indexes = true;
+
+   merge_join = MERGE_JOIN_SORTMERGE;
+   run_fixture (db, one_to_many_fixture, "owner", merge_many_spec, SPEC_COUNT (merge_many_spec), MERGE_STRATEGY_SORT_MERGE);
+   merge_join = MERGE_JOIN_SERVER;
+
+   server_side = true;
+   run_fixture (db, one_to_one_fixture, "people", merge_one_spec, SPEC_COUNT (merge_one_spec), server_one);
+   run_fixture (db, one_to_many_fixture, "owner", merge_many_spec, SPEC_COUNT (merge_many_spec), server_many);
+   server_side = false;
+
+   merge_partitions = 3; /* range-partitioned group, one thread per range */
+   hash_join_max_bytes = 0;
+   run_fixture (db, one_to_one_fixture, "people", merge_one_spec, SPEC_COUNT (merge_one_spec),
+                MERGE_STRATEGY_TEMP | MERGE_STRATEGY_PARTITIONS);
+   run_fixture (db, one_to_many_fixture, "owner", merge_many_spec, SPEC_COUNT (merge_many_spec),
+                MERGE_STRATEGY_TEMP | MERGE_STRATEGY_PARTITIONS);
+   shadow_rebuild = true; /* each range rebuilt into <parent>_merged */
+   run_fixture (db, one_to_many_fixture, "owner", merge_many_spec, SPEC_COUNT (merge_many_spec),
+                MERGE_STRATEGY_TEMP | MERGE_STRATEGY_PARTITIONS | MERGE_STRATEGY_SHADOW);
+   merge_partitions = 1;
+   run_fixture (db, one_to_one_fixture, "people", merge_one_spec, SPEC_COUNT (merge_one_spec),
+                MERGE_STRATEGY_TEMP | MERGE_STRATEGY_SHADOW);
+   shadow_rebuild = false;
+
+   checkpoint_merge = true; /* phases recorded in merge_checkpoint, removed when done */
+   run_fixture (db, one_to_one_fixture, "people", merge_one_spec, SPEC_COUNT (merge_one_spec), MERGE_STRATEGY_TEMP);
+   run_fixture (db, one_to_many_fixture, "owner", merge_many_spec, SPEC_COUNT (merge_many_spec), MERGE_STRATEGY_TEMP);
+   run_fixture (db, checkpoint_fixture, "owner", merge_many_spec, SPEC_COUNT (merge_many_spec), MERGE_STRATEGY_TEMP);
+   run_fixture (db, checkpoint_mixed_fixture, "owner", merge_many_spec, SPEC_COUNT (merge_many_spec), MERGE_STRATEGY_TEMP);
+   checkpoint_merge = false;
+   hash_join_max_bytes = HASH_JOIN_MAX_BYTES;
+
+   merge_join = MERGE_JOIN_PLAN; /* a strategy per edge from collStats, whichever it picks */
+   run_fixture (db, one_to_one_fixture, "people", merge_one_spec, SPEC_COUNT (merge_one_spec), 0);
+   run_fixture (db, one_to_many_fixture, "owner", merge_many_spec, SPEC_COUNT (merge_many_spec), 0);
+   explain_merge = true; /* the plan is printed, nothing runs */
+   run_fixture (db, one_to_many_fixture, "owner", merge_many_spec, SPEC_COUNT (merge_many_spec), 0);
+   explain_merge = false;
+   merge_join = MERGE_JOIN_SERVER;
+
+   /* field lists are projected at the source on each path */
+   run_fixture (db, projection_fixture, "owner", merge_projection_spec, SPEC_COUNT (merge_projection_spec),
+                MERGE_STRATEGY_HASH_JOIN | MERGE_STRATEGY_TEMP);
+   merge_join = MERGE_JOIN_SORTMERGE;
+   hash_join_max_bytes = 0;
+   run_fixture (db, projection_fixture, "owner", merge_projection_spec, SPEC_COUNT (merge_projection_spec),
+                MERGE_STRATEGY_SORT_MERGE | MERGE_STRATEGY_TEMP);
+   merge_join = MERGE_JOIN_SERVER;
+   server_side = true;
+   run_fixture (db, projection_fixture, "owner", merge_projection_spec, SPEC_COUNT (merge_projection_spec), server_many);
+   server_side = false;
+   hash_join_max_bytes = HASH_JOIN_MAX_BYTES;
+
+
+   /* pet merged inside the owner pass, and level by level */
+   fused_merge = true;
+   run_spec_fixture (db, fused_fixture, fused_spec, MERGE_STRATEGY_FUSED);
+   run_spec_fixture (db, fused_stamped_fixture, fused_spec, MERGE_STRATEGY_HASH_JOIN);
+   fused_merge = false;
+   run_spec_fixture (db, fused_fixture, fused_spec, MERGE_STRATEGY_HASH_JOIN | MERGE_STRATEGY_TEMP);
 }
 
 void
@@ -273,7 +792,13 @@ main (int   argc,
    database_name = mongoc_uri_get_database (uri);
    db = mongoc_client_get_database (client, database_name);
 
-   test_merge (db);
+   test_external_sort ();
+   test_merge_plan ();
+   test_merge_spec ();
+   test_merge (client, db);
+   test_incremental (db);
+   test_merge_indexes (db);
+   printf ("tests passed\n");
 
    mongoc_database_destroy (db);
    mongoc_client_destroy (client);